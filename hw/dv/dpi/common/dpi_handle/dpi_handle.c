@@ -0,0 +1,75 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dpi_handle.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The table is never reallocated, so that DPI calls from other threads of a
+// multi-threaded model can look up handles while a new one is created.
+#define DPI_HANDLE_MAX 256
+
+struct dpi_handle_entry {
+  void *ctx;
+  char *name;
+  char *freed_name;
+};
+
+static struct dpi_handle_entry entries[DPI_HANDLE_MAX];
+static size_t num_entries;
+
+void *dpi_handle_new(const char *model, const char *name, void *ctx) {
+  assert(ctx);
+
+  size_t idx = __atomic_load_n(&num_entries, __ATOMIC_ACQUIRE);
+  if (idx == DPI_HANDLE_MAX) {
+    fprintf(stderr, "DPI: Too many DPI model instances (at %s %s).\n", model,
+            name);
+    return NULL;
+  }
+
+  size_t len = strlen(model) + strlen(name) + sizeof(":") + sizeof(" (freed)");
+  struct dpi_handle_entry *entry = &entries[idx];
+  entry->name = (char *)malloc(len);
+  entry->freed_name = (char *)malloc(len);
+  assert(entry->name && entry->freed_name);
+  snprintf(entry->name, len, "%s:%s", model, name);
+  snprintf(entry->freed_name, len, "%s:%s (freed)", model, name);
+  entry->ctx = ctx;
+
+  // Handles start at 1, so that no handle is NULL
+  __atomic_store_n(&num_entries, idx + 1, __ATOMIC_RELEASE);
+  return (void *)(uintptr_t)(idx + 1);
+}
+
+void *dpi_handle_get(void *handle) {
+  uintptr_t num = (uintptr_t)handle;
+  if (num == 0 || num > __atomic_load_n(&num_entries, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return __atomic_load_n(&entries[num - 1].ctx, __ATOMIC_ACQUIRE);
+}
+
+void dpi_handle_free(void *handle) {
+  uintptr_t num = (uintptr_t)handle;
+  if (num == 0 || num > __atomic_load_n(&num_entries, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&entries[num - 1].ctx, NULL, __ATOMIC_RELEASE);
+}
+
+size_t dpi_handle_count(void) {
+  return __atomic_load_n(&num_entries, __ATOMIC_ACQUIRE);
+}
+
+const char *dpi_handle_name(size_t idx) {
+  assert(idx < dpi_handle_count());
+  const struct dpi_handle_entry *entry = &entries[idx];
+  return __atomic_load_n(&entry->ctx, __ATOMIC_ACQUIRE) ? entry->name
+                                                        : entry->freed_name;
+}
@@ -0,0 +1,77 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * Stable handles for the contexts of DPI models
+ *
+ * A DPI model keeps a pointer to its C context in a chandle in the design.
+ * When a simulation is checkpointed (with Verilator's --savable, for
+ * example), the chandle is saved with the rest of the design, but a pointer
+ * means nothing in the process that restores the checkpoint. So models give
+ * the design a handle from dpi_handle_new() instead, and look the context up
+ * with dpi_handle_get() on each call.
+ *
+ * Handles are numbered in the order they are created. A simulation creates
+ * its DPI contexts in the same order every time it starts (from the initial
+ * blocks of the design), so a handle in a restored checkpoint names the
+ * context that the restoring process created in the same place. Each handle
+ * also records the model and instance that created it, so that a checkpoint
+ * can check that the handles line up (see dpi_handle_count() and
+ * dpi_handle_name()).
+ */
+
+#ifndef DPI_HANDLE_H_
+#define DPI_HANDLE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * Make a handle for a DPI model's context
+ *
+ * @param model name of the DPI model (e.g. "uartdpi")
+ * @param name name of the instance
+ * @param ctx the context, which must not be NULL
+ * @return the handle, or NULL if there are too many handles
+ */
+void *dpi_handle_new(const char *model, const char *name, void *ctx);
+
+/**
+ * Look up the context of a handle
+ *
+ * @param handle a handle from dpi_handle_new()
+ * @return the context, or NULL if handle is NULL, unknown or freed
+ */
+void *dpi_handle_get(void *handle);
+
+/**
+ * Forget the context of a handle
+ *
+ * The handle's number isn't reused, so the numbers of later handles don't
+ * depend on when contexts are freed.
+ *
+ * @param handle a handle from dpi_handle_new(), or NULL
+ */
+void dpi_handle_free(void *handle);
+
+/**
+ * The number of handles created so far (including freed ones)
+ */
+size_t dpi_handle_count(void);
+
+/**
+ * Describe handle idx (counting from zero, in order of creation)
+ *
+ * @return "MODEL:NAME" for a live handle, or "MODEL:NAME (freed)". The string
+ *         stays valid until the end of the process.
+ */
+const char *dpi_handle_name(size_t idx);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+#endif  // DPI_HANDLE_H_
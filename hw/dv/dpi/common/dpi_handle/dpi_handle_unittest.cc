@@ -0,0 +1,68 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dpi_handle.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// The handle table is global, so each test looks only at the handles it made.
+
+TEST(DpiHandleTest, LooksUpContexts) {
+  int a, b;
+  void *ha = dpi_handle_new("testdpi", "a", &a);
+  void *hb = dpi_handle_new("testdpi", "b", &b);
+  ASSERT_NE(ha, nullptr);
+  ASSERT_NE(hb, nullptr);
+  EXPECT_NE(ha, hb);
+
+  EXPECT_EQ(dpi_handle_get(ha), &a);
+  EXPECT_EQ(dpi_handle_get(hb), &b);
+  EXPECT_EQ(dpi_handle_get(nullptr), nullptr);
+
+  dpi_handle_free(ha);
+  dpi_handle_free(hb);
+}
+
+TEST(DpiHandleTest, NumbersHandlesInOrderOfCreation) {
+  int a, b;
+  size_t first = dpi_handle_count();
+  void *ha = dpi_handle_new("testdpi", "first", &a);
+  void *hb = dpi_handle_new("otherdpi", "second", &b);
+
+  ASSERT_EQ(dpi_handle_count(), first + 2);
+  EXPECT_EQ(std::string(dpi_handle_name(first)), "testdpi:first");
+  EXPECT_EQ(std::string(dpi_handle_name(first + 1)), "otherdpi:second");
+
+  dpi_handle_free(ha);
+  dpi_handle_free(hb);
+}
+
+TEST(DpiHandleTest, FreedHandlesAreNotReused) {
+  int a, b;
+  size_t first = dpi_handle_count();
+  void *ha = dpi_handle_new("testdpi", "freed", &a);
+  dpi_handle_free(ha);
+
+  EXPECT_EQ(dpi_handle_get(ha), nullptr);
+  EXPECT_EQ(std::string(dpi_handle_name(first)), "testdpi:freed (freed)");
+
+  // Freeing a handle doesn't change the numbers of later ones
+  void *hb = dpi_handle_new("testdpi", "after", &b);
+  EXPECT_NE(hb, ha);
+  EXPECT_EQ(dpi_handle_count(), first + 2);
+  EXPECT_EQ(dpi_handle_get(hb), &b);
+  dpi_handle_free(hb);
+}
+
+TEST(DpiHandleTest, RejectsUnknownHandles) {
+  void *past_end = reinterpret_cast<void *>(dpi_handle_count() + 1);
+  EXPECT_EQ(dpi_handle_get(past_end), nullptr);
+  dpi_handle_free(past_end);
+}
+
+}  // namespace
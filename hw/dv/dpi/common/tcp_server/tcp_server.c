@@ -9,24 +9,47 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
- * Simple buffer for passing data between TCP sockets and DPI modules
+ * Default size of the buffers in each direction, in bytes
  */
-const int BUFSIZE_BYTE = 256;
+const size_t DEFAULT_BUFSIZE_BYTE = 4096;
 
+/**
+ * Number of times a blocked writer yields the CPU before it starts sleeping
+ */
+const unsigned int BACKOFF_YIELDS = 64;
+
+/**
+ * Longest sleep of a blocked writer is 2^BACKOFF_MAX_SHIFT microseconds
+ */
+const unsigned int BACKOFF_MAX_SHIFT = 10;
+
+/**
+ * Lock-free single-producer, single-consumer ring buffer for passing data
+ * between the TCP server thread and the DPI module
+ *
+ * rptr and wptr count the bytes read from and written to the buffer since it
+ * was created. wptr is only written by the producer, which publishes new data
+ * with a release store that the consumer pairs with an acquire load. rptr is
+ * only written by the consumer and frees space in the same way. size is a
+ * power of two, so a pointer's position in buf is the pointer modulo size.
+ */
 struct tcp_buf {
-  unsigned int rptr;
-  unsigned int wptr;
-  char buf[BUFSIZE_BYTE];
+  size_t size;
+  size_t rptr;
+  size_t wptr;
+  char *buf;
 };
 
 /**
@@ -36,60 +59,217 @@ struct tcp_server_ctx {
   // Writeable by the host thread
   char *display_name;
   uint16_t listen_port;
-  volatile bool socket_run;
+  bool socket_run;
+  bool client_close_req;
+  pid_t owner_pid;  // process that started the server thread
   // Writeable by the server thread
   tcp_buf *buf_in;
   tcp_buf *buf_out;
   int sfd;  // socket fd
   int cfd;  // client fd
+  bool client_connected;  // cfd is valid, readable by the host thread
   pthread_t sock_thread;
+  // Set while the server thread is waiting in poll(). The host thread clears
+  // it and writes a byte to wake_fds[1] when it has work for the server.
+  bool server_waiting;
+  int wake_fds[2];
 };
 
-static bool tcp_buffer_is_full(struct tcp_buf *buf) {
-  if (buf->wptr >= buf->rptr) {
-    return (buf->wptr - buf->rptr) == (BUFSIZE_BYTE - 1);
-  } else {
-    return (buf->rptr - buf->wptr) == 1;
+/**
+ * Get the number of bytes in the buffer
+ *
+ * The server thread uses this to decide what to wait for, after announcing
+ * that it is about to wait (see wake_server()). The loads are sequentially
+ * consistent so that they can't be ordered before that announcement.
+ */
+static size_t tcp_buffer_used(struct tcp_buf *buf) {
+  return __atomic_load_n(&buf->wptr, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&buf->rptr, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Get the largest contiguous block of data that can be read (consumer only)
+ *
+ * @param buf buffer
+ * @param dat set to the start of the block
+ * @return the size of the block in bytes
+ */
+static size_t tcp_buffer_read_region(struct tcp_buf *buf, char **dat) {
+  size_t rptr = __atomic_load_n(&buf->rptr, __ATOMIC_RELAXED);
+  size_t wptr = __atomic_load_n(&buf->wptr, __ATOMIC_ACQUIRE);
+  size_t offset = rptr & (buf->size - 1);
+  size_t len = wptr - rptr;
+  if (len > buf->size - offset) {
+    len = buf->size - offset;
+  }
+  *dat = buf->buf + offset;
+  return len;
+}
+
+/**
+ * Release len bytes at the start of the read region (consumer only)
+ *
+ * @return true if the buffer was full before this call
+ */
+static bool tcp_buffer_consume(struct tcp_buf *buf, size_t len) {
+  size_t rptr = __atomic_load_n(&buf->rptr, __ATOMIC_RELAXED);
+  bool was_full =
+      __atomic_load_n(&buf->wptr, __ATOMIC_ACQUIRE) - rptr == buf->size;
+  __atomic_store_n(&buf->rptr, rptr + len, __ATOMIC_SEQ_CST);
+  return was_full;
+}
+
+/**
+ * Get the largest contiguous block of free space (producer only)
+ *
+ * @param buf buffer
+ * @param dat set to the start of the block
+ * @return the size of the block in bytes
+ */
+static size_t tcp_buffer_write_region(struct tcp_buf *buf, char **dat) {
+  size_t wptr = __atomic_load_n(&buf->wptr, __ATOMIC_RELAXED);
+  size_t rptr = __atomic_load_n(&buf->rptr, __ATOMIC_ACQUIRE);
+  size_t offset = wptr & (buf->size - 1);
+  size_t len = buf->size - (wptr - rptr);
+  if (len > buf->size - offset) {
+    len = buf->size - offset;
   }
+  *dat = buf->buf + offset;
+  return len;
 }
 
-static bool tcp_buffer_is_empty(struct tcp_buf *buf) {
-  return (buf->wptr == buf->rptr);
+/**
+ * Publish len bytes written at the start of the write region (producer only)
+ */
+static void tcp_buffer_produce(struct tcp_buf *buf, size_t len) {
+  size_t wptr = __atomic_load_n(&buf->wptr, __ATOMIC_RELAXED);
+  __atomic_store_n(&buf->wptr, wptr + len, __ATOMIC_SEQ_CST);
 }
 
-static void tcp_buffer_put_byte(struct tcp_buf *buf, char dat) {
-  bool done = false;
-  while (!done) {
-    if (!tcp_buffer_is_full(buf)) {
-      buf->buf[buf->wptr++] = dat;
-      buf->wptr %= BUFSIZE_BYTE;
-      done = true;
+/**
+ * Copy up to len bytes out of the buffer (consumer only)
+ *
+ * @param was_full set to true if the buffer was full before the read
+ * @return the number of bytes read
+ */
+static size_t tcp_buffer_read(struct tcp_buf *buf, char *dat, size_t len,
+                              bool *was_full) {
+  size_t done = 0;
+  *was_full = false;
+  // The data can wrap around the end of the buffer, so take up to two blocks
+  for (int i = 0; i < 2 && done < len; ++i) {
+    char *region;
+    size_t avail = tcp_buffer_read_region(buf, &region);
+    if (avail == 0) {
+      break;
     }
+    if (avail > len - done) {
+      avail = len - done;
+    }
+    memcpy(dat + done, region, avail);
+    *was_full |= tcp_buffer_consume(buf, avail);
+    done += avail;
   }
+  return done;
 }
 
-static bool tcp_buffer_get_byte(struct tcp_buf *buf, char *dat) {
-  if (tcp_buffer_is_empty(buf)) {
-    return false;
+/**
+ * Copy up to len bytes into the buffer (producer only)
+ *
+ * @return the number of bytes written
+ */
+static size_t tcp_buffer_write(struct tcp_buf *buf, const char *dat,
+                               size_t len) {
+  size_t done = 0;
+  for (int i = 0; i < 2 && done < len; ++i) {
+    char *region;
+    size_t space = tcp_buffer_write_region(buf, &region);
+    if (space == 0) {
+      break;
+    }
+    if (space > len - done) {
+      space = len - done;
+    }
+    memcpy(region, dat + done, space);
+    tcp_buffer_produce(buf, space);
+    done += space;
   }
-  *dat = buf->buf[buf->rptr++];
-  buf->rptr %= BUFSIZE_BYTE;
-  return true;
+  return done;
 }
 
-static struct tcp_buf *tcp_buffer_new(void) {
+/**
+ * Create a buffer of at least size_min bytes (rounded up to a power of two)
+ */
+static struct tcp_buf *tcp_buffer_new(size_t size_min) {
+  size_t size = 16;
+  while (size < size_min) {
+    size <<= 1;
+  }
+
   struct tcp_buf *buf_new;
   buf_new = (struct tcp_buf *)malloc(sizeof(struct tcp_buf));
+  assert(buf_new);
+  buf_new->buf = (char *)malloc(size);
+  assert(buf_new->buf);
+  buf_new->size = size;
   buf_new->rptr = 0;
   buf_new->wptr = 0;
   return buf_new;
 }
 
 static void tcp_buffer_free(struct tcp_buf **buf) {
+  if (*buf) {
+    free((*buf)->buf);
+  }
   free(*buf);
   *buf = NULL;
 }
 
+/**
+ * Wait a little before retrying an operation that couldn't make progress
+ *
+ * The first few waits just yield the CPU, so that a short stall costs little
+ * latency. After that, the caller sleeps for exponentially longer periods
+ * (up to about a millisecond) rather than burning a CPU core.
+ *
+ * @param attempt number of previous waits, updated by this function
+ */
+static void backoff(unsigned int *attempt) {
+  if (*attempt < BACKOFF_YIELDS) {
+    ++*attempt;
+    sched_yield();
+    return;
+  }
+  unsigned int shift = *attempt - BACKOFF_YIELDS;
+  if (shift < BACKOFF_MAX_SHIFT) {
+    ++*attempt;
+  }
+  struct timespec ts;
+  ts.tv_sec = 0;
+  ts.tv_nsec = 1000L << shift;
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * Wake up the server thread if it is waiting in poll() (host thread only)
+ *
+ * The server thread sets server_waiting before it decides what to wait for,
+ * and we call this after changing the state it bases the decision on (the
+ * buffer pointers, socket_run and client_close_req). Both sides use
+ * sequentially consistent stores and loads for these, so either the server
+ * thread sees the new state or we see the flag.
+ */
+static void wake_server(struct tcp_server_ctx *ctx) {
+  if (!__atomic_load_n(&ctx->server_waiting, __ATOMIC_SEQ_CST) ||
+      !__atomic_exchange_n(&ctx->server_waiting, false, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  char dummy = 0;
+  // If the pipe is full, the server has plenty of wake-ups queued already
+  ssize_t rv = write(ctx->wake_fds[1], &dummy, 1);
+  (void)rv;
+}
+
 /**
  * Start a TCP server
  *
@@ -201,6 +381,7 @@ static int client_tryaccept(struct tcp_server_ctx *ctx) {
 
   ctx->cfd = cfd;
   assert(ctx->cfd > 0);
+  __atomic_store_n(&ctx->client_connected, true, __ATOMIC_RELEASE);
 
   printf("%s: Accepted client connection\n", ctx->display_name);
 
@@ -222,63 +403,88 @@ static void stop(struct tcp_server_ctx *ctx) {
 }
 
 /**
- * Receive a byte from a connected client
+ * Close the connection to the client (server thread only)
  *
  * @param ctx context object
- * @param cmd byte received
- * @return true if a byte was read
  */
-static bool get_byte(struct tcp_server_ctx *ctx, char *cmd) {
+static void client_close(struct tcp_server_ctx *ctx) {
   assert(ctx);
 
-  ssize_t num_read = read(ctx->cfd, cmd, 1);
-
-  if (num_read == 0) {
-    return false;
+  if (!ctx->cfd) {
+    return;
   }
-  if (num_read == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      return false;
-    } else if (errno == EBADF) {
-      // Possibly client went away? Accept a new connection.
-      fprintf(stderr, "%s: Client disappeared.\n", ctx->display_name);
-      tcp_server_client_close(ctx);
-      return false;
-    } else {
+
+  __atomic_store_n(&ctx->client_connected, false, __ATOMIC_RELEASE);
+  close(ctx->cfd);
+  ctx->cfd = 0;
+}
+
+/**
+ * Receive as much data from the client as fits into the input buffer
+ *
+ * @param ctx context object
+ */
+static void recv_from_client(struct tcp_server_ctx *ctx) {
+  while (ctx->cfd) {
+    char *region;
+    size_t space = tcp_buffer_write_region(ctx->buf_in, &region);
+    if (space == 0) {
+      return;
+    }
+
+    ssize_t num_read = recv(ctx->cfd, region, space, 0);
+    if (num_read == 0) {
+      printf("%s: Remote disconnected.\n", ctx->display_name);
+      client_close(ctx);
+      return;
+    }
+    if (num_read == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
       fprintf(stderr, "%s: Error while reading from client: %s (%d)\n",
               ctx->display_name, strerror(errno), errno);
-      assert(0 && "Error reading from client");
+      client_close(ctx);
+      return;
+    }
+
+    tcp_buffer_produce(ctx->buf_in, num_read);
+    if ((size_t)num_read < space) {
+      // Nothing more is waiting in the socket
+      return;
     }
   }
-  assert(num_read == 1);
-  return true;
 }
 
 /**
- * Send a byte to a connected client
+ * Send as much data from the output buffer as the client accepts
  *
  * @param ctx context object
- * @param cmd byte to send
  */
-static void put_byte(struct tcp_server_ctx *ctx, char cmd) {
-  while (1) {
-    ssize_t num_written = send(ctx->cfd, &cmd, sizeof(cmd), MSG_NOSIGNAL);
+static void send_to_client(struct tcp_server_ctx *ctx) {
+  while (ctx->cfd) {
+    char *region;
+    size_t avail = tcp_buffer_read_region(ctx->buf_out, &region);
+    if (avail == 0) {
+      return;
+    }
+
+    ssize_t num_written = send(ctx->cfd, region, avail, MSG_NOSIGNAL);
     if (num_written == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        continue;
-      } else if (errno == EPIPE) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      if (errno == EPIPE || errno == ECONNRESET) {
         printf("%s: Remote disconnected.\n", ctx->display_name);
-        tcp_server_client_close(ctx);
-        break;
       } else {
         fprintf(stderr, "%s: Error while writing to client: %s (%d)\n",
                 ctx->display_name, strerror(errno), errno);
-        assert(0 && "Error writing to client.");
       }
+      client_close(ctx);
+      return;
     }
-    if (num_written >= 1) {
-      break;
-    }
+
+    tcp_buffer_consume(ctx->buf_out, num_written);
   }
 }
 
@@ -291,6 +497,9 @@ static void ctx_free(struct tcp_server_ctx *ctx) {
   // Free the buffers
   tcp_buffer_free(&ctx->buf_in);
   tcp_buffer_free(&ctx->buf_out);
+  // Close the wake-up pipe
+  close(ctx->wake_fds[0]);
+  close(ctx->wake_fds[1]);
   // Free the display name
   free(ctx->display_name);
   // Free the ctx
@@ -301,13 +510,16 @@ static void ctx_free(struct tcp_server_ctx *ctx) {
 /**
  * Thread function to create a new server instance
  *
+ * The thread sleeps in poll() until there is something to do: a new client, a
+ * client that has sent data or can take more of ours, or a wake-up from the
+ * host thread (see wake_server()).
+ *
  * @param ctx_void context object
  * @return Always returns NULL
  */
 static void *server_create(void *ctx_void) {
   // Cast to a server struct
   struct tcp_server_ctx *ctx = (struct tcp_server_ctx *)ctx_void;
-  struct timeval timeout;
 
   // Start the server
   int rv = start(ctx);
@@ -317,53 +529,82 @@ static void *server_create(void *ctx_void) {
     goto err_cleanup_return;
   }
 
-  // Initialise timeout
-  timeout.tv_sec = 0;
-
-  // Initialise fd_set
-
   // Start waiting for connection / data
-  char xfer_data;
-  while (ctx->socket_run) {
-    // Initialise structure of fds
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    if (ctx->sfd) {
-      FD_SET(ctx->sfd, &read_fds);
+  while (__atomic_load_n(&ctx->socket_run, __ATOMIC_ACQUIRE)) {
+    if (__atomic_exchange_n(&ctx->client_close_req, false, __ATOMIC_ACQUIRE)) {
+      client_close(ctx);
     }
+
     if (ctx->cfd) {
-      FD_SET(ctx->cfd, &read_fds);
+      recv_from_client(ctx);
+      send_to_client(ctx);
     }
-    // max fd num
-    int mfd = (ctx->cfd > ctx->sfd) ? ctx->cfd : ctx->sfd;
 
-    // Set timeout - 50us gives good performance
-    timeout.tv_usec = 50;
+    // Announce that we're about to wait before looking at the state the host
+    // thread can change, so that we can't miss a wake-up.
+    __atomic_store_n(&ctx->server_waiting, true, __ATOMIC_SEQ_CST);
 
-    // Wait for socket activity or timeout
-    rv = select(mfd + 1, &read_fds, NULL, NULL, &timeout);
+    struct pollfd pfds[2];
+    int nfds = 0;
+    pfds[nfds].fd = ctx->wake_fds[0];
+    pfds[nfds].events = POLLIN;
+    ++nfds;
+    if (ctx->cfd) {
+      pfds[nfds].fd = ctx->cfd;
+      pfds[nfds].events = 0;
+      if (tcp_buffer_used(ctx->buf_in) < ctx->buf_in->size) {
+        pfds[nfds].events |= POLLIN;
+      }
+      if (tcp_buffer_used(ctx->buf_out) > 0) {
+        pfds[nfds].events |= POLLOUT;
+      }
+      ++nfds;
+    } else {
+      pfds[nfds].fd = ctx->sfd;
+      pfds[nfds].events = POLLIN;
+      ++nfds;
+    }
 
-    if (rv < 0) {
-      printf("%s: Socket read failed, port: %d\n", ctx->display_name,
-             ctx->listen_port);
-      tcp_server_client_close(ctx);
+    int timeout_ms = -1;
+    if (!__atomic_load_n(&ctx->socket_run, __ATOMIC_SEQ_CST) ||
+        __atomic_load_n(&ctx->client_close_req, __ATOMIC_SEQ_CST)) {
+      timeout_ms = 0;
     }
 
-    // New connection
-    if (FD_ISSET(ctx->sfd, &read_fds)) {
-      client_tryaccept(ctx);
+    for (int i = 0; i < nfds; ++i) {
+      pfds[i].revents = 0;
     }
+    rv = poll(pfds, nfds, timeout_ms);
+    __atomic_store_n(&ctx->server_waiting, false, __ATOMIC_SEQ_CST);
 
-    // New client data
-    if (FD_ISSET(ctx->cfd, &read_fds)) {
-      while (get_byte(ctx, &xfer_data)) {
-        tcp_buffer_put_byte(ctx->buf_in, xfer_data);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      printf("%s: Socket poll failed, port: %d\n", ctx->display_name,
+             ctx->listen_port);
+      client_close(ctx);
+      continue;
     }
 
-    if (ctx->cfd != 0) {
-      while (tcp_buffer_get_byte(ctx->buf_out, &xfer_data)) {
-        put_byte(ctx, xfer_data);
+    // Drain any wake-ups
+    if (pfds[0].revents & POLLIN) {
+      char dummy[64];
+      while (read(ctx->wake_fds[0], dummy, sizeof dummy) > 0) {
+      }
+    }
+
+    // New connection
+    if (!ctx->cfd && (pfds[1].revents & POLLIN)) {
+      client_tryaccept(ctx);
+    } else if (ctx->cfd && (pfds[1].revents & (POLLERR | POLLHUP))) {
+      // Pick up any remaining data, then close the connection. poll() keeps
+      // reporting the hang-up even when we aren't asking for POLLIN (because
+      // the input buffer is full), so leaving the socket open would spin.
+      recv_from_client(ctx);
+      if (ctx->cfd) {
+        printf("%s: Remote disconnected.\n", ctx->display_name);
+        client_close(ctx);
       }
     }
   }
@@ -371,7 +612,7 @@ static void *server_create(void *ctx_void) {
 err_cleanup_return:
 
   // Simulation done - clean up
-  tcp_server_client_close(ctx);
+  client_close(ctx);
   stop(ctx);
 
   return NULL;
@@ -379,13 +620,20 @@ err_cleanup_return:
 
 // Abstract interface functions
 tcp_server_ctx *tcp_server_create(const char *display_name, int listen_port) {
+  return tcp_server_create_with_bufsize(display_name, listen_port,
+                                        DEFAULT_BUFSIZE_BYTE);
+}
+
+tcp_server_ctx *tcp_server_create_with_bufsize(const char *display_name,
+                                               int listen_port,
+                                               size_t buf_size) {
   struct tcp_server_ctx *ctx =
       (struct tcp_server_ctx *)calloc(1, sizeof(struct tcp_server_ctx));
   assert(ctx);
 
   // Create the buffers
-  struct tcp_buf *buf_in = tcp_buffer_new();
-  struct tcp_buf *buf_out = tcp_buffer_new();
+  struct tcp_buf *buf_in = tcp_buffer_new(buf_size);
+  struct tcp_buf *buf_out = tcp_buffer_new(buf_size);
   assert(buf_in);
   assert(buf_out);
 
@@ -396,42 +644,103 @@ tcp_server_ctx *tcp_server_create(const char *display_name, int listen_port) {
   // Set up socket details
   ctx->socket_run = true;
   ctx->listen_port = listen_port;
+  ctx->owner_pid = getpid();
   ctx->display_name = strdup(display_name);
   assert(ctx->display_name);
 
+  // Create the pipe used to wake up the server thread. Both ends are
+  // non-blocking: the server drains it without waiting and the host thread
+  // never needs to queue more than one wake-up.
+  ctx->wake_fds[0] = ctx->wake_fds[1] = -1;
+  if (pipe(ctx->wake_fds) != 0 ||
+      fcntl(ctx->wake_fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+      fcntl(ctx->wake_fds[1], F_SETFL, O_NONBLOCK) != 0) {
+    fprintf(stderr, "%s: Unable to create wake-up pipe: %s (%d)\n",
+            ctx->display_name, strerror(errno), errno);
+    ctx_free(ctx);
+    return NULL;
+  }
+
   if (pthread_create(&ctx->sock_thread, NULL, server_create, (void *)ctx) !=
       0) {
     fprintf(stderr, "%s: Unable to create TCP socket thread\n",
             ctx->display_name);
     ctx_free(ctx);
-    free(ctx);
     return NULL;
   }
   return ctx;
 }
 
 bool tcp_server_read(struct tcp_server_ctx *ctx, char *dat) {
-  return tcp_buffer_get_byte(ctx->buf_in, dat);
+  return tcp_server_read_buf(ctx, dat, 1) == 1;
+}
+
+size_t tcp_server_read_buf(struct tcp_server_ctx *ctx, char *dat, size_t len) {
+  bool was_full;
+  size_t num_read = tcp_buffer_read(ctx->buf_in, dat, len, &was_full);
+  if (was_full) {
+    // The server thread stops reading from the client when the buffer is full
+    wake_server(ctx);
+  }
+  return num_read;
 }
 
 void tcp_server_write(struct tcp_server_ctx *ctx, char dat) {
-  tcp_buffer_put_byte(ctx->buf_out, dat);
+  tcp_server_write_buf(ctx, &dat, 1);
+}
+
+void tcp_server_write_buf(struct tcp_server_ctx *ctx, const char *dat,
+                          size_t len) {
+  unsigned int attempt = 0;
+  while (len > 0) {
+    size_t num_written = tcp_buffer_write(ctx->buf_out, dat, len);
+    if (num_written > 0) {
+      wake_server(ctx);
+      dat += num_written;
+      len -= num_written;
+      attempt = 0;
+    } else if (!__atomic_load_n(&ctx->client_connected, __ATOMIC_ACQUIRE)) {
+      // Nobody will empty the buffer, so waiting could block forever
+      return;
+    } else {
+      // The buffer is full, so the server thread is already waiting for the
+      // client to accept more data.
+      backoff(&attempt);
+    }
+  }
+}
+
+size_t tcp_server_try_write_buf(struct tcp_server_ctx *ctx, const char *dat,
+                                size_t len) {
+  size_t num_written = tcp_buffer_write(ctx->buf_out, dat, len);
+  if (num_written > 0) {
+    wake_server(ctx);
+  }
+  return num_written;
 }
 
 void tcp_server_close(struct tcp_server_ctx *ctx) {
-  // Shut down the socket thread
-  ctx->socket_run = false;
-  pthread_join(ctx->sock_thread, NULL);
+  // Shut down the socket thread. If this process was forked from the one that
+  // created the server (as in the simulation's fork-server mode), the thread
+  // only exists in the parent and there is nothing to join.
+  __atomic_store_n(&ctx->socket_run, false, __ATOMIC_SEQ_CST);
+  if (ctx->owner_pid == getpid()) {
+    wake_server(ctx);
+    pthread_join(ctx->sock_thread, NULL);
+  }
   ctx_free(ctx);
 }
 
 void tcp_server_client_close(struct tcp_server_ctx *ctx) {
   assert(ctx);
 
-  if (!ctx->cfd) {
-    return;
+  // The socket belongs to the server thread, so ask it to close the
+  // connection. Anything the client sent that we haven't read yet is dropped.
+  char *region;
+  size_t avail;
+  while ((avail = tcp_buffer_read_region(ctx->buf_in, &region)) > 0) {
+    tcp_buffer_consume(ctx->buf_in, avail);
   }
-
-  close(ctx->cfd);
-  ctx->cfd = 0;
+  __atomic_store_n(&ctx->client_close_req, true, __ATOMIC_SEQ_CST);
+  wake_server(ctx);
 }
@@ -16,6 +16,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct tcp_server_ctx;
@@ -29,17 +30,54 @@ struct tcp_server_ctx;
  */
 bool tcp_server_read(struct tcp_server_ctx *ctx, char *dat);
 
+/**
+ * Non-blocking read of up to len bytes from a connected client
+ *
+ * @param ctx tcp server context object
+ * @param dat buffer for the bytes received
+ * @param len size of dat in bytes
+ * @return the number of bytes read
+ */
+size_t tcp_server_read_buf(struct tcp_server_ctx *ctx, char *dat, size_t len);
+
 /**
  * Write a byte to a connected client
  *
  * The write is internally buffered and so does not block if the client is not
- * ready to accept data, but does block if the buffer is full.
+ * ready to accept data, but does block if the buffer is full. If the buffer is
+ * full and no client is connected, the byte is dropped.
  *
  * @param ctx tcp server context object
  * @param dat byte to send
  */
 void tcp_server_write(struct tcp_server_ctx *ctx, char dat);
 
+/**
+ * Write len bytes to a connected client
+ *
+ * Like tcp_server_write(), this blocks while the buffer is full. A blocked
+ * writer yields the CPU and then sleeps for increasing periods, rather than
+ * spinning. If the buffer is full and no client is connected (or the client
+ * disconnects while we wait), the bytes that don't fit are dropped.
+ *
+ * @param ctx tcp server context object
+ * @param dat bytes to send
+ * @param len number of bytes to send
+ */
+void tcp_server_write_buf(struct tcp_server_ctx *ctx, const char *dat,
+                          size_t len);
+
+/**
+ * Non-blocking write of up to len bytes to a connected client
+ *
+ * @param ctx tcp server context object
+ * @param dat bytes to send
+ * @param len number of bytes to send
+ * @return the number of bytes that fitted into the buffer
+ */
+size_t tcp_server_try_write_buf(struct tcp_server_ctx *ctx, const char *dat,
+                                size_t len);
+
 /**
  * Create a new TCP server instance
  *
@@ -49,6 +87,23 @@ void tcp_server_write(struct tcp_server_ctx *ctx, char dat);
  */
 tcp_server_ctx *tcp_server_create(const char *display_name, int listen_port);
 
+/**
+ * Create a new TCP server instance with buffers of a given size
+ *
+ * tcp_server_create() uses 4 KiB buffers, which is plenty for a client that
+ * waits for replies (like OpenOCD). A client that streams data should use
+ * larger buffers.
+ *
+ * @param display_name C string description of server
+ * @param listen_port On which port the server should listen
+ * @param buf_size Minimum size of the buffer in each direction, in bytes
+ *                 (rounded up to a power of two)
+ * @return A pointer to the created context struct
+ */
+tcp_server_ctx *tcp_server_create_with_bufsize(const char *display_name,
+                                               int listen_port,
+                                               size_t buf_size);
+
 /**
  * Shut down the server and free all reserved memory
  *
@@ -59,6 +114,8 @@ void tcp_server_close(struct tcp_server_ctx *ctx);
 /**
  * Instruct the server to disconnect a client
  *
+ * Any data received from the client that has not been read yet is discarded.
+ *
  * @param ctx tcp server context object
  */
 void tcp_server_client_close(struct tcp_server_ctx *ctx);
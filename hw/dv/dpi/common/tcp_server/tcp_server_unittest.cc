@@ -0,0 +1,270 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// The ring buffer functions are static, so test them from the same
+// translation unit. Like the DPI modules, this compiles the server as C++.
+#include "tcp_server.c"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+/** Byte `i` of the test stream. */
+char Pattern(size_t i) { return static_cast<char>(i * 7 + (i >> 8)); }
+
+struct BufDeleter {
+  void operator()(tcp_buf *buf) { tcp_buffer_free(&buf); }
+};
+using BufPtr = std::unique_ptr<tcp_buf, BufDeleter>;
+
+TEST(TcpBufferTest, RoundsSizeUpToPowerOfTwo) {
+  EXPECT_EQ(BufPtr(tcp_buffer_new(1))->size, 16u);
+  EXPECT_EQ(BufPtr(tcp_buffer_new(4096))->size, 4096u);
+  EXPECT_EQ(BufPtr(tcp_buffer_new(4097))->size, 8192u);
+}
+
+TEST(TcpBufferTest, WrapsAround) {
+  BufPtr buf(tcp_buffer_new(16));
+  char out[16];
+  bool was_full;
+
+  // Move the pointers to the middle of the buffer
+  ASSERT_EQ(tcp_buffer_write(buf.get(), "0123456789", 10), 10u);
+  ASSERT_EQ(tcp_buffer_read(buf.get(), out, 10, &was_full), 10u);
+  EXPECT_FALSE(was_full);
+
+  // A write that crosses the end of the buffer only fills the free space
+  std::string in = "abcdefghijklmnopqrstuvwxyz";
+  EXPECT_EQ(tcp_buffer_write(buf.get(), in.data(), in.size()), 16u);
+  EXPECT_EQ(tcp_buffer_used(buf.get()), 16u);
+  EXPECT_EQ(tcp_buffer_write(buf.get(), "x", 1), 0u);
+
+  // The contiguous regions end at the end of the buffer
+  char *region;
+  EXPECT_EQ(tcp_buffer_read_region(buf.get(), &region), 6u);
+  EXPECT_EQ(std::string(region, 6), "abcdef");
+
+  ASSERT_EQ(tcp_buffer_read(buf.get(), out, 16, &was_full), 16u);
+  EXPECT_TRUE(was_full);
+  EXPECT_EQ(std::string(out, 16), in.substr(0, 16));
+  EXPECT_EQ(tcp_buffer_used(buf.get()), 0u);
+  EXPECT_EQ(tcp_buffer_read(buf.get(), out, 16, &was_full), 0u);
+  EXPECT_FALSE(was_full);
+}
+
+TEST(TcpBufferTest, PassesDataBetweenThreads) {
+  constexpr size_t kStreamLen = 1 << 22;
+  BufPtr buf(tcp_buffer_new(64));
+
+  // Random chunk sizes make the threads meet at every offset in the buffer
+  std::thread producer([&buf] {
+    std::mt19937 rng(1);
+    char chunk[100];
+    size_t done = 0;
+    while (done < kStreamLen) {
+      size_t len =
+          std::min<size_t>(rng() % sizeof chunk + 1, kStreamLen - done);
+      for (size_t i = 0; i < len; ++i) {
+        chunk[i] = Pattern(done + i);
+      }
+      size_t written = tcp_buffer_write(buf.get(), chunk, len);
+      if (written == 0) {
+        std::this_thread::yield();
+      }
+      done += written;
+    }
+  });
+
+  std::mt19937 rng(2);
+  char chunk[100];
+  size_t done = 0;
+  size_t mismatches = 0;
+  while (done < kStreamLen) {
+    bool was_full;
+    size_t len = tcp_buffer_read(buf.get(), chunk, rng() % sizeof chunk + 1,
+                                 &was_full);
+    if (len == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < len; ++i) {
+      mismatches += chunk[i] != Pattern(done + i);
+    }
+    done += len;
+  }
+  producer.join();
+
+  EXPECT_EQ(mismatches, 0u);
+  EXPECT_EQ(tcp_buffer_used(buf.get()), 0u);
+}
+
+/** A server with a minimal buffer and a client connected to it. */
+class TcpServerTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    // Let the kernel pick a free port. Nothing else should grab it before the
+    // server binds it again (with SO_REUSEADDR).
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    ASSERT_EQ(bind(fd, (struct sockaddr *)&addr, addr_len), 0);
+    ASSERT_EQ(getsockname(fd, (struct sockaddr *)&addr, &addr_len), 0);
+    close(fd);
+    port_ = ntohs(addr.sin_port);
+
+    ctx_ = tcp_server_create_with_bufsize("test", port_, 16);
+    ASSERT_NE(ctx_, nullptr);
+  }
+
+  void TearDown() override {
+    if (client_ >= 0) {
+      close(client_);
+    }
+    if (ctx_) {
+      tcp_server_close(ctx_);
+    }
+  }
+
+  /** Connect the client, retrying until the server thread listens. */
+  void Connect() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port_);
+    for (int attempt = 0; attempt < 1000; ++attempt) {
+      client_ = socket(AF_INET, SOCK_STREAM, 0);
+      ASSERT_GE(client_, 0);
+      if (connect(client_, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        break;
+      }
+      close(client_);
+      client_ = -1;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_GE(client_, 0);
+    WaitFor([this] {
+      return __atomic_load_n(&ctx_->client_connected, __ATOMIC_ACQUIRE);
+    });
+  }
+
+  /** Wait up to ten seconds for cond() to hold. */
+  template <typename Cond>
+  void WaitFor(Cond cond) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!cond()) {
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  int port_ = 0;
+  int client_ = -1;
+  tcp_server_ctx *ctx_ = nullptr;
+};
+
+TEST_F(TcpServerTest, StreamsFromClient) {
+  Connect();
+  constexpr size_t kStreamLen = 1 << 18;
+
+  std::thread sender([this] {
+    std::string data;
+    for (size_t i = 0; i < kStreamLen; ++i) {
+      data += Pattern(i);
+    }
+    for (size_t done = 0; done < kStreamLen;) {
+      ssize_t rv = send(client_, data.data() + done, kStreamLen - done, 0);
+      if (rv <= 0) {
+        return;
+      }
+      done += rv;
+    }
+  });
+
+  std::string received;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (received.size() < kStreamLen &&
+         std::chrono::steady_clock::now() < deadline) {
+    char chunk[7];
+    received.append(chunk, tcp_server_read_buf(ctx_, chunk, sizeof chunk));
+  }
+  sender.join();
+
+  ASSERT_EQ(received.size(), kStreamLen);
+  for (size_t i = 0; i < kStreamLen; ++i) {
+    ASSERT_EQ(received[i], Pattern(i)) << "at byte " << i;
+  }
+}
+
+TEST_F(TcpServerTest, StreamsToClient) {
+  Connect();
+  constexpr size_t kStreamLen = 1 << 18;
+
+  std::string received;
+  std::thread receiver([this, &received] {
+    char chunk[4096];
+    while (received.size() < kStreamLen) {
+      ssize_t rv = recv(client_, chunk, sizeof chunk, 0);
+      if (rv <= 0) {
+        return;
+      }
+      received.append(chunk, rv);
+    }
+  });
+
+  // tcp_server_write_buf() blocks while the 16 byte buffer is full
+  for (size_t done = 0; done < kStreamLen; done += 5) {
+    char chunk[5];
+    for (size_t i = 0; i < sizeof chunk; ++i) {
+      chunk[i] = Pattern(done + i);
+    }
+    tcp_server_write_buf(ctx_, chunk,
+                         std::min(sizeof chunk, kStreamLen - done));
+  }
+  receiver.join();
+
+  ASSERT_EQ(received.size(), kStreamLen);
+  for (size_t i = 0; i < kStreamLen; ++i) {
+    ASSERT_EQ(received[i], Pattern(i)) << "at byte " << i;
+  }
+}
+
+TEST_F(TcpServerTest, TryWriteOnlyFillsBuffer) {
+  char data[40] = {};
+  EXPECT_EQ(tcp_server_try_write_buf(ctx_, data, sizeof data), 16u);
+  EXPECT_EQ(tcp_server_try_write_buf(ctx_, data, sizeof data), 0u);
+}
+
+TEST_F(TcpServerTest, WriteWithoutClientDoesNotBlock) {
+  char data[40] = {};
+  tcp_server_write_buf(ctx_, data, sizeof data);
+  EXPECT_EQ(tcp_buffer_used(ctx_->buf_out), 16u);
+}
+
+TEST_F(TcpServerTest, ClosesHungUpClient) {
+  Connect();
+  close(client_);
+  client_ = -1;
+  WaitFor([this] {
+    return !__atomic_load_n(&ctx_->client_connected, __ATOMIC_ACQUIRE);
+  });
+
+  // With nobody to send to, a full buffer no longer blocks the writer
+  char data[40] = {};
+  tcp_server_write_buf(ctx_, data, sizeof data);
+}
+
+}  // namespace
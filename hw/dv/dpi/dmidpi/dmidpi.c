@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "dmidpi.h"
+#include "dpi_handle.h"
 #include "tcp_server.h"
 
 #include <assert.h>
@@ -30,6 +31,14 @@ const int IDCODEVAL = 0x04F5484D;
 // [3:0]    0x1  - Protocol version (0.13)
 const int DTMCSRVAL = 0x00000071;
 
+// Size of the buffers for bytes received from and sent to the client
+#define DMIDPI_BUFSIZE 256
+
+// Length of a DMI access packet ('D', op, address, 4 data bytes) and of the
+// reply to it (status, 4 data bytes)
+#define DMI_PACKET_LEN 7
+#define DMI_REPLY_LEN 5
+
 enum jtag_state_t : uint8_t {
   TestLogicReset,
   RunTestIdle,
@@ -66,6 +75,8 @@ struct jtag_ctx {
   uint8_t jtag_tdo;
   jtag_state_t jtag_state;
   uint8_t dmi_outstanding;
+  // The outstanding DMI request came from a DMI access packet
+  uint8_t dmi_direct;
 };
 
 struct dmi_sig_values {
@@ -85,8 +96,50 @@ struct dmidpi_ctx {
   struct tcp_server_ctx *sock;
   struct jtag_ctx jtag;
   struct dmi_sig_values sig;
+  // Bytes received but not processed yet (rx_buf[rx_pos..rx_len))
+  char rx_buf[DMIDPI_BUFSIZE];
+  size_t rx_pos;
+  size_t rx_len;
+  // Replies to send at the end of the tick
+  char tx_buf[DMIDPI_BUFSIZE];
+  size_t tx_len;
 };
 
+/**
+ * Make sure that at least n unprocessed bytes are in the receive buffer
+ *
+ * @param ctx dmidpi context object
+ * @param n number of bytes needed
+ * @return true if there are at least n bytes
+ */
+static bool fill_rx(struct dmidpi_ctx *ctx, size_t n) {
+  if (ctx->rx_len - ctx->rx_pos >= n) {
+    return true;
+  }
+  memmove(ctx->rx_buf, ctx->rx_buf + ctx->rx_pos, ctx->rx_len - ctx->rx_pos);
+  ctx->rx_len -= ctx->rx_pos;
+  ctx->rx_pos = 0;
+  ctx->rx_len += tcp_server_read_buf(ctx->sock, ctx->rx_buf + ctx->rx_len,
+                                     DMIDPI_BUFSIZE - ctx->rx_len);
+  return ctx->rx_len >= n;
+}
+
+/**
+ * Queue a reply to the client, which is sent at the end of the tick
+ *
+ * @param ctx dmidpi context object
+ * @param dat reply bytes
+ * @param len number of bytes in dat
+ */
+static void queue_reply(struct dmidpi_ctx *ctx, const char *dat, size_t len) {
+  if (ctx->tx_len + len > DMIDPI_BUFSIZE) {
+    tcp_server_write_buf(ctx->sock, ctx->tx_buf, ctx->tx_len);
+    ctx->tx_len = 0;
+  }
+  memcpy(ctx->tx_buf + ctx->tx_len, dat, len);
+  ctx->tx_len += len;
+}
+
 /**
  * Setup the correct shift register data
  *
@@ -305,14 +358,18 @@ static bool process_cmd_byte(struct dmidpi_ctx *ctx, char cmd) {
   } else if (cmd == 'R') {
     // JTAG read, send tdo as response
     char tdo_ascii = ctx->jtag.jtag_tdo + '0';
-    tcp_server_write(ctx->sock, tdo_ascii);
+    queue_reply(ctx, &tdo_ascii, 1);
   } else if (cmd == 'B') {
     // printf("DMI DPI: BLINK ON!\n");
   } else if (cmd == 'b') {
     // printf("DMI DPI: BLINK OFF!\n");
+  } else if (cmd == 'Z' || cmd == 'z') {
+    // Sleep (1ms or 1us). Simulated time is what matters, so there is nothing
+    // to wait for.
   } else if (cmd == 'Q') {
     // quit (client disconnect)
     printf("DMI DPI: Remote disconnected.\n");
+    ctx->rx_pos = ctx->rx_len = 0;
     tcp_server_client_close(ctx->sock);
   } else {
     fprintf(stderr,
@@ -324,6 +381,48 @@ static bool process_cmd_byte(struct dmidpi_ctx *ctx, char cmd) {
   return false;
 }
 
+/**
+ * Process a DMI access packet
+ *
+ * A packet is 'D', followed by the DMI operation (0: nop, 1: read, 2: write),
+ * the 7 bit DMI address and 4 bytes of write data (least significant byte
+ * first). It lets a client access the debug module directly, without
+ * emulating the JTAG DTM bit by bit.
+ *
+ * @param ctx dmidpi context object
+ * @param pkt the packet (DMI_PACKET_LEN bytes)
+ * @return true when a DMI request was issued, false otherwise
+ */
+static bool process_dmi_packet(struct dmidpi_ctx *ctx, const char *pkt) {
+  uint8_t op = (uint8_t)pkt[1];
+  if (op > 2) {
+    // Op 3 is reserved, so don't pass it (or a truncated larger value) on to
+    // the debug module. Reply with the "failed" status instead.
+    fprintf(stderr, "DMI DPI: Invalid DMI operation %u in packet\n", op);
+    char reply[DMI_REPLY_LEN] = {2};
+    queue_reply(ctx, reply, DMI_REPLY_LEN);
+    return false;
+  }
+  if (op == 0) {
+    // Nothing to do on the bus, reply straight away
+    char reply[DMI_REPLY_LEN] = {0};
+    queue_reply(ctx, reply, DMI_REPLY_LEN);
+    return false;
+  }
+
+  ctx->sig.dmi_rst_n = 1;
+  ctx->jtag.dmi_outstanding = 1;
+  ctx->jtag.dmi_direct = 1;
+  ctx->sig.dmi_req_valid = 1;
+  ctx->sig.dmi_req_addr = pkt[2] & 0x7F;
+  ctx->sig.dmi_req_op = op;
+  ctx->sig.dmi_req_data = 0;
+  for (int i = 0; i < 4; ++i) {
+    ctx->sig.dmi_req_data |= (uint32_t)(uint8_t)pkt[3 + i] << (8 * i);
+  }
+  return true;
+}
+
 /**
  * Process DPI inputs from the design
  *
@@ -337,8 +436,19 @@ static void process_dmi_inputs(struct dmidpi_ctx *ctx) {
   // Always ready for a resp
   ctx->sig.dmi_rsp_ready = 1;
   if (ctx->sig.dmi_rsp_valid) {
-    ctx->jtag.dr_captured = (uint64_t)ctx->sig.dmi_rsp_data << 2;
-    ctx->jtag.dr_captured |= (uint64_t)ctx->sig.dmi_rsp_resp & 0x3;
+    if (ctx->jtag.dmi_direct) {
+      // Reply to the DMI access packet: the status, then the data
+      char reply[DMI_REPLY_LEN];
+      reply[0] = ctx->sig.dmi_rsp_resp & 0x3;
+      for (int i = 0; i < 4; ++i) {
+        reply[1 + i] = (ctx->sig.dmi_rsp_data >> (8 * i)) & 0xFF;
+      }
+      queue_reply(ctx, reply, DMI_REPLY_LEN);
+      ctx->jtag.dmi_direct = 0;
+    } else {
+      ctx->jtag.dr_captured = (uint64_t)ctx->sig.dmi_rsp_data << 2;
+      ctx->jtag.dr_captured |= (uint64_t)ctx->sig.dmi_rsp_resp & 0x3;
+    }
     // Clear req outstanding flag
     ctx->jtag.dmi_outstanding = 0;
   }
@@ -347,6 +457,9 @@ static void process_dmi_inputs(struct dmidpi_ctx *ctx) {
 /**
  * Advance DMI internal state
  *
+ * Replies to the client are collected during the tick and sent together at
+ * the end of it.
+ *
  * @param ctx dmidpi context object
  */
 static void update_dmi_state(struct dmidpi_ctx *ctx) {
@@ -357,19 +470,26 @@ static void update_dmi_state(struct dmidpi_ctx *ctx) {
 
   // If we are waiting for a previous transaction to complete, do not attempt
   // a new one
-  if (ctx->jtag.dmi_outstanding) {
-    return;
+  bool done = ctx->jtag.dmi_outstanding;
+  while (!done && fill_rx(ctx, 1)) {
+    char cmd = ctx->rx_buf[ctx->rx_pos];
+    if (cmd == 'D') {
+      // Wait for the rest of a DMI access packet
+      if (!fill_rx(ctx, DMI_PACKET_LEN)) {
+        break;
+      }
+      done = process_dmi_packet(ctx, ctx->rx_buf + ctx->rx_pos);
+      ctx->rx_pos += DMI_PACKET_LEN;
+    } else {
+      // Process command bytes until a command completes
+      ++ctx->rx_pos;
+      done = process_cmd_byte(ctx, cmd);
+    }
   }
 
-  char done = 0;
-  while (!done) {
-    // read a command byte
-    char cmd;
-    if (!tcp_server_read(ctx->sock, &cmd)) {
-      return;
-    }
-    // Process command bytes until a command completes
-    done = process_cmd_byte(ctx, cmd);
+  if (ctx->tx_len) {
+    tcp_server_write_buf(ctx->sock, ctx->tx_buf, ctx->tx_len);
+    ctx->tx_len = 0;
   }
 }
 
@@ -391,11 +511,11 @@ void *dmidpi_create(const char *display_name, int listen_port) {
       "  remote_bitbang_port %d\n",
       display_name, listen_port, listen_port);
 
-  return (void *)ctx;
+  return dpi_handle_new("dmidpi", display_name, ctx);
 }
 
 void dmidpi_close(void *ctx_void) {
-  struct dmidpi_ctx *ctx = (struct dmidpi_ctx *)ctx_void;
+  struct dmidpi_ctx *ctx = (struct dmidpi_ctx *)dpi_handle_get(ctx_void);
   if (!ctx) {
     return;
   }
@@ -404,6 +524,7 @@ void dmidpi_close(void *ctx_void) {
   tcp_server_close(ctx->sock);
 
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
 
 void dmidpi_tick(void *ctx_void, svBit *dmi_req_valid,
@@ -412,7 +533,7 @@ void dmidpi_tick(void *ctx_void, svBit *dmi_req_valid,
                  const svBit dmi_rsp_valid, svBit *dmi_rsp_ready,
                  const svBitVecVal *dmi_rsp_data,
                  const svBitVecVal *dmi_rsp_resp, svBit *dmi_rst_n) {
-  struct dmidpi_ctx *ctx = (struct dmidpi_ctx *)ctx_void;
+  struct dmidpi_ctx *ctx = (struct dmidpi_ctx *)dpi_handle_get(ctx_void);
 
   if (!ctx) {
     return;
@@ -18,7 +18,8 @@ extern "C" {
  *
  * @param display_name Name of the interface (for display purposes only)
  * @param listen_port Port to listen on
- * @return an initialized struct dmidpi_ctx context object
+ * @return a handle (see dpi_handle.h) for an initialized struct dmidpi_ctx
+ *         context object
  */
 void *dmidpi_create(const char *display_name, int listen_port);
 
@@ -27,7 +28,7 @@ void *dmidpi_create(const char *display_name, int listen_port);
  *
  * Call from a finish block.
  *
- * @param ctx_void  a struct dmidpi_ctx context object
+ * @param ctx_void  the handle of a struct dmidpi_ctx context object
  */
 void dmidpi_close(void *ctx_void);
 
@@ -37,7 +38,7 @@ void dmidpi_close(void *ctx_void);
  * Call this function from the simulation at every clock tick to read/write
  * from/to the DMI signals.
  *
- * @param ctx_void  a struct dmidpi_ctx context object
+ * @param ctx_void  the handle of a struct dmidpi_ctx context object
  */
 void dmidpi_tick(void *ctx_void, svBit *dmi_req_valid,
                  const svBit dmi_req_ready, svBitVecVal *dmi_req_addr,
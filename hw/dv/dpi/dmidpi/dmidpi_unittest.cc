@@ -0,0 +1,211 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// Include the module itself so that the test can replace the TCP server with
+// an in-memory one and look at the context.
+#include "dmidpi.c"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+/**
+ * In-memory stand-in for the TCP server: rx holds the bytes the client has
+ * sent, and tx collects the bytes sent back to it.
+ */
+struct tcp_server_ctx {
+  std::string rx;
+  std::string tx;
+  bool client_closed = false;
+};
+
+tcp_server_ctx *tcp_server_create(const char *, int) {
+  return new tcp_server_ctx;
+}
+
+void tcp_server_close(tcp_server_ctx *ctx) { delete ctx; }
+
+void tcp_server_client_close(tcp_server_ctx *ctx) {
+  ctx->rx.clear();
+  ctx->client_closed = true;
+}
+
+size_t tcp_server_read_buf(tcp_server_ctx *ctx, char *dat, size_t len) {
+  size_t num_read = ctx->rx.copy(dat, len);
+  ctx->rx.erase(0, num_read);
+  return num_read;
+}
+
+void tcp_server_write_buf(tcp_server_ctx *ctx, const char *dat, size_t len) {
+  ctx->tx.append(dat, len);
+}
+
+namespace {
+
+/** A DMI access packet. */
+std::string Packet(uint8_t op, uint8_t addr, uint32_t data) {
+  std::string pkt = {'D', static_cast<char>(op), static_cast<char>(addr)};
+  for (int i = 0; i < 4; ++i) {
+    pkt += static_cast<char>(data >> (8 * i));
+  }
+  return pkt;
+}
+
+/** The reply to a DMI access packet. */
+std::string Reply(uint8_t status, uint32_t data) {
+  std::string reply = {static_cast<char>(status)};
+  for (int i = 0; i < 4; ++i) {
+    reply += static_cast<char>(data >> (8 * i));
+  }
+  return reply;
+}
+
+struct DmiRequest {
+  uint32_t addr;
+  uint32_t op;
+  uint32_t data;
+
+  bool operator==(const DmiRequest &other) const {
+    return addr == other.addr && op == other.op && data == other.data;
+  }
+};
+
+std::ostream &operator<<(std::ostream &os, const DmiRequest &req) {
+  return os << "{addr " << req.addr << ", op " << req.op << ", data "
+            << req.data << "}";
+}
+
+/**
+ * Drives dmidpi_tick() like the simulation, with a debug module that takes a
+ * request every cycle and responds in the next one.
+ */
+class DmiDpiTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    handle_ = dmidpi_create("test", 0);
+    ctx_ = static_cast<dmidpi_ctx *>(dpi_handle_get(handle_));
+    ASSERT_NE(ctx_, nullptr);
+  }
+
+  void TearDown() override { dmidpi_close(handle_); }
+
+  void Send(const std::string &dat) { ctx_->sock->rx += dat; }
+  const std::string &Received() const { return ctx_->sock->tx; }
+
+  void Tick() {
+    svBit req_valid, rsp_ready, rst_n;
+    svBitVecVal req_addr, req_op, req_data;
+    svBit rsp_valid = rsp_pending_;
+    svBitVecVal rsp_data = rsp_data_, rsp_resp = rsp_resp_;
+    dmidpi_tick(handle_, &req_valid, 1, &req_addr, &req_op, &req_data, rsp_valid,
+                &rsp_ready, &rsp_data, &rsp_resp, &rst_n);
+    rsp_pending_ = false;
+
+    if (req_valid) {
+      requests_.push_back({req_addr, req_op, req_data});
+      if (req_op == 2) {
+        regs_[req_addr] = req_data;
+      }
+      rsp_pending_ = true;
+      rsp_data_ = regs_[req_addr];
+    }
+  }
+
+  void Tick(int n) {
+    for (int i = 0; i < n; ++i) {
+      Tick();
+    }
+  }
+
+  void *handle_;
+  dmidpi_ctx *ctx_;
+  std::map<uint32_t, uint32_t> regs_;
+  std::vector<DmiRequest> requests_;
+  uint32_t rsp_resp_ = 0;
+
+ private:
+  bool rsp_pending_ = false;
+  uint32_t rsp_data_ = 0;
+};
+
+TEST_F(DmiDpiTest, Read) {
+  regs_[0x11] = 0x12345678;
+  Send(Packet(1, 0x11, 0));
+  Tick(4);
+  EXPECT_EQ(requests_, std::vector<DmiRequest>({{0x11, 1, 0}}));
+  EXPECT_EQ(Received(), Reply(0, 0x12345678));
+}
+
+TEST_F(DmiDpiTest, Write) {
+  Send(Packet(2, 0x10, 0x80000001));
+  Tick(4);
+  EXPECT_EQ(requests_, std::vector<DmiRequest>({{0x10, 2, 0x80000001}}));
+  EXPECT_EQ(regs_[0x10], 0x80000001u);
+  EXPECT_EQ(Received(), Reply(0, 0x80000001));
+}
+
+TEST_F(DmiDpiTest, MasksAddress) {
+  Send(Packet(1, 0xff, 0));
+  Tick(4);
+  EXPECT_EQ(requests_, std::vector<DmiRequest>({{0x7f, 1, 0}}));
+}
+
+TEST_F(DmiDpiTest, ReportsStatus) {
+  rsp_resp_ = 3;
+  Send(Packet(1, 0x11, 0));
+  Tick(4);
+  EXPECT_EQ(Received(), Reply(3, 0));
+}
+
+TEST_F(DmiDpiTest, NopDoesNotReachBus) {
+  Send(Packet(0, 0x11, 0x12345678));
+  Tick(4);
+  EXPECT_TRUE(requests_.empty());
+  EXPECT_EQ(Received(), Reply(0, 0));
+}
+
+TEST_F(DmiDpiTest, ReservedOpsFail) {
+  for (uint8_t op : {3, 5, 0xff}) {
+    Send(Packet(op, 0x11, 0));
+  }
+  Tick(4);
+  EXPECT_TRUE(requests_.empty());
+  EXPECT_EQ(Received(), Reply(2, 0) + Reply(2, 0) + Reply(2, 0));
+}
+
+TEST_F(DmiDpiTest, WaitsForWholePacket) {
+  std::string pkt = Packet(2, 0x10, 0x12345678);
+  Send(pkt.substr(0, 3));
+  Tick(4);
+  EXPECT_TRUE(requests_.empty());
+  EXPECT_TRUE(Received().empty());
+
+  Send(pkt.substr(3));
+  Tick(4);
+  EXPECT_EQ(requests_, std::vector<DmiRequest>({{0x10, 2, 0x12345678}}));
+  EXPECT_EQ(Received(), Reply(0, 0x12345678));
+}
+
+TEST_F(DmiDpiTest, OneRequestAtATime) {
+  regs_[0x11] = 1;
+  regs_[0x12] = 2;
+  Send(Packet(1, 0x11, 0) + Packet(1, 0x12, 0));
+  Tick();
+  EXPECT_EQ(requests_.size(), 1u);
+  Tick(4);
+  EXPECT_EQ(requests_, std::vector<DmiRequest>({{0x11, 1, 0}, {0x12, 1, 0}}));
+  EXPECT_EQ(Received(), Reply(0, 1) + Reply(0, 2));
+}
+
+TEST_F(DmiDpiTest, MixesWithBitbang) {
+  regs_[0x11] = 0x12345678;
+  // Read TDO, then access the DMI, then read TDO again
+  Send("R" + Packet(1, 0x11, 0) + "R");
+  Tick(4);
+  EXPECT_EQ(Received(), "0" + Reply(0, 0x12345678) + "0");
+}
+
+}  // namespace
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "gpiodpi.h"
+#include "dpi_handle.h"
 
 #ifdef __linux__
 #include <pty.h>
@@ -130,12 +131,12 @@ void *gpiodpi_create(const char *name, int n_bits) {
 
   print_usage(ctx->dev_to_host_path, ctx->host_to_dev_path, ctx->n_bits);
 
-  return (void *)ctx;
+  return dpi_handle_new("gpiodpi", name, ctx);
 }
 
 void gpiodpi_device_to_host(void *ctx_void, svBitVecVal *gpio_data,
                             svBitVecVal *gpio_oe) {
-  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)ctx_void;
+  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)dpi_handle_get(ctx_void);
   assert(ctx);
 
   // Write 0, 1, or X (when oe is not set) for each GPIO pin, in big endian
@@ -187,7 +188,7 @@ static uint32_t parse_dec(char **text) {
 }
 
 uint32_t gpiodpi_host_to_device_tick(void *ctx_void, svBitVecVal *gpio_oe) {
-  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)ctx_void;
+  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)dpi_handle_get(ctx_void);
   assert(ctx);
 
   char gpio_str[32 + 2];
@@ -236,7 +237,7 @@ parse_loop_end:
 }
 
 void gpiodpi_close(void *ctx_void) {
-  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)ctx_void;
+  struct gpiodpi_ctx *ctx = (struct gpiodpi_ctx *)dpi_handle_get(ctx_void);
   if (ctx == NULL) {
     return;
   }
@@ -260,4 +261,5 @@ void gpiodpi_close(void *ctx_void) {
   }
 
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
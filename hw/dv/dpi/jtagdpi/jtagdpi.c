@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "jtagdpi.h"
+#include "dpi_handle.h"
 #include "tcp_server.h"
 
 #include <assert.h>
@@ -11,6 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * Size of the buffers for command bytes received from OpenOCD and for replies
+ */
+#define JTAGDPI_BUFSIZE 256
+
 struct jtagdpi_ctx {
   // Server context
   struct tcp_server_ctx *sock;
@@ -21,6 +27,13 @@ struct jtagdpi_ctx {
   uint8_t tdo;
   uint8_t trst_n;
   uint8_t srst_n;
+  // Command bytes received but not processed yet (rx_buf[rx_pos..rx_len))
+  char rx_buf[JTAGDPI_BUFSIZE];
+  size_t rx_pos;
+  size_t rx_len;
+  // Replies to send at the end of the tick
+  char tx_buf[JTAGDPI_BUFSIZE];
+  size_t tx_len;
 };
 
 /**
@@ -40,8 +53,44 @@ static void reset_jtag_signals(struct jtagdpi_ctx *ctx) {
   ctx->srst_n = 1;
 }
 
+/**
+ * Get the next command byte without consuming it
+ *
+ * @return true if there was a command byte
+ */
+static bool peek_cmd(struct jtagdpi_ctx *ctx, char *cmd) {
+  if (ctx->rx_pos == ctx->rx_len) {
+    ctx->rx_pos = 0;
+    ctx->rx_len = tcp_server_read_buf(ctx->sock, ctx->rx_buf, JTAGDPI_BUFSIZE);
+    if (ctx->rx_len == 0) {
+      return false;
+    }
+  }
+  *cmd = ctx->rx_buf[ctx->rx_pos];
+  return true;
+}
+
+/**
+ * Send all buffered replies
+ */
+static void flush_replies(struct jtagdpi_ctx *ctx) {
+  if (ctx->tx_len) {
+    tcp_server_write_buf(ctx->sock, ctx->tx_buf, ctx->tx_len);
+    ctx->tx_len = 0;
+  }
+}
+
 /**
  * Update the JTAG signals in the context structure
+ *
+ * Every command used to take a tick of its own. Now, commands are processed
+ * until one of them needs the design to see a change at the pins: a new TCK
+ * level (a clock edge) or a reset change. Any number of writes that only
+ * change TMS or TDI can come before that, because the TAP only samples them on
+ * a TCK edge, and TDO reads are answered from the current TDO as long as
+ * nothing has clocked the TAP in this tick. OpenOCD queues up many commands
+ * (and reads) without waiting for replies, so this takes about one tick per
+ * TCK edge rather than one per command byte.
  */
 static void update_jtag_signals(struct jtagdpi_ctx *ctx) {
   assert(ctx);
@@ -53,52 +102,60 @@ static void update_jtag_signals(struct jtagdpi_ctx *ctx) {
    * https://repo.or.cz/openocd.git/blob/HEAD:/doc/manual/jtag/drivers/remote_bitbang.txt
    */
 
-  // read a command byte
-  char cmd;
-  if (!tcp_server_read(ctx->sock, &cmd)) {
-    return;
-  }
-
-  bool act_send_resp = false;
   bool act_quit = false;
 
-  // parse received command byte
-  if (cmd >= '0' && cmd <= '7') {
-    // JTAG write
-    char cmd_bit = cmd - '0';
-    ctx->tdi = (cmd_bit >> 0) & 0x1;
-    ctx->tms = (cmd_bit >> 1) & 0x1;
-    ctx->tck = (cmd_bit >> 2) & 0x1;
-  } else if (cmd >= 'r' && cmd <= 'u') {
-    // JTAG reset (active high from OpenOCD)
-    char cmd_bit = cmd - 'r';
-    ctx->srst_n = !((cmd_bit >> 0) & 0x1);
-    ctx->trst_n = !((cmd_bit >> 1) & 0x1);
-  } else if (cmd == 'R') {
-    // JTAG read
-    act_send_resp = true;
-  } else if (cmd == 'B') {
-    // printf("%s: BLINK ON!\n", ctx->display_name);
-  } else if (cmd == 'b') {
-    // printf("%s: BLINK OFF!\n", ctx->display_name);
-  } else if (cmd == 'Q') {
-    // quit (client disconnect)
-    act_quit = true;
-  } else {
-    fprintf(stderr,
-            "JTAG DPI Protocol violation detected: unsupported command %c\n",
-            cmd);
-    exit(1);
+  char cmd;
+  while (!act_quit && peek_cmd(ctx, &cmd)) {
+    bool pin_event = false;
+
+    // parse received command byte
+    if (cmd >= '0' && cmd <= '7') {
+      // JTAG write
+      char cmd_bit = cmd - '0';
+      ctx->tdi = (cmd_bit >> 0) & 0x1;
+      ctx->tms = (cmd_bit >> 1) & 0x1;
+      pin_event = ctx->tck != ((cmd_bit >> 2) & 0x1);
+      ctx->tck = (cmd_bit >> 2) & 0x1;
+    } else if (cmd >= 'r' && cmd <= 'u') {
+      // JTAG reset (active high from OpenOCD)
+      char cmd_bit = cmd - 'r';
+      ctx->srst_n = !((cmd_bit >> 0) & 0x1);
+      ctx->trst_n = !((cmd_bit >> 1) & 0x1);
+      pin_event = true;
+    } else if (cmd == 'R') {
+      // JTAG read, send tdo as response
+      if (ctx->tx_len == JTAGDPI_BUFSIZE) {
+        flush_replies(ctx);
+      }
+      ctx->tx_buf[ctx->tx_len++] = ctx->tdo + '0';
+    } else if (cmd == 'B') {
+      // printf("%s: BLINK ON!\n", ctx->display_name);
+    } else if (cmd == 'b') {
+      // printf("%s: BLINK OFF!\n", ctx->display_name);
+    } else if (cmd == 'Z' || cmd == 'z') {
+      // Sleep (1ms or 1us). Simulated time is what matters, so there is
+      // nothing to wait for.
+    } else if (cmd == 'Q') {
+      // quit (client disconnect)
+      act_quit = true;
+    } else {
+      fprintf(stderr,
+              "JTAG DPI Protocol violation detected: unsupported command %c\n",
+              cmd);
+      exit(1);
+    }
+    ++ctx->rx_pos;
+
+    if (pin_event) {
+      break;
+    }
   }
 
-  // send tdo as response
-  if (act_send_resp) {
-    char tdo_ascii = ctx->tdo + '0';
-    tcp_server_write(ctx->sock, tdo_ascii);
-  }
+  flush_replies(ctx);
 
   if (act_quit) {
     printf("JTAG DPI: Remote disconnected.\n");
+    ctx->rx_pos = ctx->rx_len = 0;
     tcp_server_client_close(ctx->sock);
   }
 }
@@ -122,21 +179,22 @@ void *jtagdpi_create(const char *display_name, int listen_port) {
       "  remote_bitbang_port %d\n",
       display_name, listen_port, listen_port);
 
-  return (void *)ctx;
+  return dpi_handle_new("jtagdpi", display_name, ctx);
 }
 
 void jtagdpi_close(void *ctx_void) {
-  struct jtagdpi_ctx *ctx = (struct jtagdpi_ctx *)ctx_void;
+  struct jtagdpi_ctx *ctx = (struct jtagdpi_ctx *)dpi_handle_get(ctx_void);
   if (!ctx) {
     return;
   }
   tcp_server_close(ctx->sock);
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
 
 void jtagdpi_tick(void *ctx_void, svBit *tck, svBit *tms, svBit *tdi,
                   svBit *trst_n, svBit *srst_n, const svBit tdo) {
-  struct jtagdpi_ctx *ctx = (struct jtagdpi_ctx *)ctx_void;
+  struct jtagdpi_ctx *ctx = (struct jtagdpi_ctx *)dpi_handle_get(ctx_void);
 
   ctx->tdo = tdo;
 
@@ -20,7 +20,8 @@ struct jtagdpi_ctx;
  *
  * @param display_name Name of the JTAG interface (for display purposes only)
  * @param listen_port Port to listen on
- * @return an initialized struct jtagdpi_ctx context object
+ * @return a handle (see dpi_handle.h) for an initialized struct jtagdpi_ctx
+ *         context object
  */
 void *jtagdpi_create(const char *display_name, int listen_port);
 
@@ -29,7 +30,7 @@ void *jtagdpi_create(const char *display_name, int listen_port);
  *
  * Call from a finish block.
  *
- * @param ctx_void  a struct jtagdpi_ctx context object
+ * @param ctx_void  the handle of a struct jtagdpi_ctx context object
  */
 void jtagdpi_close(void *ctx_void);
 
@@ -39,7 +40,7 @@ void jtagdpi_close(void *ctx_void);
  * Call this function from the simulation at every clock tick to read/write
  * from/to the JTAG signals.
  *
- * @param ctx_void  a struct jtagdpi_ctx context object
+ * @param ctx_void  the handle of a struct jtagdpi_ctx context object
  * @param tck       JTAG test clock signal
  * @param tms       JTAG test mode select signal
  * @param tdi       JTAG test data input signal
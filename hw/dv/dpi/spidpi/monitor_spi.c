@@ -9,7 +9,11 @@
 
 #include "spidpi.h"
 
-#define MON_BUFLEN 65
+// Room for the longest transaction, plus the byte that is cleared ahead of
+// the next one to be captured
+#define MON_BUFLEN (MAX_TRANSACTION + 1)
+// Bytes of a packet logged per line
+#define MON_LINE_BYTES 32
 
 struct mon_ctx {
   int cpol;
@@ -116,15 +120,28 @@ static void log_signals(struct mon_ctx *mon, FILE *mon_file, int tick, int p2d,
 }
 
 static void log_packet(struct mon_ctx *mon, FILE *mon_file) {
-  fprintf(mon_file, "H>D: ");
-  for (int i = 0; i < mon->poff; i++) {
-    fprintf(mon_file, "%02x ", mon->mobuf[i]);
-  }
-  fprintf(mon_file, "D>H: ");
-  for (int i = 0; i < mon->poff; i++) {
-    fprintf(mon_file, "%02x ", mon->sobuf[i]);
-  }
-  fprintf(mon_file, "\n");
+  // Long packets are split into lines of MON_LINE_BYTES, each starting with
+  // the offset of its first byte
+  int start = 0;
+  do {
+    int end = start + MON_LINE_BYTES;
+    if (end > mon->poff) {
+      end = mon->poff;
+    }
+    if (start > 0) {
+      fprintf(mon_file, "%04x ", start);
+    }
+    fprintf(mon_file, "H>D: ");
+    for (int i = start; i < end; i++) {
+      fprintf(mon_file, "%02x ", mon->mobuf[i]);
+    }
+    fprintf(mon_file, "D>H: ");
+    for (int i = start; i < end; i++) {
+      fprintf(mon_file, "%02x ", mon->sobuf[i]);
+    }
+    fprintf(mon_file, "\n");
+    start = end;
+  } while (start < mon->poff);
 }
 
 static void capture_bit(struct mon_ctx *mon, FILE *mon_file, int p2d, int d2p) {
@@ -19,27 +19,238 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "dpi_handle.h"
 #include "spidpi.h"
+#include "tcp_server.h"
 #include "verilator_sim_ctrl.h"
 
 // Enable this define to stop tracing at cycle 4
 // and resume at the first SPI packet
 // #define CONTROL_TRACE
 
-void *spidpi_create(const char *name, int mode, int loglevel) {
-  int i;
+/**
+ * Create a pseudo-terminal for the SPI host
+ */
+static void open_pty(struct spidpi_ctx *ctx, const char *name) {
+  int rv;
+  struct termios tty;
+  cfmakeraw(&tty);
+
+  rv = openpty(&ctx->host, &ctx->device, 0, &tty, 0);
+  assert(rv != -1);
+
+  rv = ttyname_r(ctx->device, ctx->ptyname, 64);
+  assert(rv == 0 && "ttyname_r failed");
+
+  int cur_flags = fcntl(ctx->host, F_GETFL, 0);
+  assert(cur_flags != -1 && "Unable to read current flags.");
+  int new_flags = fcntl(ctx->host, F_SETFL, cur_flags | O_NONBLOCK);
+  assert(new_flags != -1 && "Unable to set FD flags");
+
+  printf(
+      "\n"
+      "SPI: Created %s for %s. Connect to it with any terminal program, e.g.\n"
+      "$ screen %s\n",
+      ctx->ptyname, name, ctx->ptyname);
+}
+
+/**
+ * Start a TCP server for the SPI host
+ */
+static void open_tcp(struct spidpi_ctx *ctx, const char *name, int port) {
+  ctx->sock = tcp_server_create_with_bufsize(name, port, 2 * MAX_TRANSACTION);
+  assert(ctx->sock);
+
+  printf(
+      "\n"
+      "SPI: %s is listening on TCP port %d.\n",
+      name, port);
+}
+
+/**
+ * Open a file (or named pipe) with the bytes to send
+ */
+static void open_input_file(struct spidpi_ctx *ctx, const char *name,
+                            const char *path) {
+  // Don't block on a named pipe that nothing has opened for writing yet
+  ctx->input_fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (ctx->input_fd < 0) {
+    fprintf(stderr, "SPI: Unable to open input file %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+
+  printf("\nSPI: Sending the contents of '%s' over %s.\n", path, name);
+}
+
+/**
+ * Read up to len bytes from the backend
+ *
+ * @return the number of bytes read
+ */
+static int read_bytes(struct spidpi_ctx *ctx, char *dst, int len) {
+  int n = 0;
+  switch (ctx->backend) {
+    case SPIDPI_BACKEND_PTY:
+      n = read(ctx->host, dst, len);
+      if (n == -1) {
+        if (errno != EAGAIN) {
+          fprintf(stderr, "Read on SPI FIFO gave %s\n", strerror(errno));
+        }
+        n = 0;
+      }
+      break;
+    case SPIDPI_BACKEND_TCP:
+      n = tcp_server_read_buf(ctx->sock, dst, len);
+      break;
+    case SPIDPI_BACKEND_FILE:
+      if (ctx->input_done) {
+        break;
+      }
+      n = read(ctx->input_fd, dst, len);
+      if (n == 0) {
+        // End of file: send what is left as a shorter transaction
+        ctx->input_done = 1;
+      } else if (n == -1) {
+        if (errno != EAGAIN) {
+          fprintf(stderr, "Read on SPI input file gave %s\n", strerror(errno));
+        }
+        n = 0;
+      }
+      break;
+  }
+  return n;
+}
+
+/**
+ * Read more bytes for the next transaction from the backend
+ *
+ * In framed mode, this reads the frame header first, which gives the length
+ * of the transaction.
+ *
+ * @return the number of bytes read
+ */
+static int read_input(struct spidpi_ctx *ctx) {
+  int n = 0;
+  if (ctx->framed && ctx->nhdr < FRAME_HDR_LEN) {
+    n = read_bytes(ctx, &(ctx->frame_hdr[ctx->nhdr]),
+                   FRAME_HDR_LEN - ctx->nhdr);
+    ctx->nhdr += n;
+    if (ctx->nhdr < FRAME_HDR_LEN) {
+      return n;
+    }
+    int frame_len =
+        (uint8_t)ctx->frame_hdr[0] | ((uint8_t)ctx->frame_hdr[1] << 8);
+    if (frame_len < 1 || frame_len > MAX_TRANSACTION) {
+      fprintf(stderr,
+              "SPI: Frame length must be between 1 and %d bytes, not %d.\n",
+              MAX_TRANSACTION, frame_len);
+      exit(1);
+    }
+    ctx->nmax = frame_len;
+  }
+
+  int len = ctx->nmax - ctx->nin;
+  int nbody = len ? read_bytes(ctx, &(ctx->buf[ctx->nin]), len) : 0;
+  ctx->nin += nbody;
+  return n + nbody;
+}
+
+/**
+ * Write as much of the pending pseudo-terminal output as it accepts
+ *
+ * The pseudo-terminal is non-blocking, so a reply can be written in several
+ * parts. Whatever doesn't fit now is retried on a later tick.
+ */
+static void flush_pty_output(struct spidpi_ctx *ctx) {
+  while (ctx->pty_out_len > 0) {
+    ssize_t rv = write(ctx->host, ctx->pty_out, ctx->pty_out_len);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      assert((errno == EAGAIN || errno == EWOULDBLOCK) &&
+             "Write to pseudo-terminal failed.");
+      return;
+    }
+    memmove(ctx->pty_out, ctx->pty_out + rv, ctx->pty_out_len - rv);
+    ctx->pty_out_len -= rv;
+  }
+}
+
+/**
+ * Send the bytes received in a transaction to the backend
+ */
+static void write_output(struct spidpi_ctx *ctx) {
+  if (ctx->framed) {
+    // Tell the host that the frame is done and how many bytes follow
+    int len = ctx->nrecv - FRAME_DONE_HDR_LEN;
+    ctx->recv_buf[0] = FRAME_DONE;
+    ctx->recv_buf[1] = len & 0xff;
+    ctx->recv_buf[2] = (len >> 8) & 0xff;
+  } else if (ctx->nrecv == 0) {
+    return;
+  }
+  switch (ctx->backend) {
+    case SPIDPI_BACKEND_PTY:
+      // If nothing is reading the output, don't let it stop the simulation.
+      // The monitor log still shows everything.
+      if (ctx->pty_out_len + ctx->nrecv > PTY_OUT_BUFLEN) {
+        if (!ctx->dropped_output) {
+          fprintf(stderr,
+                  "SPI: Nothing is reading the SPI output, dropping it. The "
+                  "monitor log is unaffected.\n");
+          ctx->dropped_output = 1;
+        }
+        ctx->pty_out_len = 0;
+      }
+      memcpy(ctx->pty_out + ctx->pty_out_len, ctx->recv_buf, ctx->nrecv);
+      ctx->pty_out_len += ctx->nrecv;
+      flush_pty_output(ctx);
+      break;
+    case SPIDPI_BACKEND_TCP:
+      tcp_server_write_buf(ctx->sock, ctx->recv_buf, ctx->nrecv);
+      break;
+    case SPIDPI_BACKEND_FILE:
+      // The received bytes are only shown in the monitor output
+      break;
+  }
+  ctx->nrecv = 0;
+}
+
+void *spidpi_create(const char *name, int mode, int loglevel,
+                    const char *backend, int transaction_bytes,
+                    int sck_divider, int framed) {
   struct spidpi_ctx *ctx =
       (struct spidpi_ctx *)calloc(1, sizeof(struct spidpi_ctx));
   assert(ctx);
 
+  if (transaction_bytes < 1 || transaction_bytes > MAX_TRANSACTION) {
+    fprintf(stderr,
+            "SPI: Transaction size for %s must be between 1 and %d bytes, not "
+            "%d.\n",
+            name, MAX_TRANSACTION, transaction_bytes);
+    exit(1);
+  }
+  if (sck_divider < 2 || (sck_divider & 1)) {
+    fprintf(stderr,
+            "SPI: SCK divider for %s must be an even number of at least 2, "
+            "not %d.\n",
+            name, sck_divider);
+    exit(1);
+  }
+
   ctx->loglevel = loglevel;
   ctx->mon = monitor_spi_init(mode);
   ctx->tick = 0;
   ctx->msbfirst = 1;
-  ctx->nmax = MAX_TRANSACTION;
+  ctx->nmax = transaction_bytes;
   ctx->nin = 0;
   ctx->nout = 0;
   ctx->bout = 0;
+  ctx->half_period = sck_divider / 2;
+  ctx->framed = framed;
+  ctx->poll_interval = 1;
   ctx->state = SP_IDLE;
   /* mode is CPOL << 1 | CPHA
    * cpol = 0 --> external clock matches internal
@@ -55,26 +266,35 @@ void *spidpi_create(const char *name, int mode, int loglevel) {
   assert(cwd_rv != NULL);
 
   int rv;
-  struct termios tty;
-  cfmakeraw(&tty);
-
-  rv = openpty(&ctx->host, &ctx->device, 0, &tty, 0);
-  assert(rv != -1);
-
-  rv = ttyname_r(ctx->device, ctx->ptyname, 64);
-  assert(rv == 0 && "ttyname_r failed");
 
-  int cur_flags = fcntl(ctx->host, F_GETFL, 0);
-  assert(cur_flags != -1 && "Unable to read current flags.");
-  int new_flags = fcntl(ctx->host, F_SETFL, cur_flags | O_NONBLOCK);
-  assert(new_flags != -1 && "Unable to set FD flags");
+  // Set up the backend: "pty" (the default), "tcp:PORT" or "file:PATH"
+  ctx->host = ctx->device = ctx->input_fd = -1;
+  if (strlen(backend) == 0 || strcmp(backend, "pty") == 0) {
+    ctx->backend = SPIDPI_BACKEND_PTY;
+    open_pty(ctx, name);
+  } else if (strncmp(backend, "tcp:", 4) == 0) {
+    ctx->backend = SPIDPI_BACKEND_TCP;
+    open_tcp(ctx, name, atoi(backend + 4));
+  } else if (strncmp(backend, "file:", 5) == 0) {
+    ctx->backend = SPIDPI_BACKEND_FILE;
+    open_input_file(ctx, name, backend + 5);
+  } else {
+    fprintf(stderr,
+            "SPI: Unknown backend `%s' for %s. Expected `pty', `tcp:PORT' or "
+            "`file:PATH'.\n",
+            backend, name);
+    exit(1);
+  }
 
-  printf(
-      "\n"
-      "SPI: Created %s for %s. Connect to it with any terminal program, e.g.\n"
-      "$ screen %s\n"
-      "NOTE: a SPI transaction is run for every 4 characters entered.\n",
-      ctx->ptyname, name, ctx->ptyname);
+  if (ctx->framed) {
+    printf(
+        "NOTE: each SPI transaction is a frame: a 2 byte length (least "
+        "significant\n"
+        "byte first), then the data.\n");
+  } else {
+    printf("NOTE: a SPI transaction is run for every %d characters entered.\n",
+           ctx->nmax);
+  }
 
   rv = snprintf(ctx->mon_pathname, PATH_MAX, "%s/%s.log", cwd, name);
   assert(rv <= PATH_MAX && rv > 0);
@@ -91,11 +311,11 @@ void *spidpi_create(const char *name, int mode, int loglevel) {
       "$ tail -f %s\n",
       ctx->mon_pathname, ctx->mon_pathname);
 
-  return (void *)ctx;
+  return dpi_handle_new("spidpi", name, ctx);
 }
 
 char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
-  struct spidpi_ctx *ctx = (struct spidpi_ctx *)ctx_void;
+  struct spidpi_ctx *ctx = (struct spidpi_ctx *)dpi_handle_get(ctx_void);
   assert(ctx);
   int d2p = d2p_data->aval;
 
@@ -104,7 +324,7 @@ char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
 
 #ifdef CONTROL_TRACE
   if (ctx->tick == 4) {
-    VerilatorSimCtrl::GetInstance().TraceOff();
+    VerilatorSimCtrl::GetInstance().RequestTracing(false);
   }
 #endif
 
@@ -112,33 +332,54 @@ char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
               d2p);
 
   if (ctx->state == SP_IDLE) {
-    int n = read(ctx->host, &(ctx->buf[ctx->nin]), ctx->nmax - ctx->nin);
-    if (n == -1) {
-      if (errno != EAGAIN) {
-        fprintf(stderr, "Read on SPI FIFO gave %s\n", strerror(errno));
-      }
-    } else {
-      ctx->nin += n;
-      if (ctx->nin == ctx->nmax) {
-        ctx->nout = 0;
-        ctx->nin = 0;
-        ctx->bout = ctx->msbfirst ? 0x80 : 0x01;
-        ctx->bin = ctx->msbfirst ? 0x80 : 0x01;
-        ctx->din = 0;
-        ctx->state = SP_CSFALL;
+    // Look for input, backing off (up to MAX_POLL_INTERVAL ticks) while
+    // there isn't any
+    if (--ctx->poll_wait > 0) {
+      return ctx->driving;
+    }
+    if (ctx->pty_out_len > 0) {
+      flush_pty_output(ctx);
+    }
+    if (read_input(ctx) > 0) {
+      ctx->poll_interval = 1;
+    } else if (ctx->poll_interval < MAX_POLL_INTERVAL) {
+      ctx->poll_interval *= 2;
+    }
+    ctx->poll_wait = ctx->poll_interval;
+
+    bool frame_ready = (!ctx->framed || ctx->nhdr == FRAME_HDR_LEN) &&
+                       ctx->nin == ctx->nmax;
+    if (frame_ready || (!ctx->framed && ctx->input_done && ctx->nin > 0)) {
+      ctx->ntrans = ctx->nin;
+      ctx->nout = 0;
+      ctx->nin = 0;
+      ctx->nhdr = 0;
+      // Leave space for the header of the reply in framed mode
+      ctx->nrecv = ctx->framed ? FRAME_DONE_HDR_LEN : 0;
+      ctx->bout = ctx->msbfirst ? 0x80 : 0x01;
+      ctx->bin = ctx->msbfirst ? 0x80 : 0x01;
+      ctx->din = 0;
+      // The next SCK edge starts the transaction
+      ctx->internal_sck = ctx->cpha;
+      ctx->sck_count = 0;
+      ctx->state = SP_CSFALL;
 #ifdef CONTROL_TRACE
-        VerilatorSimCtrl::GetInstance().TraceOn();
+      VerilatorSimCtrl::GetInstance().RequestTracing(true);
 #endif
-      }
     }
+    return ctx->driving;
   }
-  // SPI clock toggles every 4th tick (i.e. freq=primary_frequency/8)
-  if ((ctx->tick & 3) || (ctx->state == SP_IDLE)) {
+
+  // SPI clock toggles every half_period ticks (by default every 4th tick, i.e.
+  // freq=primary_frequency/8)
+  if (++ctx->sck_count < ctx->half_period) {
     return ctx->driving;
   }
+  ctx->sck_count = 0;
 
   // Only get here on sck edges when active
-  int internal_sck = (ctx->tick & 4) ? 1 : 0;
+  ctx->internal_sck ^= 1;
+  int internal_sck = ctx->internal_sck;
   int set_sck = (internal_sck ? P2D_SCK : 0);
   if (ctx->cpol) {
     set_sck ^= P2D_SCK;
@@ -150,12 +391,12 @@ char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
       case SP_DMOVE:
         // SCLK low, CSB low
         ctx->driving =
-            set_sck | (ctx->buf[ctx->nout] & ctx->bout) ? P2D_SDI : 0;
+            set_sck | ((ctx->buf[ctx->nout] & ctx->bout) ? P2D_SDI : 0);
         ctx->bout = (ctx->msbfirst) ? ctx->bout >> 1 : ctx->bout << 1;
         if ((ctx->bout & 0xff) == 0) {
           ctx->bout = ctx->msbfirst ? 0x80 : 0x01;
           ctx->nout++;
-          if (ctx->nout == ctx->nmax) {
+          if (ctx->nout == ctx->ntrans) {
             ctx->state = SP_LASTBIT;
           }
         }
@@ -177,23 +418,27 @@ char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
         ctx->din = ctx->din | ((d2p & D2P_SDO) ? ctx->bin : 0);
         ctx->bin = (ctx->msbfirst) ? ctx->bin >> 1 : ctx->bin << 1;
         if (ctx->bin == 0) {
-          int rv = write(ctx->host, &(ctx->din), 1);
-          assert(rv == 1 && "write() failed.");
+          ctx->recv_buf[ctx->nrecv++] = ctx->din;
           ctx->bin = (ctx->msbfirst) ? 0x80 : 0x01;
           ctx->din = 0;
         }
         ctx->driving = set_sck | (ctx->driving & ~P2D_SCK);
         break;
       case SP_CSFALL:
-        // CSB low, drive SDI to first bit
-        ctx->driving =
-            (set_sck | (ctx->buf[ctx->nout] & ctx->bout) ? P2D_SDI : 0);
+        // CSB low, SCK still idle. The first bit is driven on the next
+        // (driving) edge.
+        ctx->driving = ctx->cpol ? P2D_SCK : 0;
         ctx->state = SP_DMOVE;
         break;
       case SP_CSRISE:
         // CSB high, clock stopped
-        ctx->driving = P2D_CSB;
+        ctx->driving = P2D_CSB | (ctx->cpol ? P2D_SCK : 0);
         ctx->state = SP_IDLE;
+        // Send everything received in the transaction in one go
+        write_output(ctx);
+        // Look for the next transaction straight away
+        ctx->poll_interval = 1;
+        ctx->poll_wait = 0;
         break;
       case SP_FINISH:
         VerilatorSimCtrl::GetInstance().RequestStop(true);
@@ -207,10 +452,23 @@ char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data) {
 }
 
 void spidpi_close(void *ctx_void) {
-  struct spidpi_ctx *ctx = (struct spidpi_ctx *)ctx_void;
+  struct spidpi_ctx *ctx = (struct spidpi_ctx *)dpi_handle_get(ctx_void);
   if (!ctx) {
     return;
   }
+  switch (ctx->backend) {
+    case SPIDPI_BACKEND_PTY:
+      close(ctx->host);
+      close(ctx->device);
+      break;
+    case SPIDPI_BACKEND_TCP:
+      tcp_server_close(ctx->sock);
+      break;
+    case SPIDPI_BACKEND_FILE:
+      close(ctx->input_fd);
+      break;
+  }
   fclose(ctx->mon_file);
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
@@ -10,12 +10,40 @@
 
 extern "C" {
 
-#define MAX_TRANSACTION 4
+// Largest number of bytes in one transaction (CSB low to CSB high), which is
+// a full SPI flash frame
+#define MAX_TRANSACTION 2048
+// Defaults for the runtime options
+#define DEFAULT_TRANSACTION 4
+#define DEFAULT_SCK_DIVIDER 8
+// Longest wait between two checks for input while idle, in ticks
+#define MAX_POLL_INTERVAL 1024
+
+// In framed mode, every transaction is sent as a 2 byte (little endian)
+// length followed by the data. After the transaction, the received data is
+// sent back after a FRAME_DONE byte and its length.
+#define FRAME_DONE 'F'
+#define FRAME_HDR_LEN 2
+#define FRAME_DONE_HDR_LEN 3
+// Received bytes waiting for the pseudo-terminal to accept them: room for the
+// replies to two transactions
+#define PTY_OUT_BUFLEN (2 * (FRAME_DONE_HDR_LEN + MAX_TRANSACTION))
+
+struct tcp_server_ctx;
+
+// Where the bytes to send come from and the bytes received go to
+#define SPIDPI_BACKEND_PTY  0
+#define SPIDPI_BACKEND_TCP  1
+#define SPIDPI_BACKEND_FILE 2
+
 struct spidpi_ctx {
   int loglevel;
+  int backend;
   char ptyname[64];
   int host;
   int device;
+  struct tcp_server_ctx *sock;
+  int input_fd;
   FILE *mon_file;
   char mon_pathname[PATH_MAX];
   void *mon;
@@ -28,10 +56,25 @@ struct spidpi_ctx {
   int nin;
   int bin;
   int din;
-  int nmax;
+  int nmax;   // bytes per transaction
+  int ntrans; // bytes in the current transaction
+  int nrecv;  // bytes received in the current transaction
+  int half_period;  // ticks between two SCK edges
+  int sck_count;    // ticks since the last SCK edge
+  int internal_sck;
+  int poll_interval;  // ticks between two checks for input while idle
+  int poll_wait;      // ticks until the next check for input
+  int input_done;     // end of the input file reached
+  int framed;
+  char frame_hdr[FRAME_HDR_LEN];
+  int nhdr;  // bytes of frame_hdr received
   char driving;
   int state;
   char buf[MAX_TRANSACTION];
+  char recv_buf[FRAME_DONE_HDR_LEN + MAX_TRANSACTION];
+  char pty_out[PTY_OUT_BUFLEN];
+  int pty_out_len;     // bytes in pty_out
+  int dropped_output;  // warned about a full pty_out
 };
 
 // SPI Host States
@@ -51,7 +94,9 @@ struct spidpi_ctx {
 #define P2D_CSB    0x2
 #define P2D_SDI    0x4
 
-void *spidpi_create(const char *name, int mode, int loglevel);
+void *spidpi_create(const char *name, int mode, int loglevel,
+                    const char *backend, int transaction_bytes,
+                    int sck_divider, int framed);
 char spidpi_tick(void *ctx_void, const svLogicVecVal *d2p_data);
 void spidpi_close(void *ctx_void);
 
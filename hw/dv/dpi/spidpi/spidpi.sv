@@ -7,6 +7,18 @@
 // Bits in LOG_LEVEL sets what is output on info socket
 // 0x01 -- monitor packets
 // 0x08 -- bit level
+//
+// Runtime options (plusargs, with <name> the NAME parameter):
+// +SPIDPI_BACKEND_<name>=pty|tcp:<port>|file:<input file>
+//     where the bytes to send come from (default: pty)
+// +SPIDPI_TRANSACTION_BYTES_<name>=<n>
+//     bytes sent per transaction (CSB low to CSB high), 1 to 2048 (default: 4)
+// +SPIDPI_SCK_DIVIDER_<name>=<n>
+//     clock cycles per SCK period, an even number (default: 8)
+// +SPIDPI_FRAMED_<name>
+//     framed mode: each transaction is sent as a 2 byte length (LSB first) and
+//     the data. When it is done, 'F', the length and the data received are
+//     sent back.
 
 module spidpi
   #(
@@ -24,7 +36,9 @@ module spidpi
 
 );
   import "DPI-C" function
-    chandle spidpi_create(input string name, input int mode, input int loglevel);
+    chandle spidpi_create(input string name, input int mode, input int loglevel,
+                          input string backend, input int transaction_bytes,
+                          input int sck_divider, input int framed);
 
   import "DPI-C" function
     void spidpi_close(input chandle ctx);
@@ -33,9 +47,16 @@ module spidpi
     byte spidpi_tick(input chandle ctx_void, input [1:0] d2p_data);
 
   chandle ctx;
+  string backend = "pty";
+  int transaction_bytes = 4;
+  int sck_divider = 8;
 
   initial begin
-    ctx = spidpi_create(NAME, MODE, LOG_LEVEL);
+    $value$plusargs({"SPIDPI_BACKEND_", NAME, "=%s"}, backend);
+    $value$plusargs({"SPIDPI_TRANSACTION_BYTES_", NAME, "=%d"}, transaction_bytes);
+    $value$plusargs({"SPIDPI_SCK_DIVIDER_", NAME, "=%d"}, sck_divider);
+    ctx = spidpi_create(NAME, MODE, LOG_LEVEL, backend, transaction_bytes, sck_divider,
+                        $test$plusargs({"SPIDPI_FRAMED_", NAME}));
   end
 
   final begin
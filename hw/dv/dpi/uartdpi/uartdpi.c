@@ -3,6 +3,8 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "uartdpi.h"
+#include "dpi_handle.h"
+#include "tcp_server.h"
 
 #ifdef __linux__
 #include <pty.h>
@@ -19,11 +21,10 @@
 #include <string.h>
 #include <unistd.h>
 
-void *uartdpi_create(const char *name, const char *log_file_path) {
-  struct uartdpi_ctx *ctx =
-      (struct uartdpi_ctx *)malloc(sizeof(struct uartdpi_ctx));
-  assert(ctx);
-
+/**
+ * Create a pseudo-terminal for the UART
+ */
+static void open_pty(struct uartdpi_ctx *ctx, const char *name) {
   int rv;
 
   // Initialize UART pseudo-terminal
@@ -46,6 +47,142 @@ void *uartdpi_create(const char *name, const char *log_file_path) {
       "UART: Created %s for %s. Connect to it with any terminal program, e.g.\n"
       "$ screen %s\n",
       ctx->ptyname, name, ctx->ptyname);
+}
+
+/**
+ * Start a TCP server for the UART
+ */
+static void open_tcp(struct uartdpi_ctx *ctx, const char *name, int port) {
+  ctx->sock = tcp_server_create(name, port);
+  assert(ctx->sock);
+
+  printf(
+      "\n"
+      "UART: %s is listening on TCP port %d. Connect to it with e.g.\n"
+      "$ nc localhost %d\n",
+      name, port, port);
+}
+
+/**
+ * Open a file (or named pipe) with input for the UART
+ */
+static void open_input_file(struct uartdpi_ctx *ctx, const char *name,
+                            const char *path) {
+  // Don't block on a named pipe that nothing has opened for writing yet
+  ctx->input_fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (ctx->input_fd < 0) {
+    fprintf(stderr, "UART: Unable to open input file %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+
+  printf("\nUART: Sending the contents of '%s' to %s.\n", path, name);
+}
+
+/**
+ * Refill the input buffer from the backend (only call when it's empty)
+ */
+static void read_input(struct uartdpi_ctx *ctx) {
+  ssize_t rv = 0;
+  switch (ctx->backend) {
+    case UARTDPI_BACKEND_PTY:
+      rv = read(ctx->host, ctx->in_buf, UARTDPI_BUFSIZE);
+      break;
+    case UARTDPI_BACKEND_TCP:
+      rv = tcp_server_read_buf(ctx->sock, ctx->in_buf, UARTDPI_BUFSIZE);
+      break;
+    case UARTDPI_BACKEND_FILE:
+      rv = read(ctx->input_fd, ctx->in_buf, UARTDPI_BUFSIZE);
+      break;
+  }
+  ctx->in_pos = 0;
+  ctx->in_len = rv > 0 ? rv : 0;
+}
+
+/**
+ * Write output to the backend without blocking
+ *
+ * @return the number of bytes written
+ */
+static size_t write_output(struct uartdpi_ctx *ctx, const char *dat,
+                           size_t len) {
+  ssize_t rv;
+  switch (ctx->backend) {
+    case UARTDPI_BACKEND_PTY:
+      rv = write(ctx->host, dat, len);
+      if (rv < 0) {
+        assert((errno == EAGAIN || errno == EWOULDBLOCK) &&
+               "Write to pseudo-terminal failed.");
+        return 0;
+      }
+      return rv;
+    case UARTDPI_BACKEND_TCP:
+      return tcp_server_try_write_buf(ctx->sock, dat, len);
+    case UARTDPI_BACKEND_FILE:
+      // Output only goes to the log file
+      return len;
+  }
+  return len;
+}
+
+/**
+ * Write buffered output to the log file and as much of it as possible to the
+ * backend
+ */
+static void flush_output(struct uartdpi_ctx *ctx) {
+  if (ctx->log_file && ctx->out_logged < ctx->out_len) {
+    size_t rv = fwrite(ctx->out_buf + ctx->out_logged, sizeof(char),
+                       ctx->out_len - ctx->out_logged, ctx->log_file);
+    assert(rv == ctx->out_len - ctx->out_logged &&
+           "Write to log file failed.");
+  }
+  ctx->out_logged = ctx->out_len;
+
+  size_t written = write_output(ctx, ctx->out_buf, ctx->out_len);
+  memmove(ctx->out_buf, ctx->out_buf + written, ctx->out_len - written);
+  ctx->out_len -= written;
+  ctx->out_logged -= written;
+
+  // If nothing is reading the output, don't let it stop the simulation. The
+  // log file still gets everything.
+  if (ctx->out_len == UARTDPI_BUFSIZE) {
+    if (!ctx->dropped_output) {
+      fprintf(stderr,
+              "UART: Nothing is reading the UART output, dropping it. The log "
+              "file (if any) is unaffected.\n");
+      ctx->dropped_output = 1;
+    }
+    ctx->out_len = 0;
+    ctx->out_logged = 0;
+  }
+}
+
+void *uartdpi_create(const char *name, const char *log_file_path,
+                     const char *backend) {
+  struct uartdpi_ctx *ctx =
+      (struct uartdpi_ctx *)calloc(1, sizeof(struct uartdpi_ctx));
+  assert(ctx);
+
+  int rv;
+
+  // Set up the backend: "pty" (the default), "tcp:PORT" or "file:PATH"
+  ctx->host = ctx->device = ctx->input_fd = -1;
+  if (strlen(backend) == 0 || strcmp(backend, "pty") == 0) {
+    ctx->backend = UARTDPI_BACKEND_PTY;
+    open_pty(ctx, name);
+  } else if (strncmp(backend, "tcp:", 4) == 0) {
+    ctx->backend = UARTDPI_BACKEND_TCP;
+    open_tcp(ctx, name, atoi(backend + 4));
+  } else if (strncmp(backend, "file:", 5) == 0) {
+    ctx->backend = UARTDPI_BACKEND_FILE;
+    open_input_file(ctx, name, backend + 5);
+  } else {
+    fprintf(stderr,
+            "UART: Unknown backend `%s' for %s. Expected `pty', `tcp:PORT' or "
+            "`file:PATH'.\n",
+            backend, name);
+    exit(1);
+  }
 
   // Open log file (if requested)
   ctx->log_file = NULL;
@@ -75,17 +212,29 @@ void *uartdpi_create(const char *name, const char *log_file_path) {
     }
   }
 
-  return (void *)ctx;
+  return dpi_handle_new("uartdpi", name, ctx);
 }
 
 void uartdpi_close(void *ctx_void) {
-  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)ctx_void;
+  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)dpi_handle_get(ctx_void);
   if (!ctx) {
     return;
   }
 
-  close(ctx->host);
-  close(ctx->device);
+  flush_output(ctx);
+
+  switch (ctx->backend) {
+    case UARTDPI_BACKEND_PTY:
+      close(ctx->host);
+      close(ctx->device);
+      break;
+    case UARTDPI_BACKEND_TCP:
+      tcp_server_close(ctx->sock);
+      break;
+    case UARTDPI_BACKEND_FILE:
+      close(ctx->input_fd);
+      break;
+  }
 
   if (ctx->log_file) {
     // Always ensure the log file is flushed (most important when writing
@@ -97,31 +246,46 @@ void uartdpi_close(void *ctx_void) {
   }
 
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
 
 int uartdpi_can_read(void *ctx_void) {
-  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)ctx_void;
+  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)dpi_handle_get(ctx_void);
 
-  int rv = read(ctx->host, &ctx->tmp_read, 1);
-  return (rv == 1);
+  if (ctx->in_pos < ctx->in_len) {
+    return 1;
+  }
+
+  // This is called on every clock cycle while the transmitter is idle. Only
+  // look for new input (and write out any output that is still waiting) every
+  // UARTDPI_POLL_INTERVAL calls.
+  if (++ctx->polls < UARTDPI_POLL_INTERVAL) {
+    return 0;
+  }
+  ctx->polls = 0;
+
+  if (ctx->out_len) {
+    flush_output(ctx);
+  }
+  read_input(ctx);
+  return ctx->in_pos < ctx->in_len;
 }
 
 char uartdpi_read(void *ctx_void) {
-  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)ctx_void;
+  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)dpi_handle_get(ctx_void);
 
-  return ctx->tmp_read;
+  assert(ctx->in_pos < ctx->in_len);
+  return ctx->in_buf[ctx->in_pos++];
 }
 
 void uartdpi_write(void *ctx_void, char c) {
-  int rv;
+  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)dpi_handle_get(ctx_void);
 
-  struct uartdpi_ctx *ctx = (struct uartdpi_ctx *)ctx_void;
+  ctx->out_buf[ctx->out_len++] = c;
 
-  rv = write(ctx->host, &c, 1);
-  assert(rv == 1 && "Write to pseudo-terminal failed.");
-
-  if (ctx->log_file) {
-    rv = fwrite(&c, sizeof(char), 1, ctx->log_file);
-    assert(rv == 1 && "Write to log file failed.");
+  // Write complete lines straight away, so that output shows up as it did
+  // when every character was written on its own.
+  if (c == '\n' || ctx->out_len == UARTDPI_BUFSIZE) {
+    flush_output(ctx);
   }
 }
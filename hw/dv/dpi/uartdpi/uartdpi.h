@@ -7,17 +7,48 @@
 
 extern "C" {
 
+#include <stddef.h>
 #include <stdio.h>
 
+// Size of the buffers in each direction, in bytes
+#define UARTDPI_BUFSIZE 4096
+
+// Number of calls to uartdpi_can_read() (one per idle clock cycle) between
+// two checks of the backend for new input
+#define UARTDPI_POLL_INTERVAL 256
+
+struct tcp_server_ctx;
+
+enum uartdpi_backend {
+  UARTDPI_BACKEND_PTY,   // pseudo-terminal
+  UARTDPI_BACKEND_TCP,   // TCP server
+  UARTDPI_BACKEND_FILE,  // input from a file, output only to the log
+};
+
 struct uartdpi_ctx {
+  enum uartdpi_backend backend;
   char ptyname[64];
   int host;
   int device;
-  char tmp_read;
+  struct tcp_server_ctx *sock;
+  int input_fd;
   FILE *log_file;
+  // Input for the design that hasn't been sent to it yet
+  // (in_buf[in_pos..in_len))
+  char in_buf[UARTDPI_BUFSIZE];
+  size_t in_pos;
+  size_t in_len;
+  // Output from the design that hasn't been written to the backend yet. The
+  // first out_logged bytes have been written to the log file already.
+  char out_buf[UARTDPI_BUFSIZE];
+  size_t out_len;
+  size_t out_logged;
+  unsigned int polls;
+  int dropped_output;
 };
 
-void *uartdpi_create(const char *name, const char *log_file_path);
+void *uartdpi_create(const char *name, const char *log_file_path,
+                     const char *backend);
 void uartdpi_close(void *ctx_void);
 int uartdpi_can_read(void *ctx_void);
 char uartdpi_read(void *ctx_void);
@@ -16,11 +16,16 @@ module uartdpi #(
   // Path to a log file. Used if none is specified through the `UARTDPI_LOG_<name>` plusarg.
   localparam string DEFAULT_LOG_FILE = {NAME, ".log"};
 
+  // Where to connect the UART to: "pty", "tcp:<port>" or "file:<input file>". Used if none is
+  // specified through the `UARTDPI_BACKEND_<name>` plusarg.
+  localparam string DEFAULT_BACKEND = "pty";
+
   // Min cycles is 2 for fast test mode
   localparam int CYCLES_PER_SYMBOL = FREQ / BAUD;
 
   import "DPI-C" function
-    chandle uartdpi_create(input string name, input string log_file_path);
+    chandle uartdpi_create(input string name, input string log_file_path,
+                           input string backend);
 
   import "DPI-C" function
     void uartdpi_close(input chandle ctx);
@@ -36,10 +41,12 @@ module uartdpi #(
 
   chandle ctx;
   string log_file_path = DEFAULT_LOG_FILE;
+  string backend = DEFAULT_BACKEND;
 
   initial begin
     $value$plusargs({"UARTDPI_LOG_", NAME, "=%s"}, log_file_path);
-    ctx = uartdpi_create(NAME, log_file_path);
+    $value$plusargs({"UARTDPI_BACKEND_", NAME, "=%s"}, backend);
+    ctx = uartdpi_create(NAME, log_file_path, backend);
   end
 
   final begin
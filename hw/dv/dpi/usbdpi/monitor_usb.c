@@ -68,8 +68,11 @@ void *monitor_usb_init() {
 }
 
 #define DR_SIZE 128
-static char dr[DR_SIZE];
-char *pid_2data(int pid, unsigned char d0, unsigned char d1) {
+// Decode a packet into dr, which must have space for DR_SIZE characters. The
+// caller provides the buffer so that monitors on different simulation threads
+// don't share one.
+static const char *pid_2data(char *dr, int pid, unsigned char d0,
+                             unsigned char d1) {
   int comp_crc = CRC5((d1 & 7) << 8 | d0, 11);
   const char *crcok = (comp_crc == d1 >> 3) ? "OK" : "BAD";
   if ((pid == USB_PID_IN) || (pid == USB_PID_OUT) || (pid == USB_PID_SETUP)) {
@@ -172,9 +175,10 @@ void monitor_usb(void *mon_void, FILE *mon_file, int loglevel, int tick,
       uint32_t pkt_crc16, comp_crc16;
 
       if (compact && mon->byte == 2) {
+        char dr[DR_SIZE];
         fprintf(mon_file, "mon: %8d -- %8d: (%c) SOP, PID %s, EOP\n",
                 mon->sopAt, tick, mon->driver == M_HOST ? 'H' : 'D',
-                pid_2data(mon->lastpid, mon->bytes[0], mon->bytes[1]));
+                pid_2data(dr, mon->lastpid, mon->bytes[0], mon->bytes[1]));
       } else if (compact && mon->byte == 1) {
         fprintf(mon_file, "mon: %8d -- %8d: (%c) SOP, PID %s %02x EOP\n",
                 mon->sopAt, tick, mon->driver == M_HOST ? 'H' : 'D',
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "usbdpi.h"
+#include "dpi_handle.h"
 
 #ifdef __linux__
 #include <pty.h>
@@ -79,13 +80,13 @@ void *usbdpi_create(const char *name, int loglevel) {
       "$ tail -f %s\n",
       ctx->mon_pathname, ctx->mon_pathname);
 
-  return (void *)ctx;
+  return dpi_handle_new("usbdpi", name, ctx);
 }
 
 const char *decode_usb[] = {"SE0", "0-K", "1-J", "SE1"};
 
 void usbdpi_device_to_host(void *ctx_void, const svBitVecVal *usb_d2p) {
-  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)ctx_void;
+  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)dpi_handle_get(ctx_void);
   assert(ctx);
   int d2p = usb_d2p[0];
   int dp, dn;
@@ -685,7 +686,7 @@ int inv_driving(struct usbdpi_ctx *ctx, int d2p) {
 }
 
 char usbdpi_host_to_device(void *ctx_void, const svBitVecVal *usb_d2p) {
-  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)ctx_void;
+  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)dpi_handle_get(ctx_void);
   assert(ctx);
   int d2p = usb_d2p[0];
   uint32_t last_driving = ctx->driving;
@@ -888,10 +889,11 @@ char usbdpi_host_to_device(void *ctx_void, const svBitVecVal *usb_d2p) {
 }
 
 void usbdpi_close(void *ctx_void) {
-  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)ctx_void;
+  struct usbdpi_ctx *ctx = (struct usbdpi_ctx *)dpi_handle_get(ctx_void);
   if (!ctx) {
     return;
   }
   fclose(ctx->mon_file);
   free(ctx);
+  dpi_handle_free(ctx_void);
 }
@@ -0,0 +1,36 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef SVDPI_H_
+#define SVDPI_H_
+
+/**
+ * The parts of svdpi.h (IEEE 1800-2017, Annex I) used by our DPI code, for
+ * unit tests that run it without a simulator
+ *
+ * This declares the scope functions, but a test that calls them (through
+ * SVScoped, for example) has to define them itself.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t svScalar;
+typedef svScalar svBit;
+typedef svScalar svLogic;
+typedef uint32_t svBitVecVal;
+typedef void *svScope;
+
+svScope svGetScope(void);
+svScope svSetScope(const svScope scope);
+const char *svGetNameFromScope(const svScope scope);
+svScope svGetScopeFromName(const char *scope_name);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+#endif  // SVDPI_H_
@@ -4,16 +4,23 @@
 
 #include "dpi_memutil.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <libelf.h>
 #include <sstream>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
+#include "mem_image_cache.h"
 #include "sv_scoped.h"
 
 // DPI Exports
@@ -32,6 +39,41 @@ extern void simutil_memload(const char *file);
  * @return 1 if successful, 0 otherwise
  */
 extern int simutil_set_mem(int index, const svBitVecVal *val);
+
+/**
+ * Write |count| words to memory, starting at index |start_index|. Word i is
+ * read from |data|, starting at byte i * |word_bytes|. |data| is 4096 bytes
+ * long (the SystemVerilog type is bit [32767:0]).
+ *
+ * This is declared weak so that we can fall back to simutil_set_mem in a
+ * simulation where no memory exports it.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+extern int simutil_set_mem_range(int start_index, int count, int word_bytes,
+                                 const svBitVecVal *data)
+    __attribute__((weak));
+
+/**
+ * Read a word from memory at index |index| into |val|, which is 32 bytes long
+ * (the SystemVerilog type is bit [255:0]).
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+extern int simutil_get_mem(int index, svBitVecVal *val);
+
+/**
+ * Read |count| words from memory, starting at index |start_index|. Word i is
+ * written to |data|, starting at byte i * |word_bytes|. |data| is 4096 bytes
+ * long (the SystemVerilog type is bit [32767:0]).
+ *
+ * This is declared weak so that we can fall back to simutil_get_mem in a
+ * simulation where no memory exports it.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+extern int simutil_get_mem_range(int start_index, int count, int word_bytes,
+                                 svBitVecVal *data) __attribute__((weak));
 }
 
 namespace {
@@ -50,6 +92,53 @@ class ElfError : public std::exception {
   std::string msg_;
 };
 
+// Class wrapping a read-only mapping of a file. Segments loaded from an ELF
+// file point into the mapping and hold a shared pointer to it, so that it
+// stays mapped for as long as they need it.
+class MappedFile {
+ public:
+  MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw ElfError(path, "could not open file.");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw ElfError(path, "could not stat file.");
+    }
+
+    size_ = st.st_size;
+    if (size_ == 0) {
+      close(fd);
+      throw ElfError(path, "not an ELF file.");
+    }
+
+    // libelf's elf_memory() takes a non-const image, so we make a private
+    // (copy on write) mapping that is writable. Neither libelf nor we write to
+    // it when reading an ELF file, so no pages get copied.
+    void *ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+      throw ElfError(path, "could not map file.");
+    }
+    data_ = static_cast<uint8_t *>(ptr);
+  }
+
+  ~MappedFile() { munmap(data_, size_); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t *data_;
+  size_t size_;
+};
+
 // Class wrapping an open ELF file
 class ElfFile {
  public:
@@ -59,28 +148,20 @@ class ElfFile {
       throw std::runtime_error(elf_errmsg(-1));
     }
 
-    fd_ = open(path.c_str(), O_RDONLY, 0);
-    if (fd_ < 0) {
-      throw ElfError(path, "could not open file.");
-    }
+    file_ = std::make_shared<MappedFile>(path);
 
-    ptr_ = elf_begin(fd_, ELF_C_READ, NULL);
+    ptr_ = elf_memory(reinterpret_cast<char *>(file_->data()), file_->size());
     if (!ptr_) {
-      close(fd_);
       throw ElfError(path, elf_errmsg(-1));
     }
 
     if (elf_kind(ptr_) != ELF_K_ELF) {
       elf_end(ptr_);
-      close(fd_);
       throw ElfError(path, "not an ELF file.");
     }
   }
 
-  ~ElfFile() {
-    elf_end(ptr_);
-    close(fd_);
-  }
+  ~ElfFile() { elf_end(ptr_); }
 
   size_t GetPhdrNum() {
     size_t phnum;
@@ -97,8 +178,18 @@ class ElfFile {
     return phdrs;
   }
 
+  // Get a segment that points at the data for phdr in the mapped file. Bytes
+  // past p_filesz are represented as zero fill, not stored. The caller must
+  // have checked that the segment's data fits in the file.
+  StagedSeg GetSegment(const Elf32_Phdr &phdr) const {
+    assert((size_t)phdr.p_offset + phdr.p_filesz <= file_->size());
+    size_t data_len = std::min(phdr.p_filesz, phdr.p_memsz);
+    return StagedSeg(file_, file_->data() + phdr.p_offset, data_len,
+                     phdr.p_memsz - data_len);
+  }
+
   std::string path_;
-  int fd_;
+  std::shared_ptr<MappedFile> file_;
   Elf *ptr_;
 };
 }  // namespace
@@ -110,6 +201,8 @@ static MemImageType GetMemImageTypeByName(const std::string &name) {
     return kMemImageElf;
   if (name == "vmem")
     return kMemImageVmem;
+  if (name == "bin")
+    return kMemImageBin;
 
   std::ostringstream oss;
   oss << "Unknown image type: `" << name << "'.";
@@ -137,12 +230,13 @@ static MemImageType DetectMemImageType(const std::string &filepath) {
   return image_type;
 }
 
-// Generate a single array of bytes representing the contents of PT_LOAD
-// segments of the ELF file. Like objcopy, this generates a single "giant
-// segment" whose first byte corresponds to the first byte of the lowest
-// addressed segment and whose last byte corresponds to the last byte of the
-// highest address.
-static std::vector<uint8_t> FlattenElfFile(const std::string &filepath) {
+// Stage the contents of PT_LOAD segments of the ELF file. Like objcopy, this
+// is used to generate a single "giant segment" whose first byte corresponds to
+// the first byte of the lowest addressed segment and whose last byte
+// corresponds to the last byte of the highest address (see
+// StagedMem::CopyFlat). The segments are staged at offsets relative to the
+// lowest address.
+static StagedMem FlattenElfFile(const std::string &filepath) {
   ElfFile elf(filepath);
 
   size_t phnum = elf.GetPhdrNum();
@@ -188,20 +282,18 @@ static std::vector<uint8_t> FlattenElfFile(const std::string &filepath) {
     any = true;
   }
 
+  StagedMem ret;
+
   // If any is false, there were no segments that contributed to the
   // file. Return nothing.
   if (!any)
-    return std::vector<uint8_t>();
+    return ret;
 
   // Otherwise, we know every valid byte of data has an address in the
   // range [low, high] (inclusive).
   assert(low <= high);
 
-  size_t file_size;
-  const char *file_data = elf_rawfile(elf.ptr_, &file_size);
-  assert(file_data);
-
-  StagedMem ret;
+  size_t file_size = elf.file_->size();
 
   for (size_t i = 0; i < phnum; i++) {
     const Elf32_Phdr &phdr = phdrs[i];
@@ -219,79 +311,140 @@ static std::vector<uint8_t> FlattenElfFile(const std::string &filepath) {
       throw ElfError(filepath, oss.str());
     }
 
-    uint32_t off = phdr.p_paddr - low;
-    uint32_t dst_len = phdr.p_memsz;
-    uint32_t src_len = std::min(phdr.p_filesz, dst_len);
-
-    if (!dst_len)
+    if (!phdr.p_memsz)
       continue;
 
-    std::vector<uint8_t> seg(dst_len, 0);
-    memcpy(&seg[0], file_data + phdr.p_offset, src_len);
-    ret.AddSegment(off, std::move(seg));
+    ret.AddSegment(phdr.p_paddr - low, elf.GetSegment(phdr));
   }
 
-  return ret.GetFlat();
+  return ret;
 }
 
-// Write a "segment" of data to the given memory area.
-static void WriteSegment(const MemArea &m, uint32_t offset,
-                         const std::vector<uint8_t> &data) {
-  assert(m.width_byte <= 32);
-  assert(m.addr_loc.size == 0 || offset + data.size() <= m.addr_loc.size);
-  assert((offset % m.width_byte) == 0);
-
-  // If this fails to set scope, it will throw an error which should
-  // be caught at this function's callsite.
-  SVScoped scoped(m.location.data());
-
+// Write len bytes from data to the memory in the current scope, starting at
+// word dst_word. This makes one DPI call per word. The last word may be
+// partial, in which case it is padded with zeros.
+static void WriteWords(const MemArea &m, uint32_t dst_word, const uint8_t *data,
+                       size_t len) {
   // This "mini buffer" is used to transfer each write to SystemVerilog. It's
   // not massively efficient, but doing so ensures that we pass 256 bits (32
   // bytes) of initialised data each time. This is for simutil_set_mem (defined
   // in prim_util_memload.svh), whose "val" argument has SystemVerilog type bit
   // [255:0].
   uint8_t minibuf[32];
-  memset(minibuf, 0, sizeof minibuf);
   assert(m.width_byte <= sizeof minibuf);
 
-  uint32_t all_words = (data.size() + m.width_byte - 1) / m.width_byte;
-  uint32_t full_data_words = data.size() / m.width_byte;
-  uint32_t part_data_word_len = data.size() % m.width_byte;
-  bool has_part_data_word = part_data_word_len != 0;
-
-  uint32_t word_offset = offset / m.width_byte;
-
-  // Copy the full data words
-  for (uint32_t i = 0; i < full_data_words; ++i) {
-    uint32_t dst_word = word_offset + i;
-    uint32_t src_byte = i * m.width_byte;
-    memcpy(minibuf, &data[src_byte], m.width_byte);
+  for (size_t src_byte = 0; src_byte < len;
+       src_byte += m.width_byte, ++dst_word) {
+    // Zero minibuf first to ensure that the latter bytes in a partial word are
+    // zero.
+    size_t word_len = std::min(len - src_byte, (size_t)m.width_byte);
+    memset(minibuf, 0, sizeof minibuf);
+    memcpy(minibuf, data + src_byte, word_len);
     if (!simutil_set_mem(dst_word, (svBitVecVal *)minibuf)) {
       std::ostringstream oss;
       oss << "Could not set `" << m.name << "' memory at byte offset 0x"
-          << std::hex << dst_word * m.width_byte << ".";
+          << std::hex << dst_word * m.width_byte
+          << (word_len < m.width_byte ? " (partial data word)." : ".");
       throw std::runtime_error(oss.str());
     }
   }
+}
 
-  // Copy any partial data, zeroing minibuf first to ensure that the latter
-  // bytes in the word are zero.
-  if (has_part_data_word) {
-    memset(minibuf, 0, sizeof minibuf);
-    uint32_t dst_word = word_offset + full_data_words;
-    uint32_t src_byte = full_data_words * m.width_byte;
-    memcpy(minibuf, &data[src_byte], part_data_word_len);
-    if (!simutil_set_mem(dst_word, (svBitVecVal *)minibuf)) {
-      std::ostringstream oss;
-      oss << "Could not set `" << m.name << "' memory at byte offset 0x"
-          << std::hex << dst_word * m.width_byte << " (partial data word).";
-      throw std::runtime_error(oss.str());
+// A function that writes len bytes of some image to dst, starting at byte off
+// of the image.
+typedef std::function<void(size_t off, size_t len, uint8_t *dst)> FillFun;
+
+// Write a "segment" of data to the given memory area. The segment is len bytes
+// long and is read through fill, one chunk at a time, so it never needs to
+// exist as a single buffer.
+static void WriteSegment(const MemArea &m, uint32_t offset, size_t len,
+                         const FillFun &fill) {
+  assert(m.width_byte <= 32);
+  assert(m.addr_loc.size == 0 || offset + len <= m.addr_loc.size);
+  assert((offset % m.width_byte) == 0);
+
+  // If this fails to set scope, it will throw an error which should
+  // be caught at this function's callsite.
+  SVScoped scoped(m.location.data());
+
+  uint32_t word_offset = offset / m.width_byte;
+
+  // Pass the data to SystemVerilog a chunk at a time. Where possible, we use
+  // simutil_set_mem_range to write the whole chunk with one DPI call, which
+  // makes a big difference for large images. The chunk size matches the
+  // "data" argument of simutil_set_mem_range (defined in
+  // prim_util_memload.svh).
+  uint8_t chunk[4096];
+  uint32_t chunk_words = sizeof chunk / m.width_byte;
+  size_t chunk_bytes = chunk_words * m.width_byte;
+
+  for (size_t src_byte = 0; src_byte < len; src_byte += chunk_bytes) {
+    size_t chunk_len = std::min(len - src_byte, chunk_bytes);
+    uint32_t num_words = (chunk_len + m.width_byte - 1) / m.width_byte;
+    uint32_t dst_word = word_offset + src_byte / m.width_byte;
+
+    // If the data ends with a partial word, pad it with zeros.
+    fill(src_byte, chunk_len, chunk);
+    memset(chunk + chunk_len, 0, num_words * m.width_byte - chunk_len);
+
+    // If the simulation doesn't export simutil_set_mem_range, write the chunk
+    // a word at a time. We also do this if simutil_set_mem_range fails, which
+    // happens if the memory's words are wider than m.width_byte (or if there's
+    // a genuine error, which WriteWords will report).
+    if (!simutil_set_mem_range ||
+        !simutil_set_mem_range(dst_word, num_words, m.width_byte,
+                               (svBitVecVal *)chunk)) {
+      WriteWords(m, dst_word, chunk, chunk_len);
     }
   }
 }
 
+// Write seg to the given memory area, starting at byte offset
+static void WriteSegment(const MemArea &m, uint32_t offset,
+                         const StagedSeg &seg) {
+  WriteSegment(m, offset, seg.size(),
+               [&seg](size_t off, size_t len, uint8_t *dst) {
+                 seg.CopyTo(off, len, dst);
+               });
+}
+
 static void WriteElfToMem(const MemArea &m, const std::string &filepath) {
-  WriteSegment(m, 0, FlattenElfFile(filepath));
+  StagedMem staged = FlattenElfFile(filepath);
+
+  // The flattened image runs from the lowest to the highest staged address
+  // (with zeros in any gaps), and is written at the start of the memory.
+  size_t len = 0;
+  if (staged.GetSegs().size()) {
+    std::pair<uint32_t, uint32_t> bounds = staged.GetBounds();
+    len = (size_t)1 + (bounds.second - bounds.first);
+  }
+
+  WriteSegment(m, 0, len, [&staged](size_t off, size_t len, uint8_t *dst) {
+    staged.CopyFlat(off, len, dst);
+  });
+}
+
+static void WriteBinToMem(const MemArea &m, const std::string &filepath) {
+  std::ifstream file(filepath, std::ios::binary);
+  if (!file) {
+    std::ostringstream oss;
+    oss << "Could not open binary file `" << filepath << "'.";
+    throw std::runtime_error(oss.str());
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (m.addr_loc.size && data.size() > m.addr_loc.size) {
+    std::ostringstream oss;
+    oss << "Binary file `" << filepath << "' has size 0x" << std::hex
+        << data.size() << " bytes, but the memory region `" << m.name
+        << "' is only 0x" << m.addr_loc.size << " bytes long.";
+    throw std::runtime_error(oss.str());
+  }
+
+  WriteSegment(m, 0, data.size(),
+               [&data](size_t off, size_t len, uint8_t *dst) {
+                 memcpy(dst, data.data() + off, len);
+               });
 }
 
 static void WriteVmemToMem(const MemArea &m, const std::string &filepath) {
@@ -300,70 +453,450 @@ static void WriteVmemToMem(const MemArea &m, const std::string &filepath) {
   simutil_memload(filepath.data());
 }
 
+// Write each segment of img to the given memory area
+static void WriteImageToMem(const MemArea &m, const StagedMem &img) {
+  for (const auto &pr : img.GetSegs()) {
+    WriteSegment(m, pr.first.lo, pr.second);
+  }
+}
+
+// Read num_words words from the memory in the current scope to dst, starting
+// at word src_word. This makes one DPI call per word. Returns the number of
+// words read, which is less than num_words if a read fails (normally because
+// it is past the end of the memory).
+static uint32_t ReadWords(const MemArea &m, uint32_t src_word,
+                          uint32_t num_words, uint8_t *dst) {
+  // simutil_get_mem (defined in prim_util_memload.svh) always returns 256
+  // bits, whatever the width of the memory. See WriteWords.
+  uint8_t minibuf[32];
+  assert(m.width_byte <= sizeof minibuf);
+
+  for (uint32_t i = 0; i < num_words; ++i) {
+    if (!simutil_get_mem(src_word + i, (svBitVecVal *)minibuf)) {
+      return i;
+    }
+    memcpy(dst + i * m.width_byte, minibuf, m.width_byte);
+  }
+  return num_words;
+}
+
+// Read the contents of the given memory area. This is the reverse of
+// WriteSegment, reading a chunk at a time with simutil_get_mem_range where
+// possible.
+static std::vector<uint8_t> ReadMem(const MemArea &m) {
+  assert(m.width_byte <= 32);
+
+  // If this fails to set scope, it will throw an error which should be caught
+  // at this function's callsite.
+  SVScoped scoped(m.location.data());
+
+  // If we don't know the size of the memory, read until we get an error.
+  uint64_t max_words =
+      m.addr_loc.size ? (m.addr_loc.size + m.width_byte - 1) / m.width_byte
+                      : ((uint64_t)1 << 32) / m.width_byte;
+
+  uint8_t chunk[4096];
+  uint32_t chunk_words = sizeof chunk / m.width_byte;
+
+  std::vector<uint8_t> ret;
+  for (uint64_t word = 0; word < max_words;) {
+    uint32_t num_words = std::min((uint64_t)chunk_words, max_words - word);
+
+    // simutil_get_mem_range fails if any of the chunk is past the end of the
+    // memory (or if the memory's words are wider than m.width_byte), so fall
+    // back to reading a word at a time to see how far we can get.
+    uint32_t got = num_words;
+    if (!simutil_get_mem_range ||
+        !simutil_get_mem_range(word, num_words, m.width_byte,
+                               (svBitVecVal *)chunk)) {
+      got = ReadWords(m, word, num_words, chunk);
+    }
+    ret.insert(ret.end(), chunk, chunk + got * m.width_byte);
+    word += got;
+
+    if (got < num_words) {
+      if (m.addr_loc.size || word == 0) {
+        std::ostringstream oss;
+        oss << "Could not read `" << m.name << "' memory at byte offset 0x"
+            << std::hex << word * m.width_byte << ".";
+        throw std::runtime_error(oss.str());
+      }
+      break;
+    }
+  }
+
+  if (m.addr_loc.size) {
+    ret.resize(m.addr_loc.size);
+  }
+  return ret;
+}
+
+// Open the file at path for writing, throwing a std::runtime_error on failure
+static void OpenDumpFile(std::ofstream &file, const std::string &path) {
+  file.open(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::ostringstream oss;
+    oss << "Could not open `" << path << "' for writing.";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+// Write data to a VMEM file at path, as words of width_byte bytes. This is the
+// format that ParseVmem reads, with eight words to a line.
+static void DumpVmem(const std::vector<uint8_t> &data, uint32_t width_byte,
+                     const std::string &path) {
+  std::ofstream file;
+  OpenDumpFile(file, path);
+
+  const unsigned words_per_line = 8;
+  size_t num_words = (data.size() + width_byte - 1) / width_byte;
+
+  std::string line;
+  char buf[20];
+  for (size_t word = 0; word < num_words; ++word) {
+    if (word % words_per_line == 0) {
+      snprintf(buf, sizeof buf, "@%08zx", word);
+      line = buf;
+    }
+
+    // Words are little-endian in data, but written most significant digit
+    // first. A partial last word is padded with zeros.
+    line += ' ';
+    for (size_t i = width_byte; i > 0; --i) {
+      size_t idx = word * width_byte + i - 1;
+      snprintf(buf, sizeof buf, "%02x", idx < data.size() ? data[idx] : 0);
+      line += buf;
+    }
+
+    if (word % words_per_line == words_per_line - 1 || word + 1 == num_words) {
+      line += '\n';
+      file << line;
+    }
+  }
+
+  if (!file.flush()) {
+    std::ostringstream oss;
+    oss << "Could not write VMEM file `" << path << "'.";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+// Write data to an ELF file at path, as a single loadable segment at LMA (and
+// VMA) base. This is the smallest file that FlattenElfFile and StageElf will
+// load, so it has no section headers.
+static void DumpElf(const std::vector<uint8_t> &data, uint32_t base,
+                    const std::string &path) {
+  std::ofstream file;
+  OpenDumpFile(file, path);
+
+  Elf32_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof ehdr);
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_EXEC;
+  ehdr.e_machine = EM_RISCV;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_entry = base;
+  ehdr.e_phoff = sizeof(Elf32_Ehdr);
+  ehdr.e_ehsize = sizeof(Elf32_Ehdr);
+  ehdr.e_phentsize = sizeof(Elf32_Phdr);
+  ehdr.e_phnum = 1;
+
+  Elf32_Phdr phdr;
+  memset(&phdr, 0, sizeof phdr);
+  phdr.p_type = PT_LOAD;
+  phdr.p_offset = sizeof(Elf32_Ehdr) + sizeof(Elf32_Phdr);
+  phdr.p_vaddr = base;
+  phdr.p_paddr = base;
+  phdr.p_filesz = data.size();
+  phdr.p_memsz = data.size();
+  phdr.p_flags = PF_R | PF_W;
+  phdr.p_align = 4;
+
+  file.write(reinterpret_cast<const char *>(&ehdr), sizeof ehdr);
+  file.write(reinterpret_cast<const char *>(&phdr), sizeof phdr);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  if (!file.flush()) {
+    std::ostringstream oss;
+    oss << "Could not write ELF file `" << path << "'.";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+// Write data to a binary file at path
+static void DumpBin(const std::vector<uint8_t> &data, const std::string &path) {
+  std::ofstream file;
+  OpenDumpFile(file, path);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  if (!file.flush()) {
+    std::ostringstream oss;
+    oss << "Could not write binary file `" << path << "'.";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+// Pack the flat image of staged (see StagedMem::CopyFlat) into word-aligned
+// segments that cover the whole image, starting at offset 0. Long runs of
+// zero words are stored as zero fill, rather than as data.
+static StagedMem PackFlatImage(const StagedMem &staged, uint32_t width_byte) {
+  StagedMem ret;
+  if (!staged.GetSegs().size())
+    return ret;
+
+  // The shortest run of zeros that ends a segment. Shorter runs are just
+  // included in the data.
+  const size_t min_zero_run = 4096;
+
+  std::pair<uint32_t, uint32_t> bounds = staged.GetBounds();
+  size_t len = (size_t)1 + (bounds.second - bounds.first);
+
+  uint8_t chunk[4096];
+  size_t chunk_bytes = (sizeof chunk / width_byte) * width_byte;
+
+  auto buf = std::make_shared<std::vector<uint8_t>>();
+  size_t seg_start = 0;
+  size_t zeros = 0;
+
+  for (size_t off = 0; off < len; off += chunk_bytes) {
+    size_t chunk_len = std::min(len - off, chunk_bytes);
+    staged.CopyFlat(off, chunk_len, chunk);
+
+    for (size_t w = 0; w < chunk_len; w += width_byte) {
+      size_t word_len = std::min(chunk_len - w, (size_t)width_byte);
+      const uint8_t *word = chunk + w;
+      if (std::all_of(word, word + word_len,
+                      [](uint8_t b) { return b == 0; })) {
+        zeros += word_len;
+        continue;
+      }
+
+      if (zeros >= min_zero_run) {
+        // Finish the current segment with the zeros as zero fill, and start
+        // a new one at this word.
+        ret.AddSegment(seg_start,
+                       StagedSeg(buf, buf->data(), buf->size(), zeros));
+        buf = std::make_shared<std::vector<uint8_t>>();
+        seg_start = off + w;
+      } else {
+        buf->insert(buf->end(), zeros, 0);
+      }
+      zeros = 0;
+      buf->insert(buf->end(), word, word + word_len);
+    }
+  }
+  ret.AddSegment(seg_start, StagedSeg(buf, buf->data(), buf->size(), zeros));
+  return ret;
+}
+
+// Parse a VMEM file (in the format read by $readmemh) into img, packing each
+// word into width_byte bytes. Each run of consecutive words becomes a segment.
+//
+// This supports the subset of the format that we generate: hex words,
+// addresses (@ADDR) and comments. It returns false if it sees anything else
+// (such as X or Z digits) or if a word doesn't fit in width_byte bytes, in
+// which case the caller should fall back to $readmemh.
+static bool ParseVmem(const std::string &path, uint32_t width_byte,
+                      StagedMem *img) {
+  std::ifstream file(path);
+  if (!file)
+    return false;
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+
+  StagedMem ret;
+  uint64_t addr = 0, run_start = 0;
+  auto run = std::make_shared<std::vector<uint8_t>>();
+
+  auto flush_run = [&]() {
+    if (!run->empty()) {
+      ret.AddSegment(run_start * width_byte,
+                     StagedSeg(run, run->data(), run->size(), 0));
+      run = std::make_shared<std::vector<uint8_t>>();
+    }
+  };
+
+  size_t pos = 0;
+  while (pos < text.size()) {
+    char c = text[pos];
+    if (isspace(c)) {
+      ++pos;
+      continue;
+    }
+
+    // Comments
+    if (text.compare(pos, 2, "//") == 0) {
+      pos = text.find('\n', pos);
+      if (pos == std::string::npos)
+        break;
+      continue;
+    }
+    if (text.compare(pos, 2, "/*") == 0) {
+      pos = text.find("*/", pos + 2);
+      if (pos == std::string::npos)
+        return false;
+      pos += 2;
+      continue;
+    }
+
+    bool is_addr = (c == '@');
+    if (is_addr)
+      ++pos;
+
+    // A hex number, which might contain underscores. It must be followed by
+    // whitespace or the end of the file.
+    size_t tok_start = pos;
+    while (pos < text.size() && (isxdigit(text[pos]) || text[pos] == '_'))
+      ++pos;
+    if (pos == tok_start || (pos < text.size() && !isspace(text[pos])))
+      return false;
+
+    if (is_addr) {
+      flush_run();
+      addr = strtoull(text.substr(tok_start, pos - tok_start).c_str(),
+                      nullptr, 16);
+      run_start = addr;
+      continue;
+    }
+
+    // A data word. Each pair of digits (starting from the right) is a byte.
+    if ((addr + 1) * width_byte > ((uint64_t)1 << 32))
+      return false;
+
+    size_t word_base = run->size();
+    run->resize(word_base + width_byte, 0);
+    unsigned nibble_idx = 0;
+    for (size_t i = pos; i > tok_start; --i) {
+      char d = text[i - 1];
+      if (d == '_')
+        continue;
+      uint8_t val = isdigit(d) ? d - '0' : tolower(d) - 'a' + 10;
+      if (nibble_idx >= 2 * width_byte) {
+        if (val != 0)
+          return false;
+      } else {
+        (*run)[word_base + nibble_idx / 2] |= val << (4 * (nibble_idx % 2));
+      }
+      ++nibble_idx;
+    }
+    ++addr;
+  }
+  flush_run();
+
+  *img = std::move(ret);
+  return true;
+}
+
+// Load the file at filepath into m, using the image cache in cache_dir. On a
+// miss, parse the file, pack it for the memory and add the result to the
+// cache.
+static void WriteCachedFileToMem(bool verbose, const MemArea &m,
+                                 const std::string &filepath,
+                                 MemImageType type,
+                                 const std::string &cache_dir) {
+  MemImageCache cache(cache_dir);
+  MemImageCache::Key key;
+  bool have_key = MemImageCache::MakeKey(filepath, type, m, &key);
+
+  StagedMem img;
+  if (have_key && cache.Lookup(key, &img)) {
+    if (verbose) {
+      std::cout << "Using cached image for `" << filepath << "'." << std::endl;
+    }
+    WriteImageToMem(m, img);
+    return;
+  }
+
+  if (type == kMemImageElf) {
+    img = PackFlatImage(FlattenElfFile(filepath), m.width_byte);
+    WriteImageToMem(m, img);
+  } else {
+    assert(type == kMemImageVmem);
+
+    // If we can't parse the file ourselves or can't write the result (maybe
+    // because there's data past the end of the memory), let $readmemh deal
+    // with it. It rewrites every word in the file, so it doesn't matter if we
+    // got part of the way through.
+    bool done = false;
+    if (ParseVmem(filepath, m.width_byte, &img)) {
+      try {
+        WriteImageToMem(m, img);
+        done = true;
+      } catch (const std::runtime_error &) {
+      }
+    }
+    if (!done) {
+      WriteVmemToMem(m, filepath);
+      return;
+    }
+  }
+
+  if (have_key) {
+    cache.Store(key, img);
+  }
+}
+
 // Merge seg0 and seg1, overwriting any overlapping data in seg0 with
 // that from seg1. rng0/rng1 is the base and top address of seg0/seg1,
-// respectively.
-static std::vector<uint8_t> MergeSegments(const AddrRange<uint32_t> &rng0,
-                                          std::vector<uint8_t> &&seg0,
-                                          const AddrRange<uint32_t> &rng1,
-                                          std::vector<uint8_t> &&seg1) {
+// respectively. RangedMap only calls this for segments that overlap.
+static StagedSeg MergeSegments(const AddrRange<uint32_t> &rng0,
+                               StagedSeg &&seg0,
+                               const AddrRange<uint32_t> &rng1,
+                               StagedSeg &&seg1) {
   // First, deal with the special case where seg1 completely contains
   // seg0 (since there's no copying needed at all).
   if (rng1.lo <= rng0.lo && rng0.hi <= rng1.hi) {
     return std::move(seg1);
   }
 
-  uint32_t new_bot = std::min(rng0.lo, rng1.lo);
-  uint32_t new_top = std::max(rng0.hi, rng1.hi);
-  assert(new_bot <= new_top);
-  size_t new_len = 1 + (size_t)(new_top - new_bot);
-  assert(seg0.size() <= new_len);
-  assert(seg1.size() <= new_len);
-
-  // We want to avoid copying if possible. The next most efficient
-  // case (after just returning seg1) is when seg0 doesn't stick out
-  // the left hand end. In this case, we can extend seg1 to the right
-  // (which might not cause a copy) and then copy just the bytes we
-  // need from seg0.
-  if (rng1.lo <= rng0.lo) {
-    assert(rng1.hi < rng0.hi);
-    assert(new_len == seg1.size() + (rng0.hi - rng1.hi));
-
-    size_t old_len = seg1.size();
-    std::vector<uint8_t> ret = std::move(seg1);
-    ret.resize(new_len);
-
-    // We know that that rng0 isn't completely contained in rng1 and
-    // that rng0 doesn't stick out of the left hand end. That means it
-    // must stick out of the right (so rng1.hi < rng0.hi). However, we
-    // also know that the two ranges overlap, so rng0.lo <= rng1.hi.
-    assert(rng0.lo <= rng1.hi);
-
-    // src_off is the index of the first byte that needs copying from
-    // seg0. Note that this is always at least 1 (because there is an
-    // actual overlap).
-    uint32_t src_off = 1 + (rng1.hi - rng0.lo);
-
-    assert(seg0.size() == src_off + (rng0.hi - rng1.hi));
-
-    memcpy(&ret[old_len], &seg0[src_off], rng0.hi - rng1.hi);
-    return ret;
+  // Otherwise, we need a new buffer for the merged data. We only need to store
+  // bytes up to the last explicit data byte that is still visible: anything
+  // after that can be zero fill. Work with exclusive upper bounds as uint64_t,
+  // so that nothing can overflow.
+  uint64_t lo = std::min(rng0.lo, rng1.lo);
+  uint64_t top0 = (uint64_t)rng0.hi + 1;
+  uint64_t top1 = (uint64_t)rng1.hi + 1;
+  uint64_t top = std::max(top0, top1);
+
+  uint64_t data_end0 = rng0.lo + seg0.data_len();
+  uint64_t data_end1 = rng1.lo + seg1.data_len();
+
+  // seg1's data is always visible. seg0's data is visible where it doesn't
+  // overlap seg1 (either to the left or to the right).
+  uint64_t data_end = seg1.data_len() ? data_end1 : lo;
+  data_end = std::max(data_end, std::min(data_end0, (uint64_t)rng1.lo));
+  if (top1 < data_end0) {
+    data_end = std::max(data_end, data_end0);
   }
 
-  // In this final case, seg0 sticks out the left hand end. That means
-  // we'll have to copy seg1 whatever happens (because we have to
-  // shuffle its elements to the right). Work by resizing seg0 and
-  // then writing seg1 where it's needed.
-  std::vector<uint8_t> ret = std::move(seg0);
-  ret.resize(new_len);
+  auto buf = std::make_shared<std::vector<uint8_t>>(data_end - lo);
+  if (rng0.lo < data_end) {
+    seg0.CopyTo(0, std::min(top0, data_end) - rng0.lo,
+                buf->data() + (rng0.lo - lo));
+  }
+  if (rng1.lo < data_end) {
+    seg1.CopyTo(0, std::min(top1, data_end) - rng1.lo,
+                buf->data() + (rng1.lo - lo));
+  }
 
-  uint32_t off = rng1.lo - rng0.lo;
-  memcpy(&ret[off], &seg1[0], seg1.size());
-  return ret;
+  const uint8_t *data = buf->data();
+  size_t data_len = buf->size();
+  return StagedSeg(std::move(buf), data, data_len, top - data_end);
+}
+
+void StagedSeg::CopyTo(size_t off, size_t len, uint8_t *dst) const {
+  assert(off + len <= size());
+
+  size_t from_data = (off < data_len_) ? std::min(len, data_len_ - off) : 0;
+  if (from_data) {
+    memcpy(dst, data_ + off, from_data);
+  }
+  memset(dst + from_data, 0, len - from_data);
 }
 
-void StagedMem::AddSegment(uint32_t offset, std::vector<uint8_t> &&seg) {
-  if (seg.empty())
+void StagedMem::AddSegment(uint32_t offset, StagedSeg &&seg) {
+  if (!seg.size())
     return;
 
   uint32_t seg_top = offset + seg.size() - 1;
@@ -374,24 +907,40 @@ void StagedMem::AddSegment(uint32_t offset, std::vector<uint8_t> &&seg) {
   segs_.Emplace(offset, seg_top, std::move(seg), MergeSegments);
 }
 
-std::vector<uint8_t> StagedMem::GetFlat() const {
-  // Since max_addr_ and min_addr_ are inclusive, the size to allocate
-  // is 1+(max-min). We cast to size_t to make sure the +1 doesn't
-  // overflow.
-  size_t len = (size_t)1 + (max_addr_ - min_addr_);
-  std::vector<uint8_t> ret(len, 0);
+void StagedMem::CopyFlat(size_t off, size_t len, uint8_t *dst) const {
+  memset(dst, 0, len);
+
+  // The range that we're copying, as [lo, hi)
+  uint64_t lo = (uint64_t)min_addr_ + off;
+  uint64_t hi = lo + len;
 
   for (const auto &pr : segs_) {
     const AddrRange<uint32_t> &rng = pr.first;
-    const std::vector<uint8_t> &seg = pr.second;
-    assert(seg.size() == 1 + (rng.hi - rng.lo));
-    assert(min_addr_ <= rng.lo);
+    uint64_t seg_lo = rng.lo;
+    uint64_t seg_hi = (uint64_t)rng.hi + 1;
+    assert(pr.second.size() == seg_hi - seg_lo);
 
-    uint32_t off = rng.lo - min_addr_;
-    assert(off + seg.size() <= ret.size());
+    if (seg_hi <= lo)
+      continue;
+    if (hi <= seg_lo)
+      break;
 
-    memcpy(&ret[off], &seg[0], seg.size());
+    uint64_t from = std::max(lo, seg_lo);
+    uint64_t to = std::min(hi, seg_hi);
+    pr.second.CopyTo(from - seg_lo, to - from, dst + (from - lo));
   }
+}
+
+std::vector<uint8_t> StagedMem::GetFlat() const {
+  if (!segs_.size())
+    return std::vector<uint8_t>();
+
+  // Since max_addr_ and min_addr_ are inclusive, the size to allocate
+  // is 1+(max-min). We cast to size_t to make sure the +1 doesn't
+  // overflow.
+  size_t len = (size_t)1 + (max_addr_ - min_addr_);
+  std::vector<uint8_t> ret(len);
+  CopyFlat(0, len, ret.data());
   return ret;
 }
 
@@ -488,23 +1037,21 @@ void DpiMemUtil::LoadFileToNamedMem(bool verbose, const std::string &name,
   assert(type != kMemImageUnknown);
 
   // Search for corresponding registered memory based on the name
-  auto it = name_to_mem_.find(name);
-  if (it == name_to_mem_.end()) {
-    std::ostringstream oss;
-    oss << "`" << name
-        << ("' is not the name of a known memory region. "
-            "Run with --meminit=list to get a list.");
-    throw std::runtime_error(oss.str());
-  }
+  const MemArea &m = GetNamedMem(name);
 
   if (verbose) {
     std::cout << "Loading data from file `" << filepath << "' into memory `"
               << name << "'." << std::endl;
   }
 
-  const MemArea &m = it->second;
-
   try {
+    // A binary image is already packed for the memory, so there's nothing
+    // for the cache to save.
+    if (!cache_dir_.empty() && type != kMemImageBin) {
+      WriteCachedFileToMem(verbose, m, filepath, type, cache_dir_);
+      return;
+    }
+
     switch (type) {
       case kMemImageElf:
         WriteElfToMem(m, filepath);
@@ -512,6 +1059,9 @@ void DpiMemUtil::LoadFileToNamedMem(bool verbose, const std::string &name,
       case kMemImageVmem:
         WriteVmemToMem(m, filepath);
         break;
+      case kMemImageBin:
+        WriteBinToMem(m, filepath);
+        break;
       default:
         assert(0);
     }
@@ -523,6 +1073,44 @@ void DpiMemUtil::LoadFileToNamedMem(bool verbose, const std::string &name,
   }
 }
 
+std::vector<uint8_t> DpiMemUtil::ReadNamedMem(const std::string &name) const {
+  const MemArea &m = GetNamedMem(name);
+  try {
+    return ReadMem(m);
+  } catch (const SVScoped::Error &err) {
+    std::ostringstream oss;
+    oss << "No memory found at `" << err.scope_name_
+        << "' (the scope associated with region `" << m.name << "').";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+void DpiMemUtil::DumpNamedMem(const std::string &name, const std::string &path,
+                              MemImageType type) const {
+  // If the image type isn't specified, try to figure it out from the file name
+  if (type == kMemImageUnknown) {
+    type = DetectMemImageType(path);
+  }
+  assert(type != kMemImageUnknown);
+
+  const MemArea &m = GetNamedMem(name);
+  std::vector<uint8_t> data = ReadNamedMem(name);
+
+  switch (type) {
+    case kMemImageElf:
+      DumpElf(data, m.addr_loc.base, path);
+      break;
+    case kMemImageVmem:
+      DumpVmem(data, m.width_byte, path);
+      break;
+    case kMemImageBin:
+      DumpBin(data, path);
+      break;
+    default:
+      assert(0);
+  }
+}
+
 void DpiMemUtil::LoadElfToMemories(bool verbose, const std::string &filepath) {
   // Load the contents of the ELF file into the staging area
   StageElf(verbose, filepath);
@@ -536,11 +1124,11 @@ void DpiMemUtil::LoadElfToMemories(bool verbose, const std::string &filepath) {
 
     const MemArea &mem_area = mem_area_it->second;
 
-    for (const auto seg_pr : staged_mem.GetSegs()) {
+    for (const auto &seg_pr : staged_mem.GetSegs()) {
       const AddrRange<uint32_t> &seg_rng = seg_pr.first;
-      const std::vector<uint8_t> &seg_data = seg_pr.second;
+      const StagedSeg &seg = seg_pr.second;
       try {
-        WriteSegment(mem_area, seg_rng.lo, seg_data);
+        WriteSegment(mem_area, seg_rng.lo, seg);
       } catch (const SVScoped::Error &err) {
         std::ostringstream oss;
         oss << "No memory found at `" << err.scope_name_
@@ -559,9 +1147,7 @@ void DpiMemUtil::StageElf(bool verbose, const std::string &path) {
 
   ElfFile elf(path);
 
-  size_t file_size;
-  const char *file_data = elf_rawfile(elf.ptr_, &file_size);
-  assert(file_data);
+  size_t file_size = elf.file_->size();
 
   size_t phnum = elf.GetPhdrNum();
   const Elf32_Phdr *phdrs = elf.GetPhdrs();
@@ -611,11 +1197,7 @@ void DpiMemUtil::StageElf(bool verbose, const std::string &path) {
     // there isn't one, make a new empty one.
     StagedMem &staged_mem = staging_area_[mem_area.name];
 
-    const char *seg_data = file_data + phdr.p_offset;
-    std::vector<uint8_t> vec(phdr.p_memsz, 0);
-    memcpy(&vec[0], seg_data, std::min(phdr.p_filesz, phdr.p_memsz));
-
-    staged_mem.AddSegment(local_base, std::move(vec));
+    staged_mem.AddSegment(local_base, elf.GetSegment(phdr));
   }
 }
 
@@ -624,6 +1206,18 @@ const StagedMem &DpiMemUtil::GetMemoryData(const std::string &mem_name) const {
   return (it == staging_area_.end()) ? empty_ : it->second;
 }
 
+const MemArea &DpiMemUtil::GetNamedMem(const std::string &name) const {
+  auto it = name_to_mem_.find(name);
+  if (it == name_to_mem_.end()) {
+    std::ostringstream oss;
+    oss << "`" << name
+        << ("' is not the name of a known memory region. "
+            "Run with --meminit=list to get a list.");
+    throw std::runtime_error(oss.str());
+  }
+  return it->second;
+}
+
 const MemArea &DpiMemUtil::GetRegionForSegment(const std::string &path,
                                                int seg_idx, uint32_t lma,
                                                uint32_t mem_sz) const {
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <string>
 #include <svdpi.h>
 #include <vector>
@@ -15,6 +16,7 @@ enum MemImageType {
   kMemImageUnknown = 0,
   kMemImageElf,
   kMemImageVmem,
+  kMemImageBin,
 };
 
 // The "load" location of a memory area. base is the lowest address in
@@ -32,6 +34,40 @@ struct MemArea {
   MemAreaLoc addr_loc;   // Address location. If !size, location is unknown.
 };
 
+// A segment of staged data. This is len() bytes long. The first data_len()
+// bytes are explicit data, and the rest are zero (like a .bss section in an
+// ELF file).
+//
+// The explicit data isn't copied: the segment points into some storage
+// (normally an mmap'd ELF file) that it keeps alive with a shared pointer. The
+// only time we need a new buffer is when merging overlapping segments.
+class StagedSeg {
+ public:
+  StagedSeg(std::shared_ptr<const void> owner, const uint8_t *data,
+            size_t data_len, size_t zero_len)
+      : owner_(std::move(owner)),
+        data_(data),
+        data_len_(data_len),
+        zero_len_(zero_len) {}
+
+  // The total length of the segment
+  size_t size() const { return data_len_ + zero_len_; }
+
+  // The explicit data at the start of the segment
+  const uint8_t *data() const { return data_; }
+  size_t data_len() const { return data_len_; }
+
+  // Copy len bytes, starting at byte off of the segment, to dst. This writes
+  // zeros for bytes past the explicit data.
+  void CopyTo(size_t off, size_t len, uint8_t *dst) const;
+
+ private:
+  std::shared_ptr<const void> owner_;
+  const uint8_t *data_;
+  size_t data_len_;
+  size_t zero_len_;
+};
+
 // Staged data for a given memory area.
 //
 // This is represented as an ordered list of disjoint segments (as loaded from
@@ -44,13 +80,18 @@ class StagedMem {
   StagedMem() : min_addr_(~(uint32_t)0), max_addr_(0) {}
 
   // Add a segment to the tracked memory
-  void AddSegment(uint32_t offset, std::vector<uint8_t> &&seg);
+  void AddSegment(uint32_t offset, StagedSeg &&seg);
+
+  // Copy len bytes of the "flat" version of the tracked segments (all the
+  // segments, interspersed with zeros, starting at the lowest address) to
+  // dst, starting at byte offset off.
+  void CopyFlat(size_t off, size_t len, uint8_t *dst) const;
 
   // Glob together the tracked segments, interspersing them with
   // zeros, and return as a single flat array.
   std::vector<uint8_t> GetFlat() const;
 
-  typedef RangedMap<uint32_t, std::vector<uint8_t>> SegMap;
+  typedef RangedMap<uint32_t, StagedSeg> SegMap;
 
   std::pair<uint32_t, uint32_t> GetBounds() const {
     return std::make_pair(min_addr_, max_addr_);
@@ -68,7 +109,10 @@ class StagedMem {
  * These utilities require the corresponding DPI functions:
  * simutil_memload()
  * simutil_set_mem()
- * to be defined somewhere as SystemVerilog functions.
+ * simutil_get_mem()
+ * to be defined somewhere as SystemVerilog functions. If the simulation also
+ * exports simutil_set_mem_range() and simutil_get_mem_range(), they are used
+ * to load and read data in bulk.
  */
 class DpiMemUtil {
  public:
@@ -124,6 +168,27 @@ class DpiMemUtil {
   void LoadFileToNamedMem(bool verbose, const std::string &name,
                           const std::string &filepath, MemImageType type);
 
+  /**
+   * Read the contents of the named memory
+   *
+   * If the memory was registered with an address location, this reads
+   * addr_loc.size bytes. Otherwise, it reads words until the memory ends.
+   * Throws a std::runtime_error if the memory can't be read.
+   */
+  std::vector<uint8_t> ReadNamedMem(const std::string &name) const;
+
+  /**
+   * Write the contents of the named memory to a file at path. If type is
+   * kMemImageUnknown, the file type is determined from the path.
+   *
+   * A VMEM file has one word of the memory per entry. An ELF file has a
+   * single segment, whose LMA is the base of the memory's address location
+   * (or zero if it has none). Either can be loaded back with
+   * LoadFileToNamedMem(). Throws a std::runtime_error on failure.
+   */
+  void DumpNamedMem(const std::string &name, const std::string &path,
+                    MemImageType type) const;
+
   /**
    * Load an ELF file, placing segments in memories by LMA.
    *
@@ -145,6 +210,16 @@ class DpiMemUtil {
    */
   const StagedMem &GetMemoryData(const std::string &mem_name) const;
 
+  /**
+   * Cache images loaded by LoadFileToNamedMem in the directory at dir. If dir
+   * is empty (the default), don't use a cache.
+   *
+   * The cache stores each image packed for the memory it was loaded into, so
+   * a later load of the same file into the same memory can skip parsing the
+   * ELF or VMEM file. See MemImageCache for details.
+   */
+  void SetCacheDir(const std::string &dir) { cache_dir_ = dir; }
+
  private:
   // Memory area registry
   std::map<std::string, MemArea> name_to_mem_;
@@ -157,6 +232,14 @@ class DpiMemUtil {
   std::map<std::string, StagedMem> staging_area_;
   const StagedMem empty_;
 
+  // Directory for the image cache (see SetCacheDir). Empty if disabled.
+  std::string cache_dir_;
+
+  /**
+   * Find a memory area by name. Raises a std::runtime_error if there is none.
+   */
+  const MemArea &GetNamedMem(const std::string &name) const;
+
   /**
    * Find a region containing for the given segment's addresses.
    * Raises a std::exception if none is found.
@@ -0,0 +1,492 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// Include the implementation, so that we can test the static helpers
+// (ParseVmem and PackFlatImage) as well as the classes.
+#include "dpi_memutil.cc"
+
+#include <dirent.h>
+#include <elf.h>
+
+#include <random>
+
+#include "gtest/gtest.h"
+#include "mem_image_cache.h"
+
+namespace {
+
+// A memory with the scope kMemScope, standing in for the simulation. Words
+// are width_byte bytes long.
+const char kMemScope[] = "TOP.mem";
+
+struct FakeMem {
+  uint32_t width_byte = 4;
+  std::vector<uint8_t> bytes = std::vector<uint8_t>(64 * 1024);
+  int memload_calls = 0;
+  bool in_scope = false;
+};
+FakeMem fake_mem;
+
+}  // namespace
+
+svScope svGetScope() { return fake_mem.in_scope ? &fake_mem : nullptr; }
+
+svScope svSetScope(const svScope scope) {
+  svScope prev = svGetScope();
+  fake_mem.in_scope = (scope == &fake_mem);
+  return prev;
+}
+
+const char *svGetNameFromScope(const svScope scope) {
+  return scope == &fake_mem ? kMemScope : "TOP";
+}
+
+svScope svGetScopeFromName(const char *scope_name) {
+  return strcmp(scope_name, kMemScope) == 0 ? &fake_mem : nullptr;
+}
+
+extern "C" void simutil_memload(const char *) {
+  EXPECT_TRUE(fake_mem.in_scope);
+  ++fake_mem.memload_calls;
+}
+
+extern "C" int simutil_set_mem(int index, const svBitVecVal *val) {
+  size_t off = (size_t)index * fake_mem.width_byte;
+  if (!fake_mem.in_scope || off + fake_mem.width_byte > fake_mem.bytes.size())
+    return 0;
+  memcpy(&fake_mem.bytes[off], val, fake_mem.width_byte);
+  return 1;
+}
+
+extern "C" int simutil_get_mem(int, svBitVecVal *) { return 0; }
+
+namespace {
+
+std::vector<uint8_t> Bytes(const std::string &str) {
+  return std::vector<uint8_t>(str.begin(), str.end());
+}
+
+// A segment that owns a copy of data, followed by zero_len zeros
+StagedSeg MakeSeg(const std::vector<uint8_t> &data, size_t zero_len = 0) {
+  auto buf = std::make_shared<std::vector<uint8_t>>(data);
+  return StagedSeg(buf, buf->data(), buf->size(), zero_len);
+}
+
+std::string TempPath(const std::string &name) {
+  return testing::TempDir() + "dpi_memutil_unittest_" + name;
+}
+
+void WriteFile(const std::string &path, const std::string &contents) {
+  std::ofstream(path, std::ios::binary) << contents;
+}
+
+struct ElfSeg {
+  uint32_t paddr;
+  std::string data;
+  uint32_t memsz;
+};
+
+// Write a minimal 32-bit ELF file with a PT_LOAD segment for each of segs
+void WriteElf(const std::string &path, const std::vector<ElfSeg> &segs) {
+  Elf32_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof ehdr);
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_EXEC;
+  ehdr.e_machine = EM_RISCV;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_phoff = sizeof ehdr;
+  ehdr.e_ehsize = sizeof ehdr;
+  ehdr.e_phentsize = sizeof(Elf32_Phdr);
+  ehdr.e_phnum = segs.size();
+
+  std::string contents(reinterpret_cast<const char *>(&ehdr), sizeof ehdr);
+  size_t data_off = sizeof ehdr + segs.size() * sizeof(Elf32_Phdr);
+  std::string data;
+  for (const ElfSeg &seg : segs) {
+    Elf32_Phdr phdr;
+    memset(&phdr, 0, sizeof phdr);
+    phdr.p_type = PT_LOAD;
+    phdr.p_offset = data_off + data.size();
+    phdr.p_vaddr = phdr.p_paddr = seg.paddr;
+    phdr.p_filesz = seg.data.size();
+    phdr.p_memsz = seg.memsz;
+    contents.append(reinterpret_cast<const char *>(&phdr), sizeof phdr);
+    data += seg.data;
+  }
+  WriteFile(path, contents + data);
+}
+
+TEST(StagedMemTest, SegmentZeroFill) {
+  StagedSeg seg = MakeSeg(Bytes("abc"), 5);
+  EXPECT_EQ(seg.size(), 8u);
+  EXPECT_EQ(seg.data_len(), 3u);
+
+  uint8_t dst[6];
+  memset(dst, 0xff, sizeof dst);
+  seg.CopyTo(1, 6, dst);
+  EXPECT_EQ(std::vector<uint8_t>(dst, dst + 6),
+            std::vector<uint8_t>({'b', 'c', 0, 0, 0, 0}));
+}
+
+TEST(StagedMemTest, FlattensWithGaps) {
+  StagedMem mem;
+  mem.AddSegment(4, MakeSeg(Bytes("ab"), 2));
+  mem.AddSegment(16, MakeSeg(Bytes("cd")));
+  EXPECT_EQ(mem.GetBounds(), std::make_pair(4u, 17u));
+
+  std::vector<uint8_t> expected = Bytes("ab");
+  expected.resize(12, 0);
+  expected.push_back('c');
+  expected.push_back('d');
+  EXPECT_EQ(mem.GetFlat(), expected);
+
+  uint8_t dst[4];
+  mem.CopyFlat(10, 4, dst);
+  EXPECT_EQ(std::vector<uint8_t>(dst, dst + 4),
+            std::vector<uint8_t>({0, 0, 'c', 'd'}));
+}
+
+TEST(StagedMemTest, ContainedSegmentIsNotCopied) {
+  StagedMem mem;
+  mem.AddSegment(8, MakeSeg(Bytes("abcd")));
+  StagedSeg outer = MakeSeg(std::vector<uint8_t>(16, 'x'), 16);
+  const uint8_t *outer_data = outer.data();
+  mem.AddSegment(0, std::move(outer));
+
+  ASSERT_EQ(mem.GetSegs().size(), 1u);
+  EXPECT_EQ(mem.GetSegs().begin()->second.data(), outer_data);
+}
+
+TEST(StagedMemTest, MatchesReference) {
+  // Add random overlapping segments and compare the result with a simple
+  // byte array, where later segments overwrite earlier ones.
+  std::mt19937 rng(9);
+  for (int iter = 0; iter < 500; ++iter) {
+    StagedMem mem;
+    std::vector<int> ref(256, -1);
+    int num_segs = 1 + rng() % 6;
+    for (int i = 0; i < num_segs; ++i) {
+      uint32_t offset = rng() % 200;
+      std::vector<uint8_t> data(rng() % 28);
+      for (uint8_t &byte : data) {
+        byte = 1 + rng() % 255;
+      }
+      size_t zero_len = rng() % 28;
+      if (data.empty() && !zero_len)
+        zero_len = 1;
+
+      for (size_t j = 0; j < data.size() + zero_len; ++j) {
+        ref[offset + j] = j < data.size() ? data[j] : 0;
+      }
+      mem.AddSegment(offset, MakeSeg(data, zero_len));
+    }
+
+    int lo = 0, hi = ref.size() - 1;
+    while (ref[lo] < 0)
+      ++lo;
+    while (ref[hi] < 0)
+      --hi;
+    ASSERT_EQ(mem.GetBounds(), std::make_pair((uint32_t)lo, (uint32_t)hi));
+
+    std::vector<uint8_t> expected;
+    for (int j = lo; j <= hi; ++j) {
+      expected.push_back(ref[j] < 0 ? 0 : ref[j]);
+    }
+    ASSERT_EQ(mem.GetFlat(), expected) << "iteration " << iter;
+  }
+}
+
+TEST(ParseVmemTest, ParsesWordsAndAddresses) {
+  std::string path = TempPath("words.vmem");
+  WriteFile(path,
+            "// A comment\n"
+            "@2 0a0b0c0d /* another comment */ 1234_5678\n"
+            "@10\n"
+            "ff\n");
+
+  StagedMem img;
+  ASSERT_TRUE(ParseVmem(path, 4, &img));
+  ASSERT_EQ(img.GetSegs().size(), 2u);
+  auto it = img.GetSegs().begin();
+  EXPECT_EQ(it->first.lo, 8u);
+  EXPECT_EQ(std::vector<uint8_t>(it->second.data(),
+                                 it->second.data() + it->second.size()),
+            std::vector<uint8_t>(
+                {0x0d, 0x0c, 0x0b, 0x0a, 0x78, 0x56, 0x34, 0x12}));
+  ++it;
+  EXPECT_EQ(it->first.lo, 64u);
+  EXPECT_EQ(std::vector<uint8_t>(it->second.data(),
+                                 it->second.data() + it->second.size()),
+            std::vector<uint8_t>({0xff, 0, 0, 0}));
+  remove(path.c_str());
+}
+
+TEST(ParseVmemTest, RejectsWhatReadmemhShouldParse) {
+  std::string path = TempPath("bad.vmem");
+  for (const char *contents :
+       {"xxxxxxxx\n", "12 zz\n", "/* unterminated", "@\n", "123456789\n"}) {
+    WriteFile(path, contents);
+    StagedMem img;
+    EXPECT_FALSE(ParseVmem(path, 4, &img)) << contents;
+  }
+  remove(path.c_str());
+
+  StagedMem img;
+  EXPECT_FALSE(ParseVmem(TempPath("missing.vmem"), 4, &img));
+}
+
+TEST(PackFlatImageTest, SplitsAtLongZeroRuns) {
+  StagedMem staged;
+  staged.AddSegment(0, MakeSeg(std::vector<uint8_t>(16, 1), 8192));
+  staged.AddSegment(8208, MakeSeg(std::vector<uint8_t>(4, 2), 100));
+  staged.AddSegment(8312, MakeSeg(std::vector<uint8_t>(4, 3)));
+
+  StagedMem packed = PackFlatImage(staged, 4);
+  ASSERT_EQ(packed.GetSegs().size(), 2u);
+  auto it = packed.GetSegs().begin();
+  EXPECT_EQ(it->first.lo, 0u);
+  EXPECT_EQ(it->second.data_len(), 16u);
+  ++it;
+  EXPECT_EQ(it->first.lo, 8208u);
+  EXPECT_EQ(it->second.data_len(), 108u);
+  EXPECT_EQ(packed.GetFlat(), staged.GetFlat());
+}
+
+class MemImageCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = TempPath("cache");
+    mkdir(dir_.c_str(), 0777);
+    key_ = {0x1234, 8, 4, kMemImageVmem, kMemScope};
+
+    img_.AddSegment(0, MakeSeg(Bytes("abcdefgh"), 8));
+    img_.AddSegment(32, MakeSeg(Bytes("ijkl")));
+  }
+
+  void TearDown() override {
+    remove((dir_ + "/" + key_.FileName()).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  std::string dir_;
+  MemImageCache::Key key_;
+  StagedMem img_;
+};
+
+TEST_F(MemImageCacheTest, StoresAndLooksUp) {
+  MemImageCache cache(dir_);
+  StagedMem found;
+  EXPECT_FALSE(cache.Lookup(key_, &found));
+
+  cache.Store(key_, img_);
+  ASSERT_TRUE(cache.Lookup(key_, &found));
+  EXPECT_EQ(found.GetSegs().size(), 2u);
+  EXPECT_EQ(found.GetBounds(), img_.GetBounds());
+  EXPECT_EQ(found.GetFlat(), img_.GetFlat());
+}
+
+TEST_F(MemImageCacheTest, MissesForOtherKeys) {
+  MemImageCache cache(dir_);
+  cache.Store(key_, img_);
+
+  StagedMem found;
+  MemImageCache::Key key = key_;
+  key.hash ^= 1;
+  EXPECT_FALSE(cache.Lookup(key, &found));
+  key = key_;
+  key.width_byte = 8;
+  EXPECT_FALSE(cache.Lookup(key, &found));
+  key = key_;
+  key.location = "TOP.other_mem";
+  EXPECT_FALSE(cache.Lookup(key, &found));
+  key = key_;
+  key.type = kMemImageElf;
+  EXPECT_FALSE(cache.Lookup(key, &found));
+}
+
+TEST_F(MemImageCacheTest, MissesCorruptEntries) {
+  MemImageCache cache(dir_);
+  cache.Store(key_, img_);
+  std::string path = dir_ + "/" + key_.FileName();
+  std::string entry;
+  {
+    std::ifstream ifs(path, std::ios::binary);
+    entry.assign(std::istreambuf_iterator<char>(ifs),
+                 std::istreambuf_iterator<char>());
+  }
+  ASSERT_FALSE(entry.empty());
+
+  StagedMem found;
+  WriteFile(path, entry.substr(0, entry.size() - 4));
+  EXPECT_FALSE(cache.Lookup(key_, &found));
+  WriteFile(path, entry + "junk");
+  EXPECT_FALSE(cache.Lookup(key_, &found));
+  // An entry in another version of the format
+  entry[7] = 2;
+  WriteFile(path, entry);
+  EXPECT_FALSE(cache.Lookup(key_, &found));
+}
+
+TEST_F(MemImageCacheTest, KeyDependsOnContents) {
+  MemArea m = {"ram", kMemScope, 4, {0, 0}};
+  std::string path = TempPath("key.vmem");
+  MemImageCache::Key key0, key1;
+
+  WriteFile(path, "00000001\n");
+  ASSERT_TRUE(MemImageCache::MakeKey(path, kMemImageVmem, m, &key0));
+  WriteFile(path, "00000002\n");
+  ASSERT_TRUE(MemImageCache::MakeKey(path, kMemImageVmem, m, &key1));
+  EXPECT_NE(key0.hash, key1.hash);
+  EXPECT_NE(key0.FileName(), key1.FileName());
+
+  // The same file loaded into a different memory needs a different entry
+  m.width_byte = 8;
+  ASSERT_TRUE(MemImageCache::MakeKey(path, kMemImageVmem, m, &key0));
+  EXPECT_EQ(key0.hash, key1.hash);
+  EXPECT_NE(key0.FileName(), key1.FileName());
+
+  remove(path.c_str());
+  EXPECT_FALSE(MemImageCache::MakeKey(path, kMemImageVmem, m, &key0));
+}
+
+class DpiMemUtilTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    fake_mem = FakeMem();
+    cache_dir_ = TempPath("load_cache");
+    mkdir(cache_dir_.c_str(), 0777);
+  }
+
+  void TearDown() override {
+    for (const std::string &path : temp_files_) {
+      remove(path.c_str());
+    }
+    for (const std::string &name : CacheEntries()) {
+      remove((cache_dir_ + "/" + name).c_str());
+    }
+    rmdir(cache_dir_.c_str());
+  }
+
+  std::string TempFile(const std::string &name) {
+    temp_files_.push_back(TempPath(name));
+    return temp_files_.back();
+  }
+
+  std::vector<std::string> CacheEntries() {
+    std::vector<std::string> names;
+    if (DIR *dir = opendir(cache_dir_.c_str())) {
+      while (struct dirent *ent = readdir(dir)) {
+        if (ent->d_name[0] != '.')
+          names.push_back(ent->d_name);
+      }
+      closedir(dir);
+    }
+    return names;
+  }
+
+  std::vector<uint8_t> MemBytes(size_t len) {
+    return std::vector<uint8_t>(fake_mem.bytes.begin(),
+                                fake_mem.bytes.begin() + len);
+  }
+
+  std::string cache_dir_;
+  std::vector<std::string> temp_files_;
+};
+
+TEST_F(DpiMemUtilTest, StagesElfSegments) {
+  DpiMemUtil util;
+  MemAreaLoc loc = {0x1000, 0x1000};
+  ASSERT_TRUE(util.RegisterMemoryArea("rom", kMemScope, 32, &loc));
+
+  // The second segment has BSS, and the third overwrites part of it
+  std::string path = TempFile("stage.elf");
+  WriteElf(path, {{0x1000, "abcd", 4}, {0x1008, "efgh", 12}, {0x1010, "ij", 2}});
+  util.StageElf(false, path);
+
+  const StagedMem &staged = util.GetMemoryData("rom");
+  EXPECT_EQ(staged.GetBounds(), std::make_pair(0u, 0x13u));
+  std::vector<uint8_t> expected = Bytes("abcd");
+  expected.resize(8, 0);
+  for (char c : std::string("efgh\0\0\0\0ij\0\0", 12)) {
+    expected.push_back(c);
+  }
+  EXPECT_EQ(staged.GetFlat(), expected);
+
+  // The BSS that is still visible is zero fill, not data
+  ASSERT_EQ(staged.GetSegs().size(), 2u);
+  auto it = ++staged.GetSegs().begin();
+  EXPECT_EQ(it->first.lo, 8u);
+  EXPECT_EQ(it->second.data_len(), 10u);
+  EXPECT_EQ(it->second.size(), 12u);
+}
+
+TEST_F(DpiMemUtilTest, LoadsVmemThroughCache) {
+  DpiMemUtil util;
+  ASSERT_TRUE(util.RegisterMemoryArea("ram", kMemScope));
+  util.SetCacheDir(cache_dir_);
+
+  std::string path = TempFile("load.vmem");
+  WriteFile(path, "@1 11223344\n");
+  util.LoadFileToNamedMem(false, "ram", path, kMemImageVmem);
+  EXPECT_EQ(MemBytes(8),
+            std::vector<uint8_t>({0, 0, 0, 0, 0x44, 0x33, 0x22, 0x11}));
+  std::vector<std::string> entries = CacheEntries();
+  ASSERT_EQ(entries.size(), 1u);
+
+  // Change the data in the cache entry (the last byte of the file), so that
+  // we can tell whether the next load used it.
+  std::string entry_path = cache_dir_ + "/" + entries[0];
+  std::fstream entry(entry_path,
+                     std::ios::in | std::ios::out | std::ios::binary);
+  entry.seekp(-1, std::ios::end);
+  entry.put(0x55);
+  entry.close();
+
+  fake_mem = FakeMem();
+  util.LoadFileToNamedMem(false, "ram", path, kMemImageVmem);
+  EXPECT_EQ(MemBytes(8),
+            std::vector<uint8_t>({0, 0, 0, 0, 0x44, 0x33, 0x22, 0x55}));
+  EXPECT_EQ(fake_mem.memload_calls, 0);
+}
+
+TEST_F(DpiMemUtilTest, FallsBackToReadmemh) {
+  DpiMemUtil util;
+  ASSERT_TRUE(util.RegisterMemoryArea("ram", kMemScope));
+  util.SetCacheDir(cache_dir_);
+
+  // We don't parse X digits, and the word past the end of the memory can't
+  // be written, so both files go to $readmemh and aren't cached.
+  std::string path = TempFile("x.vmem");
+  WriteFile(path, "xxxxxxxx\n");
+  util.LoadFileToNamedMem(false, "ram", path, kMemImageVmem);
+  WriteFile(path, "@4000 00000001\n");
+  util.LoadFileToNamedMem(false, "ram", path, kMemImageVmem);
+  EXPECT_EQ(fake_mem.memload_calls, 2);
+  EXPECT_TRUE(CacheEntries().empty());
+}
+
+TEST_F(DpiMemUtilTest, LoadsElfThroughCache) {
+  DpiMemUtil util;
+  ASSERT_TRUE(util.RegisterMemoryArea("ram", kMemScope));
+  util.SetCacheDir(cache_dir_);
+
+  // The ELF is flattened from its lowest address, like objcopy does
+  std::string path = TempFile("load.elf");
+  WriteElf(path, {{0x2000, "abcdefgh", 8}, {0x2010, "ijkl", 4}});
+  std::vector<uint8_t> expected = Bytes("abcdefgh");
+  expected.resize(16, 0);
+  expected.insert(expected.end(), {'i', 'j', 'k', 'l'});
+
+  for (int i = 0; i < 2; ++i) {
+    fake_mem = FakeMem();
+    util.LoadFileToNamedMem(false, "ram", path, kMemImageElf);
+    EXPECT_EQ(MemBytes(expected.size()), expected) << "load " << i;
+    EXPECT_EQ(CacheEntries().size(), 1u);
+  }
+}
+
+}  // namespace
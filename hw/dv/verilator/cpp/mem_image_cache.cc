@@ -0,0 +1,278 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "mem_image_cache.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Every cache entry starts with this. Bump the last byte when changing the
+// format, which will make existing entries miss.
+static const char kMagic[8] = {'D', 'P', 'I', 'M', 'E', 'M', 'C', 1};
+
+// The cache entry format (with all integers little-endian) is:
+//
+//   magic       8 bytes
+//   hash        u64
+//   file_size   u64
+//   width_byte  u32
+//   type        u32
+//   loc_len     u32
+//   location    loc_len bytes, padded to a multiple of 4
+//   num_segs    u32
+//
+// followed by num_segs segments, each of which is:
+//
+//   offset      u32
+//   data_len    u32
+//   zero_len    u32
+//   data        data_len bytes, padded to a multiple of 4
+//
+// The header repeats every field of the key, so that we can check an entry
+// really is the one we want.
+
+// Map the file at path into memory, read-only. Returns nullptr on failure.
+// The mapping is removed when the last copy of the pointer goes away.
+static std::shared_ptr<const uint8_t> MapFile(const std::string &path,
+                                              size_t *size) {
+  int fd = open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  size_t len = st.st_size;
+  void *ptr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  *size = len;
+  return std::shared_ptr<const uint8_t>(
+      static_cast<const uint8_t *>(ptr),
+      [len](const uint8_t *p) { munmap(const_cast<uint8_t *>(p), len); });
+}
+
+static uint64_t Rotl64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+
+// The finalizer from SplitMix64, which mixes every input bit into every output
+// bit.
+static uint64_t Mix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// A fast 64-bit hash of len bytes at data. This isn't cryptographic (a cache
+// key only needs to avoid accidental collisions), but it mixes each 8-byte
+// word thoroughly before combining it.
+static uint64_t HashBytes(const uint8_t *data, size_t len, uint64_t seed) {
+  uint64_t h = Mix64(seed ^ len);
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = Rotl64(h ^ Mix64(word), 29) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, len - i);
+  h = Rotl64(h ^ Mix64(tail ^ 0xff), 29) * 0x9e3779b97f4a7c15ULL;
+  return Mix64(h);
+}
+
+std::string MemImageCache::Key::FileName() const {
+  std::vector<uint8_t> meta(location.begin(), location.end());
+  uint32_t extra[2] = {width_byte, type};
+  const uint8_t *extra_bytes = reinterpret_cast<const uint8_t *>(extra);
+  meta.insert(meta.end(), extra_bytes, extra_bytes + sizeof extra);
+
+  char name[64];
+  snprintf(name, sizeof name, "%016llx-%016llx.memimg",
+           (unsigned long long)hash,
+           (unsigned long long)HashBytes(meta.data(), meta.size(), file_size));
+  return name;
+}
+
+bool MemImageCache::HashFile(const std::string &path, uint64_t *hash,
+                             uint64_t *file_size) {
+  assert(hash && file_size);
+
+  size_t size;
+  std::shared_ptr<const uint8_t> data = MapFile(path, &size);
+  if (!data)
+    return false;
+
+  *hash = HashBytes(data.get(), size, 0);
+  *file_size = size;
+  return true;
+}
+
+bool MemImageCache::MakeKey(const std::string &path, MemImageType type,
+                            const MemArea &m, Key *key) {
+  assert(key);
+
+  if (!HashFile(path, &key->hash, &key->file_size))
+    return false;
+
+  key->width_byte = m.width_byte;
+  key->type = type;
+  key->location = m.location;
+  return true;
+}
+
+namespace {
+// A cursor for reading a cache entry. Each Read method returns false if there
+// isn't enough data left.
+class EntryReader {
+ public:
+  EntryReader(const uint8_t *data, size_t len) : pos_(data), end_(data + len) {}
+
+  bool ReadBytes(size_t len, const uint8_t **dst) {
+    // Fields are padded to a multiple of 4 bytes
+    size_t padded = (len + 3) & ~(size_t)3;
+    if ((size_t)(end_ - pos_) < padded)
+      return false;
+    *dst = pos_;
+    pos_ += padded;
+    return true;
+  }
+
+  template <typename T>
+  bool Read(T *dst) {
+    const uint8_t *src;
+    if (!ReadBytes(sizeof(T), &src))
+      return false;
+    memcpy(dst, src, sizeof(T));
+    return true;
+  }
+
+  bool AtEnd() const { return pos_ == end_; }
+
+ private:
+  const uint8_t *pos_;
+  const uint8_t *end_;
+};
+
+// Accumulates a cache entry in memory
+class EntryWriter {
+ public:
+  void WriteBytes(const void *data, size_t len) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    buf_.insert(buf_.end(), bytes, bytes + len);
+    buf_.resize((buf_.size() + 3) & ~(size_t)3, 0);
+  }
+
+  template <typename T>
+  void Write(const T &val) {
+    WriteBytes(&val, sizeof val);
+  }
+
+  const std::vector<uint8_t> &buf() const { return buf_; }
+
+ private:
+  std::vector<uint8_t> buf_;
+};
+}  // namespace
+
+bool MemImageCache::Lookup(const Key &key, StagedMem *img) const {
+  assert(img);
+
+  size_t size;
+  std::shared_ptr<const uint8_t> data =
+      MapFile(dir_ + "/" + key.FileName(), &size);
+  if (!data)
+    return false;
+
+  EntryReader reader(data.get(), size);
+
+  const uint8_t *magic;
+  uint64_t hash, file_size;
+  uint32_t width_byte, type, loc_len, num_segs;
+  const uint8_t *loc;
+  if (!(reader.ReadBytes(sizeof kMagic, &magic) &&
+        memcmp(magic, kMagic, sizeof kMagic) == 0 && reader.Read(&hash) &&
+        reader.Read(&file_size) && reader.Read(&width_byte) &&
+        reader.Read(&type) && reader.Read(&loc_len) &&
+        reader.ReadBytes(loc_len, &loc) && reader.Read(&num_segs)))
+    return false;
+
+  if (hash != key.hash || file_size != key.file_size ||
+      width_byte != key.width_byte || type != key.type ||
+      loc_len != key.location.size() ||
+      memcmp(loc, key.location.data(), loc_len) != 0)
+    return false;
+
+  StagedMem ret;
+  for (uint32_t i = 0; i < num_segs; ++i) {
+    uint32_t offset, data_len, zero_len;
+    const uint8_t *seg_data;
+    if (!(reader.Read(&offset) && reader.Read(&data_len) &&
+          reader.Read(&zero_len) && reader.ReadBytes(data_len, &seg_data)))
+      return false;
+
+    // Make sure that the segment fits in the address space and is aligned
+    // (which the writer guarantees, but we might have a corrupt file).
+    if ((uint64_t)offset + data_len + zero_len > ((uint64_t)1 << 32) ||
+        offset % width_byte != 0)
+      return false;
+
+    ret.AddSegment(offset, StagedSeg(data, seg_data, data_len, zero_len));
+  }
+
+  if (!reader.AtEnd())
+    return false;
+
+  *img = std::move(ret);
+  return true;
+}
+
+void MemImageCache::Store(const Key &key, const StagedMem &img) const {
+  EntryWriter writer;
+  writer.WriteBytes(kMagic, sizeof kMagic);
+  writer.Write(key.hash);
+  writer.Write(key.file_size);
+  writer.Write(key.width_byte);
+  writer.Write(key.type);
+  writer.Write((uint32_t)key.location.size());
+  writer.WriteBytes(key.location.data(), key.location.size());
+  writer.Write((uint32_t)img.GetSegs().size());
+
+  for (const auto &pr : img.GetSegs()) {
+    const StagedSeg &seg = pr.second;
+    assert(pr.first.lo % key.width_byte == 0);
+    writer.Write(pr.first.lo);
+    writer.Write((uint32_t)seg.data_len());
+    writer.Write((uint32_t)(seg.size() - seg.data_len()));
+    writer.WriteBytes(seg.data(), seg.data_len());
+  }
+
+  // Write to a temporary file, then rename it into place. The rename is
+  // atomic, so a concurrent Lookup sees either no entry or a complete one.
+  std::string path = dir_ + "/" + key.FileName();
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp)
+    return;
+
+  const std::vector<uint8_t> &buf = writer.buf();
+  bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+  ok = (fclose(fp) == 0) && ok;
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
@@ -0,0 +1,70 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "dpi_memutil.h"
+
+/**
+ * An on-disk cache of memory images that have been packed for a particular
+ * memory.
+ *
+ * An entry is keyed by a hash of the contents of the image file, together with
+ * the image type and the location and word width of the memory it was loaded
+ * into. The entry holds the image as a list of word-aligned segments, ready to
+ * be written to the memory, so a hit doesn't need to parse the file at all.
+ *
+ * Entries are written to a temporary file and then renamed into place, so
+ * several simulations can share a cache directory. Any problem with the cache
+ * (a missing directory, a corrupt entry and so on) is treated as a miss.
+ */
+class MemImageCache {
+ public:
+  // Identifies an entry in the cache
+  struct Key {
+    uint64_t hash;       // Hash of the file contents
+    uint64_t file_size;  // Size of the file
+    uint32_t width_byte;
+    uint32_t type;
+    std::string location;
+
+    // The file name of the entry (relative to the cache directory)
+    std::string FileName() const;
+  };
+
+  explicit MemImageCache(const std::string &dir) : dir_(dir) {}
+
+  /**
+   * Make a key for loading the file at path (of the given type) into the
+   * memory m. Returns false if the file can't be read.
+   */
+  static bool MakeKey(const std::string &path, MemImageType type,
+                      const MemArea &m, Key *key);
+
+  /**
+   * Hash the contents of the file at path (with the same hash as Key::hash)
+   * and get its size. Returns false if the file can't be read.
+   */
+  static bool HashFile(const std::string &path, uint64_t *hash,
+                       uint64_t *file_size);
+
+  /**
+   * Look up key in the cache. On a hit, replace the contents of img with the
+   * cached image and return true. The segments of img point into a mapping of
+   * the cache entry, which stays valid even if the entry is later replaced.
+   */
+  bool Lookup(const Key &key, StagedMem *img) const;
+
+  /**
+   * Store img in the cache under key. Every segment must start at an offset
+   * that is aligned to the memory's word width.
+   */
+  void Store(const Key &key, const StagedMem &img) const;
+
+ private:
+  std::string dir_;
+};
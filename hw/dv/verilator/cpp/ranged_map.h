@@ -28,7 +28,9 @@ class RangedMap {
 
   // A function used to merge overlapping segments. When called by
   // Emplace(), val1 will be the newer value and val0 will be the
-  // older.
+  // older. The two ranges always overlap: segments that are merely adjacent
+  // are kept separate, so the function doesn't have to copy anything for
+  // them.
   typedef val_t (*MergeFun)(const rng_t &rng0, val_t &&val0, const rng_t &rng1,
                             val_t &&val1);
 
@@ -9,10 +9,14 @@
 #include <cstring>
 #include <getopt.h>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "mem_image_cache.h"
+#include "verilator_sim_ctrl.h"
+
 namespace {
 // An instruction to load the file at filepath to the memory called name. If
 // name is the empty string then type must be kMemImageElf and this is an
@@ -24,9 +28,11 @@ struct LoadArg {
 };
 }  // namespace
 
-// Parse a meminit command-line argument. This should be of the form
-// mem_area,file[,type]. Throw a std::runtime_error if something looks wrong.
-static LoadArg ParseMemArg(std::string mem_argument) {
+// Parse a meminit (or memdump) command-line argument. This should be of the
+// form mem_area,file[,type]. Throw a std::runtime_error if something looks
+// wrong.
+static LoadArg ParseMemArg(std::string mem_argument,
+                           const char *opt_name = "meminit") {
   std::array<std::string, 3> args;
   size_t pos = 0;
   size_t end_pos = 0;
@@ -51,7 +57,7 @@ static LoadArg ParseMemArg(std::string mem_argument) {
   // but not a valid argument for memory initialization
   if (i == 0) {
     std::ostringstream oss;
-    oss << "meminit must be in the format `name,file[,type]'. Got: `"
+    oss << opt_name << " must be in the format `name,file[,type]'. Got: `"
         << mem_argument << "'.";
     throw std::runtime_error(oss.str());
   }
@@ -62,6 +68,24 @@ static LoadArg ParseMemArg(std::string mem_argument) {
   return {.name = args[0], .filepath = args[1], .type = type};
 }
 
+// Parse the "when" part of a memdump argument (after the '@'), which is
+// either a cycle number or "end". Throw a std::runtime_error if it's neither.
+static void ParseDumpTime(const std::string &when, bool *at_end,
+                          unsigned long *cycle) {
+  *at_end = (when == "end");
+  if (*at_end) {
+    return;
+  }
+  char *end;
+  *cycle = strtoul(when.c_str(), &end, 10);
+  if (when.empty() || *end != '\0') {
+    std::ostringstream oss;
+    oss << "memdump must end with `@CYCLE' or `@end'. Got: `@" << when
+        << "'.";
+    throw std::runtime_error(oss.str());
+  }
+}
+
 // Print a usage message to stdout
 static void PrintHelp() {
   std::cout << "Simulation memory utilities:\n\n"
@@ -73,11 +97,17 @@ static void PrintHelp() {
                "  Initialize the FLASH with FILE (elf/vmem)\n\n"
                "-l|--meminit=NAME,FILE[,TYPE]\n"
                "  Initialize memory region NAME with FILE [of TYPE]\n"
-               "  TYPE is either 'elf' or 'vmem'\n\n"
+               "  TYPE is 'elf', 'vmem' or 'bin'\n\n"
                "-E|--load-elf=FILE\n"
                "  Load ELF file, using segment LMAs to pick memory regions\n\n"
                "-l list|--meminit=list\n"
                "  Print registered memory regions\n\n"
+               "--memdump=NAME,FILE[,TYPE]@CYCLE|end\n"
+               "  Write the contents of memory region NAME to FILE [as TYPE] "
+               "at the start\n"
+               "  of cycle CYCLE or at the end of the simulation\n\n"
+               "--meminit-cache=DIR\n"
+               "  Cache images loaded into named memories in DIR\n\n"
                "--verbose-mem-load\n"
                "  Print a message for each memory load\n\n"
                "-h|--help\n"
@@ -102,6 +132,8 @@ bool VerilatorMemUtil::ParseCLIArguments(int argc, char **argv,
       {"meminit", required_argument, nullptr, 'l'},
       {"verbose-mem-load", no_argument, nullptr, 'V'},
       {"load-elf", required_argument, nullptr, 'E'},
+      {"meminit-cache", required_argument, nullptr, 'C'},
+      {"memdump", required_argument, nullptr, 'D'},
       {"help", no_argument, nullptr, 'h'},
       {nullptr, no_argument, nullptr, 0}};
 
@@ -161,6 +193,30 @@ bool VerilatorMemUtil::ParseCLIArguments(int argc, char **argv,
         load_args.push_back(
             {.name = "", .filepath = optarg, .type = kMemImageElf});
         break;
+      case 'C':
+        mem_util_->SetCacheDir(optarg);
+        break;
+      case 'D': {
+        // --memdump=NAME,FILE[,TYPE]@WHEN
+        std::string arg = optarg;
+        size_t at_pos = arg.rfind('@');
+        DumpArg dump;
+        try {
+          if (at_pos == std::string::npos) {
+            ParseDumpTime("", &dump.at_end, &dump.cycle);
+          }
+          LoadArg spec = ParseMemArg(arg.substr(0, at_pos), "memdump");
+          ParseDumpTime(arg.substr(at_pos + 1), &dump.at_end, &dump.cycle);
+          dump.name = spec.name;
+          dump.filepath = spec.filepath;
+          dump.type = spec.type;
+        } catch (const std::runtime_error &err) {
+          std::cerr << "ERROR: " << err.what() << std::endl;
+          return false;
+        }
+        dump_args_.push_back(dump);
+        break;
+      }
       case 'h':
         PrintHelp();
         return true;
@@ -187,7 +243,93 @@ bool VerilatorMemUtil::ParseCLIArguments(int argc, char **argv,
       std::cerr << "ERROR: " << err.what() << std::endl;
       return false;
     }
+
+    uint64_t hash, file_size;
+    if (!MemImageCache::HashFile(arg.filepath, &hash, &file_size)) {
+      std::cerr << "ERROR: Cannot read `" << arg.filepath << "'." << std::endl;
+      return false;
+    }
+    std::ostringstream oss;
+    oss << (arg.name.empty() ? "(elf)" : arg.name) << " " << arg.type << " "
+        << file_size << " " << std::hex << hash << "\n";
+    loaded_images_ += oss.str();
   }
 
   return true;
 }
+
+void VerilatorMemUtil::PreExec() {
+  VerilatorSimCtrl &simctrl = VerilatorSimCtrl::GetInstance();
+  for (const DumpArg &arg : dump_args_) {
+    if (arg.at_end) {
+      continue;
+    }
+    simctrl.ScheduleAt(arg.cycle, [this, arg, &simctrl](unsigned long) {
+      if (!Dump(arg)) {
+        simctrl.RequestStop(false);
+      }
+    });
+  }
+}
+
+void VerilatorMemUtil::PostExec() {
+  for (const DumpArg &arg : dump_args_) {
+    if (arg.at_end && !Dump(arg)) {
+      VerilatorSimCtrl::GetInstance().RequestStop(false);
+    }
+  }
+}
+
+bool VerilatorMemUtil::HandleControlCommand(
+    const std::vector<std::string> &words, std::string &reply) {
+  // memdump NAME FILE [TYPE]
+  if (words[0] != "memdump") {
+    return false;
+  }
+  if (words.size() != 3 && words.size() != 4) {
+    reply = "error usage: memdump NAME FILE [TYPE]";
+    return true;
+  }
+
+  try {
+    MemImageType type = DpiMemUtil::GetMemImageType(
+        words[2], words.size() == 4 ? words[3].c_str() : nullptr);
+    mem_util_->DumpNamedMem(words[1], words[2], type);
+  } catch (const std::exception &err) {
+    reply = std::string("error ") + err.what();
+    return true;
+  }
+  reply = "ok";
+  return true;
+}
+
+bool VerilatorMemUtil::SaveCheckpoint(std::ostream &os) {
+  os << loaded_images_;
+  return bool(os);
+}
+
+bool VerilatorMemUtil::RestoreCheckpoint(std::istream &is) {
+  std::string saved((std::istreambuf_iterator<char>(is)),
+                    std::istreambuf_iterator<char>());
+  if (saved != loaded_images_) {
+    std::cerr << "ERROR: The checkpoint was saved by a simulation that loaded "
+                 "different memory images. It loaded:\n"
+              << (saved.empty() ? "(none)\n" : saved)
+              << "and this simulation loaded:\n"
+              << (loaded_images_.empty() ? "(none)\n" : loaded_images_);
+    return false;
+  }
+  return true;
+}
+
+bool VerilatorMemUtil::Dump(const DumpArg &arg) {
+  try {
+    mem_util_->DumpNamedMem(arg.name, arg.filepath, arg.type);
+  } catch (const std::exception &err) {
+    std::cerr << "ERROR: " << err.what() << std::endl;
+    return false;
+  }
+  std::cout << "Wrote memory `" << arg.name << "' to " << arg.filepath << "."
+            << std::endl;
+  return true;
+}
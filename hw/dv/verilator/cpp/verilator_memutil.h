@@ -9,6 +9,8 @@
 //
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "dpi_memutil.h"
 #include "sim_ctrl_extension.h"
@@ -22,6 +24,12 @@ class VerilatorMemUtil : public SimCtrlExtension {
 
   // Declared in SimCtrlExtension
   bool ParseCLIArguments(int argc, char **argv, bool &exit_app) override;
+  void PreExec() override;
+  void PostExec() override;
+  bool HandleControlCommand(const std::vector<std::string> &words,
+                            std::string &reply) override;
+  bool SaveCheckpoint(std::ostream &os) override;
+  bool RestoreCheckpoint(std::istream &is) override;
 
   // Get underlying DpiMemUtil object
   DpiMemUtil *GetUnderlying() { return mem_util_; }
@@ -37,6 +45,25 @@ class VerilatorMemUtil : public SimCtrlExtension {
   }
 
  private:
+  // A memory dump requested with --memdump. at_end is true if the dump
+  // should happen at the end of the simulation, rather than at cycle.
+  struct DumpArg {
+    std::string name;
+    std::string filepath;
+    MemImageType type;
+    bool at_end;
+    unsigned long cycle;
+  };
+
   DpiMemUtil *mem_util_;
   std::unique_ptr<DpiMemUtil> allocation_;
+  std::vector<DumpArg> dump_args_;
+
+  // The images loaded with --meminit (and friends), one line per image giving
+  // the memory, type, size and hash of the file. Memory contents in a
+  // checkpoint are only valid for a simulation that loaded the same images.
+  std::string loaded_images_;
+
+  // Run a dump, printing a message. Returns false on failure.
+  bool Dump(const DumpArg &arg);
 };
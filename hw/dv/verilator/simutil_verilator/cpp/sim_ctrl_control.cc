@@ -0,0 +1,117 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_ctrl_control.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+SimCtrlControlSocket::SimCtrlControlSocket(const std::string &path)
+    : path_(path), listen_fd_(-1), client_fd_(-1) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    throw std::runtime_error("Control socket path `" + path +
+                             "' is too long");
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error(std::string("Cannot create control socket: ") +
+                             strerror(errno));
+  }
+
+  unlink(path.c_str());
+  if (bind(listen_fd_, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+      listen(listen_fd_, 1) != 0) {
+    std::ostringstream oss;
+    oss << "Cannot listen on control socket `" << path
+        << "': " << strerror(errno);
+    close(listen_fd_);
+    throw std::runtime_error(oss.str());
+  }
+}
+
+SimCtrlControlSocket::~SimCtrlControlSocket() {
+  CloseClient();
+  close(listen_fd_);
+  unlink(path_.c_str());
+}
+
+bool SimCtrlControlSocket::NextCommand(std::vector<std::string> &words,
+                                       bool wait) {
+  while (true) {
+    // Return the first non-empty line we already have
+    size_t eol;
+    while ((eol = buf_.find('\n')) != std::string::npos) {
+      std::istringstream line(buf_.substr(0, eol));
+      buf_.erase(0, eol + 1);
+      words.clear();
+      std::string word;
+      while (line >> word) {
+        words.push_back(word);
+      }
+      if (!words.empty()) {
+        return true;
+      }
+    }
+
+    // Wait for a client if we don't have one, otherwise for more data from
+    // the client. poll() returns early if a signal arrives (e.g. on CTRL-c).
+    struct pollfd pfd;
+    pfd.fd = client_fd_ >= 0 ? client_fd_ : listen_fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, wait ? -1 : 0) <= 0) {
+      return false;
+    }
+
+    if (client_fd_ < 0) {
+      client_fd_ = accept(listen_fd_, nullptr, nullptr);
+      if (client_fd_ < 0) {
+        return false;
+      }
+      continue;
+    }
+
+    char chunk[4096];
+    ssize_t len = read(client_fd_, chunk, sizeof chunk);
+    if (len < 0 && errno == EINTR) {
+      return false;
+    }
+    if (len <= 0) {
+      // The client has gone away. Drop anything it didn't finish sending.
+      CloseClient();
+      continue;
+    }
+    buf_.append(chunk, len);
+  }
+}
+
+void SimCtrlControlSocket::Reply(const std::string &line) {
+  if (client_fd_ < 0) {
+    return;
+  }
+  std::string msg = line + "\n";
+  if (send(client_fd_, msg.data(), msg.size(), MSG_NOSIGNAL) !=
+      (ssize_t)msg.size()) {
+    CloseClient();
+  }
+}
+
+void SimCtrlControlSocket::CloseClient() {
+  if (client_fd_ >= 0) {
+    close(client_fd_);
+    client_fd_ = -1;
+  }
+  buf_.clear();
+}
@@ -0,0 +1,65 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_CONTROL_H_
+#define OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_CONTROL_H_
+
+#include <string>
+#include <vector>
+
+/**
+ * A Unix domain socket for controlling a running simulation
+ *
+ * Clients connect one at a time and send commands as lines of text, made up
+ * of words separated by whitespace. The simulation controller interprets the
+ * commands and sends a line back for each one, which starts with "ok" or
+ * "error". This class only deals with the socket: it doesn't know what any
+ * of the commands mean.
+ */
+class SimCtrlControlSocket {
+ public:
+  /**
+   * Listen on a socket at path, replacing any file that is already there
+   *
+   * Throws a std::runtime_error if the socket can't be created.
+   */
+  explicit SimCtrlControlSocket(const std::string &path);
+
+  /**
+   * Close the socket and remove it from the file system
+   */
+  ~SimCtrlControlSocket();
+
+  SimCtrlControlSocket(const SimCtrlControlSocket &) = delete;
+  SimCtrlControlSocket &operator=(const SimCtrlControlSocket &) = delete;
+
+  /**
+   * Get the next command from the client (accepting a new client if there is
+   * none)
+   *
+   * If wait is false, only commands that have already arrived are returned.
+   * If wait is true, blocks until a command arrives or a signal interrupts the
+   * wait.
+   *
+   * @param words Set to the words of the command
+   * @return true if there was a command
+   */
+  bool NextCommand(std::vector<std::string> &words, bool wait);
+
+  /**
+   * Send a line to the current client (if there is one)
+   */
+  void Reply(const std::string &line);
+
+ private:
+  std::string path_;
+  int listen_fd_;
+  int client_fd_;
+  // Data received from the client that doesn't make up a full line yet
+  std::string buf_;
+
+  void CloseClient();
+};
+
+#endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_CONTROL_H_
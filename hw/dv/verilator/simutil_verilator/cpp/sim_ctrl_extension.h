@@ -5,6 +5,10 @@
 #ifndef OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_EXTENSION_H_
 #define OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_EXTENSION_H_
 
+#include <iosfwd>
+#include <string>
+#include <vector>
+
 class SimCtrlExtension {
  public:
   virtual ~SimCtrlExtension() = default;
@@ -29,13 +33,65 @@ class SimCtrlExtension {
 
   /**
    * Function to be called every clock cycle
+   *
+   * Extensions that don't override this aren't called every cycle: the
+   * simulation controller drops them after the first call to this default
+   * implementation. Extensions that only care about occasional events should
+   * use the scheduler in VerilatorSimCtrl instead.
+   */
+  virtual void OnClock(unsigned long sim_time) { wants_on_clock_ = false; }
+
+  /**
+   * Does this extension need OnClock() to be called every cycle?
    */
-  virtual void OnClock(unsigned long sim_time) {}
+  bool WantsOnClock() const { return wants_on_clock_; }
 
   /**
    * Function to be called after executing the simulation
    */
   virtual void PostExec() {}
+
+  /**
+   * Save the extension's state to a checkpoint
+   *
+   * Called by the simulation controller when writing a checkpoint. Anything
+   * written to os is passed to RestoreCheckpoint() when the checkpoint is
+   * restored. Extensions without state that changes over the simulation don't
+   * need to override this.
+   *
+   * @return Return code, true == success
+   */
+  virtual bool SaveCheckpoint(std::ostream &os) { return true; }
+
+  /**
+   * Restore the extension's state from a checkpoint
+   *
+   * Called after PreExec() and before the first OnClock() call when resuming
+   * from a checkpoint, before the model state is restored. is holds exactly
+   * the data that SaveCheckpoint() wrote. Return false to refuse a checkpoint
+   * that doesn't fit this simulation.
+   *
+   * @return Return code, true == success
+   */
+  virtual bool RestoreCheckpoint(std::istream &is) { return true; }
+
+  /**
+   * Handle a command from the control socket (see --control-socket)
+   *
+   * Called between clock cycles for each command that the simulation
+   * controller doesn't know itself, with the words of the command in words.
+   * An extension that handles the command sets reply to a line starting with
+   * "ok" or "error", which is sent back to the client.
+   *
+   * @return true if the extension handled the command
+   */
+  virtual bool HandleControlCommand(const std::vector<std::string> &words,
+                                    std::string &reply) {
+    return false;
+  }
+
+ private:
+  bool wants_on_clock_ = true;
 };
 
 #endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_EXTENSION_H_
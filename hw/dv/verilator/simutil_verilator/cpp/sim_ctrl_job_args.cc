@@ -0,0 +1,18 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_ctrl_job_args.h"
+
+std::vector<char *> MakeJobArgv(int server_argc, char **server_argv,
+                                std::vector<std::string> &job_args) {
+  std::vector<char *> argv;
+  for (auto it = job_args.begin(); it != job_args.end(); ++it) {
+    argv.push_back(&(*it)[0]);
+  }
+  for (int i = 1; i < server_argc; ++i) {
+    argv.push_back(server_argv[i]);
+  }
+  argv.push_back(nullptr);
+  return argv;
+}
@@ -0,0 +1,25 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_JOB_ARGS_H_
+#define OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_JOB_ARGS_H_
+
+#include <string>
+#include <vector>
+
+/**
+ * Build the command line that Verilator sees in a fork-server job.
+ *
+ * This is the job's arguments (including its program name) followed by the
+ * server's, without the server's program name. Verilator's plusarg lookups
+ * and $value$plusargs return the first match, so a job's plusargs take
+ * precedence over the server's.
+ *
+ * The returned array points into server_argv and job_args and ends with a
+ * null pointer.
+ */
+std::vector<char *> MakeJobArgv(int server_argc, char **server_argv,
+                                std::vector<std::string> &job_args);
+
+#endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_JOB_ARGS_H_
@@ -0,0 +1,56 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_ctrl_job_args.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+/**
+ * The value of the first +<prefix> argument, like $value$plusargs and
+ * Verilated::commandArgsPlusMatch() (which stop at the first match).
+ */
+std::string FirstPlusarg(const std::vector<char *> &argv,
+                         const std::string &prefix) {
+  for (char *arg : argv) {
+    if (arg && std::string(arg).compare(0, prefix.size() + 1,
+                                        "+" + prefix) == 0) {
+      return arg + prefix.size() + 1;
+    }
+  }
+  return "";
+}
+
+TEST(MakeJobArgvTest, PutsJobArgsFirst) {
+  std::string server_args[] = {"Vtop", "--fork-server=sock", "+BAR=1"};
+  char *server_argv[] = {&server_args[0][0], &server_args[1][0],
+                         &server_args[2][0]};
+  std::vector<std::string> job_args = {"Vtop", "+BAZ=2", "-c", "10"};
+
+  std::vector<char *> argv = MakeJobArgv(3, server_argv, job_args);
+  ASSERT_EQ(argv.size(), 7u);
+  EXPECT_EQ(argv.back(), nullptr);
+  argv.pop_back();
+
+  std::vector<std::string> strs(argv.begin(), argv.end());
+  EXPECT_EQ(strs, std::vector<std::string>({"Vtop", "+BAZ=2", "-c", "10",
+                                            "--fork-server=sock", "+BAR=1"}));
+}
+
+TEST(MakeJobArgvTest, JobPlusargsOverrideServer) {
+  std::string server_args[] = {"Vtop", "+FOO=server", "+BAR=server"};
+  char *server_argv[] = {&server_args[0][0], &server_args[1][0],
+                         &server_args[2][0]};
+  std::vector<std::string> job_args = {"Vtop", "+FOO=job"};
+
+  std::vector<char *> argv = MakeJobArgv(3, server_argv, job_args);
+  EXPECT_EQ(FirstPlusarg(argv, "FOO="), "job");
+  EXPECT_EQ(FirstPlusarg(argv, "BAR="), "server");
+}
+
+}  // namespace
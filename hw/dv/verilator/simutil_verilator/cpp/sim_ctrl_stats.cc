@@ -0,0 +1,152 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_ctrl_stats.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+// Get the resident set size of this process in KiB, or zero if we can't tell
+static unsigned long GetRssKiB() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return 0;
+  }
+  unsigned long size_pages, rss_pages;
+  int matched = fscanf(fp, "%lu %lu", &size_pages, &rss_pages);
+  fclose(fp);
+  if (matched != 2) {
+    return 0;
+  }
+  return rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Escape a string for use in JSON. Class names don't contain anything
+// interesting, but be safe.
+static std::string JsonString(const std::string &str) {
+  std::string ret = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if ((unsigned char)c < 0x20) {
+      ret += ' ';
+    } else {
+      ret += c;
+    }
+  }
+  return ret + "\"";
+}
+
+SimCtrlStats::SimCtrlStats(const std::string &path,
+                           const std::vector<std::string> &ext_names,
+                           unsigned long start_cycle)
+    : fp_(nullptr),
+      close_fp_(false),
+      ext_names_(ext_names),
+      start_time_(std::chrono::steady_clock::now()),
+      last_time_(start_time_),
+      start_cycle_(start_cycle),
+      last_cycle_(start_cycle),
+      phase_ticks_(),
+      ext_ticks_(ext_names.size()) {
+  if (path == "-") {
+    fp_ = stdout;
+  } else if (!path.empty()) {
+    fp_ = fopen(path.c_str(), "w");
+    if (!fp_) {
+      std::ostringstream oss;
+      oss << "Cannot open statistics file `" << path
+          << "': " << strerror(errno);
+      throw std::runtime_error(oss.str());
+    }
+    close_fp_ = true;
+  }
+}
+
+SimCtrlStats::~SimCtrlStats() {
+  if (close_fp_) {
+    fclose(fp_);
+  }
+}
+
+bool SimCtrlStats::ReportDue(double interval_s) const {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - last_time_;
+  return elapsed.count() >= interval_s;
+}
+
+std::string SimCtrlStats::Report(unsigned long cycle, bool final) {
+  auto now = std::chrono::steady_clock::now();
+  double interval_s = std::chrono::duration<double>(now - last_time_).count();
+  double total_s = std::chrono::duration<double>(now - start_time_).count();
+
+  double khz = interval_s > 0 ? (cycle - last_cycle_) / interval_s / 1000 : 0;
+  double avg_khz = total_s > 0 ? (cycle - start_cycle_) / total_s / 1000 : 0;
+
+  uint64_t sampled_ticks = 0;
+  for (int i = 0; i < kNumPhases; ++i) {
+    sampled_ticks += phase_ticks_[i];
+  }
+  for (uint64_t ticks : ext_ticks_) {
+    sampled_ticks += ticks;
+  }
+  // Avoid dividing by zero if there haven't been any samples yet
+  double scale = sampled_ticks ? 1.0 / sampled_ticks : 0;
+
+  static const char *const phase_names[kNumPhases] = {"callbacks", "eval",
+                                                      "trace"};
+
+  std::ostringstream oss;
+  oss.precision(4);
+  oss << "{\"wall_s\": " << total_s << ", \"cycle\": " << cycle
+      << ", \"khz\": " << khz << ", \"avg_khz\": " << avg_khz
+      << ", \"rss_kib\": " << GetRssKiB() << ", \"profile\": {";
+  for (int i = 0; i < kNumPhases; ++i) {
+    oss << JsonString(phase_names[i]) << ": " << phase_ticks_[i] * scale
+        << ", ";
+  }
+  oss << "\"extensions\": {";
+  for (size_t i = 0; i < ext_names_.size(); ++i) {
+    oss << (i ? ", " : "") << JsonString(ext_names_[i]) << ": "
+        << ext_ticks_[i] * scale;
+  }
+  oss << "}}";
+  if (final) {
+    oss << ", \"final\": true";
+  }
+  oss << "}";
+
+  std::string line = oss.str();
+  if (fp_) {
+    fprintf(fp_, "%s\n", line.c_str());
+    fflush(fp_);
+  }
+
+  last_time_ = now;
+  last_cycle_ = cycle;
+  for (int i = 0; i < kNumPhases; ++i) {
+    phase_ticks_[i] = 0;
+  }
+  for (uint64_t &ticks : ext_ticks_) {
+    ticks = 0;
+  }
+  return line;
+}
+
+std::string SimCtrlStats::Demangle(const char *name) {
+  int status;
+  char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (status != 0 || !demangled) {
+    return name;
+  }
+  std::string ret(demangled);
+  free(demangled);
+  return ret;
+}
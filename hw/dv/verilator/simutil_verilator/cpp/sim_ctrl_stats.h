@@ -0,0 +1,108 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_STATS_H_
+#define OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_STATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Throughput and profiling statistics for a running simulation
+ *
+ * The simulation controller times the phases of the main loop (and the
+ * OnClock() method of each extension) on a sample of cycles, using the
+ * processor's timestamp counter where there is one. Report() writes a JSON
+ * object on a single line with the simulation speed since the last report,
+ * the memory use of the process and the share of the sampled time spent in
+ * each phase.
+ */
+class SimCtrlStats {
+ public:
+  // The phases of the main loop that are timed separately. Extensions'
+  // OnClock() methods are timed individually, with AddExtension().
+  enum Phase { kCallbacks, kEval, kTrace, kNumPhases };
+
+  /**
+   * Write reports to the file at path (or stdout if path is "-"). If path is
+   * empty, reports are only returned by Report().
+   *
+   * ext_names are the names of the registered extensions, in the order they
+   * were registered. start_cycle is the current cycle (which might not be
+   * zero if the simulation was restored from a checkpoint).
+   *
+   * Throws a std::runtime_error if the file can't be opened.
+   */
+  SimCtrlStats(const std::string &path,
+               const std::vector<std::string> &ext_names,
+               unsigned long start_cycle);
+  ~SimCtrlStats();
+
+  SimCtrlStats(const SimCtrlStats &) = delete;
+  SimCtrlStats &operator=(const SimCtrlStats &) = delete;
+
+  /**
+   * Read the timestamp counter. The unit is arbitrary: only ratios between
+   * timings are reported.
+   */
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  void AddPhase(Phase phase, uint64_t ticks) { phase_ticks_[phase] += ticks; }
+
+  void AddExtension(size_t idx, uint64_t ticks) { ext_ticks_[idx] += ticks; }
+
+  /**
+   * Has at least interval_s seconds passed since the last report?
+   */
+  bool ReportDue(double interval_s) const;
+
+  /**
+   * Write a report, then start a new interval. final marks the report at the
+   * end of the simulation.
+   *
+   * @return The report (without a trailing newline)
+   */
+  std::string Report(unsigned long cycle, bool final);
+
+  /**
+   * Get a readable name for an extension (its demangled class name)
+   */
+  template <typename T>
+  static std::string ExtensionName(const T &ext) {
+    return Demangle(typeid(ext).name());
+  }
+
+ private:
+  static std::string Demangle(const char *name);
+
+  FILE *fp_;
+  bool close_fp_;
+  std::vector<std::string> ext_names_;
+
+  std::chrono::steady_clock::time_point start_time_;
+  std::chrono::steady_clock::time_point last_time_;
+  unsigned long start_cycle_;
+  unsigned long last_cycle_;
+
+  uint64_t phase_ticks_[kNumPhases];
+  std::vector<uint64_t> ext_ticks_;
+};
+
+#endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_SIM_CTRL_STATS_H_
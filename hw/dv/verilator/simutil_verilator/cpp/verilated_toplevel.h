@@ -43,6 +43,11 @@
 #endif
 #endif
 
+// VM_SAVABLE must be set by the user when calling Verilator with --savable.
+#ifdef VM_SAVABLE
+#include "verilated_save.h"
+#endif
+
 #if VM_TRACE == 1
 /**
  * "Base" for all tracers in Verilator with common functionality
@@ -112,6 +117,9 @@ class TOPLEVEL_NAME;
  * To support the different tracing implementations (VCD, FST or no tracing),
  * the trace() function is modified to take a VerilatedTracer argument instead
  * of the tracer-specific class.
+ *
+ * If the model was built with --savable (and VM_SAVABLE is defined), save()
+ * and restore() serialize the complete state of the model.
  */
 class VerilatedToplevel {
  public:
@@ -122,6 +130,10 @@ class VerilatedToplevel {
   virtual void final() = 0;
   virtual const char *name() const = 0;
   virtual void trace(VerilatedTracer &tfp, int levels, int options) = 0;
+#ifdef VM_SAVABLE
+  virtual void save(VerilatedSerialize &os) = 0;
+  virtual void restore(VerilatedDeserialize &is) = 0;
+#endif
 
   /**
    * Get the Verilator-generated device under test
@@ -150,6 +162,14 @@ class TOPLEVEL_NAME : public VERILATED_TOPLEVEL_NAME, public VerilatedToplevel {
     assert(0 && "Tracing not enabled.");
 #endif
   }
+#ifdef VM_SAVABLE
+  void save(VerilatedSerialize &os) {
+    os << static_cast<VERILATED_TOPLEVEL_NAME &>(*this);
+  }
+  void restore(VerilatedDeserialize &is) {
+    is >> static_cast<VERILATED_TOPLEVEL_NAME &>(*this);
+  }
+#endif
 };
 
 #endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_VERILATED_TOPLEVEL_H_
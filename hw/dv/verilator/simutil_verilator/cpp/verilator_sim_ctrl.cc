@@ -4,23 +4,238 @@
 
 #include "verilator_sim_ctrl.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <sched.h>
 #include <signal.h>
+#include <sstream>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <verilated.h>
 
+#include "dpi_handle.h"
+#include "sim_ctrl_job_args.h"
+
 // This is defined by Verilator and passed through the command line
 #ifndef VM_TRACE
 #define VM_TRACE 0
 #endif
 
+#ifdef VM_SAVABLE
+#define CHECKPOINT_POSSIBLE true
+#else
+#define CHECKPOINT_POSSIBLE false
+#endif
+
+// Values of trace_request_
+static const int kTraceNoRequest = 0;
+static const int kTraceRequestOn = 1;
+static const int kTraceRequestOff = 2;
+
+#ifdef VM_SAVABLE
+// Every checkpoint file starts with this. Bump the last byte when changing the
+// format.
+static const char kCheckpointMagic[8] = {'V', 'S', 'I', 'M', 'C', 'K', 'P', 2};
+
+static void WriteU64(std::ostream &os, uint64_t val) {
+  os.write(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+static void WriteBlob(std::ostream &os, const std::string &blob) {
+  WriteU64(os, blob.size());
+  os.write(blob.data(), blob.size());
+}
+
+static bool ReadU64(std::istream &is, uint64_t *val) {
+  return bool(is.read(reinterpret_cast<char *>(val), sizeof *val));
+}
+
+static bool ReadBlob(std::istream &is, std::string *blob) {
+  uint64_t len;
+  if (!ReadU64(is, &len)) {
+    return false;
+  }
+  // Read in chunks, so that a corrupt length fails at the end of the file
+  // rather than with a huge allocation.
+  blob->clear();
+  char buf[65536];
+  while (len) {
+    size_t chunk = len < sizeof buf ? len : sizeof buf;
+    if (!is.read(buf, chunk)) {
+      return false;
+    }
+    blob->append(buf, chunk);
+    len -= chunk;
+  }
+  return true;
+}
+
+// Verilator's serialization classes only write to and read from files, so we
+// go through a temporary file to get the state of the model as a string.
+static std::string TempFileName() {
+  const char *tmp_dir = getenv("TMPDIR");
+  std::string tmpl = std::string(tmp_dir ? tmp_dir : "/tmp") + "/simctrl-XXXXXX";
+  std::vector<char> path(tmpl.begin(), tmpl.end());
+  path.push_back('\0');
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    return "";
+  }
+  close(fd);
+  return path.data();
+}
+
+// Describe the DPI handles that exist, one line per handle, in the order they
+// were created.
+static std::string DpiHandleTable() {
+  std::string table;
+  for (size_t i = 0; i < dpi_handle_count(); ++i) {
+    table += dpi_handle_name(i);
+    table += '\n';
+  }
+  return table;
+}
+
+static bool SaveModelState(VerilatedToplevel &top, std::string *state) {
+  std::string path = TempFileName();
+  if (path.empty()) {
+    return false;
+  }
+  {
+    VerilatedSave os;
+    os.open(path.c_str());
+    if (!os.isOpen()) {
+      unlink(path.c_str());
+      return false;
+    }
+    top.save(os);
+  }
+  std::ifstream is(path, std::ios::binary);
+  std::ostringstream contents;
+  contents << is.rdbuf();
+  unlink(path.c_str());
+  if (!is) {
+    return false;
+  }
+  *state = contents.str();
+  return true;
+}
+
+static bool RestoreModelState(VerilatedToplevel &top,
+                              const std::string &state) {
+  std::string path = TempFileName();
+  if (path.empty()) {
+    return false;
+  }
+  {
+    std::ofstream os(path, std::ios::binary);
+    if (!os.write(state.data(), state.size())) {
+      unlink(path.c_str());
+      return false;
+    }
+  }
+  VerilatedRestore is;
+  is.open(path.c_str());
+  if (!is.isOpen()) {
+    unlink(path.c_str());
+    return false;
+  }
+  top.restore(is);
+  is.close();
+  unlink(path.c_str());
+  return true;
+}
+#endif  // VM_SAVABLE
+
+#ifdef __linux__
+// Parse a list of CPUs like 0-3,6 into cpus. Returns false if the list is
+// malformed.
+static bool ParseCpuList(const char *list, std::vector<int> &cpus) {
+  std::vector<int> ret;
+  const char *pos = list;
+  while (true) {
+    char *end;
+    unsigned long first = strtoul(pos, &end, 10);
+    if (end == pos) {
+      return false;
+    }
+    unsigned long last = first;
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtoul(pos, &end, 10);
+      if (end == pos || last < first) {
+        return false;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (unsigned long cpu = first; cpu <= last; ++cpu) {
+      ret.push_back(cpu);
+    }
+    if (*end == '\0') {
+      break;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    pos = end + 1;
+  }
+  cpus = ret;
+  return true;
+}
+
+// Get the IDs of all threads in this process
+static std::vector<pid_t> GetThreadIds() {
+  std::vector<pid_t> tids;
+  DIR *dir = opendir("/proc/self/task");
+  if (!dir) {
+    return tids;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(atoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  std::sort(tids.begin(), tids.end());
+  return tids;
+}
+
+// Set the affinity of thread tid to cpus, printing a warning on failure
+static void SetThreadAffinity(pid_t tid, const std::vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto it = cpus.begin(); it != cpus.end(); ++it) {
+    CPU_SET(*it, &set);
+  }
+  if (sched_setaffinity(tid, sizeof set, &set) != 0) {
+    std::cerr << "WARNING: Failed to set the CPU affinity of thread " << tid
+              << ": " << strerror(errno) << std::endl;
+  }
+}
+#endif  // __linux__
+
 /**
  * Get the current simulation time
  *
  * Called by $time in Verilog, converts to double, to match what SystemC does
  */
-double sc_time_stamp() { return VerilatorSimCtrl::GetInstance().GetTime(); }
+double sc_time_stamp() VL_MT_SAFE {
+  return VerilatorSimCtrl::GetInstance().GetTime();
+}
 
 #ifdef VL_USER_STOP
 /**
@@ -29,7 +244,7 @@ double sc_time_stamp() { return VerilatorSimCtrl::GetInstance().GetTime(); }
  * This function overrides Verilator's default implementation to more gracefully
  * shut down the simulation.
  */
-void vl_stop(const char *filename, int linenum, const char *hier) VL_MT_UNSAFE {
+void vl_stop(const char *filename, int linenum, const char *hier) VL_MT_SAFE {
   VerilatorSimCtrl::GetInstance().RequestStop(false);
 }
 #endif
@@ -54,6 +269,34 @@ std::pair<int, bool> VerilatorSimCtrl::Exec(int argc, char **argv) {
     return std::make_pair(good_cmdline ? 0 : 1, false);
   }
 
+  if (!fork_server_socket_.empty() || !fork_server_jobs_.empty()) {
+    bool is_child = false;
+    bool success = RunForkServer(argv[0], is_child);
+    if (!is_child) {
+      return std::make_pair(success ? 0 : 1, false);
+    }
+
+    // This is a child process that should run a job. Parse its arguments on
+    // top of the ones given to the server.
+    std::vector<char *> job_argv;
+    for (auto it = job_args_.begin(); it != job_args_.end(); ++it) {
+      job_argv.push_back(&(*it)[0]);
+    }
+    job_argv.push_back(nullptr);
+    good_cmdline = ParseCommandArgs(job_argv.size() - 1, job_argv.data(),
+                                    exit_app);
+    if (exit_app) {
+      return std::make_pair(good_cmdline ? 0 : 1, false);
+    }
+
+    // ParseCommandArgs() gave Verilator only the job's arguments, which would
+    // hide plusargs given to the server. Give it both, job's first, so that
+    // a job can override them (plusarg lookups return the first match).
+    // Verilator keeps the pointer, so the array is a member.
+    verilated_argv_ = MakeJobArgv(argc, argv, job_args_);
+    Verilated::commandArgs(verilated_argv_.size() - 1, verilated_argv_.data());
+  }
+
   RunSimulation();
 
   int retcode = WasSimulationSuccessful() ? 0 : 1;
@@ -65,8 +308,22 @@ bool VerilatorSimCtrl::ParseCommandArgs(int argc, char **argv, bool &exit_app) {
       {"term-after-cycles", required_argument, nullptr, 'c'},
       {"trace", no_argument, nullptr, 't'},
       {"help", no_argument, nullptr, 'h'},
+      {"save-checkpoint-at", required_argument, nullptr, 'S'},
+      {"restore-checkpoint", required_argument, nullptr, 'R'},
+      {"fork-server", required_argument, nullptr, 'F'},
+      {"fork-server-jobs", required_argument, nullptr, 'J'},
+      {"trace-window", required_argument, nullptr, 'W'},
+      {"trace-flight-recorder", required_argument, nullptr, 'L'},
+      {"stats-interval", required_argument, nullptr, 'I'},
+      {"stats-file", required_argument, nullptr, 'O'},
+      {"cpu-affinity", required_argument, nullptr, 'A'},
+      {"control-socket", required_argument, nullptr, 'C'},
+      {"start-paused", no_argument, nullptr, 'P'},
       {nullptr, no_argument, nullptr, 0}};
 
+  // Reset the command parsing index in case the arguments have been parsed
+  // before (as they are for a job in fork-server mode)
+  optind = 1;
   while (1) {
     int c = getopt_long(argc, argv, ":c:th", long_options, nullptr);
     if (c == -1) {
@@ -91,6 +348,111 @@ bool VerilatorSimCtrl::ParseCommandArgs(int argc, char **argv, bool &exit_app) {
       case 'c':
         term_after_cycles_ = atoi(optarg);
         break;
+      case 'S':
+      case 'R': {
+        if (!checkpoint_possible_) {
+          std::cerr << "ERROR: Checkpoints have not been enabled at compile "
+                       "time. Build the simulation with Verilator's --savable "
+                       "option (e.g. the sim_savable target)."
+                    << std::endl;
+          exit_app = true;
+          return false;
+        }
+        if (c == 'R') {
+          checkpoint_restore_file_ = optarg;
+          break;
+        }
+        // The argument has the form CYCLE,FILE
+        char *comma;
+        checkpoint_save_cycle_ = strtoul(optarg, &comma, 10);
+        if (comma == optarg || *comma != ',' || comma[1] == '\0') {
+          std::cerr << "ERROR: Invalid argument to --save-checkpoint-at: `"
+                    << optarg << "'. Expected CYCLE,FILE." << std::endl;
+          exit_app = true;
+          return false;
+        }
+        checkpoint_save_file_ = comma + 1;
+        break;
+      }
+      case 'W':
+      case 'L': {
+        if (!tracing_possible_) {
+          std::cerr << "ERROR: Tracing has not been enabled at compile time."
+                    << std::endl;
+          exit_app = true;
+          return false;
+        }
+        char *end;
+        if (c == 'L') {
+          flight_recorder_cycles_ = strtoul(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || flight_recorder_cycles_ == 0) {
+            std::cerr << "ERROR: Invalid argument to --trace-flight-recorder: `"
+                      << optarg << "'. Expected a number of cycles."
+                      << std::endl;
+            exit_app = true;
+            return false;
+          }
+          break;
+        }
+        // The argument has the form START:END
+        unsigned long start = strtoul(optarg, &end, 10);
+        char *colon = end;
+        unsigned long stop = 0;
+        if (colon != optarg && *colon == ':') {
+          stop = strtoul(colon + 1, &end, 10);
+        }
+        if (colon == optarg || *colon != ':' || end == colon + 1 ||
+            *end != '\0' || stop <= start) {
+          std::cerr << "ERROR: Invalid argument to --trace-window: `" << optarg
+                    << "'. Expected START:END, with START < END." << std::endl;
+          exit_app = true;
+          return false;
+        }
+        trace_windows_.push_back(std::make_pair(start, stop));
+        break;
+      }
+      case 'I': {
+        char *end;
+        stats_interval_s_ = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(stats_interval_s_ > 0)) {
+          std::cerr << "ERROR: Invalid argument to --stats-interval: `"
+                    << optarg << "'. Expected a number of seconds."
+                    << std::endl;
+          exit_app = true;
+          return false;
+        }
+        break;
+      }
+      case 'O':
+        stats_file_ = optarg;
+        break;
+      case 'A':
+#ifdef __linux__
+        if (!ParseCpuList(optarg, cpu_affinity_)) {
+          std::cerr << "ERROR: Invalid argument to --cpu-affinity: `" << optarg
+                    << "'. Expected a list of CPUs, e.g. 0-3,6." << std::endl;
+          exit_app = true;
+          return false;
+        }
+#else
+        std::cerr << "ERROR: --cpu-affinity is only supported on Linux."
+                  << std::endl;
+        exit_app = true;
+        return false;
+#endif
+        break;
+      case 'C':
+        control_socket_path_ = optarg;
+        break;
+      case 'P':
+        start_paused_ = true;
+        break;
+      case 'F':
+        fork_server_socket_ = optarg;
+        break;
+      case 'J':
+        fork_server_jobs_ = optarg;
+        break;
       case 'h':
         PrintHelp();
         exit_app = true;
@@ -106,6 +468,20 @@ bool VerilatorSimCtrl::ParseCommandArgs(int argc, char **argv, bool &exit_app) {
     }
   }
 
+  if (flight_recorder_cycles_ && (!trace_windows_.empty() || tracing_enabled_)) {
+    std::cerr << "ERROR: --trace-flight-recorder can't be combined with "
+                 "--trace or --trace-window."
+              << std::endl;
+    exit_app = true;
+    return false;
+  }
+
+  if (start_paused_ && control_socket_path_.empty()) {
+    std::cerr << "ERROR: --start-paused needs --control-socket." << std::endl;
+    exit_app = true;
+    return false;
+  }
+
   // Pass args to verilator
   Verilated::commandArgs(argc, argv);
 
@@ -126,7 +502,12 @@ void VerilatorSimCtrl::RunSimulation() {
   RegisterSignalHandler();
 
   // Print helper message for tracing
-  if (TracingPossible()) {
+  if (flight_recorder_cycles_) {
+    std::cout << "The trace flight recorder can be triggered by sending "
+                 "SIGUSR1 to this process:"
+              << std::endl
+              << "$ kill -USR1 " << getpid() << std::endl;
+  } else if (TracingPossible()) {
     std::cout << "Tracing can be toggled by sending SIGUSR1 to this process:"
               << std::endl
               << "$ kill -USR1 " << getpid() << std::endl;
@@ -141,10 +522,36 @@ void VerilatorSimCtrl::RunSimulation() {
   for (auto it = extension_array_.begin(); it != extension_array_.end(); ++it) {
     (*it)->PostExec();
   }
+  // Tell the fork server how long the job ran for
+  if (fork_result_fd_ >= 0) {
+    uint64_t cycles = time_ / 2;
+    if (write(fork_result_fd_, &cycles, sizeof cycles) != sizeof cycles) {
+      std::cerr << "WARNING: Failed to report cycle count to fork server."
+                << std::endl;
+    }
+    close(fork_result_fd_);
+    fork_result_fd_ = -1;
+  }
   // Print simulation speed info
   PrintStatistics();
   // Print helper message for tracing
-  if (TracingEverEnabled()) {
+  if (flight_recorder_cycles_) {
+    if (flight_segments_.empty()) {
+      std::cout << std::endl
+                << "The trace flight recorder wasn't triggered, so no "
+                   "simulation traces were kept."
+                << std::endl;
+    } else {
+      std::cout << std::endl
+                << "The trace flight recorder was triggered. You can view "
+                   "the simulation traces by calling"
+                << std::endl;
+      for (auto it = flight_segments_.begin(); it != flight_segments_.end();
+           ++it) {
+        std::cout << "$ gtkwave " << *it << std::endl;
+      }
+    }
+  } else if (TracingEverEnabled()) {
     std::cout << std::endl
               << "You can view the simulation traces by calling" << std::endl
               << "$ gtkwave " << GetTraceFileName() << std::endl;
@@ -160,14 +567,121 @@ void VerilatorSimCtrl::SetResetDuration(unsigned int cycles) {
 }
 
 void VerilatorSimCtrl::RequestStop(bool simulation_success) {
+  // A failure sticks, even if another thread asks for a successful stop
+  if (!simulation_success) {
+    simulation_success_ = false;
+    TriggerFlightRecorder();
+  }
   request_stop_ = true;
-  simulation_success_ &= simulation_success;
 }
 
+void VerilatorSimCtrl::RequestTracing(bool enable) {
+  trace_request_ = enable ? kTraceRequestOn : kTraceRequestOff;
+}
+
+void VerilatorSimCtrl::TriggerFlightRecorder() { flight_triggered_ = true; }
+
 void VerilatorSimCtrl::RegisterExtension(SimCtrlExtension *ext) {
   extension_array_.push_back(ext);
 }
 
+SimCtrlCallbackId VerilatorSimCtrl::ScheduleEvery(unsigned long period,
+                                                  SimCtrlCallback cb,
+                                                  unsigned long first_cycle) {
+  assert(period > 0);
+  SimCtrlCallbackId id = next_callback_id_++;
+  timed_callbacks_[id] = {cb, period};
+  due_callbacks_.push(std::make_pair(first_cycle, id));
+  next_due_cycle_ = due_callbacks_.top().first;
+  return id;
+}
+
+SimCtrlCallbackId VerilatorSimCtrl::ScheduleAt(unsigned long cycle,
+                                               SimCtrlCallback cb) {
+  SimCtrlCallbackId id = next_callback_id_++;
+  timed_callbacks_[id] = {cb, 0};
+  due_callbacks_.push(std::make_pair(cycle, id));
+  next_due_cycle_ = due_callbacks_.top().first;
+  return id;
+}
+
+SimCtrlCallbackId VerilatorSimCtrl::ScheduleOnChange(const void *signal,
+                                                     size_t len_bytes,
+                                                     SimCtrlCallback cb) {
+  assert(signal);
+  SimCtrlCallbackId id = next_callback_id_++;
+  const uint8_t *bytes = static_cast<const uint8_t *>(signal);
+  signal_callbacks_.push_back(
+      {id, bytes, std::vector<uint8_t>(bytes, bytes + len_bytes), cb});
+  return id;
+}
+
+void VerilatorSimCtrl::Unschedule(SimCtrlCallbackId id) {
+  if (timed_callbacks_.erase(id)) {
+    return;
+  }
+  for (auto it = signal_callbacks_.begin(); it != signal_callbacks_.end();
+       ++it) {
+    if (it->id == id) {
+      // Don't erase the entry, because RunSignalCallbacks() might be iterating
+      // over the vector. An empty callback marks it as cancelled.
+      it->cb = nullptr;
+      return;
+    }
+  }
+}
+
+void VerilatorSimCtrl::RunTimedCallbacks(unsigned long cycle) {
+  while (!due_callbacks_.empty() && due_callbacks_.top().first <= cycle) {
+    SimCtrlCallbackId id = due_callbacks_.top().second;
+    due_callbacks_.pop();
+
+    auto it = timed_callbacks_.find(id);
+    if (it == timed_callbacks_.end()) {
+      // Cancelled
+      continue;
+    }
+
+    // Copy the callback, since it might unschedule itself
+    SimCtrlCallback cb = it->second.cb;
+    if (it->second.period) {
+      due_callbacks_.push(std::make_pair(cycle + it->second.period, id));
+    } else {
+      timed_callbacks_.erase(it);
+    }
+    cb(time_);
+  }
+
+  next_due_cycle_ =
+      due_callbacks_.empty() ? ULONG_MAX : due_callbacks_.top().first;
+}
+
+void VerilatorSimCtrl::RunSignalCallbacks() {
+  bool any_cancelled = false;
+  // Iterate by index: a callback might schedule more.
+  for (size_t i = 0; i < signal_callbacks_.size(); ++i) {
+    SignalCallback &sc = signal_callbacks_[i];
+    if (!sc.cb) {
+      any_cancelled = true;
+      continue;
+    }
+    size_t len = sc.last_value.size();
+    if (memcmp(sc.signal, sc.last_value.data(), len) == 0) {
+      continue;
+    }
+    memcpy(sc.last_value.data(), sc.signal, len);
+    SimCtrlCallback cb = sc.cb;
+    cb(time_);
+  }
+
+  if (any_cancelled) {
+    signal_callbacks_.erase(
+        std::remove_if(signal_callbacks_.begin(), signal_callbacks_.end(),
+                       [](const SignalCallback &sc) { return !sc.cb; }),
+        signal_callbacks_.end());
+  }
+}
+
 VerilatorSimCtrl::VerilatorSimCtrl()
     : top_(nullptr),
       time_(0),
@@ -179,8 +693,26 @@ VerilatorSimCtrl::VerilatorSimCtrl()
       reset_duration_cycles_(2),
       request_stop_(false),
       simulation_success_(true),
+      trace_request_(kTraceNoRequest),
       tracer_(VerilatedTracer()),
-      term_after_cycles_(0) {}
+      term_after_cycles_(0),
+      checkpoint_possible_(CHECKPOINT_POSSIBLE),
+      checkpoint_save_cycle_(0),
+      restored_time_(0),
+      model_initialized_(false),
+      fork_result_fd_(-1),
+      next_due_cycle_(ULONG_MAX),
+      next_callback_id_(0),
+      flight_recorder_cycles_(0),
+      flight_recorder_id_(0),
+      flight_triggered_(false),
+      stats_interval_s_(0),
+      start_paused_(false),
+      paused_(false),
+      next_control_cycle_(ULONG_MAX),
+      run_to_cycle_(ULONG_MAX) {
+  trace_file_name_ = std::string("sim") + GetTraceFileExtension();
+}
 
 void VerilatorSimCtrl::RegisterSignalHandler() {
   struct sigaction sigIntHandler;
@@ -201,10 +733,14 @@ void VerilatorSimCtrl::SignalHandler(int sig) {
       simctrl.RequestStop(true);
       break;
     case SIGUSR1:
-      if (simctrl.TracingEnabled()) {
-        simctrl.TraceOff();
+      if (simctrl.flight_recorder_cycles_) {
+        simctrl.TriggerFlightRecorder();
       } else {
-        simctrl.TraceOn();
+        // Toggle relative to a request that hasn't been applied yet, if any
+        int pending = simctrl.trace_request_;
+        bool enabled = pending == kTraceNoRequest ? simctrl.TracingEnabled()
+                                                  : pending == kTraceRequestOn;
+        simctrl.RequestTracing(!enabled);
       }
       break;
   }
@@ -216,9 +752,52 @@ void VerilatorSimCtrl::PrintHelp() const {
     std::cout << "-t|--trace\n"
                  "  Write a trace file from the start\n\n";
   }
+  if (tracing_possible_) {
+    std::cout << "--trace-window=START:END\n"
+                 "  Write a trace file from cycle START up to cycle END. Can "
+                 "be given\n"
+                 "  more than once\n\n"
+                 "--trace-flight-recorder=N\n"
+                 "  Keep traces of (at least) the last N cycles, writing them "
+                 "out only if\n"
+                 "  the simulation fails or gets SIGUSR1\n\n";
+  }
   std::cout << "-c|--term-after-cycles=N\n"
                "  Terminate simulation after N cycles\n\n"
-               "-h|--help\n"
+               "--stats-interval=SECONDS\n"
+               "  Report simulation speed, memory use and a profile of the "
+               "main loop as a\n"
+               "  line of JSON every SECONDS seconds\n\n"
+               "--stats-file=FILE\n"
+               "  Write the reports from --stats-interval to FILE instead of "
+               "stdout\n\n";
+  if (checkpoint_possible_) {
+    std::cout << "--save-checkpoint-at=CYCLE,FILE\n"
+                 "  Write a checkpoint of the simulation to FILE at the start "
+                 "of cycle CYCLE\n\n"
+                 "--restore-checkpoint=FILE\n"
+                 "  Resume the simulation from the checkpoint in FILE\n\n";
+  }
+  std::cout << "--cpu-affinity=LIST\n"
+               "  Run on the CPUs in LIST (e.g. 0-3,6), giving each thread of "
+               "the model a\n"
+               "  CPU of its own\n\n";
+  std::cout << "--control-socket=SOCKET\n"
+               "  Accept commands to pause, resume and inspect the simulation "
+               "on the Unix\n"
+               "  socket SOCKET\n\n"
+               "--start-paused\n"
+               "  Wait for a command on the control socket before running the "
+               "first cycle\n\n";
+  std::cout << "--fork-server=SOCKET\n"
+               "  Initialize the simulation, then run a job for each line of "
+               "arguments\n"
+               "  sent to the Unix socket SOCKET\n\n"
+               "--fork-server-jobs=FILE\n"
+               "  Initialize the simulation, then run a job for each line of "
+               "arguments\n"
+               "  in FILE (- for stdin)\n\n";
+  std::cout << "-h|--help\n"
                "  Show help\n\n"
                "All arguments are passed to the design and can be used "
                "in the design, e.g. by DPI modules.\n\n";
@@ -245,13 +824,15 @@ bool VerilatorSimCtrl::TraceOff() {
 }
 
 void VerilatorSimCtrl::PrintStatistics() const {
-  double speed_hz = time_ / 2 / (GetExecutionTimeMs() / 1000.0);
+  // Don't count any cycles that were restored from a checkpoint
+  unsigned long executed_cycles = (time_ - restored_time_) / 2;
+  double speed_hz = executed_cycles / (GetExecutionTimeMs() / 1000.0);
   double speed_khz = speed_hz / 1000.0;
 
   std::cout << std::endl
             << "Simulation statistics" << std::endl
             << "=====================" << std::endl
-            << "Executed cycles:  " << time_ / 2 << std::endl
+            << "Executed cycles:  " << executed_cycles << std::endl
             << "Wallclock time:   " << GetExecutionTimeMs() / 1000.0 << " s"
             << std::endl
             << "Simulation speed: " << speed_hz << " cycles/s "
@@ -264,15 +845,247 @@ void VerilatorSimCtrl::PrintStatistics() const {
 }
 
 const char *VerilatorSimCtrl::GetTraceFileName() const {
+  return trace_file_name_.c_str();
+}
+
+const char *VerilatorSimCtrl::GetTraceFileExtension() const {
 #ifdef VM_TRACE_FMT_FST
-  return "sim.fst";
+  return ".fst";
 #else
-  return "sim.vcd";
+  return ".vcd";
 #endif
 }
 
-void VerilatorSimCtrl::Run() {
-  assert(top_ && "Use SetTop() first.");
+void VerilatorSimCtrl::SetupTraceSchedule() {
+  for (auto it = trace_windows_.begin(); it != trace_windows_.end(); ++it) {
+    ScheduleAt(it->first, [this](unsigned long) { TraceOn(); });
+    ScheduleAt(it->second, [this](unsigned long) { TraceOff(); });
+  }
+
+  if (flight_recorder_cycles_) {
+    NextFlightSegment();
+    TraceOn();
+    flight_recorder_id_ =
+        ScheduleEvery(flight_recorder_cycles_,
+                      [this](unsigned long) { NextFlightSegment(); },
+                      time_ / 2 + flight_recorder_cycles_);
+  }
+}
+
+void VerilatorSimCtrl::NextFlightSegment() {
+  if (tracer_.isOpen()) {
+    tracer_.close();
+  }
+
+  // Once triggered, the flight recorder finishes the segment it is writing
+  // and then stops.
+  if (flight_triggered_) {
+    TraceOff();
+    Unschedule(flight_recorder_id_);
+    std::cout << "Trace flight recorder triggered at cycle " << time_ / 2
+              << "." << std::endl;
+    return;
+  }
+
+  // Keep the previous segment (so that there are always at least
+  // flight_recorder_cycles_ cycles available) and delete any older ones.
+  while (flight_segments_.size() > 1) {
+    unlink(flight_segments_.front().c_str());
+    flight_segments_.pop_front();
+  }
+
+  // Trace() opens the file when it next dumps
+  std::ostringstream oss;
+  oss << "sim-" << time_ / 2 << GetTraceFileExtension();
+  trace_file_name_ = oss.str();
+  flight_segments_.push_back(trace_file_name_);
+}
+
+bool VerilatorSimCtrl::SetupStats() {
+  std::vector<std::string> ext_names;
+  for (auto it = extension_array_.begin(); it != extension_array_.end(); ++it) {
+    ext_names.push_back(SimCtrlStats::ExtensionName(**it));
+  }
+
+  // Without --stats-interval, reports are only made on request from the
+  // control socket and aren't written anywhere.
+  std::string path;
+  if (stats_interval_s_ > 0) {
+    path = stats_file_.empty() ? "-" : stats_file_;
+  }
+
+  try {
+    stats_.reset(new SimCtrlStats(path, ext_names, time_ / 2));
+  } catch (const std::runtime_error &err) {
+    std::cerr << "ERROR: " << err.what() << std::endl;
+    return false;
+  }
+
+  if (stats_interval_s_ <= 0) {
+    return true;
+  }
+
+  // Looking at the wall clock is relatively expensive, so only do it every
+  // kStatsCheckCycles cycles. Do it one cycle after a multiple of
+  // kStatsCheckCycles (which is also a multiple of kProfileSampleCycles), so
+  // that the checks and reports don't land in the profile.
+  unsigned long first_check =
+      (time_ / 2 / kStatsCheckCycles + 1) * kStatsCheckCycles + 1;
+  ScheduleEvery(kStatsCheckCycles,
+                [this](unsigned long) {
+                  if (stats_->ReportDue(stats_interval_s_)) {
+                    stats_->Report(time_ / 2, false);
+                  }
+                },
+                first_check);
+  return true;
+}
+
+bool VerilatorSimCtrl::SetupControl() {
+  try {
+    control_.reset(new SimCtrlControlSocket(control_socket_path_));
+  } catch (const std::runtime_error &err) {
+    std::cerr << "ERROR: " << err.what() << std::endl;
+    return false;
+  }
+
+  std::cout << "Control socket listening on " << control_socket_path_ << "."
+            << std::endl;
+  if (start_paused_) {
+    std::cout << "Waiting for a command on the control socket." << std::endl;
+  }
+
+  paused_ = start_paused_;
+  next_control_cycle_ = time_ / 2;
+  return true;
+}
+
+void VerilatorSimCtrl::PollControl() {
+  unsigned long cycle = time_ / 2;
+  if (cycle >= run_to_cycle_) {
+    run_to_cycle_ = ULONG_MAX;
+    paused_ = true;
+    control_->Reply("ok cycle=" + std::to_string(cycle));
+  }
+
+  std::vector<std::string> words;
+  while (!request_stop_) {
+    if (control_->NextCommand(words, paused_)) {
+      std::string reply = RunControlCommand(words);
+      if (!reply.empty()) {
+        control_->Reply(reply);
+      }
+    } else if (!paused_) {
+      break;
+    }
+  }
+
+  next_control_cycle_ = std::min(cycle + kControlPollCycles, run_to_cycle_);
+}
+
+std::string VerilatorSimCtrl::RunControlCommand(
+    const std::vector<std::string> &words) {
+  const std::string &cmd = words[0];
+  unsigned long cycle = time_ / 2;
+  std::ostringstream reply;
+  reply << "ok";
+
+  if (cmd == "status") {
+    reply << " cycle=" << cycle << " paused=" << paused_
+          << " tracing=" << TracingEnabled();
+  } else if (cmd == "pause") {
+    paused_ = true;
+    reply << " cycle=" << cycle;
+  } else if (cmd == "resume") {
+    paused_ = false;
+  } else if (cmd == "run-to") {
+    // The reply is sent by PollControl() once the cycle is reached
+    char *end = nullptr;
+    unsigned long target =
+        words.size() == 2 ? strtoul(words[1].c_str(), &end, 10) : 0;
+    if (!end || end == words[1].c_str() || *end != '\0' || target <= cycle) {
+      return "error usage: run-to CYCLE, with CYCLE after the current cycle (" +
+             std::to_string(cycle) + ")";
+    }
+    if (run_to_cycle_ != ULONG_MAX) {
+      return "error run-to is already waiting for cycle " +
+             std::to_string(run_to_cycle_);
+    }
+    run_to_cycle_ = target;
+    paused_ = false;
+    return "";
+  } else if (cmd == "trace") {
+    bool on = words.size() >= 2 && words[1] == "on";
+    bool off = words.size() == 2 && words[1] == "off";
+    if (!(on && words.size() <= 3) && !off) {
+      return "error usage: trace on [FILE] | trace off";
+    }
+    if (!tracing_possible_) {
+      return "error tracing has not been enabled at compile time";
+    }
+    if (flight_recorder_cycles_) {
+      return "error tracing is controlled by the flight recorder";
+    }
+    if (off) {
+      TraceOff();
+    } else {
+      if (words.size() == 3 && words[2] != trace_file_name_) {
+        // Trace() opens the new file when it next dumps
+        if (tracer_.isOpen()) {
+          tracer_.close();
+        }
+        trace_file_name_ = words[2];
+      }
+      TraceOn();
+    }
+  } else if (cmd == "stats") {
+    reply << " " << stats_->Report(cycle, false);
+  } else if (cmd == "checkpoint") {
+    if (words.size() != 2) {
+      return "error usage: checkpoint FILE";
+    }
+    if (!checkpoint_possible_) {
+      return "error checkpoints have not been enabled at compile time";
+    }
+    if (!SaveCheckpoint(words[1])) {
+      return "error failed to write checkpoint to " + words[1];
+    }
+    std::cout << "Wrote checkpoint to " << words[1] << " at cycle " << cycle
+              << "." << std::endl;
+    reply << " cycle=" << cycle;
+  } else if (cmd == "stop") {
+    bool fail = words.size() == 2 && words[1] == "fail";
+    if (words.size() > 2 || (words.size() == 2 && !fail && words[1] != "pass")) {
+      return "error usage: stop [pass|fail]";
+    }
+    RequestStop(!fail);
+  } else {
+    for (auto it = extension_array_.begin(); it != extension_array_.end();
+         ++it) {
+      std::string ext_reply;
+      if ((*it)->HandleControlCommand(words, ext_reply)) {
+        return ext_reply;
+      }
+    }
+    return "error unknown command `" + cmd + "'";
+  }
+  return reply.str();
+}
+
+void VerilatorSimCtrl::FinishFlightRecorder() {
+  if (!flight_triggered_) {
+    for (auto it = flight_segments_.begin(); it != flight_segments_.end();
+         ++it) {
+      unlink(it->c_str());
+    }
+    flight_segments_.clear();
+  }
+}
+
+void VerilatorSimCtrl::InitModel() {
+  if (model_initialized_) {
+    return;
+  }
 
   // We always need to enable this as tracing can be enabled at runtime
   if (tracing_possible_) {
@@ -280,22 +1093,141 @@ void VerilatorSimCtrl::Run() {
     top_->trace(tracer_, 99, 0);
   }
 
+  if (!cpu_affinity_.empty()) {
+    SetCpuAffinity(false);
+  }
+
   // Evaluate all initial blocks, including the DPI setup routines
   top_->eval();
+  model_initialized_ = true;
+
+  if (!cpu_affinity_.empty()) {
+    SetCpuAffinity(true);
+  }
+}
+
+void VerilatorSimCtrl::SetCpuAffinity(bool init_done) {
+#ifdef __linux__
+  pid_t self = syscall(SYS_gettid);
+  if (init_done) {
+    SetThreadAffinity(self, std::vector<int>(1, cpu_affinity_[0]));
+    return;
+  }
+
+  // The first CPU is for this thread, which evaluates the model. Each of the
+  // other threads gets the next CPU in the list, round-robin if there aren't
+  // enough.
+  std::vector<pid_t> tids = GetThreadIds();
+  size_t next_cpu = 1;
+  for (auto it = tids.begin(); it != tids.end(); ++it) {
+    if (*it == self) {
+      continue;
+    }
+    if (next_cpu == cpu_affinity_.size()) {
+      next_cpu = cpu_affinity_.size() > 1 ? 1 : 0;
+    }
+    SetThreadAffinity(*it, std::vector<int>(1, cpu_affinity_[next_cpu++]));
+  }
+
+  size_t needed = tids.size();
+  if (needed > cpu_affinity_.size()) {
+    std::cout << "WARNING: The simulation has " << needed
+              << " threads, but only " << cpu_affinity_.size()
+              << " CPUs were given with --cpu-affinity." << std::endl;
+  }
+
+  // Any threads that DPI models start while the model is initialized inherit
+  // the affinity of this thread. Give them the CPUs that are left over (or all
+  // of them, if none are).
+  std::vector<int> spare(cpu_affinity_.begin() +
+                             std::min(needed, cpu_affinity_.size()),
+                         cpu_affinity_.end());
+  SetThreadAffinity(self, spare.empty() ? cpu_affinity_ : spare);
+#endif
+}
+
+void VerilatorSimCtrl::Run() {
+  assert(top_ && "Use SetTop() first.");
+
+  InitModel();
 
   std::cout << std::endl
             << "Simulation running, end by pressing CTRL-c." << std::endl;
 
   time_begin_ = std::chrono::steady_clock::now();
   UnsetReset();
+
+  // Restoring a checkpoint overwrites the reset signal and the time, so must
+  // come after the initial values are set up. It also needs the DPI models to
+  // have been created by the model's initial blocks.
+  if (!checkpoint_restore_file_.empty()) {
+    if (RestoreCheckpoint(checkpoint_restore_file_)) {
+      std::cout << "Restored checkpoint from " << checkpoint_restore_file_
+                << " at cycle " << time_ / 2 << "." << std::endl;
+      // The simulation never goes back to an earlier cycle, so a checkpoint
+      // requested for one would silently never be written.
+      if (!checkpoint_save_file_.empty() &&
+          checkpoint_save_cycle_ < time_ / 2) {
+        std::cerr << "ERROR: Cannot save a checkpoint at cycle "
+                  << checkpoint_save_cycle_ << ": the simulation starts at "
+                  << "cycle " << time_ / 2 << ", where the checkpoint in `"
+                  << checkpoint_restore_file_ << "' was taken." << std::endl;
+        RequestStop(false);
+      }
+    } else {
+      RequestStop(false);
+    }
+  }
+
+  SetupTraceSchedule();
+  if ((stats_interval_s_ > 0 || !control_socket_path_.empty()) &&
+      !SetupStats()) {
+    RequestStop(false);
+  }
+  if (!request_stop_ && !control_socket_path_.empty() && !SetupControl()) {
+    RequestStop(false);
+  }
   Trace();
 
+  // Indices in extension_array_ of the extensions that need OnClock() calls
+  std::vector<size_t> clock_extensions;
+  for (size_t i = 0; i < extension_array_.size(); ++i) {
+    if (extension_array_[i]->WantsOnClock()) {
+      clock_extensions.push_back(i);
+    }
+  }
+
   unsigned long start_reset_cycle_ = initial_reset_delay_cycles_;
   unsigned long end_reset_cycle_ = start_reset_cycle_ + reset_duration_cycles_;
 
-  while (1) {
+  while (!request_stop_) {
     unsigned long cycle_ = time_ / 2;
 
+    // Time the phases of the loop on a sample of cycles
+    bool profile = stats_ && (cycle_ % kProfileSampleCycles == 0);
+
+    // The control socket is polled here, rather than from a scheduled
+    // callback, so that the simulation pauses between cycles rather than at
+    // the rising clock edge.
+    if (cycle_ >= next_control_cycle_ && (time_ % 2 == 0)) {
+      PollControl();
+      if (request_stop_) {
+        std::cout << "Received stop request, shutting down simulation."
+                  << std::endl;
+        break;
+      }
+    }
+
+    if (!checkpoint_save_file_.empty() && (time_ % 2 == 0) &&
+        cycle_ == checkpoint_save_cycle_) {
+      if (!SaveCheckpoint(checkpoint_save_file_)) {
+        RequestStop(false);
+        break;
+      }
+      std::cout << "Wrote checkpoint to " << checkpoint_save_file_
+                << " at cycle " << cycle_ << "." << std::endl;
+    }
+
     if (cycle_ == start_reset_cycle_) {
       SetReset();
     } else if (cycle_ == end_reset_cycle_) {
@@ -304,18 +1236,50 @@ void VerilatorSimCtrl::Run() {
 
     *sig_clk_ = !*sig_clk_;
 
-    // Call all extension on-clock methods
     if (*sig_clk_) {
-      for (auto it = extension_array_.begin(); it != extension_array_.end();
-           ++it) {
-        (*it)->OnClock(time_);
+      // Call the on-clock methods of extensions that need them. An extension
+      // that doesn't override OnClock() drops out after the first call.
+      if (!clock_extensions.empty()) {
+        for (auto it = clock_extensions.begin(); it != clock_extensions.end();
+             ++it) {
+          uint64_t ext_start = profile ? SimCtrlStats::Now() : 0;
+          extension_array_[*it]->OnClock(time_);
+          if (profile) {
+            stats_->AddExtension(*it, SimCtrlStats::Now() - ext_start);
+          }
+        }
+        clock_extensions.erase(
+            std::remove_if(clock_extensions.begin(), clock_extensions.end(),
+                           [this](size_t idx) {
+                             return !extension_array_[idx]->WantsOnClock();
+                           }),
+            clock_extensions.end());
+      }
+
+      uint64_t cb_start = profile ? SimCtrlStats::Now() : 0;
+      if (cycle_ >= next_due_cycle_) {
+        RunTimedCallbacks(cycle_);
+      }
+      if (!signal_callbacks_.empty()) {
+        RunSignalCallbacks();
+      }
+      if (profile) {
+        stats_->AddPhase(SimCtrlStats::kCallbacks,
+                         SimCtrlStats::Now() - cb_start);
       }
     }
 
+    uint64_t eval_start = profile ? SimCtrlStats::Now() : 0;
     top_->eval();
     time_++;
 
+    uint64_t trace_start = profile ? SimCtrlStats::Now() : 0;
     Trace();
+    if (profile) {
+      uint64_t trace_end = SimCtrlStats::Now();
+      stats_->AddPhase(SimCtrlStats::kEval, trace_start - eval_start);
+      stats_->AddPhase(SimCtrlStats::kTrace, trace_end - trace_start);
+    }
 
     if (request_stop_) {
       std::cout << "Received stop request, shutting down simulation."
@@ -340,6 +1304,19 @@ void VerilatorSimCtrl::Run() {
   if (TracingEverEnabled()) {
     tracer_.close();
   }
+  if (flight_recorder_cycles_) {
+    FinishFlightRecorder();
+  }
+  if (stats_) {
+    stats_->Report(time_ / 2, true);
+  }
+  if (control_) {
+    if (run_to_cycle_ != ULONG_MAX) {
+      control_->Reply("error simulation stopped at cycle " +
+                      std::to_string(time_ / 2));
+    }
+    control_.reset();
+  }
 }
 
 std::string VerilatorSimCtrl::GetName() const {
@@ -383,9 +1360,20 @@ bool VerilatorSimCtrl::FileSize(std::string filepath, int &size_byte) const {
 }
 
 void VerilatorSimCtrl::Trace() {
-  // We cannot output a message when calling TraceOn()/TraceOff() as these
-  // functions can be called from a signal handler. Instead we print the message
-  // here from the main loop.
+  // Apply any change requested from another thread or a signal handler. Only
+  // the (cheap) load happens on every call.
+  if (trace_request_.load(std::memory_order_relaxed) != kTraceNoRequest) {
+    int request = trace_request_.exchange(kTraceNoRequest);
+    if (request == kTraceRequestOn) {
+      TraceOn();
+    } else if (request == kTraceRequestOff) {
+      TraceOff();
+    }
+  }
+
+  // We print the message about a change here from the main loop, rather than
+  // from TraceOn()/TraceOff(), so that the message appears once, in order with
+  // the rest of the output.
   if (tracing_enabled_changed_) {
     if (TracingEnabled()) {
       std::cout << "Tracing enabled." << std::endl;
@@ -401,9 +1389,378 @@ void VerilatorSimCtrl::Trace() {
 
   if (!tracer_.isOpen()) {
     tracer_.open(GetTraceFileName());
-    std::cout << "Writing simulation traces to " << GetTraceFileName()
-              << std::endl;
+    // The flight recorder opens a new file for each segment, so don't report
+    // each one.
+    if (!flight_recorder_cycles_) {
+      std::cout << "Writing simulation traces to " << GetTraceFileName()
+                << std::endl;
+    }
   }
 
   tracer_.dump(GetTime());
 }
+
+bool VerilatorSimCtrl::SaveCheckpoint(const std::string &filename) {
+#ifdef VM_SAVABLE
+  std::vector<std::string> ext_states;
+  for (auto it = extension_array_.begin(); it != extension_array_.end(); ++it) {
+    std::ostringstream ext_os;
+    if (!(*it)->SaveCheckpoint(ext_os)) {
+      std::cerr << "ERROR: Failed to save extension state to checkpoint."
+                << std::endl;
+      return false;
+    }
+    ext_states.push_back(ext_os.str());
+  }
+
+  std::string model_state;
+  if (!SaveModelState(*top_, &model_state)) {
+    std::cerr << "ERROR: Failed to save the state of the model." << std::endl;
+    return false;
+  }
+
+  std::ofstream os(filename, std::ios::binary);
+  os.write(kCheckpointMagic, sizeof kCheckpointMagic);
+  WriteBlob(os, GetName());
+  WriteU64(os, time_);
+  WriteU64(os, ext_states.size());
+  for (auto it = ext_states.begin(); it != ext_states.end(); ++it) {
+    WriteBlob(os, *it);
+  }
+  WriteBlob(os, DpiHandleTable());
+  WriteBlob(os, model_state);
+  os.close();
+  if (!os) {
+    std::cerr << "ERROR: Failed to write checkpoint file `" << filename << "'."
+              << std::endl;
+    return false;
+  }
+  return true;
+#else
+  assert(0 && "Checkpoints not enabled.");
+  return false;
+#endif
+}
+
+bool VerilatorSimCtrl::RestoreCheckpoint(const std::string &filename) {
+#ifdef VM_SAVABLE
+  std::ifstream is(filename, std::ios::binary);
+  if (!is) {
+    std::cerr << "ERROR: Cannot open checkpoint file `" << filename
+              << "' for reading." << std::endl;
+    return false;
+  }
+
+  char magic[sizeof kCheckpointMagic];
+  std::string name;
+  uint64_t time, num_exts;
+  if (!is.read(magic, sizeof magic) ||
+      memcmp(magic, kCheckpointMagic, sizeof magic) != 0 ||
+      !ReadBlob(is, &name) || !ReadU64(is, &time) || !ReadU64(is, &num_exts)) {
+    std::cerr << "ERROR: `" << filename << "' is not a checkpoint file."
+              << std::endl;
+    return false;
+  }
+  if (name != GetName()) {
+    std::cerr << "ERROR: Checkpoint file `" << filename
+              << "' was written by a simulation of " << name << ", not "
+              << GetName() << "." << std::endl;
+    return false;
+  }
+  if (num_exts != extension_array_.size()) {
+    std::cerr << "ERROR: Checkpoint file `" << filename << "' has state for "
+              << num_exts << " extensions, but " << extension_array_.size()
+              << " are registered." << std::endl;
+    return false;
+  }
+
+  std::vector<std::string> ext_states(num_exts);
+  std::string handle_table, model_state;
+  bool ok = true;
+  for (auto it = ext_states.begin(); it != ext_states.end(); ++it) {
+    ok = ok && ReadBlob(is, &*it);
+  }
+  ok = ok && ReadBlob(is, &handle_table) && ReadBlob(is, &model_state);
+  if (!ok) {
+    std::cerr << "ERROR: Checkpoint file `" << filename << "' is truncated."
+              << std::endl;
+    return false;
+  }
+
+  // The chandles in the model state are DPI handles (see dpi_handle.h), which
+  // mean the same thing in this process as in the one that saved the
+  // checkpoint if the same DPI models were created in the same order.
+  if (handle_table != DpiHandleTable()) {
+    std::cerr << "ERROR: Checkpoint file `" << filename
+              << "' was written by a simulation with different DPI models."
+              << std::endl;
+    return false;
+  }
+
+  // Extensions check that the checkpoint fits this simulation (for example,
+  // that the same memory images were loaded), so restore them before touching
+  // the model.
+  for (size_t i = 0; i < extension_array_.size(); ++i) {
+    std::istringstream ext_is(ext_states[i]);
+    if (!extension_array_[i]->RestoreCheckpoint(ext_is)) {
+      std::cerr << "ERROR: Failed to restore extension state from checkpoint."
+                << std::endl;
+      return false;
+    }
+  }
+
+  // Verilator checks that the model state matches the design (and stops the
+  // simulation with a fatal error if not).
+  if (!RestoreModelState(*top_, model_state)) {
+    std::cerr << "ERROR: Failed to restore the state of the model."
+              << std::endl;
+    return false;
+  }
+  time_ = time;
+  restored_time_ = time;
+  return true;
+#else
+  assert(0 && "Checkpoints not enabled.");
+  return false;
+#endif
+}
+
+bool VerilatorSimCtrl::RunForkServer(const char *prog_name, bool &is_child) {
+  assert(top_ && "Use SetTop() first.");
+
+#ifdef VL_THREADED
+  // fork() only copies the calling thread, so a child can't use the worker
+  // threads of a multi-threaded model and would hang in its first eval().
+  if (Verilated::threads() > 1) {
+    std::cerr << "ERROR: The fork server needs a model built with --threads 1, "
+                 "but this one uses "
+              << Verilated::threads() << " threads." << std::endl;
+    return false;
+  }
+#endif
+
+  RegisterSignalHandler();
+  InitModel();
+
+  if (!fork_server_jobs_.empty()) {
+    return ServeJobFile(prog_name, is_child);
+  }
+  return ServeSocket(prog_name, is_child);
+}
+
+bool VerilatorSimCtrl::RunJob(const std::string &line, const char *prog_name,
+                              const std::vector<int> &close_fds,
+                              bool &is_child, std::string &result) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    result = std::string("error=") + strerror(errno);
+    return false;
+  }
+
+  // Flush output, so that the child doesn't write out our buffered data again
+  std::cout.flush();
+  std::cerr.flush();
+  fflush(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    result = std::string("error=") + strerror(errno);
+    return false;
+  }
+
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    for (auto it = close_fds.begin(); it != close_fds.end(); ++it) {
+      close(*it);
+    }
+    fork_result_fd_ = pipe_fds[1];
+
+    job_args_.clear();
+    job_args_.push_back(prog_name);
+    std::istringstream iss(line);
+    std::string arg;
+    while (iss >> arg) {
+      job_args_.push_back(arg);
+    }
+    is_child = true;
+    return true;
+  }
+
+  close(pipe_fds[1]);
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      close(pipe_fds[0]);
+      result = std::string("error=") + strerror(errno);
+      return false;
+    }
+  }
+
+  uint64_t cycles;
+  bool have_cycles = read(pipe_fds[0], &cycles, sizeof cycles) == sizeof cycles;
+  close(pipe_fds[0]);
+
+  std::ostringstream oss;
+  if (WIFEXITED(status)) {
+    oss << "exit=" << WEXITSTATUS(status);
+  } else {
+    oss << "signal=" << WTERMSIG(status);
+  }
+  oss << " cycles=";
+  if (have_cycles) {
+    oss << cycles;
+  } else {
+    oss << "?";
+  }
+  result = oss.str();
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Strip leading and trailing whitespace from line. Returns false if there's
+// nothing left, or if the line is a comment.
+static bool TrimJobLine(std::string &line) {
+  size_t first = line.find_first_not_of(" \t\r\n");
+  if (first == std::string::npos || line[first] == '#') {
+    return false;
+  }
+  size_t last = line.find_last_not_of(" \t\r\n");
+  line = line.substr(first, last - first + 1);
+  return true;
+}
+
+bool VerilatorSimCtrl::ServeJobFile(const char *prog_name, bool &is_child) {
+  // Read all the jobs before forking anything. A child's stdio streams are
+  // copies of ours and exiting the child can move the shared file offset of
+  // a stream that has buffered input, which would confuse our reads.
+  std::vector<std::string> jobs;
+  {
+    std::ifstream file;
+    std::istream *is = &std::cin;
+    if (fork_server_jobs_ != "-") {
+      file.open(fork_server_jobs_);
+      if (!file) {
+        std::cerr << "ERROR: Cannot open job file `" << fork_server_jobs_
+                  << "'." << std::endl;
+        return false;
+      }
+      is = &file;
+    }
+    std::string line;
+    while (std::getline(*is, line)) {
+      if (TrimJobLine(line)) {
+        jobs.push_back(line);
+      }
+    }
+  }
+
+  std::cout << "Fork server running " << jobs.size() << " jobs from "
+            << fork_server_jobs_ << "." << std::endl;
+
+  bool success = true;
+  unsigned int num_passed = 0;
+  for (size_t i = 0; i < jobs.size() && !request_stop_; ++i) {
+    std::string result;
+    bool passed = RunJob(jobs[i], prog_name, {}, is_child, result);
+    if (is_child) {
+      return true;
+    }
+    std::cout << "Job " << i << ": " << result << " (" << jobs[i] << ")"
+              << std::endl;
+    success &= passed;
+    num_passed += passed;
+  }
+
+  std::cout << "Fork server finished: " << num_passed << " of " << jobs.size()
+            << " jobs passed." << std::endl;
+  return success && !request_stop_;
+}
+
+bool VerilatorSimCtrl::ServeSocket(const char *prog_name, bool &is_child) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (fork_server_socket_.size() >= sizeof addr.sun_path) {
+    std::cerr << "ERROR: Socket path `" << fork_server_socket_
+              << "' is too long." << std::endl;
+    return false;
+  }
+  strncpy(addr.sun_path, fork_server_socket_.c_str(),
+          sizeof addr.sun_path - 1);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    std::cerr << "ERROR: Cannot create socket: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  unlink(fork_server_socket_.c_str());
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+      listen(listen_fd, 1) != 0) {
+    std::cerr << "ERROR: Cannot listen on socket `" << fork_server_socket_
+              << "': " << strerror(errno) << std::endl;
+    close(listen_fd);
+    return false;
+  }
+
+  std::cout << "Fork server listening on " << fork_server_socket_
+            << ". Stop it by pressing CTRL-c." << std::endl;
+
+  // Serve one client at a time. A client sends a line of arguments for each
+  // job and gets a line back with the result once the job has finished.
+  while (!request_stop_) {
+    int conn_fd = accept(listen_fd, nullptr, nullptr);
+    if (conn_fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "ERROR: Cannot accept connection: " << strerror(errno)
+                << std::endl;
+      break;
+    }
+
+    std::string buf;
+    char chunk[4096];
+    bool conn_open = true;
+    while (conn_open && !request_stop_) {
+      ssize_t len = read(conn_fd, chunk, sizeof chunk);
+      if (len < 0 && errno == EINTR) {
+        continue;
+      }
+      if (len <= 0) {
+        break;
+      }
+      buf.append(chunk, len);
+
+      size_t eol;
+      while ((eol = buf.find('\n')) != std::string::npos) {
+        std::string line = buf.substr(0, eol);
+        buf.erase(0, eol + 1);
+        if (!TrimJobLine(line)) {
+          continue;
+        }
+
+        std::string result;
+        RunJob(line, prog_name, {listen_fd, conn_fd}, is_child, result);
+        if (is_child) {
+          return true;
+        }
+
+        result += "\n";
+        if (send(conn_fd, result.data(), result.size(), MSG_NOSIGNAL) !=
+            (ssize_t)result.size()) {
+          conn_open = false;
+          break;
+        }
+      }
+    }
+    close(conn_fd);
+  }
+
+  close(listen_fd);
+  unlink(fork_server_socket_.c_str());
+  return true;
+}
@@ -5,11 +5,19 @@
 #ifndef OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_VERILATOR_SIM_CTRL_H_
 #define OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_VERILATOR_SIM_CTRL_H_
 
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
 #include <string>
 #include <vector>
 
+#include "sim_ctrl_control.h"
 #include "sim_ctrl_extension.h"
+#include "sim_ctrl_stats.h"
 #include "verilated_toplevel.h"
 
 enum VerilatorSimCtrlFlags {
@@ -17,6 +25,17 @@ enum VerilatorSimCtrlFlags {
   ResetPolarityNegative = 1,
 };
 
+/**
+ * A callback for the simulation controller's scheduler. The argument is the
+ * current simulation time (as for SimCtrlExtension::OnClock()).
+ */
+typedef std::function<void(unsigned long)> SimCtrlCallback;
+
+/**
+ * Identifies a scheduled callback (see VerilatorSimCtrl::Unschedule())
+ */
+typedef unsigned int SimCtrlCallbackId;
+
 /**
  * Simulation controller for verilated simulations
  */
@@ -49,6 +68,12 @@ class VerilatorSimCtrl {
    * 1. Parses a C-style set of command line arguments (see ParseCommandArgs())
    * 2. Runs the simulation (see RunSimulation())
    *
+   * In fork-server mode (--fork-server or --fork-server-jobs), this function
+   * initializes the model and then forks a child process for each job. The
+   * server process returns once it has finished, reporting that no
+   * simulation ran. Each child returns after running its job's simulation,
+   * just like a normal run, so the caller can check the results as usual.
+   *
    * @return a pair with main()-compatible process exit code (0 for success, 1
    *         in case of an error) and a boolean flag telling the calling
    *         function whether the simulation actually ran.
@@ -99,8 +124,33 @@ class VerilatorSimCtrl {
 
   /**
    * Request the simulation to stop
+   *
+   * This can be called from any thread (including the worker threads of a
+   * model built with --threads, e.g. from a DPI function) and from a signal
+   * handler. The simulation stops at the end of the current cycle.
+   */
+  void RequestStop(bool simulation_success) VL_MT_SAFE;
+
+  /**
+   * Request tracing to be turned on or off
+   *
+   * Like RequestStop(), this can be called from any thread and from a signal
+   * handler. The change takes effect at the end of the current cycle. Tracing
+   * can only be turned on if tracing support is compiled into the simulation.
+   */
+  void RequestTracing(bool enable) VL_MT_SAFE;
+
+  /**
+   * Trigger the trace flight recorder (if enabled with
+   * --trace-flight-recorder)
+   *
+   * The flight recorder keeps the traces it has recorded so far and stops
+   * after finishing the segment it is writing. This is called automatically
+   * for a failing simulation (see RequestStop()), but can also be used to
+   * catch some other event, e.g. from a ScheduleOnChange() callback. It is safe
+   * to call from any thread and from a signal handler.
    */
-  void RequestStop(bool simulation_success);
+  void TriggerFlightRecorder() VL_MT_SAFE;
 
   /**
    * Register an extension to be called automatically
@@ -109,8 +159,60 @@ class VerilatorSimCtrl {
 
   /**
    * Get the current time in ticks
+   *
+   * The time only changes between calls to eval(), so this is safe to call
+   * from the model's worker threads.
+   */
+  unsigned long GetTime() const VL_MT_SAFE { return time_; }
+
+  /**
+   * Call cb on the rising clock edge of every period'th cycle, starting with
+   * cycle first_cycle
+   *
+   * Scheduled callbacks are called at the same point as
+   * SimCtrlExtension::OnClock(), but cost nothing on cycles where none are
+   * due.
+   *
+   * @return An ID that can be passed to Unschedule()
    */
-  unsigned long GetTime() const { return time_; }
+  SimCtrlCallbackId ScheduleEvery(unsigned long period, SimCtrlCallback cb,
+                                  unsigned long first_cycle = 0);
+
+  /**
+   * Call cb once, on the rising clock edge of cycle (or of the next cycle, if
+   * that has already passed)
+   *
+   * @return An ID that can be passed to Unschedule()
+   */
+  SimCtrlCallbackId ScheduleAt(unsigned long cycle, SimCtrlCallback cb);
+
+  /**
+   * Call cb on the rising clock edge of each cycle where the len_bytes bytes
+   * at signal differ from the previous cycle
+   *
+   * The first comparison is with the value of the signal when this function is
+   * called. This is the only kind of callback with a cost on every cycle (one
+   * comparison per watched signal).
+   *
+   * @return An ID that can be passed to Unschedule()
+   */
+  SimCtrlCallbackId ScheduleOnChange(const void *signal, size_t len_bytes,
+                                     SimCtrlCallback cb);
+
+  /**
+   * Call cb whenever the signal changes (see above). T is the type of a
+   * Verilated signal (CData, SData, IData or QData).
+   */
+  template <typename T>
+  SimCtrlCallbackId ScheduleOnChange(const T *signal, SimCtrlCallback cb) {
+    return ScheduleOnChange(static_cast<const void *>(signal), sizeof(T), cb);
+  }
+
+  /**
+   * Cancel a scheduled callback. It is safe to call this from a callback
+   * (including on itself).
+   */
+  void Unschedule(SimCtrlCallbackId id);
 
  private:
   VerilatedToplevel *top_;
@@ -124,13 +226,83 @@ class VerilatorSimCtrl {
   bool tracing_possible_;
   unsigned int initial_reset_delay_cycles_;
   unsigned int reset_duration_cycles_;
-  volatile unsigned int request_stop_;
-  volatile bool simulation_success_;
+  // These can be set from other threads and from signal handlers
+  std::atomic<bool> request_stop_;
+  std::atomic<bool> simulation_success_;
+  // A tracing change requested with RequestTracing(), applied by Trace()
+  std::atomic<int> trace_request_;
   std::chrono::steady_clock::time_point time_begin_;
   std::chrono::steady_clock::time_point time_end_;
   VerilatedTracer tracer_;
   int term_after_cycles_;
+  bool checkpoint_possible_;
+  unsigned long checkpoint_save_cycle_;
+  std::string checkpoint_save_file_;
+  std::string checkpoint_restore_file_;
+  unsigned long restored_time_;
+  bool model_initialized_;
+  std::string fork_server_socket_;
+  std::string fork_server_jobs_;
+  int fork_result_fd_;
+  std::vector<std::string> job_args_;
+  std::vector<char *> verilated_argv_;
   std::vector<SimCtrlExtension *> extension_array_;
+  // CPUs to run on (from --cpu-affinity), or empty to leave the affinity alone
+  std::vector<int> cpu_affinity_;
+
+  // A callback scheduled by ScheduleEvery() or ScheduleAt(). period is zero
+  // for a one-off callback.
+  struct TimedCallback {
+    SimCtrlCallback cb;
+    unsigned long period;
+  };
+
+  // A callback scheduled by ScheduleOnChange()
+  struct SignalCallback {
+    SimCtrlCallbackId id;
+    const uint8_t *signal;
+    std::vector<uint8_t> last_value;
+    SimCtrlCallback cb;
+  };
+
+  // Min-heap of (cycle, ID) pairs for timed callbacks. Cancelled callbacks
+  // stay in the heap until they are due, but are removed from
+  // timed_callbacks_ straight away.
+  typedef std::pair<unsigned long, SimCtrlCallbackId> DueCallback;
+  std::priority_queue<DueCallback, std::vector<DueCallback>,
+                      std::greater<DueCallback>>
+      due_callbacks_;
+  std::map<SimCtrlCallbackId, TimedCallback> timed_callbacks_;
+  std::vector<SignalCallback> signal_callbacks_;
+  unsigned long next_due_cycle_;  // cycle at the top of due_callbacks_
+  SimCtrlCallbackId next_callback_id_;
+
+  std::string trace_file_name_;
+  std::vector<std::pair<unsigned long, unsigned long>> trace_windows_;
+  unsigned long flight_recorder_cycles_;
+  SimCtrlCallbackId flight_recorder_id_;
+  std::atomic<bool> flight_triggered_;
+  // Trace files written by the flight recorder, oldest first
+  std::deque<std::string> flight_segments_;
+
+  // How often to check whether a statistics report is due
+  static const unsigned long kStatsCheckCycles = 1024;
+  // How often to time the phases of the main loop for the profile. Timing
+  // every cycle would slow small simulations down noticeably. This must
+  // divide kStatsCheckCycles.
+  static const unsigned long kProfileSampleCycles = 64;
+  double stats_interval_s_;
+  std::string stats_file_;
+  std::unique_ptr<SimCtrlStats> stats_;
+
+  // How often to check the control socket for commands
+  static const unsigned long kControlPollCycles = 4096;
+  std::string control_socket_path_;
+  bool start_paused_;
+  std::unique_ptr<SimCtrlControlSocket> control_;
+  bool paused_;
+  unsigned long next_control_cycle_;  // ULONG_MAX without a control socket
+  unsigned long run_to_cycle_;        // ULONG_MAX unless run-to is pending
 
   /**
    * Default constructor
@@ -200,6 +372,89 @@ class VerilatorSimCtrl {
    */
   const char *GetTraceFileName() const;
 
+  /**
+   * Get the file name extension for trace files (including the dot)
+   */
+  const char *GetTraceFileExtension() const;
+
+  /**
+   * Schedule the trace windows and flight recorder segments
+   */
+  void SetupTraceSchedule();
+
+  /**
+   * Close the current flight recorder trace file and start a new one (or
+   * stop, if the flight recorder has been triggered)
+   */
+  void NextFlightSegment();
+
+  /**
+   * Delete the flight recorder's trace files, unless it was triggered
+   */
+  void FinishFlightRecorder();
+
+  /**
+   * Set up stats_ and schedule its periodic reports (if enabled with
+   * --stats-interval)
+   *
+   * @return Return code, true == success
+   */
+  bool SetupStats();
+
+  /**
+   * Open the control socket
+   *
+   * @return Return code, true == success
+   */
+  bool SetupControl();
+
+  /**
+   * Run any commands that have arrived on the control socket. While the
+   * simulation is paused, this waits for more commands and only returns once
+   * the simulation is resumed or stopped.
+   *
+   * This is called at the start of a cycle, so the simulation can be
+   * checkpointed while it is paused.
+   */
+  void PollControl();
+
+  /**
+   * Run a command from the control socket
+   *
+   * @return The reply for the client, or an empty string if the reply is sent
+   *         later (for run-to)
+   */
+  std::string RunControlCommand(const std::vector<std::string> &words);
+
+  /**
+   * Enable tracing support and evaluate the initial blocks of the model
+   *
+   * Only the first call does anything.
+   */
+  void InitModel();
+
+  /**
+   * Pin the threads of the process to the CPUs from --cpu-affinity
+   *
+   * If init_done is false, each thread other than the calling one (normally
+   * the worker threads of a model built with --threads) is pinned to a CPU of
+   * its own, and the calling thread may run on any CPU left over, which is
+   * inherited by the threads that DPI models start while the model is
+   * initialized. If init_done is true, the calling thread is pinned to the
+   * first CPU in the list.
+   */
+  void SetCpuAffinity(bool init_done);
+
+  /**
+   * Call any timed callbacks that are due at cycle
+   */
+  void RunTimedCallbacks(unsigned long cycle);
+
+  /**
+   * Call the callbacks for any watched signals that have changed
+   */
+  void RunSignalCallbacks();
+
   /**
    * Run the main loop of the simulation
    *
@@ -238,6 +493,65 @@ class VerilatorSimCtrl {
    * Perform tracing in Verilator if required
    */
   void Trace();
+
+  /**
+   * Write a checkpoint of the simulation to a file
+   *
+   * The checkpoint holds the state of the Verilated model (which includes the
+   * clock and reset signals), the simulation time, the DPI handles that the
+   * model holds and the state of all registered extensions.
+   *
+   * @return Return code, true == success
+   */
+  bool SaveCheckpoint(const std::string &filename);
+
+  /**
+   * Restore a checkpoint written by SaveCheckpoint()
+   *
+   * The simulation must have been built from the same design, with the same
+   * extensions registered and the same DPI models. The model state is restored
+   * in full. Extensions can refuse a checkpoint that doesn't fit this
+   * simulation, in which case the model is left untouched.
+   *
+   * @return Return code, true == success
+   */
+  bool RestoreCheckpoint(const std::string &filename);
+
+  /**
+   * Run in fork-server mode
+   *
+   * Initialize the model, then run each job from the job file or socket in a
+   * forked child process. Returns in the server process once all jobs have
+   * run (or the server has been stopped), with is_child false. Also returns
+   * in each child, with is_child true and the job's arguments in job_args_.
+   *
+   * @return Return code, true == success (all jobs passed)
+   */
+  bool RunForkServer(const char *prog_name, bool &is_child);
+
+  /**
+   * Fork a child to run the job described by line (a list of command line
+   * arguments separated by whitespace)
+   *
+   * In the server, waits for the child to finish and sets result to a
+   * description of how the job ended. In the child, closes the file
+   * descriptors in close_fds and sets is_child.
+   *
+   * @return Return code, true == the job passed
+   */
+  bool RunJob(const std::string &line, const char *prog_name,
+              const std::vector<int> &close_fds, bool &is_child,
+              std::string &result);
+
+  /**
+   * Serve jobs from fork_server_jobs_, running them one after another
+   */
+  bool ServeJobFile(const char *prog_name, bool &is_child);
+
+  /**
+   * Serve jobs from clients connecting to the socket at fork_server_socket_
+   */
+  bool ServeSocket(const char *prog_name, bool &is_child);
 };
 
 #endif  // OPENTITAN_HW_DV_VERILATOR_SIMUTIL_VERILATOR_CPP_VERILATOR_SIM_CTRL_H_
@@ -173,7 +173,7 @@ extern "C" svBit OtbnMemUtilGetSegData(
   // Copy data from the segment into a uint32_t. Zero-initialize it, in case
   // to_copy < 4.
   uint32_t data = 0;
-  memcpy(&data, &it->second[seg_off], to_copy);
+  it->second.CopyTo(seg_off, to_copy, reinterpret_cast<uint8_t *>(&data));
 
   // Now copy that uint32_t into data_value and return success.
   memcpy(data_value, &data, 4);
@@ -0,0 +1,72 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "iss_pool.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+static std::unique_ptr<ISSPool> iss_pool;
+
+// Read the number of ISS processes to start on the first lease from the
+// OTBN_MODEL_ISS_PREFORK environment variable. Returns zero if it isn't set.
+static unsigned get_prefork_count() {
+  const char *from_env = getenv("OTBN_MODEL_ISS_PREFORK");
+  if (!from_env)
+    return 0;
+
+  char *end;
+  unsigned long val = strtoul(from_env, &end, 0);
+  if (*end || val > 64) {
+    std::ostringstream oss;
+    oss << "Invalid value for OTBN_MODEL_ISS_PREFORK (`" << from_env
+        << "'): should be an integer between 0 and 64.";
+    throw std::runtime_error(oss.str());
+  }
+  return val;
+}
+
+ISSPool::ISSPool() : preforked_(false) {}
+
+ISSPool &ISSPool::get() {
+  if (!iss_pool) {
+    iss_pool.reset(new ISSPool());
+  }
+  return *iss_pool;
+}
+
+std::unique_ptr<ISSWrapper> ISSPool::Lease() {
+  if (!preforked_) {
+    preforked_ = true;
+    unsigned count = get_prefork_count();
+    while (idle_.size() < count) {
+      idle_.emplace_back(new ISSWrapper());
+    }
+  }
+
+  if (idle_.empty()) {
+    return std::unique_ptr<ISSWrapper>(new ISSWrapper());
+  }
+
+  std::unique_ptr<ISSWrapper> iss = std::move(idle_.back());
+  idle_.pop_back();
+  return iss;
+}
+
+void ISSPool::Return(std::unique_ptr<ISSWrapper> iss) {
+  if (!iss)
+    return;
+
+  try {
+    iss->reset();
+  } catch (const std::runtime_error &err) {
+    std::cerr << "WARNING: Dropping ISS that failed to reset: " << err.what()
+              << "\n";
+    return;
+  }
+
+  idle_.push_back(std::move(iss));
+}
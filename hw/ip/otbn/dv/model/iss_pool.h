@@ -0,0 +1,46 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+// A singleton pool of ISS subprocesses.
+//
+// Starting an ISS means starting a Python interpreter and importing the
+// simulator, which is slow compared to resetting one that is already running.
+// A model leases an ISS from the pool the first time it needs one and gives it
+// back when it is destroyed. At that point, the ISS gets reset and is kept
+// around for the next model that asks.
+//
+// If the OTBN_MODEL_ISS_PREFORK environment variable is set to a positive
+// integer N, the first lease starts N ISS processes at once. These start up in
+// parallel, so a simulation with several OTBN models only waits for Python
+// startup once.
+
+#include <memory>
+#include <vector>
+
+#include "iss_wrapper.h"
+
+class ISSPool {
+ public:
+  ISSPool();
+
+  // Get the singleton object
+  static ISSPool &get();
+
+  // Take an ISS from the pool, starting a new one if there are none idle.
+  // Throws a std::runtime_error if we can't start an ISS.
+  std::unique_ptr<ISSWrapper> Lease();
+
+  // Reset an ISS and put it back in the pool. If the reset fails, the ISS is
+  // destroyed instead.
+  void Return(std::unique_ptr<ISSWrapper> iss);
+
+ private:
+  // True once we've started any processes requested by OTBN_MODEL_ISS_PREFORK
+  bool preforked_;
+
+  // ISS processes that have been reset and are ready to lease
+  std::vector<std::unique_ptr<ISSWrapper>> idle_;
+};
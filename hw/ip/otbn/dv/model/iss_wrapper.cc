@@ -7,12 +7,12 @@
 #include <cassert>
 #include <cstring>
 #include <fcntl.h>
-#include <ftw.h>
 #include <iostream>
 #include <memory>
 #include <regex>
 #include <signal.h>
 #include <sstream>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -26,81 +26,6 @@ struct CStrDeleter {
 }  // namespace
 typedef std::unique_ptr<char, CStrDeleter> c_str_ptr;
 
-// Guard class to create (and possibly delete) temporary directories.
-struct TmpDir {
-  std::string path;
-
-  TmpDir() : path(TmpDir::make_tmp_dir()) {}
-  ~TmpDir() { cleanup(); }
-
- private:
-  // A wrapper around mkdtemp that respects TMPDIR
-  static std::string make_tmp_dir() {
-    const char *tmpdir = getenv("TMPDIR");
-    if (!tmpdir)
-      tmpdir = "/tmp";
-
-    std::string tmp_template(tmpdir);
-    tmp_template += "/otbn_XXXXXX";
-
-    if (!mkdtemp(&tmp_template.at(0))) {
-      std::ostringstream oss;
-      oss << ("Cannot create temporary directory for OTBN simulation "
-              "with template ")
-          << tmp_template << ": " << strerror(errno);
-      throw std::runtime_error(oss.str());
-    }
-
-    // The backing string for tmp_template will have been populated by mkdtemp.
-    return tmp_template;
-  }
-
-  // Return true if the OTBN_MODEL_KEEP_TMP environment variable is set to 1.
-  static bool should_keep_tmp() {
-    const char *keep_str = getenv("OTBN_MODEL_KEEP_TMP");
-    if (!keep_str)
-      return false;
-    return (strcmp(keep_str, "1") == 0) ? true : false;
-  }
-
-  // Called by nftw when we're deleting the temporary directory
-  static int ftw_callback(const char *fpath, const struct stat *sb,
-                          int typeflag, struct FTW *ftwbuf) {
-    // The libc remove() function calls unlink or rmdir as necessary. Ignore
-    // any failures: we'll check that we managed to delete the directory when
-    // nftw finishes.
-    remove(fpath);
-
-    // Tell nftw to keep going
-    return 0;
-  }
-
-  // Recursively delete the temporary directory
-  void cleanup() {
-    if (path.empty())
-      return;
-
-    if (TmpDir::should_keep_tmp()) {
-      std::cerr << "Keeping temporary directory at " << path
-                << " because OTBN_MODEL_KEEP_TMP=1.\n";
-      return;
-    }
-
-    // We're not supposed to keep the directory. Try to delete it and its
-    // contents. Ignore any failures: we'll just check whether it's gone
-    // afterwards.
-    nftw(path.c_str(), TmpDir::ftw_callback, 4, FTW_DEPTH | FTW_PHYS);
-
-    // Is there still anything at path? If so, we failed. Print something to
-    // stderr to tell the user what's going on.
-    struct stat statbuf;
-    if (stat(path.c_str(), &statbuf) == 0) {
-      std::cerr << "ERROR: Failed to delete OTBN temporary directory at "
-                << path << ".\n";
-    }
-  }
-};
-
 // Find the top of the OpenTitan repository
 //
 // If REPO_TOP is defined, use that. Otherwise, this will only work if we're
@@ -170,8 +95,13 @@ static std::string find_repo_top() {
 }
 
 // Find the otbn Python model. On failure, throw a std::runtime_error with a
-// description of what went wrong.
+// description of what went wrong. The result is cached, so we only walk the
+// filesystem the first time this is called.
 static std::string find_otbn_model() {
+  static std::string cached_path;
+  if (!cached_path.empty())
+    return cached_path;
+
   std::string path = find_repo_top() + "/hw/ip/otbn/dv/otbnsim/stepped.py";
   c_str_ptr abs_path(realpath(path.c_str(), NULL));
   if (!abs_path) {
@@ -180,7 +110,8 @@ static std::string find_otbn_model() {
     throw std::runtime_error(oss.str());
   }
 
-  return std::string(abs_path.get());
+  cached_path = abs_path.get();
+  return cached_path;
 }
 
 // Read 8 hex characters from str as a uint32_t.
@@ -191,36 +122,67 @@ static uint32_t read_hex_32(const char *str) {
   return strtoul(buf, nullptr, 16);
 }
 
-// Read through trace output (in the lines argument) to pick up any write to
-// the named CSR register. If there is no such write, return default_val.
-static uint32_t read_ext_reg(const std::string &reg_name,
-                             const std::vector<std::string> &lines,
-                             uint32_t default_val) {
-  // We're interested in lines that show an update to the external register
-  // called reg_name. These look something like this:
-  //
-  //   ! otbn.$REG_NAME: 0x00000000
-  std::regex re("! otbn\\." + reg_name + ": 0x([0-9a-f]{8})");
-  std::smatch match;
-
-  uint32_t val = default_val;
+// Read a little-endian uint32_t from the 4 bytes at str
+static uint32_t read_le_32(const char *str) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(str);
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
 
-  for (const auto &line : lines) {
-    if (std::regex_match(line, match, re)) {
-      // Ahah! We have a match. We have captured exactly 8 hex digits, so know
-      // that we can safely parse them to a uint32_t without risking a parse
-      // failure or overflow.
-      assert(match.size() == 2);
-      val = (uint32_t)strtoul(match[1].str().c_str(), nullptr, 16);
+// Split text into lines, dropping the newline characters. A trailing newline
+// doesn't start a new (empty) line.
+static void split_lines(const std::string &text,
+                        std::vector<std::string> *dst) {
+  size_t bol = 0;
+  while (bol < text.size()) {
+    size_t eol = text.find('\n', bol);
+    if (eol == std::string::npos) {
+      dst->push_back(text.substr(bol));
+      break;
     }
+    dst->push_back(text.substr(bol, eol - bol));
+    bol = eol + 1;
   }
+}
 
+// The number of cycles to run the ISS ahead with each step_batch command. This
+// is 32 by default, but can be overridden with the OTBN_MODEL_STEP_BATCH
+// environment variable.
+static unsigned get_step_batch_size() {
+  const char *from_env = getenv("OTBN_MODEL_STEP_BATCH");
+  if (!from_env)
+    return 32;
+
+  char *end;
+  unsigned long val = strtoul(from_env, &end, 0);
+  if (*end || val == 0 || val > 0xffffffff) {
+    std::ostringstream oss;
+    oss << "Invalid value for OTBN_MODEL_STEP_BATCH (`" << from_env
+        << "'): should be a positive integer.";
+    throw std::runtime_error(oss.str());
+  }
   return val;
 }
 
-ISSWrapper::ISSWrapper() : tmpdir(new TmpDir()) {
+ISSWrapper::ISSWrapper()
+    : binary_mode(false),
+      step_batch_size(get_step_batch_size()),
+      shm_ptr(nullptr),
+      shm_size(0) {
   std::string model_path(find_otbn_model());
 
+  // Create an anonymous file to back the memory region that we share with the
+  // child. Like the pipes below, it is close-on-exec so that other ISS
+  // processes (started later or kept in a pool) don't inherit it: we clear the
+  // flag in our own child only, just before it execs. The region starts empty
+  // and is grown on demand by get_shared_mem().
+  shm_fd = memfd_create("otbn_iss_mem", MFD_CLOEXEC);
+  if (shm_fd < 0) {
+    std::ostringstream oss;
+    oss << "Failed to create shared memory for ISS: " << strerror(errno);
+    throw std::runtime_error(oss.str());
+  }
+
   // We want two pipes: one for writing to the child process, and the other for
   // reading from it. We set the O_CLOEXEC flag so that the child process will
   // drop all the fds when it execs.
@@ -229,6 +191,7 @@ ISSWrapper::ISSWrapper() : tmpdir(new TmpDir()) {
     if (pipe2(fds + 2 * i, O_CLOEXEC)) {
       std::ostringstream oss;
       oss << "Failed to open pipe " << i << " for ISS: " << strerror(errno);
+      close(shm_fd);
       throw std::runtime_error(oss.str());
     }
   }
@@ -244,6 +207,7 @@ ISSWrapper::ISSWrapper() : tmpdir(new TmpDir()) {
     // Something went wrong.
     std::ostringstream oss;
     oss << "Failed to fork to create ISS process: " << strerror(errno);
+    close(shm_fd);
     throw std::runtime_error(oss.str());
   }
 
@@ -262,6 +226,12 @@ ISSWrapper::ISSWrapper() : tmpdir(new TmpDir()) {
                 << "\n";
       abort();
     }
+    // Keep the shared memory fd open across the exec, under the same number
+    if (fcntl(shm_fd, F_SETFD, 0) == -1) {
+      std::cerr << "Failed to pass shared memory to ISS subprocess: "
+                << strerror(errno) << "\n";
+      abort();
+    }
     // Finally, exec the ISS
     execl(model_path.c_str(), model_path.c_str(), NULL);
   }
@@ -282,6 +252,12 @@ ISSWrapper::ISSWrapper() : tmpdir(new TmpDir()) {
   // valid). Add an assertion to make sure nothing weird happens.
   assert(child_write_file);
   assert(child_read_file);
+
+  // Ask the child to switch to binary framing. We don't wait for the response
+  // here (see finish_handshake), which means that several ISS processes can
+  // start up in parallel.
+  fputs("binary\n", child_write_file);
+  fflush(child_write_file);
 }
 
 ISSWrapper::~ISSWrapper() {
@@ -296,44 +272,102 @@ ISSWrapper::~ISSWrapper() {
   // Close the child file handles.
   fclose(child_write_file);
   fclose(child_read_file);
+
+  // Drop the shared memory region
+  if (shm_ptr)
+    munmap(shm_ptr, shm_size);
+  close(shm_fd);
 }
 
-void ISSWrapper::load_d(const std::string &path) {
+uint8_t *ISSWrapper::get_shared_mem(size_t num_bytes) {
+  if (num_bytes <= shm_size)
+    return shm_ptr;
+
+  // Round up to a whole number of pages
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t new_size = (num_bytes + page_size - 1) / page_size * page_size;
+
+  if (ftruncate(shm_fd, new_size) != 0) {
+    std::ostringstream oss;
+    oss << "Failed to resize ISS shared memory to " << new_size
+        << " bytes: " << strerror(errno);
+    throw std::runtime_error(oss.str());
+  }
+
+  void *new_ptr =
+      mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (new_ptr == MAP_FAILED) {
+    std::ostringstream oss;
+    oss << "Failed to map ISS shared memory: " << strerror(errno);
+    throw std::runtime_error(oss.str());
+  }
+
+  if (shm_ptr)
+    munmap(shm_ptr, shm_size);
+  shm_ptr = static_cast<uint8_t *>(new_ptr);
+  shm_size = new_size;
+
+  // Tell the child to map the resized region too
+  std::ostringstream oss;
+  oss << "shm " << shm_fd << " " << shm_size << "\n";
+  if (!run_command(oss.str(), nullptr)) {
+    throw std::runtime_error("Failed to map shared memory in ISS.");
+  }
+
+  return shm_ptr;
+}
+
+void ISSWrapper::load_d(size_t offset, size_t len) {
+  assert(offset + len <= shm_size);
   std::ostringstream oss;
-  oss << "load_d " << path << "\n";
+  oss << "load_shm_d " << offset << " " << len << "\n";
   run_command(oss.str(), nullptr);
 }
 
-void ISSWrapper::load_i(const std::string &path) {
+void ISSWrapper::load_i(size_t offset, size_t len) {
+  assert(offset + len <= shm_size);
   std::ostringstream oss;
-  oss << "load_i " << path << "\n";
+  oss << "load_shm_i " << offset << " " << len << "\n";
   run_command(oss.str(), nullptr);
 }
 
-void ISSWrapper::dump_d(const std::string &path) const {
+void ISSWrapper::dump_d(size_t offset, size_t len) const {
+  assert(offset + len <= shm_size);
   std::ostringstream oss;
-  oss << "dump_d " << path << "\n";
+  oss << "dump_shm_d " << offset << " " << len << "\n";
   run_command(oss.str(), nullptr);
 }
 
+void ISSWrapper::reset() {
+  pending_steps.clear();
+  if (!run_command("reset\n", nullptr)) {
+    throw std::runtime_error("Failed to reset ISS.");
+  }
+}
+
 void ISSWrapper::start(uint32_t addr) {
+  // Any cycles that were simulated ahead of time belong to an old run.
+  pending_steps.clear();
+
   std::ostringstream oss;
   oss << "start " << addr << "\n";
   run_command(oss.str(), nullptr);
 }
 
 std::pair<bool, uint32_t> ISSWrapper::step(bool gen_trace) {
-  std::vector<std::string> lines;
-  run_command("step\n", &lines);
+  if (pending_steps.empty())
+    fetch_steps();
+  assert(!pending_steps.empty());
+
+  const StepRecord &record = pending_steps.front();
   if (gen_trace) {
-    OtbnTraceChecker::get().OnIssTrace(lines);
+    iss_record.Reset(record.trace.c_str(), 0);
+    OtbnTraceChecker::get().OnIssTrace(iss_record);
   }
 
-  // The busy flag is bit 0 of the STATUS register, so is cleared on this cycle
-  // if we see a write that sets the value to an even number.
-  bool done = (read_ext_reg("STATUS", lines, 1) & 1) == 0;
-  uint32_t err_code = done ? read_ext_reg("ERR_BITS", lines, 0) : 0;
-  return std::make_pair(done, err_code);
+  auto ret = std::make_pair(record.done, record.err_bits);
+  pending_steps.pop_front();
+  return ret;
 }
 
 void ISSWrapper::get_regs(std::array<uint32_t, 32> *gprs,
@@ -454,10 +488,6 @@ std::vector<uint32_t> ISSWrapper::get_call_stack() {
   return call_stack;
 }
 
-std::string ISSWrapper::make_tmp_path(const std::string &relative) const {
-  return tmpdir->path + "/" + relative;
-}
-
 bool ISSWrapper::read_child_response(std::vector<std::string> *dst) const {
   char buf[256];
   bool continuation = false;
@@ -507,12 +537,91 @@ bool ISSWrapper::read_child_response(std::vector<std::string> *dst) const {
   }
 }
 
+bool ISSWrapper::read_child_frame(std::string *dst) const {
+  assert(dst);
+
+  char len_buf[4];
+  if (fread(len_buf, 1, sizeof len_buf, child_read_file) != sizeof len_buf)
+    return false;
+
+  dst->resize(read_le_32(len_buf));
+  if (dst->empty())
+    return true;
+
+  return fread(&dst->at(0), 1, dst->size(), child_read_file) == dst->size();
+}
+
 bool ISSWrapper::run_command(const std::string &cmd,
                              std::vector<std::string> *dst) const {
   assert(cmd.size() > 0);
   assert(cmd.back() == '\n');
 
+  finish_handshake();
+
   fputs(cmd.c_str(), child_write_file);
   fflush(child_write_file);
-  return read_child_response(dst);
+
+  std::string payload;
+  if (!read_child_frame(&payload))
+    return false;
+
+  if (dst)
+    split_lines(payload, dst);
+  return true;
+}
+
+void ISSWrapper::finish_handshake() const {
+  if (binary_mode)
+    return;
+
+  // The response to the binary command is still in the text format.
+  std::vector<std::string> lines;
+  if (!read_child_response(&lines) || lines.size() != 1 ||
+      lines[0] != "BINARY") {
+    throw std::runtime_error(
+        "ISS subprocess failed to switch to binary framing.");
+  }
+  binary_mode = true;
+}
+
+void ISSWrapper::fetch_steps() {
+  finish_handshake();
+
+  std::ostringstream oss;
+  oss << "step_batch " << step_batch_size << "\n";
+  fputs(oss.str().c_str(), child_write_file);
+  fflush(child_write_file);
+
+  std::string payload;
+  if (!read_child_frame(&payload)) {
+    throw std::runtime_error("Failed to read step_batch response from ISS.");
+  }
+
+  // Each record is a 9 byte header (done flag, ERR_BITS and trace length)
+  // followed by the trace text.
+  const size_t hdr_len = 9;
+  size_t pos = 0;
+  while (pos < payload.size()) {
+    if (payload.size() - pos < hdr_len) {
+      throw std::runtime_error("Truncated record header in step_batch frame.");
+    }
+
+    StepRecord record;
+    record.done = payload[pos] != 0;
+    record.err_bits = read_le_32(&payload[pos + 1]);
+    uint32_t trace_len = read_le_32(&payload[pos + 5]);
+    pos += hdr_len;
+
+    if (payload.size() - pos < trace_len) {
+      throw std::runtime_error("Truncated trace text in step_batch frame.");
+    }
+    record.trace = payload.substr(pos, trace_len);
+    pos += trace_len;
+
+    pending_steps.push_back(std::move(record));
+  }
+
+  if (pending_steps.empty()) {
+    throw std::runtime_error("ISS returned no cycles for step_batch.");
+  }
 }
@@ -7,13 +7,13 @@
 #include <array>
 #include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <memory>
 #include <string>
 #include <unistd.h>
 #include <vector>
 
-// Forward declaration (the implementation is private in iss_wrapper.cc)
-struct TmpDir;
+#include "otbn_trace_record.h"
 
 // An object wrapping the ISS subprocess.
 struct ISSWrapper {
@@ -26,12 +26,24 @@ struct ISSWrapper {
   ISSWrapper();
   ~ISSWrapper();
 
-  // Load new contents of DMEM / IMEM
-  void load_d(const std::string &path);
-  void load_i(const std::string &path);
+  // Return a pointer to the start of the memory region that is shared with
+  // the ISS, growing the region (and telling the ISS about it) if it is
+  // smaller than num_bytes. Any pointer returned by an earlier call is
+  // invalidated if the region grows.
+  uint8_t *get_shared_mem(size_t num_bytes);
 
-  // Dump the contents of DMEM to a file
-  void dump_d(const std::string &path) const;
+  // Load new contents of DMEM / IMEM from len bytes at offset in the shared
+  // memory region.
+  void load_d(size_t offset, size_t len);
+  void load_i(size_t offset, size_t len);
+
+  // Dump the contents of DMEM to len bytes at offset in the shared memory
+  // region. len must equal the size of DMEM.
+  void dump_d(size_t offset, size_t len) const;
+
+  // Reset the ISS to its initial state, ready for reuse by another model.
+  // Throws a std::runtime_error on failure.
+  void reset();
 
   // Jump to a new address and start running
   void start(uint32_t addr);
@@ -41,6 +53,10 @@ struct ISSWrapper {
   //
   // If gen_trace is true, pass trace data to the (singleton)
   // OtbnTraceChecker object.
+  //
+  // The ISS is actually run in batches of cycles (see fetch_steps), so most
+  // calls to this function just consume a cycle that has already been
+  // simulated.
   std::pair<bool, uint32_t> step(bool gen_trace);
 
   // Read contents of the register file
@@ -49,25 +65,60 @@ struct ISSWrapper {
   // Read the contents of the call stack
   std::vector<uint32_t> get_call_stack();
 
-  // Resolve a path relative to the convenience temporary directory.
-  // relative should be a relative path (it is just appended to the
-  // path of the temporary directory).
-  std::string make_tmp_path(const std::string &relative) const;
-
  private:
+  // The result of simulating a single cycle, as returned by the child's
+  // step_batch command.
+  struct StepRecord {
+    bool done;
+    uint32_t err_bits;
+    std::string trace;
+  };
+
   // Read line by line from the child process until we get ".\n".
   // Return true if we got the ".\n" terminator, false if EOF. If dst
   // is not null, append to it each line that was read.
   bool read_child_response(std::vector<std::string> *dst) const;
 
-  // Send a command to the child and wait for its response. Return
-  // value and dst argument behave as for read_child_response.
+  // Read a length-prefixed binary frame from the child process into dst.
+  // Return true on success, false on EOF or a truncated frame.
+  bool read_child_frame(std::string *dst) const;
+
+  // Wait for the child to respond to the binary command that we sent when
+  // starting it. Does nothing if that has already happened. Throws a
+  // std::runtime_error on failure.
+  void finish_handshake() const;
+
+  // Send a command to the child and wait for its response, which is read as a
+  // single frame and split into lines. Return value and dst argument behave as
+  // for read_child_response.
   bool run_command(const std::string &cmd, std::vector<std::string> *dst) const;
 
+  // Ask the child to simulate up to step_batch_size cycles and append the
+  // results to pending_steps. Throws a std::runtime_error on failure.
+  void fetch_steps();
+
   pid_t child_pid;
   FILE *child_write_file;
   FILE *child_read_file;
 
-  // A temporary directory for communicating with the child process
-  std::unique_ptr<TmpDir> tmpdir;
+  // True once the child has agreed to use binary framing for its responses.
+  // This gets set by the first command that we send (see finish_handshake).
+  mutable bool binary_mode;
+
+  // The number of cycles to ask for with each step_batch command
+  unsigned step_batch_size;
+
+  // Cycles that the child has already simulated but that we haven't yet
+  // passed back through step().
+  std::deque<StepRecord> pending_steps;
+
+  // Used to split the trace for a step into lines for the trace checker. We
+  // keep it between steps so that it doesn't need to allocate every time.
+  OtbnTraceRecord iss_record;
+
+  // A memfd (inherited by the child process) that backs the shared memory
+  // region, together with our mapping of it.
+  int shm_fd;
+  uint8_t *shm_ptr;
+  size_t shm_size;
 };
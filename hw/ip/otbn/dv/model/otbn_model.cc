@@ -5,13 +5,14 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <svdpi.h>
 
+#include "dpi_handle.h"
+#include "iss_pool.h"
 #include "iss_wrapper.h"
 #include "otbn_trace_checker.h"
 #include "sv_scoped.h"
@@ -20,14 +21,17 @@ namespace {
 // An extremely thin wrapper around ISSWrapper. The point is that we want to
 // create the model in an initial block in the SystemVerilog simulation, but
 // might not actually want to spawn the ISS. To handle that in a non-racy
-// way, the most convenient thing is to spawn the ISS on the first call to
-// otbn_model_step.
+// way, the most convenient thing is to lease an ISS from the pool on the first
+// call to otbn_model_step. The ISS goes back to the pool when the model is
+// destroyed.
 struct OtbnModel {
  public:
+  ~OtbnModel() { ISSPool::get().Return(std::move(iss)); }
+
   bool ensure() {
     if (!iss) {
       try {
-        iss.reset(new ISSWrapper());
+        iss = ISSPool::get().Lease();
       } catch (const std::runtime_error &err) {
         std::cerr << "Error when constructing ISS wrapper: " << err.what()
                   << "\n";
@@ -90,17 +94,17 @@ int otbn_stack_element_peek(int index, svBitVecVal *val) __attribute__((weak));
 //
 // If start_i is true, we start the model at start_addr and then step once (as
 // described above).
-extern "C" unsigned otbn_model_step(OtbnModel *model, const char *imem_scope,
+extern "C" unsigned otbn_model_step(void *handle, const char *imem_scope,
                                     unsigned imem_words, const char *dmem_scope,
                                     unsigned dmem_words,
                                     const char *design_scope, svLogic start_i,
                                     unsigned start_addr, unsigned status,
                                     svBitVecVal *err_code /* bit [31:0] */);
 
-// Use simutil_get_mem to read data one word at a time from the given scope and
-// collect the results up in a vector of uint8_t values.
-static std::vector<uint8_t> get_sim_memory(const char *scope, size_t num_words,
-                                           size_t word_size) {
+// Use simutil_get_mem to read data one word at a time from the given scope,
+// writing num_words * word_size bytes to dst.
+static void get_sim_memory(const char *scope, size_t num_words,
+                           size_t word_size, uint8_t *dst) {
   SVScoped scoped(scope);
 
   // simutil_get_mem passes data as a packed array of svBitVecVal words. It
@@ -109,8 +113,6 @@ static std::vector<uint8_t> get_sim_memory(const char *scope, size_t num_words,
   assert(word_size <= 256 / 8);
   svBitVecVal buf[256 / 8 / sizeof(svBitVecVal)];
 
-  std::vector<uint8_t> ret;
-
   for (size_t w = 0; w < num_words; w++) {
     if (!simutil_get_mem(w, buf)) {
       std::ostringstream oss;
@@ -119,104 +121,66 @@ static std::vector<uint8_t> get_sim_memory(const char *scope, size_t num_words,
       throw std::runtime_error(oss.str());
     }
 
-    // Append the first word_size bytes of data to ret.
-    std::copy_n(reinterpret_cast<const char *>(buf), word_size,
-                std::back_inserter(ret));
+    // Copy the first word_size bytes of data to dst.
+    memcpy(dst + w * word_size, buf, word_size);
   }
-
-  return ret;
 }
 
-// Use simutil_get_mem to write data one word at a time to the given scope.
-static void set_sim_memory(const std::vector<uint8_t> &data, const char *scope,
-                           size_t num_words, size_t word_size) {
+// Like get_sim_memory, but only read the words whose indices appear in
+// word_idxs. Each word is written to the position in dst that it would have
+// had for get_sim_memory, leaving the rest of dst unchanged.
+static void get_sim_words(const char *scope,
+                          const std::vector<uint32_t> &word_idxs,
+                          size_t word_size, uint8_t *dst) {
   SVScoped scoped(scope);
 
-  assert(num_words * word_size == data.size());
-
   // See get_sim_memory for why this array is sized like this.
   assert(word_size <= 256 / 8);
   svBitVecVal buf[256 / 8 / sizeof(svBitVecVal)];
 
-  for (size_t w = 0; w < num_words; w++) {
-    const uint8_t *p = &data[w * word_size];
-    memcpy(buf, p, word_size);
-
-    if (!simutil_set_mem(w, buf)) {
+  for (uint32_t w : word_idxs) {
+    if (!simutil_get_mem(w, buf)) {
       std::ostringstream oss;
-      oss << "Cannot set memory at word " << w << " for scope " << scope
+      oss << "Cannot get memory at word " << w << " from scope " << scope
           << ".\n";
       throw std::runtime_error(oss.str());
     }
-  }
-}
 
-// Read (the start of) the contents of a file at path as a vector of bytes.
-// Expects num_bytes bytes of data.
-static std::vector<uint8_t> read_vector_from_file(const std::string &path,
-                                                  size_t num_bytes) {
-  std::filebuf fb;
-  if (!fb.open(path.c_str(), std::ios::in | std::ios::binary)) {
-    std::ostringstream oss;
-    oss << "Cannot open the file '" << path << "'.";
-    throw std::runtime_error(oss.str());
+    memcpy(dst + w * word_size, buf, word_size);
   }
-
-  std::vector<uint8_t> buf(num_bytes);
-  std::streamsize chars_in =
-      fb.sgetn(reinterpret_cast<char *>(&buf[0]), num_bytes);
-
-  if (chars_in != num_bytes) {
-    std::ostringstream oss;
-    oss << "Cannot read " << num_bytes << " bytes of memory data from " << path
-        << " (actually got " << chars_in << ").";
-    throw std::runtime_error(oss.str());
-  }
-
-  return buf;
 }
 
-// Write a vector of bytes to a new file at path
-static void write_vector_to_file(const std::string &path,
-                                 const std::vector<uint8_t> &data) {
-  std::filebuf fb;
-  if (!fb.open(path.c_str(), std::ios::out | std::ios::binary)) {
-    std::ostringstream oss;
-    oss << "Cannot open the file '" << path << "'.";
-    throw std::runtime_error(oss.str());
-  }
+// Use simutil_set_mem to write num_words * word_size bytes from src one word
+// at a time to the given scope.
+static void set_sim_memory(const uint8_t *src, const char *scope,
+                           size_t num_words, size_t word_size) {
+  SVScoped scoped(scope);
+
+  // See get_sim_memory for why this array is sized like this.
+  assert(word_size <= 256 / 8);
+  svBitVecVal buf[256 / 8 / sizeof(svBitVecVal)];
 
-  // Write out the data
-  std::streamsize chars_out =
-      fb.sputn(reinterpret_cast<const char *>(&data[0]), data.size());
+  for (size_t w = 0; w < num_words; w++) {
+    memcpy(buf, src + w * word_size, word_size);
 
-  if (chars_out != data.size()) {
-    std::ostringstream oss;
-    oss << "Cannot write " << data.size() << " bytes of memory data to " << path
-        << "' (actually wrote " << chars_out << ").";
-    throw std::runtime_error(oss.str());
+    if (!simutil_set_mem(w, buf)) {
+      std::ostringstream oss;
+      oss << "Cannot set memory at word " << w << " for scope " << scope
+          << ".\n";
+      throw std::runtime_error(oss.str());
+    }
   }
 }
 
-// Dump the memory at the given scope to a file at path.
-static void dump_memory_to_file(const std::string &path, const char *scope,
-                                size_t num_words, size_t word_size) {
-  write_vector_to_file(path, get_sim_memory(scope, num_words, word_size));
+extern "C" void *otbn_model_init() {
+  return dpi_handle_new("otbn_model", "otbn", new OtbnModel);
 }
 
-// Read data from the given file and then write it into the memory at the given
-// scope.
-static void load_memory_from_file(const std::string &path, const char *scope,
-                                  size_t num_words, size_t word_size) {
-  size_t num_bytes = num_words * word_size;
-  set_sim_memory(read_vector_from_file(path, num_bytes), scope, num_words,
-                 word_size);
+extern "C" void otbn_model_destroy(void *handle) {
+  delete static_cast<OtbnModel *>(dpi_handle_get(handle));
+  dpi_handle_free(handle);
 }
 
-extern "C" OtbnModel *otbn_model_init() { return new OtbnModel; }
-
-extern "C" void otbn_model_destroy(OtbnModel *model) { delete model; }
-
 // Start a new run with the model, writing IMEM/DMEM and jumping to the given
 // start address. Returns 0 on success; -1 on failure.
 static int start_model(OtbnModel *model, const char *imem_scope,
@@ -232,20 +196,23 @@ static int start_model(OtbnModel *model, const char *imem_scope,
   assert(model->iss);
   ISSWrapper &iss = *model->iss;
 
-  std::string ifname(iss.make_tmp_path("imem"));
-  std::string dfname(iss.make_tmp_path("dmem"));
+  // The memory region shared with the ISS holds DMEM, followed by IMEM. Copy
+  // the contents of both memories straight into it.
+  size_t dmem_bytes = dmem_words * 32;
+  size_t imem_bytes = imem_words * 4;
 
   try {
-    dump_memory_to_file(dfname, dmem_scope, dmem_words, 32);
-    dump_memory_to_file(ifname, imem_scope, imem_words, 4);
+    uint8_t *shared = iss.get_shared_mem(dmem_bytes + imem_bytes);
+    get_sim_memory(dmem_scope, dmem_words, 32, shared);
+    get_sim_memory(imem_scope, imem_words, 4, shared + dmem_bytes);
   } catch (const std::exception &err) {
     std::cerr << "Error when dumping memory contents: " << err.what() << "\n";
     return -1;
   }
 
   try {
-    iss.load_d(dfname);
-    iss.load_i(ifname);
+    iss.load_d(0, dmem_bytes);
+    iss.load_i(dmem_bytes, imem_bytes);
     iss.start(start_addr);
   } catch (const std::runtime_error &err) {
     std::cerr << "Error when starting ISS: " << err.what() << "\n";
@@ -292,10 +259,11 @@ static int load_dmem(OtbnModel *model, const char *dmem_scope,
   }
   ISSWrapper &iss = *model->iss;
 
-  std::string dfname(iss.make_tmp_path("dmem_out"));
+  size_t dmem_bytes = dmem_words * 32;
   try {
-    iss.dump_d(dfname);
-    load_memory_from_file(dfname, dmem_scope, dmem_words, 32);
+    const uint8_t *shared = iss.get_shared_mem(dmem_bytes);
+    iss.dump_d(0, dmem_bytes);
+    set_sim_memory(shared, dmem_scope, dmem_words, 32);
   } catch (const std::exception &err) {
     std::cerr << "Error when loading dmem from ISS: " << err.what() << "\n";
     return -1;
@@ -309,14 +277,27 @@ static int load_dmem(OtbnModel *model, const char *dmem_scope,
 static bool check_dmem(ISSWrapper &iss, const char *dmem_scope,
                        unsigned dmem_words) {
   size_t dmem_bytes = dmem_words * 32;
-  std::string dfname(iss.make_tmp_path("dmem_out"));
 
-  iss.dump_d(dfname);
-  std::vector<uint8_t> iss_data = read_vector_from_file(dfname, dmem_bytes);
-  assert(iss_data.size() == dmem_bytes);
-
-  std::vector<uint8_t> rtl_data = get_sim_memory(dmem_scope, dmem_words, 32);
-  assert(rtl_data.size() == dmem_bytes);
+  // The ISS writes its copy of DMEM to the start of the shared memory region.
+  const uint8_t *iss_data = iss.get_shared_mem(dmem_bytes);
+  iss.dump_d(0, dmem_bytes);
+
+  // DMEM in the ISS was loaded from the RTL at the start of the operation, so
+  // the only words that can differ are ones that were written since then. If
+  // the trace checker has a complete list of them, we only need to read those
+  // words from the RTL: the rest of rtl_data is a copy of the ISS data.
+  std::vector<uint32_t> dirty_words;
+  bool dirty_valid = OtbnTraceChecker::get().GetDmemDirtyWords(&dirty_words);
+  dirty_words.erase(std::remove_if(dirty_words.begin(), dirty_words.end(),
+                                   [=](uint32_t w) { return w >= dmem_words; }),
+                    dirty_words.end());
+
+  std::vector<uint8_t> rtl_data(iss_data, iss_data + dmem_bytes);
+  if (dirty_valid) {
+    get_sim_words(dmem_scope, dirty_words, 32, &rtl_data[0]);
+  } else {
+    get_sim_memory(dmem_scope, dmem_words, 32, &rtl_data[0]);
+  }
 
   // If the arrays match, we're done.
   if (0 == memcmp(&iss_data[0], &rtl_data[0], dmem_bytes))
@@ -571,12 +552,13 @@ static void set_err_code(svBitVecVal *dst, uint32_t src) {
   }
 }
 
-extern "C" unsigned otbn_model_step(OtbnModel *model, const char *imem_scope,
+extern "C" unsigned otbn_model_step(void *handle, const char *imem_scope,
                                     unsigned imem_words, const char *dmem_scope,
                                     unsigned dmem_words,
                                     const char *design_scope, svLogic start_i,
                                     unsigned start_addr, unsigned status,
                                     svBitVecVal *err_code /* bit [31:0] */) {
+  OtbnModel *model = static_cast<OtbnModel *>(dpi_handle_get(handle));
   assert(model && imem_scope && dmem_scope && design_scope && err_code);
 
   // Run model checks if needed. This usually happens just after an operation
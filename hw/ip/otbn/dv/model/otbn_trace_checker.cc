@@ -4,8 +4,11 @@
 
 #include "otbn_trace_checker.h"
 
-#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <memory>
 
@@ -17,6 +20,7 @@ OtbnTraceChecker::OtbnTraceChecker()
     : rtl_pending_(false),
       rtl_stall_(false),
       iss_pending_(false),
+      rtl_cycle_(0),
       done_(true),
       seen_err_(false) {
   OtbnTraceSource::get().AddListener(this);
@@ -37,26 +41,25 @@ OtbnTraceChecker &OtbnTraceChecker::get() {
   return *trace_checker;
 }
 
-void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
-                                         unsigned int cycle_count) {
+void OtbnTraceChecker::AcceptTraceRecord(const OtbnTraceRecord &record) {
   assert(!(rtl_pending_ && iss_pending_));
 
   if (seen_err_)
     return;
 
-  done_ = false;
-  TraceEntry trace_entry = TraceEntry::from_rtl_trace(trace);
-  if (trace_entry.hdr_.empty()) {
-    std::cerr << "ERROR: Invalid RTL trace entry with empty header:\n";
-    trace_entry.print("  ", std::cerr);
+  StartEvent();
+  TraceEntry trace_entry;
+  std::string err;
+  if (!trace_entry.from_rtl_trace(record, &err)) {
+    std::cerr << "ERROR: Invalid RTL trace entry at cycle "
+              << record.cycle_count() << ": " << err << "\n";
     seen_err_ = true;
     return;
   }
 
-  // Unless something has gone very wrong, trace_entry.hdr_ will start with 'S'
-  // (stall) or 'E' (execute). We want to coalesce entries for an instruction
-  // here to avoid the ISS needing to figure out what write happens when on a
-  // multi-cycle instruction.
+  // We want to coalesce entries for an instruction here to avoid the ISS
+  // needing to figure out what write happens when on a multi-cycle
+  // instruction.
   //
   // We work on the basis that an instruction will appear as zero or more stall
   // entries followed by an execution entry. When we see a stall entry, we
@@ -66,11 +69,10 @@ void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
   // When an execution entry comes up, we check it matches the pending stall
   // entry and then merge all the fields together, finally setting
   // rtl_pending_.
-  bool is_stall = trace_entry.hdr_[0] == 'S';
-  if (is_stall) {
+  if (trace_entry.is_stall_) {
     if (rtl_stall_) {
       // We already have a stall line. Make sure the headers match.
-      if (rtl_stalled_entry_.hdr_ != trace_entry.hdr_) {
+      if (!rtl_stalled_entry_.SameInsn(trace_entry)) {
         std::cerr
             << ("ERROR: Stall trace entry followed by "
                 "mis-matching stall.\n"
@@ -81,7 +83,12 @@ void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
         seen_err_ = true;
         return;
       }
-      rtl_stalled_entry_.take_writes(trace_entry);
+      if (!rtl_stalled_entry_.take_writes(trace_entry)) {
+        std::cerr << "ERROR: Too many writes for stalled instruction:\n";
+        rtl_stalled_entry_.print("    ", std::cerr);
+        seen_err_ = true;
+        return;
+      }
     } else {
       // This is the first stall. Set the rtl_stall_ flag and save trace_entry.
       rtl_stall_ = true;
@@ -90,19 +97,10 @@ void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
     return;
   }
 
-  // This wasn't a stall entry. Check it's an execution.
-  if (trace_entry.hdr_[0] != 'E') {
-    std::cerr << "ERROR: Invalid RTL trace entry (neither S nor E):\n";
-    trace_entry.print("  ", std::cerr);
-    seen_err_ = true;
-    return;
-  }
-
-  // If had a stall before, merge in any writes from it, making sure the lines
-  // match.
+  // This was an execution entry. If had a stall before, merge in any writes
+  // from it, making sure the instructions match.
   if (rtl_stall_) {
-    if (trace_entry.hdr_.compare(1, std::string::npos, rtl_stalled_entry_.hdr_,
-                                 1, std::string::npos) != 0) {
+    if (!trace_entry.SameInsn(rtl_stalled_entry_)) {
       std::cerr
           << ("ERROR: Execution trace entry doesn't match stall:\n"
               "  Stall entry was:\n");
@@ -113,7 +111,12 @@ void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
       return;
     }
 
-    trace_entry.take_writes(rtl_stalled_entry_);
+    if (!trace_entry.take_writes(rtl_stalled_entry_)) {
+      std::cerr << "ERROR: Too many writes for instruction:\n";
+      trace_entry.print("    ", std::cerr);
+      seen_err_ = true;
+      return;
+    }
   }
 
   // Check we don't already have a pending RTL execution entry
@@ -132,13 +135,14 @@ void OtbnTraceChecker::AcceptTraceString(const std::string &trace,
   rtl_pending_ = true;
   rtl_stall_ = false;
   rtl_entry_ = trace_entry;
+  rtl_cycle_ = record.cycle_count();
 
   if (!MatchPair()) {
     seen_err_ = true;
   }
 }
 
-bool OtbnTraceChecker::OnIssTrace(const std::vector<std::string> &lines) {
+bool OtbnTraceChecker::OnIssTrace(const OtbnTraceRecord &record) {
   assert(!(rtl_pending_ && iss_pending_));
 
   if (seen_err_) {
@@ -146,13 +150,20 @@ bool OtbnTraceChecker::OnIssTrace(const std::vector<std::string> &lines) {
   }
 
   // Ignore STALL entries
-  if (lines.size() == 1 && lines[0] == "STALL") {
+  const std::vector<OtbnTraceLine> &lines = record.lines();
+  if (lines.size() == 1 && lines[0].len == 5 && lines[0].StartsWith("STALL")) {
     return true;
   }
 
-  TraceEntry trace_entry = TraceEntry::from_iss_trace(lines);
+  TraceEntry trace_entry;
+  std::string err;
+  if (!trace_entry.from_iss_trace(record, &err)) {
+    std::cerr << "ERROR: Invalid ISS trace entry: " << err << "\n";
+    seen_err_ = true;
+    return false;
+  }
 
-  done_ = false;
+  StartEvent();
   if (iss_pending_) {
     std::cerr
         << ("ERROR: Two back-to-back ISS "
@@ -195,16 +206,46 @@ bool OtbnTraceChecker::Finish() {
   return true;
 }
 
+bool OtbnTraceChecker::GetDmemDirtyWords(std::vector<uint32_t> *dst) const {
+  assert(dst);
+  dst->assign(dmem_dirty_.begin(), dmem_dirty_.end());
+  return !seen_err_;
+}
+
+void OtbnTraceChecker::StartEvent() {
+  if (done_) {
+    dmem_dirty_.clear();
+  }
+  done_ = false;
+}
+
+void OtbnTraceChecker::MarkDirty(const TraceEntry &entry) {
+  for (size_t i = 0; i < entry.num_writes_; ++i) {
+    const TraceEntry::Write &write = entry.writes_[i];
+    if (write.kind == TraceEntry::kDmem) {
+      dmem_dirty_.insert(write.loc / 32);
+    }
+  }
+}
+
 bool OtbnTraceChecker::MatchPair() {
   if (!(rtl_pending_ && iss_pending_)) {
     return true;
   }
   rtl_pending_ = false;
   iss_pending_ = false;
+
+  // Track DMEM writes from both sides, so that the final check of memory
+  // contents looks at every word that either of them touched.
+  MarkDirty(rtl_entry_);
+  MarkDirty(iss_entry_);
+
   if (!(rtl_entry_ == iss_entry_)) {
     std::cerr
-        << ("ERROR: Mismatch between RTL and ISS trace entries.\n"
-            "  RTL entry is:\n");
+        << "ERROR: Mismatch between RTL and ISS trace entries at cycle "
+        << rtl_cycle_ << ":\n";
+    rtl_entry_.print_diff(iss_entry_, "RTL", "ISS", "  ", std::cerr);
+    std::cerr << "  RTL entry is:\n";
     rtl_entry_.print("    ", std::cerr);
     std::cerr << "  ISS entry is:\n";
     iss_entry_.print("    ", std::cerr);
@@ -214,68 +255,382 @@ bool OtbnTraceChecker::MatchPair() {
   return true;
 }
 
-OtbnTraceChecker::TraceEntry OtbnTraceChecker::TraceEntry::from_rtl_trace(
-    const std::string &trace) {
-  TraceEntry entry;
+namespace {
+// A cursor over a trace line, used to parse it. Each of the Read and Expect
+// methods returns false if the text at the cursor doesn't have the expected
+// form. On failure, the cursor might have moved.
+class LineParser {
+ public:
+  explicit LineParser(const OtbnTraceLine &line)
+      : pos_(line.data), end_(line.data + line.len) {}
+
+  bool AtEnd() const { return pos_ == end_; }
+
+  // If the text at the cursor starts with str, skip over it.
+  bool Expect(const char *str) {
+    size_t len = strlen(str);
+    if (static_cast<size_t>(end_ - pos_) < len || memcmp(pos_, str, len) != 0)
+      return false;
+    pos_ += len;
+    return true;
+  }
+
+  // Read an unsigned decimal number
+  bool ReadDec(uint32_t *dst) {
+    if (pos_ == end_ || !isdigit(*pos_))
+      return false;
+
+    uint32_t val = 0;
+    while (pos_ != end_ && isdigit(*pos_)) {
+      val = 10 * val + (*pos_ - '0');
+      ++pos_;
+    }
+    *dst = val;
+    return true;
+  }
 
-  size_t eol = trace.find('\n');
-  entry.hdr_ = trace.substr(0, eol);
+  // Read a hex value like 0x12345678 or 0x12345678_9abcdef0 (as generated by
+  // otbn_wlen_data_str in the RTL tracer) into exactly num_words 32-bit words,
+  // most significant first.
+  bool ReadHex(uint32_t *dst, unsigned num_words) {
+    if (!Expect("0x"))
+      return false;
+
+    unsigned digits = 0;
+    uint32_t acc = 0;
+    for (; pos_ != end_; ++pos_) {
+      char c = *pos_;
+      if (c == '_')
+        continue;
+      if (!isxdigit(c))
+        break;
+
+      if (digits == 8 * num_words)
+        return false;
+
+      uint32_t nibble = isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10);
+      acc = (acc << 4) | nibble;
+      ++digits;
+      if (digits % 8 == 0) {
+        dst[digits / 8 - 1] = acc;
+        acc = 0;
+      }
+    }
+    return digits == 8 * num_words;
+  }
+
+ private:
+  const char *pos_;
+  const char *end_;
+};
+}  // namespace
 
-  while (eol != std::string::npos) {
-    size_t bol = eol + 1;
-    eol = trace.find('\n', bol);
-    size_t line_len =
-        (eol == std::string::npos) ? std::string::npos : eol - bol;
-    std::string line = trace.substr(bol, line_len);
-    if (line.size() > 0 && line[0] == '>')
-      entry.writes_.push_back(line);
+static const char *ispr_names[] = {"MOD", "ACC", "RND"};
+
+bool OtbnTraceChecker::TraceEntry::from_rtl_trace(
+    const OtbnTraceRecord &record, std::string *err) {
+  assert(err);
+  *this = TraceEntry();
+
+  const std::vector<OtbnTraceLine> &lines = record.lines();
+  if (lines.empty()) {
+    *err = "empty record";
+    return false;
   }
-  std::sort(entry.writes_.begin(), entry.writes_.end());
 
-  return entry;
+  if (!parse_header(lines[0], err))
+    return false;
+
+  // Reads ('<' and 'R' lines) don't appear in the ISS trace, so we don't
+  // track them.
+  for (size_t i = 1; i < lines.size(); ++i) {
+    char type = lines[i].type();
+    if ((type == '>' || type == 'W') && !parse_write(lines[i], err))
+      return false;
+  }
+  return true;
 }
 
-OtbnTraceChecker::TraceEntry OtbnTraceChecker::TraceEntry::from_iss_trace(
-    const std::vector<std::string> &lines) {
-  TraceEntry entry;
-  if (!lines.empty()) {
-    entry.hdr_ = lines[0];
+bool OtbnTraceChecker::TraceEntry::from_iss_trace(
+    const OtbnTraceRecord &record, std::string *err) {
+  assert(err);
+  *this = TraceEntry();
+
+  const std::vector<OtbnTraceLine> &lines = record.lines();
+  if (lines.empty()) {
+    *err = "empty record";
+    return false;
   }
-  bool first = true;
-  for (const std::string &line : lines) {
-    if (first) {
-      entry.hdr_ = line;
-    } else {
-      // Ignore '!' lines (which are used to tell the simulation about external
-      // register changes, not tracked by the RTL core simulation)
-      bool is_bang = (line.size() > 0 && line[0] == '!');
-      if (!is_bang) {
-        entry.writes_.push_back(line);
-      }
-    }
-    first = false;
+
+  if (!parse_header(lines[0], err))
+    return false;
+
+  for (size_t i = 1; i < lines.size(); ++i) {
+    // Ignore '!' lines (which are used to tell the simulation about external
+    // register changes, not tracked by the RTL core simulation)
+    if (lines[i].type() == '!')
+      continue;
+    if (!parse_write(lines[i], err))
+      return false;
   }
-  std::sort(entry.writes_.begin(), entry.writes_.end());
-  return entry;
+  return true;
 }
 
 bool OtbnTraceChecker::TraceEntry::operator==(const TraceEntry &other) const {
-  return hdr_ == other.hdr_ && writes_ == other.writes_;
+  if (is_stall_ != other.is_stall_ || !SameInsn(other) ||
+      num_writes_ != other.num_writes_)
+    return false;
+
+  for (size_t i = 0; i < num_writes_; ++i) {
+    if (!(writes_[i] == other.writes_[i]))
+      return false;
+  }
+  return true;
 }
 
 void OtbnTraceChecker::TraceEntry::print(const std::string &indent,
                                          std::ostream &os) const {
-  os << indent << hdr_ << "\n";
-  for (const std::string &write : writes_) {
-    os << indent << write << "\n";
+  char hdr[64];
+  snprintf(hdr, sizeof hdr, "%c PC: 0x%08x, insn: 0x%08x",
+           is_stall_ ? 'S' : 'E', pc_, insn_);
+  os << indent << hdr << "\n";
+  for (size_t i = 0; i < num_writes_; ++i) {
+    os << indent << writes_[i].str() << "\n";
   }
 }
 
-void OtbnTraceChecker::TraceEntry::take_writes(const TraceEntry &other) {
-  if (!other.writes_.empty()) {
-    for (const std::string &write : other.writes_) {
-      writes_.push_back(write);
+void OtbnTraceChecker::TraceEntry::print_diff(const TraceEntry &other,
+                                              const char *this_name,
+                                              const char *other_name,
+                                              const std::string &indent,
+                                              std::ostream &os) const {
+  if (!SameInsn(other)) {
+    os << std::hex << std::setfill('0');
+    os << indent << "Instructions differ: " << this_name << " has PC 0x"
+       << std::setw(8) << pc_ << ", insn 0x" << std::setw(8) << insn_ << "; "
+       << other_name << " has PC 0x" << std::setw(8) << other.pc_
+       << ", insn 0x" << std::setw(8) << other.insn_ << ".\n";
+    os << std::dec << std::setfill(' ');
+  }
+
+  // Both lists of writes are sorted by target and then value, so we can walk
+  // through them together, one target at a time.
+  size_t i = 0, j = 0;
+  while (i < num_writes_ || j < other.num_writes_) {
+    const Write *target;
+    if (j == other.num_writes_ ||
+        (i < num_writes_ && !(other.writes_[j] < writes_[i]))) {
+      target = &writes_[i];
+    } else {
+      target = &other.writes_[j];
+    }
+
+    // Find the writes to this target on each side that the other side
+    // doesn't have. Writes to the same target are compared as a multiset, so
+    // the order in which they appeared in the trace doesn't matter.
+    const Write *ours[kMaxWrites], *theirs[kMaxWrites];
+    size_t num_ours = 0, num_theirs = 0;
+    while (i < num_writes_ && writes_[i].SameTarget(*target) &&
+           j < other.num_writes_ && other.writes_[j].SameTarget(*target)) {
+      if (writes_[i] == other.writes_[j]) {
+        ++i;
+        ++j;
+      } else if (writes_[i].Before(other.writes_[j])) {
+        ours[num_ours++] = &writes_[i++];
+      } else {
+        theirs[num_theirs++] = &other.writes_[j++];
+      }
+    }
+    while (i < num_writes_ && writes_[i].SameTarget(*target)) {
+      ours[num_ours++] = &writes_[i++];
+    }
+    while (j < other.num_writes_ && other.writes_[j].SameTarget(*target)) {
+      theirs[num_theirs++] = &other.writes_[j++];
+    }
+
+    if (num_ours == 1 && num_theirs == 1) {
+      os << indent << "Different values written. " << this_name << ": `"
+         << ours[0]->str() << "'; " << other_name << ": `" << theirs[0]->str()
+         << "'.\n";
+      continue;
+    }
+    for (size_t k = 0; k < num_ours; ++k) {
+      os << indent << "Write only in " << this_name << ": `" << ours[k]->str()
+         << "'.\n";
+    }
+    for (size_t k = 0; k < num_theirs; ++k) {
+      os << indent << "Write only in " << other_name << ": `"
+         << theirs[k]->str() << "'.\n";
+    }
+  }
+}
+
+bool OtbnTraceChecker::TraceEntry::take_writes(const TraceEntry &other) {
+  for (size_t i = 0; i < other.num_writes_; ++i) {
+    if (!add_write(other.writes_[i]))
+      return false;
+  }
+  return true;
+}
+
+bool OtbnTraceChecker::TraceEntry::parse_header(const OtbnTraceLine &line,
+                                                std::string *err) {
+  // Headers look like "E PC: 0x00000158, insn: 0x01acd08b" (or start with 'S'
+  // for a stall).
+  LineParser parser(line);
+  char type = line.type();
+  if ((type == 'E' || type == 'S') &&
+      parser.Expect(type == 'E' ? "E PC: " : "S PC: ") &&
+      parser.ReadHex(&pc_, 1) && parser.Expect(", insn: ") &&
+      parser.ReadHex(&insn_, 1) && parser.AtEnd()) {
+    is_stall_ = (type == 'S');
+    return true;
+  }
+
+  *err = "invalid header line: `" + line.str() + "'";
+  return false;
+}
+
+bool OtbnTraceChecker::TraceEntry::parse_write(const OtbnTraceLine &line,
+                                               std::string *err) {
+  LineParser parser(line);
+  Write write;
+  bool ok = false;
+
+  if (parser.Expect("W [")) {
+    // A DMEM write, which is either a single 32-bit word or a full 256-bit
+    // word. Writes with a bad mask ("Mask ERR") don't parse.
+    write.kind = kDmem;
+    if (parser.ReadHex(&write.loc, 1) && parser.Expect("]: ")) {
+      LineParser narrow = parser;
+      if (narrow.ReadHex(write.value, 1) && narrow.AtEnd()) {
+        write.num_words = 1;
+        ok = true;
+      } else {
+        write.num_words = 8;
+        ok = parser.ReadHex(write.value, 8) && parser.AtEnd();
+      }
     }
-    std::sort(writes_.begin(), writes_.end());
+  } else if (parser.Expect("> ")) {
+    if (parser.Expect("x")) {
+      write.kind = kGpr;
+      write.num_words = 1;
+      ok = parser.ReadDec(&write.loc) && write.loc < 32;
+    } else if (parser.Expect("w")) {
+      write.kind = kWdr;
+      write.num_words = 8;
+      ok = parser.ReadDec(&write.loc) && write.loc < 32;
+    } else if (parser.Expect("FLAGS")) {
+      write.kind = kFlags;
+      write.num_words = 1;
+      ok = parser.ReadDec(&write.loc);
+    } else {
+      write.kind = kIspr;
+      write.num_words = 8;
+      for (uint32_t i = 0; i < kNumIsprs; ++i) {
+        if (parser.Expect(ispr_names[i])) {
+          write.loc = i;
+          ok = true;
+          break;
+        }
+      }
+    }
+
+    ok = ok && parser.Expect(": ");
+    if (ok && write.kind == kFlags) {
+      // Flags look like "{C: 1, M: 0, L: 1, Z: 0}"
+      static const char *fields[] = {"{C: ", ", M: ", ", L: ", ", Z: "};
+      write.value[0] = 0;
+      for (int i = 0; ok && i < 4; ++i) {
+        uint32_t bit;
+        ok = parser.Expect(fields[i]) && parser.ReadDec(&bit) && bit <= 1;
+        write.value[0] |= bit << i;
+      }
+      ok = ok && parser.Expect("}");
+    } else if (ok) {
+      ok = parser.ReadHex(write.value, write.num_words);
+    }
+    ok = ok && parser.AtEnd();
+  }
+
+  if (!ok) {
+    *err = "invalid write line: `" + line.str() + "'";
+    return false;
+  }
+  if (!add_write(write)) {
+    *err = "too many writes (at most " + std::to_string(kMaxWrites) +
+           " are supported)";
+    return false;
+  }
+  return true;
+}
+
+bool OtbnTraceChecker::TraceEntry::add_write(const Write &write) {
+  if (num_writes_ == kMaxWrites)
+    return false;
+
+  // Insertion sort: entries have few enough writes that this is cheap. Writes
+  // to the same target are sorted by value, so the order in which they
+  // arrived doesn't affect the comparison.
+  size_t pos = num_writes_;
+  while (pos > 0 && write.Before(writes_[pos - 1])) {
+    writes_[pos] = writes_[pos - 1];
+    --pos;
+  }
+  writes_[pos] = write;
+  ++num_writes_;
+  return true;
+}
+
+bool OtbnTraceChecker::TraceEntry::Write::operator==(
+    const Write &other) const {
+  return SameTarget(other) && num_words == other.num_words &&
+         memcmp(value, other.value, num_words * sizeof value[0]) == 0;
+}
+
+bool OtbnTraceChecker::TraceEntry::Write::Before(const Write &other) const {
+  if (!SameTarget(other))
+    return *this < other;
+  if (num_words != other.num_words)
+    return num_words < other.num_words;
+  for (unsigned i = 0; i < num_words; ++i) {
+    if (value[i] != other.value[i])
+      return value[i] < other.value[i];
+  }
+  return false;
+}
+
+std::string OtbnTraceChecker::TraceEntry::Write::str() const {
+  char buf[128];
+  int pos;
+  switch (kind) {
+    case kGpr:
+      pos = snprintf(buf, sizeof buf, "> x%02u: ", loc);
+      break;
+    case kWdr:
+      pos = snprintf(buf, sizeof buf, "> w%02u: ", loc);
+      break;
+    case kIspr:
+      pos = snprintf(buf, sizeof buf, "> %s: ",
+                     loc < kNumIsprs ? ispr_names[loc] : "UNKNOWN_ISPR");
+      break;
+    case kFlags:
+      snprintf(buf, sizeof buf, "> FLAGS%u: {C: %u, M: %u, L: %u, Z: %u}",
+               loc, value[0] & 1, (value[0] >> 1) & 1, (value[0] >> 2) & 1,
+               (value[0] >> 3) & 1);
+      return buf;
+    case kDmem:
+      pos = snprintf(buf, sizeof buf, "W [0x%08x]: ", loc);
+      break;
+    default:
+      assert(0);
+      return "";
+  }
+
+  pos += snprintf(buf + pos, sizeof buf - pos, "0x");
+  for (unsigned i = 0; i < num_words; ++i) {
+    pos += snprintf(buf + pos, sizeof buf - pos, "%s%08x", i ? "_" : "",
+                    value[i]);
   }
+  return buf;
 }
@@ -34,8 +34,20 @@
 //
 // To catch these cases, the ISS simulation must call the Finish() method when
 // it is done (which checks there are no outstanding events missing).
+//
+// Both traces are decoded into typed entries (the instruction address and
+// encoding, together with the register, flag and DMEM writes that it
+// performed) as they arrive. When two entries don't match, the checker
+// reports the writes that differ.
+//
+// Writes to DMEM appear as 'W' lines in both traces, so they are compared like
+// register writes. The checker also keeps track of which DMEM words have been
+// written by the current operation, which allows the end-of-run DMEM check to
+// look at just those words.
 
+#include <cstdint>
 #include <iosfwd>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -51,13 +63,13 @@ class OtbnTraceChecker : public OtbnTraceListener {
 
   // Take a trace entry from the wrapped RTL. Any mismatch error is stored
   // until the next call to an API function that can respond with the error.
-  void AcceptTraceString(const std::string &trace,
-                         unsigned int cycle_count) override;
+  void AcceptTraceRecord(const OtbnTraceRecord &record) override;
 
-  // Take a trace entry from the wrapped ISS.
+  // Take a trace entry from the wrapped ISS. The cycle count in record is
+  // ignored.
   //
   // Prints an error message to stderr and returns false on mismatch.
-  bool OnIssTrace(const std::vector<std::string> &lines);
+  bool OnIssTrace(const OtbnTraceRecord &record);
 
   // Call this when the ISS simulation completes an operation (on ECALL or
   // error).
@@ -66,27 +78,115 @@ class OtbnTraceChecker : public OtbnTraceListener {
   // mismatch.
   bool Finish();
 
+  // Get the indices of the 256-bit DMEM words written by the current (or most
+  // recent) operation, in increasing order. Returns false if the checker has
+  // seen an error, in which case the list might not be complete.
+  bool GetDmemDirtyWords(std::vector<uint32_t> *dst) const;
+
  private:
+  // Called on each trace event. If the previous operation has finished, this
+  // resets the per-operation state (at the moment, just the dirty set).
+  void StartEvent();
+
   // If rtl_pending_ and iss_pending_ are not both true, return true
   // immediately with no other change. Otherwise, compare the two pending trace
   // entries. If they match, clear them both and return true. If not, print a
   // message to stderr and return false.
   bool MatchPair();
 
+  // A decoded trace entry. Trace lines from both the RTL and the ISS are
+  // parsed into one of these when they arrive, so that comparing two entries
+  // is just a matter of comparing some integers.
   class TraceEntry {
    public:
-    static TraceEntry from_rtl_trace(const std::string &trace);
-    static TraceEntry from_iss_trace(const std::vector<std::string> &lines);
+    // The kinds of write that we track
+    enum WriteKind : uint8_t { kGpr, kWdr, kIspr, kFlags, kDmem };
+
+    // A write to a register, a flag group or DMEM. For register writes, loc
+    // is the index of the register (or flag group). For ISPRs, it is one of
+    // the kIspr* constants below. For DMEM writes, it is the byte address of
+    // the first byte written.
+    //
+    // The written value is stored in value as num_words 32-bit words, most
+    // significant first (matching the order in the trace). Flags are stored
+    // in a single word with C, M, L and Z in bits 0 to 3.
+    struct Write {
+      WriteKind kind;
+      uint32_t loc;
+      unsigned num_words;
+      uint32_t value[8];
+
+      bool SameTarget(const Write &other) const {
+        return kind == other.kind && loc == other.loc;
+      }
+      bool operator<(const Write &other) const {
+        return kind < other.kind || (kind == other.kind && loc < other.loc);
+      }
+      bool operator==(const Write &other) const;
+
+      // Order by target and then by the value written. Sorting the writes of
+      // an entry with this means that two entries with the same writes (in
+      // whatever order) end up with identical lists.
+      bool Before(const Write &other) const;
+
+      // Render the write in the trace format
+      std::string str() const;
+    };
+
+    enum { kIsprMod, kIsprAcc, kIsprRnd, kNumIsprs };
+
+    // The most writes that a single entry (including any stall cycles) can
+    // have. An instruction that does more than this is reported as an error.
+    static const size_t kMaxWrites = 8;
+
+    TraceEntry() : is_stall_(false), pc_(0), insn_(0), num_writes_(0) {}
+
+    // Parse a trace entry from the RTL or the ISS. On failure, these return
+    // false and write a description of the problem to err.
+    bool from_rtl_trace(const OtbnTraceRecord &record, std::string *err);
+    bool from_iss_trace(const OtbnTraceRecord &record, std::string *err);
 
     bool operator==(const TraceEntry &other) const;
     void print(const std::string &indent, std::ostream &os) const;
 
-    void take_writes(const TraceEntry &other);
+    // Write a description of each way that this entry differs from other to
+    // os, one per line. Our side is called this_name; the other is other_name.
+    void print_diff(const TraceEntry &other, const char *this_name,
+                    const char *other_name, const std::string &indent,
+                    std::ostream &os) const;
+
+    // Return true if other is for the same instruction (ignoring whether
+    // either entry is a stall).
+    bool SameInsn(const TraceEntry &other) const {
+      return pc_ == other.pc_ && insn_ == other.insn_;
+    }
+
+    // Add the writes from other to this entry. Returns false if there isn't
+    // space for them.
+    bool take_writes(const TraceEntry &other);
+
+    bool is_stall_;
+    uint32_t pc_;
+    uint32_t insn_;
 
-    std::string hdr_;
-    std::vector<std::string> writes_;
+    // Writes, sorted by kind, then location and then value (see Write::Before)
+    size_t num_writes_;
+    Write writes_[kMaxWrites];
+
+   private:
+    // Parse the header ('E' or 'S') line
+    bool parse_header(const OtbnTraceLine &line, std::string *err);
+
+    // Parse a '>' or 'W' line and add it to writes_
+    bool parse_write(const OtbnTraceLine &line, std::string *err);
+
+    // Insert write, keeping writes_ sorted
+    bool add_write(const Write &write);
   };
 
+  // Add any DMEM words written by entry to dmem_dirty_.
+  void MarkDirty(const TraceEntry &entry);
+
   bool rtl_pending_;
   bool rtl_stall_;
   TraceEntry rtl_entry_;
@@ -95,6 +195,12 @@ class OtbnTraceChecker : public OtbnTraceListener {
   bool iss_pending_;
   TraceEntry iss_entry_;
 
+  // The cycle count of the RTL execution entry in rtl_entry_
+  unsigned int rtl_cycle_;
+
+  // Indices of the DMEM words written by the current operation
+  std::set<uint32_t> dmem_dirty_;
+
   bool done_;
   bool seen_err_;
 };
@@ -0,0 +1,143 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "otbn_trace_checker.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "otbn_trace_source.h"
+
+namespace {
+
+const char kHdr[] = "E PC: 0x00000010, insn: 0x0000a103\n";
+const char kStallHdr[] = "S PC: 0x00000010, insn: 0x0000a103\n";
+
+class OtbnTraceCheckerTest : public testing::Test {
+ protected:
+  // The checker registers itself with the trace source, but the tests pass
+  // records to it directly.
+  ~OtbnTraceCheckerTest() { OtbnTraceSource::get().RemoveListener(&checker_); }
+
+  void Rtl(const std::string &trace, unsigned int cycle = 1) {
+    record_.Reset(trace.c_str(), cycle);
+    checker_.AcceptTraceRecord(record_);
+  }
+
+  bool Iss(const std::string &trace) {
+    record_.Reset(trace.c_str(), 0);
+    return checker_.OnIssTrace(record_);
+  }
+
+  OtbnTraceChecker checker_;
+  OtbnTraceRecord record_;
+};
+
+TEST_F(OtbnTraceCheckerTest, MatchingEntries) {
+  // Reads only appear in the RTL trace and '!' lines only in the ISS trace
+  Rtl(std::string(kHdr) + "< x02: 0x00000004\n> x01: 0x00000005");
+  EXPECT_TRUE(Iss(std::string(kHdr) + "! x02 changed\n> x01: 0x00000005"));
+
+  // The ISS can go first, and ignores ISS stalls
+  EXPECT_TRUE(Iss("STALL"));
+  EXPECT_TRUE(Iss(std::string(kHdr) + "> w03: 0x" + std::string(64, '1')));
+  Rtl(std::string(kHdr) + "> w03: 0x" + std::string(64, '1'));
+  EXPECT_TRUE(checker_.Finish());
+}
+
+TEST_F(OtbnTraceCheckerTest, WriteOrderDoesNotMatter) {
+  Rtl(std::string(kHdr) +
+      "> FLAGS0: {C: 1, M: 0, L: 0, Z: 1}\n"
+      "> x01: 0x00000005\n"
+      "W [0x00000020]: 0x00000001\n"
+      "W [0x00000020]: 0x00000002");
+  EXPECT_TRUE(Iss(std::string(kHdr) +
+                  "W [0x00000020]: 0x00000002\n"
+                  "> x01: 0x00000005\n"
+                  "W [0x00000020]: 0x00000001\n"
+                  "> FLAGS0: {C: 1, M: 0, L: 0, Z: 1}"));
+  EXPECT_TRUE(checker_.Finish());
+}
+
+TEST_F(OtbnTraceCheckerTest, MergesStalls) {
+  // The writes of a stalled instruction can be spread over several cycles
+  Rtl(std::string(kStallHdr) + "W [0x00000020]: 0x00000002", 1);
+  Rtl(std::string(kStallHdr), 2);
+  Rtl(std::string(kHdr) + "W [0x00000020]: 0x00000001", 3);
+  EXPECT_TRUE(Iss(std::string(kHdr) +
+                  "W [0x00000020]: 0x00000001\n"
+                  "W [0x00000020]: 0x00000002"));
+  EXPECT_TRUE(checker_.Finish());
+}
+
+TEST_F(OtbnTraceCheckerTest, DifferentValue) {
+  Rtl(std::string(kHdr) + "> x01: 0x00000005");
+  EXPECT_FALSE(Iss(std::string(kHdr) + "> x01: 0x00000006"));
+  EXPECT_FALSE(checker_.Finish());
+}
+
+TEST_F(OtbnTraceCheckerTest, WritesCompareAsMultiset) {
+  // The same write twice isn't the same as two different writes
+  Rtl(std::string(kHdr) +
+      "W [0x00000020]: 0x00000001\n"
+      "W [0x00000020]: 0x00000001");
+  EXPECT_FALSE(Iss(std::string(kHdr) +
+                   "W [0x00000020]: 0x00000001\n"
+                   "W [0x00000020]: 0x00000002"));
+}
+
+TEST_F(OtbnTraceCheckerTest, MissingWrite) {
+  Rtl(std::string(kHdr) + "> x01: 0x00000005");
+  EXPECT_FALSE(
+      Iss(std::string(kHdr) + "> x01: 0x00000005\n> x02: 0x00000005"));
+}
+
+TEST_F(OtbnTraceCheckerTest, DifferentInstruction) {
+  Rtl(std::string(kHdr));
+  EXPECT_FALSE(Iss("E PC: 0x00000014, insn: 0x0000a103"));
+}
+
+TEST_F(OtbnTraceCheckerTest, StallForOtherInstruction) {
+  Rtl("S PC: 0x0000000c, insn: 0x0000a103");
+  Rtl(std::string(kHdr));
+  EXPECT_FALSE(Iss(std::string(kHdr)));
+}
+
+TEST_F(OtbnTraceCheckerTest, BackToBackEntries) {
+  Rtl(std::string(kHdr));
+  Rtl(std::string(kHdr));
+  EXPECT_FALSE(Iss(std::string(kHdr)));
+}
+
+TEST_F(OtbnTraceCheckerTest, InvalidEntry) {
+  EXPECT_FALSE(Iss(std::string(kHdr) + "> x32: 0x00000005"));
+}
+
+TEST_F(OtbnTraceCheckerTest, UnmatchedEntryAtFinish) {
+  Rtl(std::string(kHdr));
+  EXPECT_FALSE(checker_.Finish());
+}
+
+TEST_F(OtbnTraceCheckerTest, TracksDirtyDmemWords) {
+  Rtl(std::string(kHdr) + "W [0x00000024]: 0x00000001");
+  EXPECT_TRUE(Iss(std::string(kHdr) + "W [0x00000024]: 0x00000001"));
+  Rtl(std::string(kHdr) + "W [0x00000040]: 0x" + std::string(64, '2'));
+  EXPECT_TRUE(Iss(std::string(kHdr) + "W [0x00000040]: 0x" +
+                  std::string(64, '2')));
+  EXPECT_TRUE(checker_.Finish());
+
+  std::vector<uint32_t> dirty;
+  EXPECT_TRUE(checker_.GetDmemDirtyWords(&dirty));
+  EXPECT_EQ(dirty, std::vector<uint32_t>({1, 2}));
+
+  // The next operation starts with a clean set
+  Rtl(std::string(kHdr) + "W [0x00000000]: 0x00000001");
+  EXPECT_TRUE(Iss(std::string(kHdr) + "W [0x00000000]: 0x00000001"));
+  EXPECT_TRUE(checker_.Finish());
+  EXPECT_TRUE(checker_.GetDmemDirtyWords(&dirty));
+  EXPECT_EQ(dirty, std::vector<uint32_t>({0}));
+}
+
+}  // namespace
@@ -22,6 +22,11 @@ class TraceDmemStore(Trace):
         top = self.addr + num_bytes - 1
         return 'dmem[{:#x}..{:#x}] = {:#x}'.format(self.addr, top, self.value)
 
+    def rtl_trace(self) -> str:
+        width = 256 if self.is_wide else 32
+        return 'W [{:#010x}]: {}'.format(self.addr,
+                                         Trace.hex_value(self.value, width))
+
 
 class Dmem:
     '''An object representing OTBN's DMEM.
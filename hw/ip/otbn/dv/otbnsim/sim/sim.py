@@ -14,6 +14,11 @@ class OTBNSim:
         self.state = OTBNState()
         self.program = []  # type: List[OTBNInsn]
 
+    def reset(self) -> None:
+        '''Reset to the state we had just after construction'''
+        self.state = OTBNState()
+        self.program = []
+
     def load_program(self, program: List[OTBNInsn]) -> None:
         self.program = program.copy()
 
@@ -34,15 +34,67 @@ prefixed with "0x" if they are hexadecimal.
 
     print_regs           Write the contents of all registers to stdout (in hex)
 
+    reset                Reset the simulator to its initial state, clearing
+                         registers, memories and the loaded program.
+
+    shm <fd> <size>      Map <size> bytes of the file descriptor <fd> (which
+                         we inherited from our parent) as a memory region
+                         shared with the parent process. Any existing mapping
+                         is replaced.
+
+    load_shm_d <offset> <len>
+                         Like load_d, but read <len> bytes at <offset> in the
+                         shared memory region.
+
+    load_shm_i <offset> <len>
+                         Like load_i, but read <len> bytes at <offset> in the
+                         shared memory region.
+
+    dump_shm_d <offset> <len>
+                         Like dump_d, but write to <len> bytes at <offset> in
+                         the shared memory region. <len> must match the size
+                         of DMEM.
+
+    binary               Switch to binary framing for all later responses
+                         (see below).
+
+    step_batch <n>       Run up to <n> cycles, stopping early if OTBN stops
+                         running. Only supported in binary mode.
+
+By default, the output for each command is a series of lines, terminated by a
+line containing just a '.'. After the binary command, the response to each
+command is instead a single frame: a 32-bit little-endian length followed by
+that many bytes of payload. For most commands, the payload is the text that
+would have been printed in text mode (without the '.' terminator).
+
+The payload for step_batch is a sequence of per-cycle records. Each record is
+a packed little-endian header (see _STEP_RECORD) followed by the trace lines
+for that cycle, joined with newlines. The header gives a "done" byte (nonzero
+if OTBN stopped on this cycle), the value of ERR_BITS (only meaningful if done
+is set) and the number of bytes of trace text that follow.
+
 '''
 
+import io
+import mmap
+import struct
 import sys
-from typing import List
+from contextlib import redirect_stdout
+from typing import Callable, Dict, List, Optional, Tuple
 
-from sim.decode import decode_file
+from sim.decode import decode_bytes, decode_file
 from sim.elf import load_elf
+from sim.ext_regs import TraceExtRegChange
 from sim.sim import OTBNSim
 
+# The header for each record in the response to step_batch: done flag,
+# ERR_BITS value and number of bytes of trace text.
+_STEP_RECORD = struct.Struct('<BII')
+
+# The memory region shared with our parent process (set up by the shm
+# command), or None if there isn't one yet.
+_SHM = None  # type: Optional[mmap.mmap]
+
 
 def read_word(arg_name: str, word_data: str) -> int:
     '''Try to read a 32-bit unsigned word'''
@@ -81,26 +133,78 @@ def on_start(sim: OTBNSim, args: List[str]) -> None:
     sim.state.start()
 
 
-def on_step(sim: OTBNSim, args: List[str]) -> None:
-    '''Step one instruction'''
-    if len(args):
-        raise ValueError('step expects zero arguments. Got {}.'
-                         .format(args))
+def step_once(sim: OTBNSim) -> Tuple[List[str], bool, int]:
+    '''Step one instruction, returning its trace lines
 
+    Also returns a flag that is true if this step made OTBN stop running and
+    the value of ERR_BITS written as it stopped (zero if it didn't stop).
+
+    '''
     pc = sim.state.pc
     assert 0 == pc & 3
 
+    was_running = sim.state.running
     insn, changes = sim.step(verbose=False)
 
     if insn is None:
         hdr = 'STALL'
     else:
         hdr = 'E PC: {:#010x}, insn: {:#010x}'.format(pc, insn.raw)
-    print(hdr)
+
+    lines = [hdr]
+    err_bits = 0
     for change in changes:
         entry = change.rtl_trace()
         if entry is not None:
-            print(entry)
+            lines.append(entry)
+        if isinstance(change, TraceExtRegChange) and change.name == 'ERR_BITS':
+            err_bits = change.new_value
+
+    done = was_running and not sim.state.running
+    return (lines, done, err_bits if done else 0)
+
+
+def on_step(sim: OTBNSim, args: List[str]) -> None:
+    '''Step one instruction'''
+    if len(args):
+        raise ValueError('step expects zero arguments. Got {}.'
+                         .format(args))
+
+    lines, _, _ = step_once(sim)
+    for line in lines:
+        print(line)
+
+
+def on_step_batch(sim: OTBNSim, args: List[str]) -> bytes:
+    '''Step up to a given number of cycles, returning packed trace records'''
+    if len(args) != 1:
+        raise ValueError('step_batch expects exactly 1 argument. Got {}.'
+                         .format(args))
+
+    num_cycles = read_word('n', args[0])
+    if num_cycles == 0:
+        raise ValueError('step_batch needs a positive cycle count.')
+
+    records = []  # type: List[bytes]
+    for _ in range(num_cycles):
+        lines, done, err_bits = step_once(sim)
+        text = '\n'.join(lines).encode('utf-8')
+        records.append(_STEP_RECORD.pack(int(done), err_bits, len(text)))
+        records.append(text)
+        if not sim.state.running:
+            break
+
+    return b''.join(records)
+
+
+def on_reset(sim: OTBNSim, args: List[str]) -> None:
+    '''Reset the simulator to its initial state'''
+    if len(args):
+        raise ValueError('reset expects zero arguments. Got {}.'
+                         .format(args))
+
+    print('RESET')
+    sim.reset()
 
 
 def on_run(sim: OTBNSim, args: List[str]) -> None:
@@ -160,6 +264,76 @@ def on_dump_d(sim: OTBNSim, args: List[str]) -> None:
         handle.write(sim.state.dmem.dump_le_words())
 
 
+def on_shm(sim: OTBNSim, args: List[str]) -> None:
+    '''Map a memory region shared with our parent process'''
+    global _SHM
+
+    if len(args) != 2:
+        raise ValueError('shm expects exactly 2 arguments. Got {}.'
+                         .format(args))
+
+    fd = read_word('fd', args[0])
+    size = read_word('size', args[1])
+
+    print('SHM {} {:#x}'.format(fd, size))
+    if _SHM is not None:
+        _SHM.close()
+        _SHM = None
+    _SHM = mmap.mmap(fd, size)
+
+
+def get_shm_range(cmd: str, args: List[str]) -> Tuple[mmap.mmap, int, int]:
+    '''Parse <offset> <len> arguments for a command using the shared region
+
+    Returns the shared region, together with the offset and length.
+
+    '''
+    if len(args) != 2:
+        raise ValueError('{} expects exactly 2 arguments. Got {}.'
+                         .format(cmd, args))
+
+    offset = read_word('offset', args[0])
+    length = read_word('len', args[1])
+
+    if _SHM is None:
+        raise RuntimeError('{} needs a shared memory region, but no shm '
+                           'command has been run.'.format(cmd))
+
+    if offset + length > len(_SHM):
+        raise ValueError('{}: range [{:#x}, {:#x}) is not in the shared memory '
+                         'region, which is {:#x} bytes long.'
+                         .format(cmd, offset, offset + length, len(_SHM)))
+
+    return (_SHM, offset, length)
+
+
+def on_load_shm_d(sim: OTBNSim, args: List[str]) -> None:
+    '''Load contents of data memory from the shared memory region'''
+    shm, offset, length = get_shm_range('load_shm_d', args)
+    print('LOAD_SHM_D {:#x} {:#x}'.format(offset, length))
+    sim.load_data(shm[offset:offset + length])
+
+
+def on_load_shm_i(sim: OTBNSim, args: List[str]) -> None:
+    '''Load contents of insn memory from the shared memory region'''
+    shm, offset, length = get_shm_range('load_shm_i', args)
+    print('LOAD_SHM_I {:#x} {:#x}'.format(offset, length))
+    sim.load_program(decode_bytes(0, shm[offset:offset + length]))
+
+
+def on_dump_shm_d(sim: OTBNSim, args: List[str]) -> None:
+    '''Dump contents of data memory to the shared memory region'''
+    shm, offset, length = get_shm_range('dump_shm_d', args)
+    print('DUMP_SHM_D {:#x} {:#x}'.format(offset, length))
+
+    data = sim.state.dmem.dump_le_words()
+    if len(data) != length:
+        raise ValueError('dump_shm_d: DMEM is {:#x} bytes long, but the '
+                         'length argument was {:#x}.'
+                         .format(len(data), length))
+    shm[offset:offset + length] = data
+
+
 def on_print_regs(sim: OTBNSim, args: List[str]) -> None:
     '''Print registers to stdout'''
     if len(args):
@@ -187,39 +361,86 @@ def on_print_call_stack(sim: OTBNSim, args: List[str]) -> None:
 _HANDLERS = {
     'start': on_start,
     'step': on_step,
+    'step_batch': on_step_batch,
     'run': on_run,
+    'reset': on_reset,
     'load_elf': on_load_elf,
     'load_d': on_load_d,
     'load_i': on_load_i,
     'dump_d': on_dump_d,
+    'shm': on_shm,
+    'load_shm_d': on_load_shm_d,
+    'load_shm_i': on_load_shm_i,
+    'dump_shm_d': on_dump_shm_d,
     'print_regs': on_print_regs,
     'print_call_stack': on_print_call_stack
-}
+}  # type: Dict[str, Callable[[OTBNSim, List[str]], Optional[bytes]]]
+
+# Commands whose handlers return a binary payload
+_BINARY_ONLY = {'step_batch'}
 
 
-def on_input(sim: OTBNSim, line: str) -> None:
-    '''Process an input command'''
+def write_frame(payload: bytes) -> None:
+    '''Write a length-prefixed frame to stdout and flush'''
+    sys.stdout.flush()
+    sys.stdout.buffer.write(struct.pack('<I', len(payload)))
+    sys.stdout.buffer.write(payload)
+    sys.stdout.buffer.flush()
+
+
+def on_input(sim: OTBNSim, line: str, binary: bool) -> bool:
+    '''Process an input command
+
+    If binary is true, the response is sent as a single binary frame. Returns
+    the binary flag to use for subsequent commands.
+
+    '''
     words = line.split()
 
     # Just ignore empty lines
     if not words:
-        return
+        return binary
 
     verb = words[0]
+
+    if verb == 'binary':
+        if len(words) != 1:
+            raise ValueError('binary expects zero arguments. Got {}.'
+                             .format(words[1:]))
+        if binary:
+            write_frame(b'BINARY')
+        else:
+            print('BINARY')
+            end_command()
+        return True
+
     handler = _HANDLERS.get(verb)
     if handler is None:
         raise RuntimeError('Unknown command: {!r}'.format(verb))
 
-    handler(sim, words[1:])
-    print('.')
-    sys.stdout.flush()
+    if not binary:
+        if verb in _BINARY_ONLY:
+            raise RuntimeError('The {!r} command is only supported in binary '
+                               'mode.'.format(verb))
+        handler(sim, words[1:])
+        end_command()
+        return False
+
+    text_out = io.StringIO()
+    with redirect_stdout(text_out):
+        payload = handler(sim, words[1:])
+    if payload is None:
+        payload = text_out.getvalue().encode('utf-8')
+    write_frame(payload)
+    return True
 
 
 def main() -> int:
     sim = OTBNSim()
+    binary = False
     try:
         for line in sys.stdin:
-            on_input(sim, line)
+            binary = on_input(sim, line, binary)
     except KeyboardInterrupt:
         print("Received shutdown request, ending OTBN simulation.")
         return 0
@@ -3,65 +3,291 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include <cassert>
-#include <iomanip>
-#include <ios>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
 #include <sstream>
 #include <stdexcept>
-#include <string>
 
 #include "log_trace_listener.h"
 
-LogTraceListener::LogTraceListener(const std::string &log_filename)
-    : trace_log(log_filename, std::fstream::out) {
-  if (!trace_log.is_open()) {
+// Magic number at the start of a binary trace log
+static const char kBinaryMagic[8] = {'O', 'T', 'B', 'N', 'T', 'R', 'C', 1};
+
+// We write out formatted data once we have at least this many bytes of it
+static const size_t kFlushBytes = 64 * 1024;
+
+static bool EndsWith(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+LogTraceListener::LogTraceListener(const std::string &log_filename,
+                                   Format format, size_t ring_bytes)
+    : format_(format),
+      log_file_(nullptr),
+#ifdef OTBN_TRACE_HAVE_ZLIB
+      gz_log_(nullptr),
+#endif
+      ring_(ring_bytes),
+      closed_(false),
+      last_cycle_(0) {
+  if (EndsWith(log_filename, ".gz")) {
+#ifdef OTBN_TRACE_HAVE_ZLIB
+    gz_log_ = gzopen(log_filename.c_str(), "wb");
+    if (!gz_log_) {
+      std::ostringstream oss;
+      oss << "Could not open log file: " << log_filename;
+      throw std::runtime_error(oss.str());
+    }
+#else
     std::ostringstream oss;
-    oss << "Could not open log file: " << log_filename;
+    oss << "Cannot write compressed log file " << log_filename
+        << ": built without zlib support (OTBN_TRACE_HAVE_ZLIB).";
     throw std::runtime_error(oss.str());
+#endif
+  } else {
+    log_file_ = fopen(log_filename.c_str(), "wb");
+    if (!log_file_) {
+      std::ostringstream oss;
+      oss << "Could not open log file: " << log_filename;
+      throw std::runtime_error(oss.str());
+    }
+  }
+
+  if (format_ == kBinary) {
+    out_buf_.append(kBinaryMagic, sizeof kBinaryMagic);
   }
+
+  writer_ = std::thread(&LogTraceListener::WriterMain, this);
 }
 
-void LogTraceListener::AcceptTraceString(const std::string &trace,
-                                         unsigned int cycle_count) {
-  assert(trace_log.is_open());
+LogTraceListener::~LogTraceListener() { Close(); }
+
+bool LogTraceListener::Close() {
+  if (closed_)
+    return write_error_.empty();
+  closed_ = true;
 
-  // Split the trace up into a vector of strings, one per line
-  auto trace_lines = SplitTraceLines(trace);
+  ring_.Close();
+  writer_.join();
+
+  if (log_file_) {
+    if (fclose(log_file_) != 0 && write_error_.empty()) {
+      write_error_ = strerror(errno);
+    }
+    log_file_ = nullptr;
+  }
+#ifdef OTBN_TRACE_HAVE_ZLIB
+  if (gz_log_) {
+    if (gzclose(gz_log_) != Z_OK && write_error_.empty()) {
+      write_error_ = "gzclose failed";
+    }
+    gz_log_ = nullptr;
+  }
+#endif
 
+  if (!write_error_.empty()) {
+    std::cerr << "ERROR: Failed to write OTBN trace log (the log is "
+                 "incomplete): "
+              << write_error_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void LogTraceListener::AcceptTraceRecord(const OtbnTraceRecord &record) {
+  // Serialise the record into the ring as a cycle count, a number of lines and
+  // then a length and the contents of each line. scratch_ keeps its capacity,
+  // so this doesn't allocate in the steady state.
+  const std::vector<OtbnTraceLine> &lines = record.lines();
+
+  scratch_.clear();
+  auto append_u32 = [this](uint32_t value) {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    scratch_.insert(scratch_.end(), bytes, bytes + sizeof value);
+  };
+
+  append_u32(record.cycle_count());
+  append_u32(lines.size());
+  for (const OtbnTraceLine &line : lines) {
+    append_u32(line.len);
+    scratch_.insert(scratch_.end(), line.data, line.data + line.len);
+  }
+
+  ring_.Write(scratch_.data(), scratch_.size());
+}
+
+void LogTraceListener::WriterMain() {
+  std::vector<std::string> lines;
+
+  for (;;) {
+    uint32_t hdr[2];
+    if (!ring_.Read(hdr, sizeof hdr))
+      break;
+
+    uint32_t cycle_count = hdr[0];
+    uint32_t num_lines = hdr[1];
+
+    lines.resize(num_lines);
+    bool truncated = false;
+    for (std::string &line : lines) {
+      uint32_t len;
+      if (!ring_.Read(&len, sizeof len)) {
+        truncated = true;
+        break;
+      }
+      line.resize(len);
+      if (len && !ring_.Read(&line[0], len)) {
+        truncated = true;
+        break;
+      }
+    }
+    // The producer always writes whole records before closing the ring
+    assert(!truncated);
+    if (truncated)
+      break;
+
+    if (format_ == kBinary) {
+      FormatBinary(cycle_count, lines);
+    } else {
+      FormatText(cycle_count, lines);
+    }
+
+    if (out_buf_.size() >= kFlushBytes) {
+      FlushOutput();
+    }
+  }
+
+  FlushOutput();
+}
+
+void LogTraceListener::FormatText(uint32_t cycle_count,
+                                  const std::vector<std::string> &lines) {
   // Write out the lines from the trace
   bool first_line = true;
-  for (auto &line : trace_lines) {
+  for (const std::string &line : lines) {
     if (first_line) {
       if (line.size() > 1) {
         // It is expected the first line of any trace output is an 'E' or 'S'
-        // line (instruction execute or instruction stall)
+        // line (instruction execute or stall)
         bool is_e_or_s_line = line[0] == 'E' || line[0] == 'S';
 
         // Output the beginning of the first line adding a cycle count. A
         // special '!' line, only giving the cycle count, is output if the first
         // line isn't an 'E' or 'S' line.
-        std::ios old_state(nullptr);
-        old_state.copyfmt(trace_log);
-        trace_log << (is_e_or_s_line ? line[0] : '!') << " " << std::setw(9)
-                  << std::setfill('0') << cycle_count;
-        trace_log.copyfmt(old_state);
+        char prefix[16];
+        snprintf(prefix, sizeof prefix, "%c %09u",
+                 is_e_or_s_line ? line[0] : '!', cycle_count);
+        out_buf_ += prefix;
 
         if (is_e_or_s_line) {
           // If this is an expected 'E' or 'S' line write the rest of it out
-          trace_log << line.substr(1) << "\n";
+          out_buf_.append(line, 1, std::string::npos);
+          out_buf_ += "\n";
         } else {
           // Otherwise leave the '!' line on it's own and dump this line out
           // indented.
-          trace_log << "\n    " << line << "\n";
+          out_buf_ += "\n    ";
+          out_buf_ += line;
+          out_buf_ += "\n";
         }
       } else {
-        trace_log << "ERR: Bad line at " << cycle_count
-                  << " line should be more than 1 character: " << line << "\n";
+        out_buf_ += "ERR: Bad line at ";
+        out_buf_ += std::to_string(cycle_count);
+        out_buf_ += " line should be more than 1 character: ";
+        out_buf_ += line;
+        out_buf_ += "\n";
       }
 
       first_line = false;
     } else {
       // All lines other than the first are indented.
-      trace_log << "    " << line << "\n";
+      out_buf_ += "    ";
+      out_buf_ += line;
+      out_buf_ += "\n";
+    }
+  }
+}
+
+void LogTraceListener::FormatBinary(uint32_t cycle_count,
+                                    const std::vector<std::string> &lines) {
+  // Each record is encoded as a series of unsigned LEB128 values (and raw
+  // strings):
+  //
+  //   - The cycle count, minus the cycle count of the previous record
+  //   - A header code. 0 means there's no 'E' or 'S' header line. 1 means
+  //     that this is a header that we haven't seen before, and is followed by
+  //     its length and contents. It gets the next unused header number
+  //     (starting at 0). A value N >= 2 means that the header is a repeat of
+  //     header number N - 2.
+  //   - The number of remaining lines, followed by the length and contents of
+  //     each one.
+  AppendVarint(static_cast<uint32_t>(cycle_count - last_cycle_));
+  last_cycle_ = cycle_count;
+
+  size_t first_body_line = 0;
+  bool has_hdr = !lines.empty() && lines[0].size() > 1 &&
+                 (lines[0][0] == 'E' || lines[0][0] == 'S');
+  if (has_hdr) {
+    first_body_line = 1;
+    auto it = hdr_ids_.find(lines[0]);
+    if (it != hdr_ids_.end()) {
+      AppendVarint(it->second + 2);
+    } else {
+      uint64_t new_id = hdr_ids_.size();
+      hdr_ids_.emplace(lines[0], new_id);
+      AppendVarint(1);
+      AppendVarint(lines[0].size());
+      out_buf_ += lines[0];
+    }
+  } else {
+    AppendVarint(0);
+  }
+
+  AppendVarint(lines.size() - first_body_line);
+  for (size_t i = first_body_line; i < lines.size(); ++i) {
+    AppendVarint(lines[i].size());
+    out_buf_ += lines[i];
+  }
+}
+
+void LogTraceListener::AppendVarint(uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value)
+      byte |= 0x80;
+    out_buf_ += static_cast<char>(byte);
+  } while (value);
+}
+
+void LogTraceListener::FlushOutput() {
+  // After a failed write, keep draining the ring (so that the simulation
+  // doesn't block) but drop the output.
+  if (out_buf_.empty() || !write_error_.empty()) {
+    out_buf_.clear();
+    return;
+  }
+
+#ifdef OTBN_TRACE_HAVE_ZLIB
+  if (gz_log_) {
+    if (gzwrite(gz_log_, out_buf_.data(), out_buf_.size()) !=
+        static_cast<int>(out_buf_.size())) {
+      int errnum;
+      const char *msg = gzerror(gz_log_, &errnum);
+      write_error_ = errnum == Z_ERRNO ? strerror(errno) : msg;
     }
+    out_buf_.clear();
+    return;
+  }
+#endif
+
+  assert(log_file_);
+  if (fwrite(out_buf_.data(), 1, out_buf_.size(), log_file_) !=
+          out_buf_.size() ||
+      fflush(log_file_) != 0) {
+    write_error_ = strerror(errno);
   }
+  out_buf_.clear();
 }
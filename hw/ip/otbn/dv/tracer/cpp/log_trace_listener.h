@@ -5,10 +5,19 @@
 #ifndef OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_LOG_TRACE_LISTENER_H_
 #define OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_LOG_TRACE_LISTENER_H_
 
-#include <fstream>
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef OTBN_TRACE_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "otbn_trace_listener.h"
+#include "trace_ring.h"
 
 /**
  * An OtbnTraceListener that dumps the trace to a log file, with some minimal
@@ -22,19 +31,87 @@
  * If an 'E' or 'S' line isn't seen as the first line it prints a special '!'
  * line that gives the cycle count and dumps the rest of the trace indented by
  * four spaces.
+ *
+ * The simulation thread only copies each record into a ring buffer. A
+ * background thread formats the records and writes them to the file.
+ *
+ * In binary mode, the log stores the difference between the cycle counts of
+ * consecutive records and gives each distinct 'E' or 'S' line a number the
+ * first time it appears. The format is described in the tracer's README and
+ * otbn_trace_decode.py turns it back into text.
+ *
+ * If the log filename ends in ".gz", the output is compressed with zlib. This
+ * is only supported if the code was compiled with OTBN_TRACE_HAVE_ZLIB
+ * defined (and linked against zlib).
  */
 class LogTraceListener : public OtbnTraceListener {
- private:
-  std::ofstream trace_log;
-
  public:
+  enum Format { kText, kBinary };
+
   /**
    * Constructor that takes a log filename to write trace output to. It throws
    * std::runtime_error if the file cannot be opened.
+   *
+   * @param log_filename File to write the trace to
+   * @param format Whether to write text or binary output
+   * @param ring_bytes Size of the buffer between the simulation and the
+   *                   background writer thread
+   */
+  LogTraceListener(const std::string &log_filename, Format format = kText,
+                   size_t ring_bytes = 4 << 20);
+
+  /**
+   * Destructor, which calls Close() if that hasn't been done already.
    */
-  LogTraceListener(const std::string &log_filename);
-  void AcceptTraceString(const std::string &trace,
-                         unsigned int cycle_count) override;
+  ~LogTraceListener();
+
+  /**
+   * Wait for the background thread to write out any buffered records, then
+   * close the file. Returns false (after printing an error to stderr) if any
+   * write failed, for example because the disk is full, in which case the
+   * trace is incomplete. Once closed, the listener must not be given any more
+   * records.
+   */
+  bool Close();
+
+  void AcceptTraceRecord(const OtbnTraceRecord &record) override;
+
+ private:
+  // The body of the background thread
+  void WriterMain();
+
+  // Format a record (cycle count plus lines) and append it to out_buf_
+  void FormatText(uint32_t cycle_count, const std::vector<std::string> &lines);
+  void FormatBinary(uint32_t cycle_count,
+                    const std::vector<std::string> &lines);
+
+  // Append an unsigned LEB128 value to out_buf_
+  void AppendVarint(uint64_t value);
+
+  // Write out_buf_ to the file and clear it. On failure, this records the
+  // error in write_error_ and drops all further output.
+  void FlushOutput();
+
+  Format format_;
+  FILE *log_file_;
+#ifdef OTBN_TRACE_HAVE_ZLIB
+  gzFile gz_log_;
+#endif
+
+  TraceRing ring_;
+  std::thread writer_;
+  bool closed_;
+
+  // Scratch space used by the simulation thread to serialise a record
+  std::vector<char> scratch_;
+
+  // State used by the writer thread
+  std::string out_buf_;
+  uint32_t last_cycle_;
+  std::unordered_map<std::string, uint64_t> hdr_ids_;
+  // The first write error, or empty if there hasn't been one. This is written
+  // by the writer thread and only read after it has been joined.
+  std::string write_error_;
 };
 
 #endif  // OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_LOG_TRACE_LISTENER_H_
@@ -0,0 +1,139 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log_trace_listener.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "otbn_trace_record.h"
+
+// The command that runs otbn_trace_decode.py (set by the build)
+#ifndef OTBN_TRACE_DECODE
+#define OTBN_TRACE_DECODE "python3 otbn_trace_decode.py"
+#endif
+
+namespace {
+
+using Record = std::pair<unsigned int, std::string>;
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream ifs(path, std::ios::binary);
+  std::ostringstream oss;
+  oss << ifs.rdbuf();
+  return oss.str();
+}
+
+/** Write records to a log at path and close it. */
+bool WriteLog(const std::string &path, LogTraceListener::Format format,
+              const std::vector<Record> &records, size_t ring_bytes) {
+  LogTraceListener listener(path, format, ring_bytes);
+  OtbnTraceRecord record;
+  for (const Record &rec : records) {
+    record.Reset(rec.second.c_str(), rec.first);
+    listener.AcceptTraceRecord(record);
+  }
+  return listener.Close();
+}
+
+/** Run otbn_trace_decode.py on the binary log at path. */
+std::string Decode(const std::string &path) {
+  std::string cmd = std::string(OTBN_TRACE_DECODE) + " " + path;
+  FILE *pipe = popen(cmd.c_str(), "r");
+  if (!pipe) {
+    ADD_FAILURE() << "Failed to run " << cmd;
+    return "";
+  }
+  std::string out;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof buf, pipe)) > 0) {
+    out.append(buf, len);
+  }
+  EXPECT_EQ(pclose(pipe), 0) << cmd << " failed";
+  return out;
+}
+
+class LogTraceListenerTest : public testing::Test {
+ protected:
+  std::string TempPath(const std::string &name) {
+    return testing::TempDir() + "log_trace_listener_unittest_" + name;
+  }
+};
+
+TEST_F(LogTraceListenerTest, FormatsText) {
+  std::string path = TempPath("text.log");
+  ASSERT_TRUE(WriteLog(path, LogTraceListener::kText,
+                       {
+                           {5,
+                            "E PC: 0x00000000, insn: 0x00000093\n"
+                            "> x01: 0x00000000"},
+                           {6, "S PC: 0x00000004, insn: 0x0000a103\n"},
+                           {7, "? unexpected\n< x02: 0x00000001"},
+                           {8, "E"},
+                           {1234567890, "E PC: 0x00000008, insn: 0x00000000"},
+                       },
+                       4096));
+  EXPECT_EQ(ReadFile(path),
+            "E 000000005 PC: 0x00000000, insn: 0x00000093\n"
+            "    > x01: 0x00000000\n"
+            "S 000000006 PC: 0x00000004, insn: 0x0000a103\n"
+            "! 000000007\n"
+            "    ? unexpected\n"
+            "    < x02: 0x00000001\n"
+            "ERR: Bad line at 8 line should be more than 1 character: E\n"
+            "E 1234567890 PC: 0x00000008, insn: 0x00000000\n");
+  remove(path.c_str());
+}
+
+TEST_F(LogTraceListenerTest, BinaryDecodesToText) {
+  // Enough records to flush the output several times, with repeated and new
+  // headers, records without a header, empty records and a cycle count that
+  // wraps. The tiny ring makes the writer thread wait for the simulation.
+  std::vector<Record> records;
+  unsigned int cycle = 0xfffff000;
+  for (int i = 0; i < 20000; ++i) {
+    std::ostringstream oss;
+    switch (i % 7) {
+      case 0:
+        oss << "? no header " << i;
+        break;
+      case 1:
+        break;
+      default:
+        oss << (i % 3 ? 'E' : 'S') << " PC: 0x" << std::hex << 4 * (i % 50)
+            << ", insn: 0x00000013";
+        for (int j = 0; j < i % 4; ++j) {
+          oss << "\n> x" << std::dec << j << ": 0x" << std::hex << i;
+        }
+    }
+    cycle += 1 + i % 3;
+    records.emplace_back(cycle, oss.str());
+  }
+
+  std::string text_path = TempPath("round_trip.log");
+  std::string bin_path = TempPath("round_trip.bin");
+  ASSERT_TRUE(WriteLog(text_path, LogTraceListener::kText, records, 64));
+  ASSERT_TRUE(WriteLog(bin_path, LogTraceListener::kBinary, records, 64));
+
+  std::string text = ReadFile(text_path);
+  std::string binary = ReadFile(bin_path);
+  EXPECT_LT(binary.size(), text.size() / 2);
+  EXPECT_EQ(Decode(bin_path), text);
+  remove(text_path.c_str());
+  remove(bin_path.c_str());
+}
+
+TEST_F(LogTraceListenerTest, ReportsWriteErrors) {
+  // Writes to /dev/full always fail with ENOSPC
+  std::vector<Record> records(100, {1, "E PC: 0x00000000, insn: 0x00000013"});
+  EXPECT_FALSE(WriteLog("/dev/full", LogTraceListener::kText, records, 4096));
+}
+
+}  // namespace
@@ -5,9 +5,7 @@
 #ifndef OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_OTBN_TRACE_LISTENER_H_
 #define OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_OTBN_TRACE_LISTENER_H_
 
-#include <sstream>
-#include <string>
-#include <vector>
+#include "otbn_trace_record.h"
 
 /**
  * Base class for anything that wants to examine trace output from OTBN. The
@@ -17,32 +15,13 @@
 class OtbnTraceListener {
  public:
   /**
-   * Helper function to split an OTBN trace output up into individual lines.
+   * Called to process an OTBN trace record, called a maximum of once per
+   * cycle. The same record is passed to every listener.
    *
-   * @param trace Trace output from OTBN
-   * @return A vector of lines from the trace
+   * @param record Trace output from OTBN, split into lines. This is only
+   *               valid for the duration of the call.
    */
-  static std::vector<std::string> SplitTraceLines(const std::string &trace) {
-    std::stringstream trace_ss(trace);
-    std::string trace_line;
-
-    std::vector<std::string> trace_lines;
-
-    while (std::getline(trace_ss, trace_line, '\n')) {
-      trace_lines.push_back(trace_line);
-    }
-
-    return trace_lines;
-  }
-
-  /**
-   * Called to process an OTBN trace output, called a maximum of once per cycle
-   *
-   * @param trace Trace output from OTBN
-   * @param cycle_count The cycle count associated with the trace output
-   */
-  virtual void AcceptTraceString(const std::string &trace,
-                                 unsigned int cycle_count) = 0;
+  virtual void AcceptTraceRecord(const OtbnTraceRecord &record) = 0;
   virtual ~OtbnTraceListener() {}
 };
 
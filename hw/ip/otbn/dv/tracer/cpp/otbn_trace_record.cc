@@ -0,0 +1,28 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "otbn_trace_record.h"
+
+#include <cassert>
+
+void OtbnTraceRecord::Reset(const char *trace, unsigned int cycle_count) {
+  assert(trace != nullptr);
+
+  cycle_count_ = cycle_count;
+
+  // Clearing the vector keeps its capacity, so we only allocate if this record
+  // has more lines than any we've seen before. Lines are split on '\n' and a
+  // trailing newline doesn't start an extra (empty) line.
+  lines_.clear();
+  const char *bol = trace;
+  while (*bol) {
+    const char *eol = strchr(bol, '\n');
+    if (!eol) {
+      lines_.push_back(OtbnTraceLine{bol, strlen(bol)});
+      break;
+    }
+    lines_.push_back(OtbnTraceLine{bol, static_cast<size_t>(eol - bol)});
+    bol = eol + 1;
+  }
+}
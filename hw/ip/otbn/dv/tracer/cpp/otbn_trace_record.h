@@ -0,0 +1,80 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_OTBN_TRACE_RECORD_H_
+#define OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_OTBN_TRACE_RECORD_H_
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * A view of a single line of OTBN trace output, not including the newline
+ * that terminates it. The line doesn't own its data: it points into the trace
+ * string that was passed to OtbnTraceRecord::Reset.
+ */
+struct OtbnTraceLine {
+  const char *data;
+  size_t len;
+
+  /**
+   * The category of the line (its first character, such as 'E' or '>'), or
+   * '\0' if the line is empty.
+   */
+  char type() const { return len ? data[0] : '\0'; }
+
+  /** Return true if the line starts with prefix */
+  bool StartsWith(const char *prefix) const {
+    size_t prefix_len = strlen(prefix);
+    return prefix_len <= len && memcmp(data, prefix, prefix_len) == 0;
+  }
+
+  /** Return a copy of the line as a std::string */
+  std::string str() const { return std::string(data, len); }
+};
+
+/**
+ * A trace record (the trace output for a single cycle), split into lines.
+ *
+ * The trace source splits each record once, as it arrives, and passes the
+ * result to every listener. The record doesn't copy the trace text, so it is
+ * only valid for the duration of the call to the listener. A listener that
+ * needs to keep any of the data must copy it.
+ *
+ * The storage for the table of lines is kept between calls to Reset, so
+ * splitting a record doesn't allocate once the record has seen a cycle with
+ * as many lines as the current one.
+ *
+ * There is no separate arena for per-cycle storage, because the listeners
+ * don't need one: LogTraceListener serialises each record into a scratch
+ * buffer that keeps its capacity, and OtbnTraceChecker decodes records into
+ * fixed-size TraceEntry objects. With both of them enabled, the steady state
+ * doesn't allocate on every cycle.
+ */
+class OtbnTraceRecord {
+ public:
+  OtbnTraceRecord() : cycle_count_(0) {}
+
+  /**
+   * Point the record at new trace output, splitting it into lines.
+   *
+   * @param trace Trace output from OTBN. This must stay valid for as long as
+   *              the record is used.
+   * @param cycle_count The cycle count associated with the trace output
+   */
+  void Reset(const char *trace, unsigned int cycle_count);
+
+  /** The cycle count associated with the trace output */
+  unsigned int cycle_count() const { return cycle_count_; }
+
+  /** The lines in the trace output, in order */
+  const std::vector<OtbnTraceLine> &lines() const { return lines_; }
+
+ private:
+  unsigned int cycle_count_;
+  std::vector<OtbnTraceLine> lines_;
+};
+
+#endif  // OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_OTBN_TRACE_RECORD_H_
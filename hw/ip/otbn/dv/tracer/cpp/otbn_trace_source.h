@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "otbn_trace_listener.h"
+#include "otbn_trace_record.h"
 
 // A source for simulation trace data.
 //
@@ -15,7 +16,9 @@
 //
 // The object is in charge of taking trace data from the simulation (which is
 // sent by calling the accept_otbn_trace_string DPI function) and passing it
-// out to registered listeners.
+// out to registered listeners. Each trace string is split into lines once,
+// into a record that is reused from cycle to cycle and shared by all the
+// listeners.
 
 class OtbnTraceSource {
  public:
@@ -29,8 +32,9 @@ class OtbnTraceSource {
   void RemoveListener(const OtbnTraceListener *listener);
 
   // Send a trace string to all listeners
-  void Broadcast(const std::string &trace, unsigned cycle_count);
+  void Broadcast(const char *trace, unsigned cycle_count);
 
  private:
   std::vector<OtbnTraceListener *> listeners_;
+  OtbnTraceRecord record_;
 };
@@ -0,0 +1,119 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+TraceRing::TraceRing(size_t capacity)
+    : head_(0),
+      tail_(0),
+      closed_(false),
+      reader_waiting_(false),
+      writer_waiting_(false) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  buf_.resize(size);
+  mask_ = size - 1;
+}
+
+template <typename Ready>
+void TraceRing::WaitFor(std::atomic<bool> *waiting, Ready ready) {
+  // The other side is usually quick, so spin for a bit before going to sleep
+  for (int i = 0; i < 128; ++i) {
+    if (ready()) {
+      return;
+    }
+    if (i >= 64) {
+      std::this_thread::yield();
+    }
+  }
+
+  // The flag, head_, tail_ and closed_ are all stored and loaded with
+  // seq_cst ordering, so either the other side sees the flag or we see its
+  // update to the ring when we check ready().
+  std::unique_lock<std::mutex> lock(mutex_);
+  waiting->store(true);
+  cv_.wait(lock, ready);
+  waiting->store(false);
+}
+
+void TraceRing::Wake(std::atomic<bool> *waiting) {
+  if (waiting->load()) {
+    // Taking the mutex means the sleeper is either in cv_.wait (and gets the
+    // notification) or hasn't yet checked ready() (and will see our update).
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+}
+
+void TraceRing::Write(const void *data, size_t len) {
+  const char *src = static_cast<const char *>(data);
+  size_t head = head_.load(std::memory_order_relaxed);
+
+  while (len) {
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t space = buf_.size() - (head - tail);
+    if (!space) {
+      WaitFor(&writer_waiting_, [this, head] {
+        return tail_.load() != head - buf_.size();
+      });
+      continue;
+    }
+
+    // Copy as much as we can, up to the end of buf_.
+    size_t pos = head & mask_;
+    size_t chunk = std::min(std::min(len, space), buf_.size() - pos);
+    memcpy(&buf_[pos], src, chunk);
+
+    src += chunk;
+    len -= chunk;
+    head += chunk;
+    head_.store(head);
+    Wake(&reader_waiting_);
+  }
+}
+
+bool TraceRing::Read(void *dst, size_t len) {
+  char *out = static_cast<char *>(dst);
+  size_t tail = tail_.load(std::memory_order_relaxed);
+
+  while (len) {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t avail = head - tail;
+    if (!avail) {
+      // Check closed_ and then head_ again: if the producer wrote some data
+      // and then closed the ring, we mustn't drop that data.
+      if (closed_.load(std::memory_order_acquire) &&
+          head_.load(std::memory_order_acquire) == tail) {
+        return false;
+      }
+      WaitFor(&reader_waiting_, [this, tail] {
+        return head_.load() != tail || closed_.load();
+      });
+      continue;
+    }
+
+    size_t pos = tail & mask_;
+    size_t chunk = std::min(std::min(len, avail), buf_.size() - pos);
+    memcpy(out, &buf_[pos], chunk);
+
+    out += chunk;
+    len -= chunk;
+    tail += chunk;
+    tail_.store(tail);
+    Wake(&writer_waiting_);
+  }
+  return true;
+}
+
+void TraceRing::Close() {
+  closed_.store(true);
+  Wake(&reader_waiting_);
+}
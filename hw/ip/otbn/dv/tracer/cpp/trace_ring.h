@@ -0,0 +1,80 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_TRACE_RING_H_
+#define OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_TRACE_RING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * A lock-free ring buffer of bytes with a single producer and a single
+ * consumer.
+ *
+ * One thread may call Write and Close. Another thread may call Read. Write
+ * blocks while the ring is full and Read blocks while it is empty. A waiting
+ * thread spins for a moment and then sleeps on a condition variable until the
+ * other side makes progress, so an idle consumer costs no CPU. The other side
+ * only takes the mutex when it sees that somebody is asleep.
+ */
+class TraceRing {
+ public:
+  /**
+   * Constructor. The capacity is rounded up to a power of two.
+   */
+  explicit TraceRing(size_t capacity);
+
+  /**
+   * Append len bytes from data to the ring, waiting for space if necessary.
+   * It is fine for len to be larger than the capacity of the ring.
+   */
+  void Write(const void *data, size_t len);
+
+  /**
+   * Read exactly len bytes from the ring into dst, waiting for data if
+   * necessary.
+   *
+   * @return true on success. false if the ring was closed before len bytes
+   *         were available.
+   */
+  bool Read(void *dst, size_t len);
+
+  /**
+   * Mark the ring as closed. Once the consumer has read any remaining data,
+   * Read will return false.
+   */
+  void Close();
+
+ private:
+  // Wait until ready() returns true. waiting is the flag that tells the other
+  // side to call Wake.
+  template <typename Ready>
+  void WaitFor(std::atomic<bool> *waiting, Ready ready);
+
+  // Wake the other side if it is waiting on waiting (after we have published
+  // a change to head_, tail_ or closed_).
+  void Wake(std::atomic<bool> *waiting);
+
+  std::vector<char> buf_;
+  size_t mask_;
+
+  // Total number of bytes written and read. These only ever increase (the
+  // position in buf_ is the count masked with mask_). head_ is only written by
+  // the producer and tail_ only by the consumer.
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+  std::atomic<bool> closed_;
+
+  // Sleeping support: a thread sets its flag (under mutex_) before sleeping on
+  // cv_.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> reader_waiting_;
+  std::atomic<bool> writer_waiting_;
+};
+
+#endif  // OPENTITAN_HW_IP_OTBN_DV_TRACER_CPP_TRACE_RING_H_
@@ -0,0 +1,88 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace_ring.h"
+
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+/** CPU time used by the whole process, in nanoseconds. */
+int64_t ProcessCpuNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+TEST(TraceRingTest, PassesDataBetweenThreads) {
+  constexpr uint32_t kNumWords = 1 << 20;
+  TraceRing ring(64);
+
+  std::thread producer([&ring] {
+    for (uint32_t i = 0; i < kNumWords; ++i) {
+      ring.Write(&i, sizeof i);
+    }
+    ring.Close();
+  });
+
+  uint32_t word, mismatches = 0, count = 0;
+  while (ring.Read(&word, sizeof word)) {
+    mismatches += word != count++;
+  }
+  producer.join();
+
+  EXPECT_EQ(count, kNumWords);
+  EXPECT_EQ(mismatches, 0u);
+}
+
+TEST(TraceRingTest, IdleReaderSleeps) {
+  TraceRing ring(64);
+  uint32_t word = 0;
+  std::thread reader([&ring, &word] { EXPECT_TRUE(ring.Read(&word, 4)); });
+
+  // A reader with nothing to read should be asleep, not polling
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  int64_t start = ProcessCpuNs();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_LT(ProcessCpuNs() - start, 2 * 1000 * 1000);
+
+  uint32_t value = 0x12345678;
+  ring.Write(&value, sizeof value);
+  reader.join();
+  EXPECT_EQ(word, value);
+}
+
+TEST(TraceRingTest, CloseWakesReader) {
+  TraceRing ring(64);
+  std::thread reader([&ring] {
+    char byte;
+    EXPECT_FALSE(ring.Read(&byte, 1));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ring.Close();
+  reader.join();
+}
+
+TEST(TraceRingTest, FullRingBlocksWriter) {
+  TraceRing ring(16);
+  char data[32] = {};
+  std::thread writer([&ring, &data] { ring.Write(data, sizeof data); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  int64_t start = ProcessCpuNs();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_LT(ProcessCpuNs() - start, 2 * 1000 * 1000);
+
+  char out[32];
+  ASSERT_TRUE(ring.Read(out, sizeof out));
+  writer.join();
+}
+
+}  // namespace
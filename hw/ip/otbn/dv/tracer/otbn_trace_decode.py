@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# Copyright lowRISC contributors.
+# Licensed under the Apache License, Version 2.0, see LICENSE for details.
+# SPDX-License-Identifier: Apache-2.0
+
+'''Convert a binary OTBN trace log to the text format
+
+The binary format is written by LogTraceListener when it is set up in binary
+mode. See README.md in this directory for a description. If the input file
+name ends in ".gz", it is decompressed first.
+
+'''
+
+import argparse
+import gzip
+import sys
+from typing import BinaryIO, List, TextIO
+
+_MAGIC = b'OTBNTRC\x01'
+
+
+class DecodeError(Exception):
+    pass
+
+
+class Reader:
+    '''A wrapper around the binary input with helpers for reading fields'''
+    def __init__(self, data: bytes):
+        self.data = data
+        self.pos = 0
+
+    def at_end(self) -> bool:
+        return self.pos >= len(self.data)
+
+    def read_varint(self) -> int:
+        '''Read an unsigned LEB128 value'''
+        value = 0
+        shift = 0
+        while True:
+            if self.pos >= len(self.data):
+                raise DecodeError('Truncated integer at end of input.')
+            byte = self.data[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def read_str(self) -> str:
+        '''Read a length-prefixed string'''
+        length = self.read_varint()
+        if self.pos + length > len(self.data):
+            raise DecodeError('Truncated string at end of input.')
+        raw = self.data[self.pos:self.pos + length]
+        self.pos += length
+        return raw.decode('utf-8')
+
+
+def write_text_record(cycle: int, lines: List[str], out: TextIO) -> None:
+    '''Write a record in the same format as the text trace log'''
+    for idx, line in enumerate(lines):
+        if idx > 0:
+            out.write('    {}\n'.format(line))
+            continue
+
+        if len(line) <= 1:
+            out.write('ERR: Bad line at {} line should be more than '
+                      '1 character: {}\n'.format(cycle, line))
+        elif line[0] in 'ES':
+            out.write('{} {:09}{}\n'.format(line[0], cycle, line[1:]))
+        else:
+            out.write('! {:09}\n    {}\n'.format(cycle, line))
+
+
+def decode(data: bytes, out: TextIO) -> None:
+    '''Decode a binary trace log, writing the text version to out'''
+    if not data.startswith(_MAGIC):
+        raise DecodeError('Input is not a binary OTBN trace log.')
+
+    reader = Reader(data)
+    reader.pos = len(_MAGIC)
+
+    headers = []  # type: List[str]
+    cycle = 0
+    while not reader.at_end():
+        cycle = (cycle + reader.read_varint()) & 0xffffffff
+
+        lines = []  # type: List[str]
+        hdr_code = reader.read_varint()
+        if hdr_code == 1:
+            headers.append(reader.read_str())
+            lines.append(headers[-1])
+        elif hdr_code >= 2:
+            hdr_idx = hdr_code - 2
+            if hdr_idx >= len(headers):
+                raise DecodeError('Reference to header {}, but we have only '
+                                  'seen {}.'.format(hdr_idx, len(headers)))
+            lines.append(headers[hdr_idx])
+
+        num_lines = reader.read_varint()
+        for _ in range(num_lines):
+            lines.append(reader.read_str())
+
+        write_text_record(cycle, lines, out)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser()
+    parser.add_argument('log', help='Binary trace log (possibly .gz)')
+    args = parser.parse_args()
+
+    try:
+        handle = (gzip.open(args.log, 'rb') if args.log.endswith('.gz')
+                  else open(args.log, 'rb'))  # type: BinaryIO
+        with handle:
+            data = handle.read()
+    except OSError as err:
+        print('Failed to read {!r}: {}'.format(args.log, err), file=sys.stderr)
+        return 1
+
+    try:
+        decode(data, sys.stdout)
+    except DecodeError as err:
+        print('Failed to decode {!r}: {}'.format(args.log, err),
+              file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -70,7 +70,7 @@ module otbn_tracer
     for (int i = 0; i < WLEN; i += 32) begin
       // If mask matches current chunk alone output trace indicating a single 32-bit write.
       if (wmask == cur_base_mask) begin
-        return $sformatf("[0x%08x]: 0x%08x", addr + (i / 8), data[i*32 +: 32]);
+        return $sformatf("[0x%08x]: 0x%08x", addr + (i / 8), data[i +: 32]);
       end
 
       cur_base_mask = cur_base_mask << 32;
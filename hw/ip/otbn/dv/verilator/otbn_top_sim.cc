@@ -2,6 +2,7 @@
 // Licensed under the Apache License, Version 2.0, see LICENSE for details.
 // SPDX-License-Identifier: Apache-2.0
 
+#include <cstring>
 #include <fstream>
 #include <getopt.h>
 #include <iomanip>
@@ -28,15 +29,18 @@ extern unsigned int otbn_bignum_reg_get(int index, int quarter);
 /**
  * SimCtrlExtension that adds a '--otbn-trace-file' command line option. If set
  * it sets up a LogTraceListener that will dump out the trace to the given log
- * file
+ * file. The '--otbn-trace-format' option chooses between text (the default)
+ * and binary logs.
  */
 class OtbnTraceUtil : public SimCtrlExtension {
  private:
   std::unique_ptr<LogTraceListener> log_trace_listener_;
 
-  bool SetupTraceLog(const std::string &log_filename) {
+  bool SetupTraceLog(const std::string &log_filename,
+                     LogTraceListener::Format format) {
     try {
-      log_trace_listener_ = std::make_unique<LogTraceListener>(log_filename);
+      log_trace_listener_ =
+          std::make_unique<LogTraceListener>(log_filename, format);
       OtbnTraceSource::get().AddListener(log_trace_listener_.get());
       return true;
     } catch (const std::runtime_error &err) {
@@ -51,16 +55,25 @@ class OtbnTraceUtil : public SimCtrlExtension {
   void PrintHelp() {
     std::cout << "Trace log utilities:\n\n"
                  "--otbn-trace-file=FILE\n"
-                 "  Write OTBN trace log to FILE\n\n";
+                 "  Write OTBN trace log to FILE (compressed if FILE ends in "
+                 ".gz)\n\n"
+                 "--otbn-trace-format=text|binary\n"
+                 "  Format for the OTBN trace log (default: text). Binary logs "
+                 "can be\n"
+                 "  converted to text with otbn_trace_decode.py\n\n";
   }
 
  public:
   virtual bool ParseCLIArguments(int argc, char **argv, bool &exit_app) {
     const struct option long_options[] = {
         {"otbn-trace-file", required_argument, nullptr, 'l'},
+        {"otbn-trace-format", required_argument, nullptr, 'f'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}};
 
+    std::string log_filename;
+    LogTraceListener::Format format = LogTraceListener::kText;
+
     // Reset the command parsing index in-case other utils have already parsed
     // some arguments
     optind = 1;
@@ -74,20 +87,45 @@ class OtbnTraceUtil : public SimCtrlExtension {
         case 0:
           break;
         case 'l':
-          return SetupTraceLog(optarg);
+          log_filename = optarg;
+          break;
+        case 'f':
+          if (!strcmp(optarg, "text")) {
+            format = LogTraceListener::kText;
+          } else if (!strcmp(optarg, "binary")) {
+            format = LogTraceListener::kBinary;
+          } else {
+            std::cerr << "ERROR: Unknown OTBN trace format `" << optarg
+                      << "'. Expected text or binary." << std::endl;
+            return false;
+          }
+          break;
         case 'h':
           PrintHelp();
           break;
       }
     }
 
+    if (!log_filename.empty()) {
+      return SetupTraceLog(log_filename, format);
+    }
+
     return true;
   }
 
-  ~OtbnTraceUtil() {
-    if (log_trace_listener_)
-      OtbnTraceSource::get().RemoveListener(log_trace_listener_.get());
+  // Stop tracing and close the trace log. Returns false if the log couldn't
+  // be written completely.
+  bool Finish() {
+    if (!log_trace_listener_)
+      return true;
+
+    OtbnTraceSource::get().RemoveListener(log_trace_listener_.get());
+    bool ok = log_trace_listener_->Close();
+    log_trace_listener_.reset();
+    return ok;
   }
+
+  ~OtbnTraceUtil() { Finish(); }
 };
 
 int main(int argc, char **argv) {
@@ -111,6 +149,10 @@ int main(int argc, char **argv) {
   int ret_code = pr.first;
   bool ran_simulation = pr.second;
 
+  if (!traceutil.Finish() && ret_code == 0) {
+    ret_code = 1;
+  }
+
   if (ret_code != 0 || !ran_simulation) {
     return ret_code;
   }
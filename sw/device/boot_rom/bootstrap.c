@@ -22,6 +22,26 @@
 
 #define GPIO_BOOTSTRAP_BIT_MASK 0x00020000u
 
+/**
+ * Upper bound on the number of flash pages, for tracking which pages have been
+ * erased for delta frames.
+ */
+#define MAX_FLASH_PAGES 1024
+
+/**
+ * Bit i is set once page i has been erased for a delta frame.
+ */
+static uint32_t erased_pages[MAX_FLASH_PAGES / 32];
+
+/**
+ * Whether delta frames are accepted, see bootstrap.h.
+ */
+#if defined(BOOTSTRAP_DELTA_UPDATES)
+static const bool kDeltaUpdatesEnabled = true;
+#else
+static const bool kDeltaUpdatesEnabled = false;
+#endif
+
 /**
  * Check if flash is blank to determine if bootstrap is needed.
  *
@@ -77,30 +97,329 @@ static bool check_frame_hash(const spiflash_frame_t *frame) {
   return memcmp(hash, frame->header.hash, sizeof(hash)) == 0;
 }
 
+/**
+ * Enable flash access and erase it, before writing the first frame. Delta
+ * updates erase pages as they go instead.
+ */
+static int prepare_flash(const spiflash_frame_t *frame) {
+  flash_default_region_access(/*rd_en=*/true, /*prog_en=*/true,
+                              /*erase_en=*/true);
+  if (SPIFLASH_FRAME_IS_DELTA(frame->header.frame_num)) {
+    LOG_INFO("Delta update, only erasing updated pages");
+    return 0;
+  }
+  int flash_error = erase_flash();
+  if (flash_error != 0) {
+    return flash_error;
+  }
+  LOG_INFO("Flash erase successful");
+  return 0;
+}
+
+/**
+ * Programs `frame` into flash.
+ *
+ * Delta frames are cut at the end of the page they start in, and that page is
+ * erased first unless an earlier delta frame has done so already.
+ */
+static int write_frame(const spiflash_frame_t *frame) {
+  uint32_t offset = frame->header.flash_offset;
+  uint32_t words = SPIFLASH_FRAME_DATA_WORDS;
+  if (SPIFLASH_FRAME_IS_DELTA(frame->header.frame_num)) {
+    uint32_t page_size = flash_get_page_size();
+    uint32_t page = offset / page_size;
+    if (page >= MAX_FLASH_PAGES) {
+      return E_BS_WRITE;
+    }
+    if ((erased_pages[page / 32] & (1u << (page % 32))) == 0) {
+      if (flash_page_erase(page * page_size, kDataPartition) != 0) {
+        return E_BS_ERASE;
+      }
+      erased_pages[page / 32] |= 1u << (page % 32);
+    }
+    uint32_t page_words = (page_size - offset % page_size) / sizeof(uint32_t);
+    if (page_words < words) {
+      words = page_words;
+    }
+  }
+
+  if (flash_write(offset, kDataPartition, frame->data, words) != 0) {
+    return E_BS_WRITE;
+  }
+  return 0;
+}
+
+/**
+ * State of the windowed protocol.
+ */
+typedef struct window_state {
+  /**
+   * All frames before this one have been received and checked.
+   */
+  uint32_t next_frame;
+  /**
+   * Whether frame 0 was a delta frame. Only valid once `next_frame` is not 0.
+   */
+  bool delta;
+} window_state_t;
+
+/**
+ * Checks whether `frame` may be processed, given that it is the frame the
+ * device expects next.
+ *
+ * Every frame after frame 0 must be a delta frame if and only if frame 0 was:
+ * a full frame in a delta update would be written to a page that hasn't been
+ * erased. Delta updates must be enabled and start with a verify frame, and the
+ * pages listed in verify frames must match the flash.
+ */
+static bool check_frame_mode(const spiflash_frame_t *frame,
+                             const window_state_t *state) {
+  bool delta = SPIFLASH_FRAME_IS_DELTA(frame->header.frame_num);
+  if (state->next_frame != 0 && delta != state->delta) {
+    return false;
+  }
+  if (!delta) {
+    return true;
+  }
+  if (!kDeltaUpdatesEnabled) {
+    return false;
+  }
+  if (!SPIFLASH_FRAME_IS_VERIFY(frame->header.frame_num)) {
+    return state->next_frame != 0;
+  }
+
+  const spiflash_verify_t *verify = (const spiflash_verify_t *)frame->data;
+  if (verify->num_pages > SPIFLASH_VERIFY_MAX_PAGES) {
+    return false;
+  }
+  uint32_t page_size = flash_get_page_size();
+  uint32_t num_flash_pages = 2 * flash_get_bank_size() / page_size;
+  flash_default_region_access(/*rd_en=*/true, /*prog_en=*/true,
+                              /*erase_en=*/true);
+  for (uint32_t i = 0; i < verify->num_pages; ++i) {
+    uint32_t page = verify->pages[i].page;
+    if (page >= num_flash_pages) {
+      return false;
+    }
+    uintptr_t page_addr = FLASH_MEM_BASE_ADDR + page * page_size;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    hw_SHA256_hash((const void *)page_addr, page_size, hash);
+    if (memcmp(hash, verify->pages[i].hash, sizeof(hash)) != 0) {
+      LOG_ERROR("Flash page %d does not match", page);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Waits until at least `len` bytes have been received.
+ */
+static void wait_for_bytes(dif_spi_device_t *spi, size_t len) {
+  while (true) {
+    size_t bytes_available;
+    CHECK(dif_spi_device_rx_pending(spi, &bytes_available) == kDifSpiDeviceOk,
+          "Failed to check pending bytes.");
+    if (bytes_available >= len) {
+      return;
+    }
+  }
+}
+
+/**
+ * Discards received bytes until the end of the next SPIFLASH_FRAME_SYNC word,
+ * or until there are no more bytes.
+ *
+ * `sync_matched` holds the number of bytes of the sync word matched so far,
+ * so that a sync word split across two calls is found.
+ *
+ * @return true if the sync word has been found.
+ */
+static bool find_sync(dif_spi_device_t *spi, uint32_t *sync_matched) {
+  while (*sync_matched < sizeof(uint32_t)) {
+    uint8_t byte;
+    size_t bytes_received;
+    CHECK(dif_spi_device_recv(spi, &byte, sizeof(byte), &bytes_received) ==
+              kDifSpiDeviceOk,
+          "Failed to recieve bytes from SPI.");
+    if (bytes_received == 0) {
+      return false;
+    }
+    // The bytes of the sync word are all different, so after a mismatch the
+    // word can only start again at this byte.
+    if (byte == ((SPIFLASH_FRAME_SYNC >> (8 * *sync_matched)) & 0xff)) {
+      ++*sync_matched;
+    } else {
+      *sync_matched = byte == (SPIFLASH_FRAME_SYNC & 0xff) ? 1 : 0;
+    }
+  }
+  return true;
+}
+
+/**
+ * Sends a windowed protocol ack for the current `state`, answering the frame
+ * with `frame_num` (or SPIFLASH_ACK_NAK).
+ */
+static void send_window_ack(dif_spi_device_t *spi, const window_state_t *state,
+                            uint32_t frame_num) {
+  spiflash_ack_t ack = {
+      .magic = SPIFLASH_ACK_MAGIC,
+      .next_frame = state->next_frame,
+      .frame = frame_num,
+      .check = ~(state->next_frame ^ frame_num),
+  };
+  CHECK(dif_spi_device_send(spi, &ack, sizeof(ack),
+                            /*bytes_sent=*/NULL) == kDifSpiDeviceOk,
+        "Failed to send bytes to SPI.");
+}
+
+/**
+ * Processes a frame of the windowed protocol.
+ *
+ * Only the frame the device expects next is written; any other frame is just
+ * answered with the number of the expected one. So nothing is written before
+ * frame 0, which erases the flash. A refused delta update, or a frame that
+ * doesn't match the mode of the update in progress, starts over from frame 0. Every frame is answered with an
+ * ack, so the host can tell which frame it has to send next. Before the ack,
+ * anything received after the frame is discarded up to the next sync word
+ * (see spiflash_frame.h), which is tracked in `sync_matched`. `done` is set
+ * once the EOF frame has been written.
+ */
+static int process_windowed_frame(dif_spi_device_t *spi,
+                                  const spiflash_frame_t *frame,
+                                  window_state_t *state,
+                                  uint32_t *sync_matched, bool *done) {
+  uint32_t frame_num = SPIFLASH_FRAME_NUM(frame->header.frame_num);
+  LOG_INFO("Processing frame #%d, expecting #%d", frame_num,
+           state->next_frame);
+
+  find_sync(spi, sync_matched);
+
+  if (!check_frame_hash(frame)) {
+    LOG_ERROR("Detected hash mismatch on frame #%d", frame_num);
+    send_window_ack(spi, state, SPIFLASH_ACK_NAK);
+    return 0;
+  }
+
+  if (frame_num == state->next_frame && !check_frame_mode(frame, state)) {
+    LOG_ERROR("Refusing frame #%d", frame_num);
+    *state = (window_state_t){
+        .next_frame = 0,
+        .delta = false,
+    };
+    memset(erased_pages, 0, sizeof(erased_pages));
+    send_window_ack(spi, state, SPIFLASH_ACK_REFUSED);
+    return 0;
+  }
+
+  if (frame_num != state->next_frame) {
+    // Already written, or sent too early: just tell the host where we are.
+    send_window_ack(spi, state, frame->header.frame_num);
+    return 0;
+  }
+
+  // Ack before programming the frame, so that the host can send the next one
+  // while the flash is busy.
+  bool first_frame = state->next_frame == 0;
+  if (first_frame) {
+    state->delta = SPIFLASH_FRAME_IS_DELTA(frame->header.frame_num);
+  }
+  ++state->next_frame;
+  send_window_ack(spi, state, frame->header.frame_num);
+
+  if (first_frame) {
+    int flash_error = prepare_flash(frame);
+    if (flash_error != 0) {
+      return flash_error;
+    }
+  }
+
+  if (!SPIFLASH_FRAME_IS_VERIFY(frame->header.frame_num)) {
+    int flash_error = write_frame(frame);
+    if (flash_error != 0) {
+      return flash_error;
+    }
+  }
+
+  *done = SPIFLASH_FRAME_IS_EOF(frame->header.frame_num);
+  return 0;
+}
+
+/**
+ * Loads spiflash frames with the windowed protocol, after the first sync word
+ * has been received.
+ */
+static int bootstrap_flash_windowed(dif_spi_device_t *spi) {
+  window_state_t window = {
+      .next_frame = 0,
+      .delta = false,
+  };
+  uint32_t sync_matched = sizeof(uint32_t);
+  while (true) {
+    if (!find_sync(spi, &sync_matched)) {
+      continue;
+    }
+    spiflash_frame_t frame;
+    wait_for_bytes(spi, sizeof(spiflash_frame_t));
+    CHECK(dif_spi_device_recv(spi, &frame, sizeof(spiflash_frame_t),
+                              /*bytes_received=*/NULL) == kDifSpiDeviceOk,
+          "Failed to recieve bytes from SPI.");
+    sync_matched = 0;
+
+    bool done = false;
+    int error =
+        process_windowed_frame(spi, &frame, &window, &sync_matched, &done);
+    if (error != 0) {
+      return error;
+    }
+    if (done) {
+      LOG_INFO("Bootstrap: DONE!");
+      return 0;
+    }
+  }
+}
+
 /**
  * Load spiflash frames from the SPI interface.
  *
  * This function checks that the sequence numbers and hashes of the frames are
- * correct before programming them into flash.
+ * correct before programming them into flash. If the first word received is
+ * SPIFLASH_FRAME_SYNC, the host uses the windowed protocol, which is handled
+ * by bootstrap_flash_windowed() instead.
  */
 static int bootstrap_flash(dif_spi_device_t *spi) {
   uint8_t ack[SHA256_DIGEST_SIZE] = {0};
   uint32_t expected_frame_num = 0;
+
+  // The first word of a stop-and-wait update is part of the hash of frame 0.
+  spiflash_frame_t frame;
+  size_t frame_bytes = sizeof(uint32_t);
+  wait_for_bytes(spi, frame_bytes);
+  CHECK(dif_spi_device_recv(spi, &frame, frame_bytes,
+                            /*bytes_received=*/NULL) == kDifSpiDeviceOk,
+        "Failed to recieve bytes from SPI.");
+  if (frame.header.hash[0] == SPIFLASH_FRAME_SYNC) {
+    return bootstrap_flash_windowed(spi);
+  }
+
   while (true) {
     size_t bytes_available;
     CHECK(dif_spi_device_rx_pending(spi, &bytes_available) == kDifSpiDeviceOk,
           "Failed to check pending bytes.");
-    if (bytes_available >= sizeof(spiflash_frame_t)) {
-      spiflash_frame_t frame;
-      CHECK(dif_spi_device_recv(spi, &frame, sizeof(spiflash_frame_t),
+    if (bytes_available >= sizeof(spiflash_frame_t) - frame_bytes) {
+      CHECK(dif_spi_device_recv(spi, (uint8_t *)&frame + frame_bytes,
+                                sizeof(spiflash_frame_t) - frame_bytes,
                                 /*bytes_received=*/NULL) == kDifSpiDeviceOk,
             "Failed to recieve bytes from SPI.");
+      frame_bytes = 0;
 
       uint32_t frame_num = SPIFLASH_FRAME_NUM(frame.header.frame_num);
       LOG_INFO("Processing frame #%d, expecting #%d", frame_num,
                expected_frame_num);
 
-      if (frame_num == expected_frame_num) {
+      // Delta frames need the windowed protocol.
+      if (frame_num == expected_frame_num &&
+          !SPIFLASH_FRAME_IS_DELTA(frame.header.frame_num)) {
         if (!check_frame_hash(&frame)) {
           LOG_ERROR("Detected hash mismatch on frame #%d", frame_num);
           CHECK(dif_spi_device_send(spi, ack, sizeof(ack),
@@ -115,18 +434,15 @@ static int bootstrap_flash(dif_spi_device_t *spi) {
               "Failed to send bytes to SPI.");
 
         if (expected_frame_num == 0) {
-          flash_default_region_access(/*rd_en=*/true, /*prog_en=*/true,
-                                      /*erase_en=*/true);
-          int flash_error = erase_flash();
+          int flash_error = prepare_flash(&frame);
           if (flash_error != 0) {
             return flash_error;
           }
-          LOG_INFO("Flash erase successful");
         }
 
-        if (flash_write(frame.header.flash_offset, kDataPartition, frame.data,
-                        SPIFLASH_FRAME_DATA_WORDS) != 0) {
-          return E_BS_WRITE;
+        int flash_error = write_frame(&frame);
+        if (flash_error != 0) {
+          return flash_error;
         }
 
         ++expected_frame_num;
@@ -169,8 +485,9 @@ int bootstrap(void) {
                                    .tx_order = kDifSpiDeviceBitOrderMsbToLsb,
                                    .rx_order = kDifSpiDeviceBitOrderMsbToLsb,
                                    .rx_fifo_timeout = 63,
-                                   .rx_fifo_len = kDifSpiDeviceBufferLen / 2,
-                                   .tx_fifo_len = kDifSpiDeviceBufferLen / 2,
+                                   .rx_fifo_len = SPIFLASH_RX_FIFO_SIZE,
+                                   .tx_fifo_len = kDifSpiDeviceBufferLen -
+                                                  SPIFLASH_RX_FIFO_SIZE,
                                }) == kDifSpiDeviceOk,
       "Failed to configure SPI.");
 
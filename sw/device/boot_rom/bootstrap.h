@@ -28,6 +28,20 @@
  * The last frame must be ord with FRAME_EOF_MARKER to signal the end of
  * payload transmission.
  *
+ * If the payload starts with SPIFLASH_FRAME_SYNC, the frames use the windowed
+ * protocol described in spiflash_frame.h instead, which acks each frame by
+ * number and lets the host send the next frame while the previous one is
+ * being programmed.
+ *
+ * Delta frames (ord with SPIFLASH_FRAME_DELTA_MARKER) only update the flash
+ * pages they are for, instead of erasing the whole flash first. They are
+ * refused unless the ROM is built with BOOTSTRAP_DELTA_UPDATES defined (meson
+ * option `bootstrap_delta`), because a delta update leaves whatever else is
+ * in flash in place, where a regular update guarantees that nothing from
+ * before the update survives. Delta updates start with verify frames, which
+ * the device checks against the pages the update leaves alone before it
+ * writes anything.
+ *
  * @return Bootstrap status code.
  */
 int bootstrap(void);
@@ -21,6 +21,69 @@
  */
 #define SPIFLASH_FRAME_EOF_MARKER 0x80000000
 
+/**
+ * The windowed flag on a spiflash frame, requesting the windowed protocol.
+ *
+ * On the wire, each windowed frame is preceded by `SPIFLASH_FRAME_SYNC`. The
+ * device answers each windowed frame with a `spiflash_ack_t` instead of a
+ * hash. It only accepts frames in order: any frame other than the one it
+ * expects next is answered with an ack that names the expected frame, and is
+ * otherwise ignored. The window is a single frame.
+ *
+ * The device doesn't read its receive FIFO while it programs a frame, and
+ * bytes that arrive while the FIFO is full are lost. It acks a frame just
+ * before programming it, so the host must not send the next frame before it
+ * has seen the ack for the previous one. The host collects acks by clocking
+ * out other bytes between frames (e.g. zeros), which the device discards
+ * while it looks for the next `SPIFLASH_FRAME_SYNC`. The device also discards
+ * whatever it has received after a frame (up to the next sync word) before it
+ * acks the frame, so when the host sees an ack, the FIFO has room for a whole
+ * frame.
+ */
+#define SPIFLASH_FRAME_WINDOWED_MARKER 0x40000000
+
+/**
+ * The word preceding each windowed frame on the wire ("SYNC").
+ *
+ * The device finds the start of a frame by looking for this word, which lets
+ * it recover when bytes of a frame have been lost or corrupted.
+ */
+#define SPIFLASH_FRAME_SYNC 0x434e5953
+
+/**
+ * Size of the device's receive FIFO in bootstrap mode, in bytes.
+ *
+ * This is room for one windowed frame with its sync word, plus the bytes the
+ * host clocks out to look for the ack of that frame.
+ */
+#define SPIFLASH_RX_FIFO_SIZE 3072
+
+/**
+ * The delta flag on a spiflash frame.
+ *
+ * Delta frames only update the flash page that contains `flash_offset`: any
+ * data that would go past the end of that page is ignored. The device erases
+ * each page before writing the first delta frame for it, and leaves pages no
+ * delta frame touches alone instead of erasing the whole flash. This lets the
+ * host skip pages which haven't changed since the last update.
+ *
+ * Delta frames are only accepted with the windowed protocol, and only by a
+ * boot ROM built with delta updates enabled (see bootstrap.h). A delta update
+ * starts with one or more verify frames, and every frame of it must be a delta
+ * frame. Likewise, every frame of an update that doesn't start with a delta
+ * frame must not be one.
+ */
+#define SPIFLASH_FRAME_DELTA_MARKER 0x20000000
+
+/**
+ * The verify flag on a delta frame.
+ *
+ * Verify frames carry a `spiflash_verify_t` instead of flash data, listing
+ * the hashes the host expects the pages it won't send to have. If any page
+ * differs, the device answers with `SPIFLASH_ACK_REFUSED`.
+ */
+#define SPIFLASH_FRAME_VERIFY_MARKER 0x10000000
+
 /**
  * Extracts the "number" part of a `frame_num`.
  */
@@ -31,6 +94,22 @@
  */
 #define SPIFLASH_FRAME_IS_EOF(k) (((k)&SPIFLASH_FRAME_EOF_MARKER) != 0)
 
+/**
+ * Checks whether a `frame_num` requests the windowed protocol.
+ */
+#define SPIFLASH_FRAME_IS_WINDOWED(k) \
+  (((k)&SPIFLASH_FRAME_WINDOWED_MARKER) != 0)
+
+/**
+ * Checks whether a `frame_num` is for a delta frame.
+ */
+#define SPIFLASH_FRAME_IS_DELTA(k) (((k)&SPIFLASH_FRAME_DELTA_MARKER) != 0)
+
+/**
+ * Checks whether a `frame_num` is for a verify frame.
+ */
+#define SPIFLASH_FRAME_IS_VERIFY(k) (((k)&SPIFLASH_FRAME_VERIFY_MARKER) != 0)
+
 /**
  * The length, in words, of a frame's data buffer.
  */
@@ -75,4 +154,85 @@ typedef struct spiflash_frame {
 _Static_assert(sizeof(spiflash_frame_t) == SPIFLASH_RAW_BUFFER_SIZE,
                "spiflash_frame_t is the wrong size!");
 
+/**
+ * The largest number of pages a verify frame can list.
+ */
+#define SPIFLASH_VERIFY_MAX_PAGES 55
+
+/**
+ * The payload of a verify frame.
+ */
+typedef struct spiflash_verify {
+  /**
+   * Number of valid entries in `pages`.
+   */
+  uint32_t num_pages;
+  /**
+   * Pages the host expects to be in flash already.
+   */
+  struct {
+    /**
+     * Page number, indexed from 0.
+     */
+    uint32_t page;
+    /**
+     * SHA256 of the whole page.
+     */
+    uint32_t hash[SHA256_DIGEST_SIZE / sizeof(uint32_t)];
+  } pages[SPIFLASH_VERIFY_MAX_PAGES];
+} spiflash_verify_t;
+
+_Static_assert(sizeof(spiflash_verify_t) <=
+                   SPIFLASH_FRAME_DATA_WORDS * sizeof(uint32_t),
+               "spiflash_verify_t does not fit in a frame!");
+
+/**
+ * The value of `spiflash_ack_t.magic`.
+ */
+#define SPIFLASH_ACK_MAGIC 0x4b414653  // "SFAK"
+
+/**
+ * The value of `spiflash_ack_t.frame` if the frame failed its hash check.
+ */
+#define SPIFLASH_ACK_NAK 0xffffffff
+
+/**
+ * The value of `spiflash_ack_t.frame` if the device refuses a delta update,
+ * because it doesn't accept delta frames or because a verify frame doesn't
+ * match the flash, or refuses a frame that is a delta frame when the update
+ * in progress isn't (or the other way around). The device expects frame 0
+ * again, so the host can send the whole image instead. A delta update that
+ * is refused at a verify frame has written nothing.
+ */
+#define SPIFLASH_ACK_REFUSED 0xfffffffe
+
+/**
+ * A windowed protocol ack, as sent back by the device after each frame.
+ *
+ * The host receives acks while it is clocking out other data, so it may see
+ * several of them (or none) at any byte offset of the data it receives, and
+ * an ack may be split between two transfers. `next_frame` is cumulative, so
+ * the last valid ack is the most up to date.
+ */
+typedef struct spiflash_ack {
+  /**
+   * `SPIFLASH_ACK_MAGIC`.
+   */
+  uint32_t magic;
+  /**
+   * All frames before this one have been received and checked.
+   */
+  uint32_t next_frame;
+  /**
+   * The `frame_num` of the frame this ack answers, `SPIFLASH_ACK_NAK` if that
+   * frame failed its hash check and must be sent again, or
+   * `SPIFLASH_ACK_REFUSED`.
+   */
+  uint32_t frame;
+  /**
+   * `~(next_frame ^ frame)`, to tell acks apart from other data.
+   */
+  uint32_t check;
+} spiflash_ack_t;
+
 #endif  // OPENTITAN_SW_DEVICE_BOOT_ROM_SPIFLASH_FRAME_H_
@@ -136,6 +136,34 @@ bool FtdiSpiInterface::TransmitFrame(const uint8_t *tx, size_t size) {
   return true;
 }
 
+bool FtdiSpiInterface::TransferFrame(const uint8_t *tx, uint8_t *rx,
+                                     size_t size) {
+  assert(spi_ != nullptr);
+
+  std::vector<uint8_t> tx_local(tx, tx + size);
+
+  if (Start(spi_->ctx)) {
+    std::cerr << "Unable to start spi transaction." << std::endl;
+    return false;
+  }
+
+  uint8_t *tmp_rx = ::Transfer(spi_->ctx, tx_local.data(), size);
+  if (tmp_rx != nullptr) {
+    memcpy(rx, tmp_rx, size);
+    free(tmp_rx);
+  }
+
+  if (Stop(spi_->ctx)) {
+    std::cerr << "Unable to terminate spi transaction." << std::endl;
+    return false;
+  }
+  if (tmp_rx == nullptr) {
+    std::cerr << "Transfer failed, did not allocate buffer." << std::endl;
+    return false;
+  }
+  return true;
+}
+
 bool FtdiSpiInterface::CheckHash(const uint8_t *tx, size_t size) {
   uint8_t hash[SHA256_DIGEST_LENGTH];
   SHA256_CTX sha256;
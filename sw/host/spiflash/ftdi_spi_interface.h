@@ -57,6 +57,7 @@ class FtdiSpiInterface : public SpiInterface {
 
   bool Init() final;
   bool TransmitFrame(const uint8_t *tx, size_t size) final;
+  bool TransferFrame(const uint8_t *tx, uint8_t *rx, size_t size) final;
   bool CheckHash(const uint8_t *tx, size_t size) final;
 
  private:
@@ -37,6 +37,18 @@ class SpiInterface {
    */
   virtual bool TransmitFrame(const uint8_t *tx, size_t size) = 0;
 
+  /**
+   * Transmit bytes from `tx` buffer, storing the bytes received at the same
+   * time in `rx`. Both buffers hold `size` bytes.
+   *
+   * @param tx   transmit buffer.
+   * @param rx   receive buffer.
+   * @param size number of bytes to transfer.
+   *
+   * @return true on success, false otherwise.
+   */
+  virtual bool TransferFrame(const uint8_t *tx, uint8_t *rx, size_t size) = 0;
+
   /**
    * Checks hash response from SPI interface.
    *
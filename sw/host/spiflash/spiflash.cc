@@ -24,6 +24,17 @@ using opentitan::spiflash::VerilatorSpiInterface;
 
 constexpr char kUsageString[] = R"R( usage options:
   --input=Input image in binary format.
+  [--windowed] Use the windowed protocol, which sends each frame while the
+    device programs the previous one. By default each frame is acked with
+    its hash before the next one is sent.
+  [--resume-from=frame] Start from this frame number, to resume an update
+    that was interrupted.
+  [--manifest=file] Write the hash of each flash page of the image to this
+    file after a successful update.
+  [--delta] Only send the flash pages which changed since the update that
+    wrote --manifest. The other pages are left alone by the device, which
+    checks them first. Implies --windowed, and needs a boot ROM built with
+    the bootstrap_delta option; otherwise the whole image is sent.
 
 FTDI Options:
   [--dev-id="vid:pid"] FTDI device ID.
@@ -33,6 +44,9 @@ FTDI Options:
 
 Verilator Options:
   [--verilator=filehandle] Enables Verilator mode with SPI filehandle.
+  [--verilator-framed] Use framed mode, which waits for each frame to
+    complete instead of a fixed delay. Start the simulation with
+    +SPIDPI_FRAMED_spi0 to use it.
 
 DV Options:
   [--dump-frames=filehandle] Dump binary SPI flash frames in binary format.
@@ -67,6 +81,21 @@ struct SpiFlashOpts {
   /** Output filename to dump SPI frames */
   std::string output_filename;
 
+  /** Use framed mode with Verilator. */
+  bool verilator_framed = false;
+
+  /** Use the windowed protocol. */
+  bool windowed = false;
+
+  /** First frame to send. */
+  uint32_t start_frame = 0;
+
+  /** Manifest of flash page hashes. */
+  std::string manifest;
+
+  /** Only send pages which differ from the manifest. */
+  bool delta = false;
+
   /** Set to SPI flash  mode of operation */
   SpiFlashAction action = SpiFlashAction::kInvalid;
 
@@ -167,11 +196,17 @@ bool ParseArgs(int argc, char **argv, SpiFlashOpts *options) {
       {"dev-sn", required_argument, nullptr, 'n'},
       {"dump-frames", required_argument, nullptr, 'x'},
       {"verilator", required_argument, nullptr, 's'},
+      {"verilator-framed", no_argument, nullptr, 'f'},
+      {"windowed", no_argument, nullptr, 'w'},
+      {"resume-from", required_argument, nullptr, 'r'},
+      {"manifest", required_argument, nullptr, 'm'},
+      {"delta", no_argument, nullptr, 'D'},
       {"help", no_argument, nullptr, 'h'},
       {nullptr, no_argument, nullptr, 0}};
 
   while (true) {
-    int c = getopt_long(argc, argv, "i:d:n:s:x:h?", long_options, nullptr);
+    int c = getopt_long(argc, argv, "i:d:n:s:fwr:m:Dx:h?", long_options,
+                        nullptr);
     if (c == -1) {
       // if only input file was given default to using FTDI
       if (!options->input.empty() &&
@@ -200,6 +235,21 @@ bool ParseArgs(int argc, char **argv, SpiFlashOpts *options) {
         options->action = SpiFlashAction::kVerilator;
         options->target = optarg;
         break;
+      case 'f':
+        options->verilator_framed = true;
+        break;
+      case 'w':
+        options->windowed = true;
+        break;
+      case 'r':
+        options->start_frame = std::stoul(optarg, /*pos=*/0, /*base=*/0);
+        break;
+      case 'm':
+        options->manifest = optarg;
+        break;
+      case 'D':
+        options->delta = true;
+        break;
       case 'x':
         options->action = SpiFlashAction::kDumpFrames;
         options->output_filename = optarg;
@@ -234,6 +284,11 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  if (spi_flash_options.delta && spi_flash_options.manifest.empty()) {
+    std::cerr << "--delta requires --manifest." << std::endl;
+    return 1;
+  }
+
   std::string code;
   if (!GetFileContents(spi_flash_options.input, &code)) {
     return 1;
@@ -245,7 +300,8 @@ int main(int argc, char **argv) {
 
   std::unique_ptr<SpiInterface> spi;
   if (spi_flash_options.action == SpiFlashAction::kVerilator) {
-    spi = std::make_unique<VerilatorSpiInterface>(spi_flash_options.target);
+    spi = std::make_unique<VerilatorSpiInterface>(
+        spi_flash_options.target, spi_flash_options.verilator_framed);
   } else {
     spi = std::make_unique<FtdiSpiInterface>(spi_flash_options.ftdi_options);
   }
@@ -255,6 +311,10 @@ int main(int argc, char **argv) {
 
   Updater::Options options;
   options.code = code;
+  options.windowed = spi_flash_options.windowed;
+  options.start_frame = spi_flash_options.start_frame;
+  options.manifest = spi_flash_options.manifest;
+  options.delta = spi_flash_options.delta;
 
   Updater updater(options, std::move(spi));
   return updater.Run() ? 0 : 1;
@@ -6,37 +6,90 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
 #include <unistd.h>
 
 namespace opentitan {
 namespace spiflash {
 namespace {
 
+/**
+ * Windowed protocol definitions, see sw/device/boot_rom/spiflash_frame.h.
+ */
+constexpr uint32_t kFrameEofMarker = 0x80000000;
+constexpr uint32_t kFrameWindowedMarker = 0x40000000;
+constexpr uint32_t kFrameDeltaMarker = 0x20000000;
+constexpr uint32_t kFrameVerifyMarker = 0x10000000;
+constexpr uint32_t kVerifyMaxPages = 55;
+constexpr uint32_t kFrameSync = 0x434e5953;
+constexpr uint32_t kAckMagic = 0x4b414653;
+constexpr uint32_t kAckNak = 0xffffffff;
+constexpr uint32_t kAckRefused = 0xfffffffe;
+
+/** Windowed protocol ack. */
+struct Ack {
+  uint32_t magic;
+  uint32_t next_frame;
+  uint32_t frame;
+  uint32_t check;
+};
+
+/** Size of the device's RX FIFO in bytes. */
+constexpr size_t kRxFifoSize = 3072;
+
+/** Bytes sent for each windowed frame: the sync word and the frame. */
+constexpr size_t kWindowedTransferSize = sizeof(uint32_t) + sizeof(Frame);
+
+/**
+ * Bytes clocked out to read acks while no frame is sent. The device discards
+ * them while it looks for the next sync word.
+ */
+constexpr size_t kPollSize = sizeof(Ack);
+
+/** Delay between two polls for an ack in microseconds. */
+constexpr useconds_t kPollDelayUs = 1000;
+
+/**
+ * Polls without an answer after which a windowed frame is sent again. This
+ * many polls still fit in the device's RX FIFO behind an unanswered frame.
+ */
+constexpr int kPollsBeforeResend =
+    (kRxFifoSize - kWindowedTransferSize) / kPollSize;
+
+/**
+ * Number of times the first frame of a resumed stop-and-wait update is sent
+ * before giving up.
+ */
+constexpr int kResumeAttempts = 8;
+
+/** Frame payload size in bytes. */
+constexpr uint32_t kPayloadSize = sizeof(Frame::data);
+
 /**
  * Populate target frame `f`.
  *
- * Populates frame `f` with `frame_number`, `code_offset`, and frame data
- * starting at `code_offset` from `code` buffer. Calculates SHA256 hash of
- * frame payload and it stores it in the frame header.
- *
- * @return the number of bytes loaded into the frame.
+ * Populates frame `f` with `frame_number`, and the frame data given by `span`
+ * from `code` buffer. Bytes past the end of `code` are left at 0xff.
  */
-uint32_t Populate(uint32_t frame_number, uint32_t code_offset,
-                  const std::string &code, Frame *f) {
+void Populate(uint32_t frame_number, const FrameSpan &span,
+              const std::string &code, Frame *f) {
   assert(f);
-  assert(code_offset < code.size());
+  assert(span.size <= f->PayloadSize());
 
   // Populate payload data. Initialize buffer to 0xff to minimize flash
   // writes.
-  size_t copy_size =
-      std::min<size_t>(f->PayloadSize(), code.size() - code_offset);
   memset(f->data, 0xff, f->PayloadSize());
-  memcpy(f->data, code.data() + code_offset, copy_size);
+  if (span.offset < code.size()) {
+    size_t copy_size = std::min<size_t>(span.size, code.size() - span.offset);
+    memcpy(f->data, code.data() + span.offset, copy_size);
+  }
 
-  // Populate header number, offset and hash.
+  // Populate header number and offset.
   f->hdr.frame_num = frame_number;
-  f->hdr.offset = code_offset;
-  return copy_size;
+  f->hdr.offset = span.offset;
 }
 
 /**
@@ -51,28 +104,328 @@ void HashFrame(Frame *f) {
   SHA256_Final(f->hdr.hash, &sha256);
 }
 
+/**
+ * Builds the frame with `frame_num` (including its flags) carrying `span` of
+ * `code` into `f`.
+ */
+void BuildFrame(const std::string &code, const FrameSpan &span,
+                uint32_t frame_num, Frame *f) {
+  Populate(frame_num, span, code, f);
+  HashFrame(f);
+}
+
+/**
+ * Builds the verify frames for a delta update, which tell the device to
+ * check that each of `pages` has the hash at the same index of `hashes`.
+ * They are numbered from 0, with `flags` added to their `frame_num`.
+ */
+std::vector<Frame> BuildVerifyFrames(const std::vector<size_t> &pages,
+                                     const std::vector<std::string> &hashes,
+                                     uint32_t flags) {
+  // A delta update starts with at least one verify frame, even if it has no
+  // pages to check.
+  std::vector<Frame> frames;
+  size_t index = 0;
+  do {
+    Frame f;
+    memset(f.data, 0, f.PayloadSize());
+    uint32_t num_pages =
+        std::min<size_t>(kVerifyMaxPages, pages.size() - index);
+    memcpy(f.data, &num_pages, sizeof(num_pages));
+    uint8_t *entry = f.data + sizeof(num_pages);
+    for (uint32_t i = 0; i < num_pages; ++i, ++index) {
+      uint32_t page = pages[index];
+      memcpy(entry, &page, sizeof(page));
+      memcpy(entry + sizeof(page), hashes[index].data(), SHA256_DIGEST_LENGTH);
+      entry += sizeof(page) + SHA256_DIGEST_LENGTH;
+    }
+    f.hdr.frame_num = frames.size() | flags;
+    f.hdr.offset = 0;
+    HashFrame(&f);
+    frames.push_back(f);
+  } while (index < pages.size());
+  return frames;
+}
+
+/** Splits an image of `size` bytes into frames. */
+std::vector<FrameSpan> SplitImage(size_t size) {
+  std::vector<FrameSpan> spans;
+  spans.reserve((size + kPayloadSize - 1) / kPayloadSize);
+  for (size_t offset = 0; offset < size; offset += kPayloadSize) {
+    spans.push_back({static_cast<uint32_t>(offset),
+                     static_cast<uint32_t>(
+                         std::min<size_t>(kPayloadSize, size - offset))});
+  }
+  return spans;
+}
+
+/**
+ * Calls `fn(i)` for all `i` from 0 to `count - 1`, spread across the
+ * available cores.
+ */
+void ParallelFor(size_t count, const std::function<void(size_t)> &fn) {
+  size_t num_threads = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), count);
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&fn, count, num_threads, t]() {
+      for (size_t i = t; i < count; i += num_threads) {
+        fn(i);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+/**
+ * Returns the SHA256 hash of flash page `page` as written for `code`, with
+ * bytes past the end of `code` left at 0xff.
+ */
+std::string PageHash(const std::string &code, size_t page) {
+  std::string data(Updater::kFlashPageSize, '\xff');
+  size_t offset = page * Updater::kFlashPageSize;
+  if (offset < code.size()) {
+    data.replace(0, std::min<size_t>(data.size(), code.size() - offset),
+                 code, offset, data.size());
+  }
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t *>(data.data()), data.size(), hash);
+  return std::string(reinterpret_cast<const char *>(hash), sizeof(hash));
+}
+
+/** Returns the hashes of all flash pages covered by `code`. */
+std::vector<std::string> PageHashes(const std::string &code) {
+  std::vector<std::string> hashes(
+      (code.size() + Updater::kFlashPageSize - 1) / Updater::kFlashPageSize);
+  ParallelFor(hashes.size(),
+              [&](size_t page) { hashes[page] = PageHash(code, page); });
+  return hashes;
+}
+
+/**
+ * Reads the page hashes from manifest file `filename` into `hashes`.
+ *
+ * Each line holds the offset of a page and its hash, in hex. Lines starting
+ * with '#' are ignored.
+ *
+ * @return true on success, false if the file is missing or malformed.
+ */
+bool ReadManifest(const std::string &filename,
+                  std::vector<std::string> *hashes) {
+  std::ifstream in(filename);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    uint32_t offset;
+    std::string hex;
+    if (!(fields >> std::hex >> offset >> hex) ||
+        offset != hashes->size() * Updater::kFlashPageSize ||
+        hex.size() != 2 * SHA256_DIGEST_LENGTH) {
+      std::cerr << "Malformed manifest line: " << line << std::endl;
+      return false;
+    }
+    std::string hash;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+      hash.push_back(static_cast<char>(std::stoul(hex.substr(i, 2), nullptr,
+                                                  /*base=*/16)));
+    }
+    hashes->push_back(hash);
+  }
+  return true;
+}
+
+/**
+ * Writes the page hashes of `code` to manifest file `filename`.
+ *
+ * @return true on success, false otherwise.
+ */
+bool WriteManifest(const std::string &filename, const std::string &code) {
+  std::ofstream out(filename);
+  out << "# spiflash manifest: offset and SHA256 of each flash page"
+      << std::endl;
+  std::vector<std::string> hashes = PageHashes(code);
+  for (size_t page = 0; page < hashes.size(); ++page) {
+    out << std::hex << std::setfill('0') << std::setw(8)
+        << page * Updater::kFlashPageSize << " ";
+    for (char c : hashes[page]) {
+      out << std::setw(2) << static_cast<unsigned>(static_cast<uint8_t>(c));
+    }
+    out << std::endl;
+  }
+  return out.good();
+}
+
+/**
+ * Looks for windowed protocol acks in `rx`, which holds `size` bytes received
+ * from the device, and appends them to `acks` in the order they were sent.
+ * The acks may be at any offset.
+ *
+ * @return the number of bytes at the end of `rx` that may be the start of an
+ * ack which continues in the next transfer.
+ */
+size_t FindAcks(const uint8_t *rx, size_t size, std::vector<Ack> *acks) {
+  size_t i = 0;
+  while (i + sizeof(Ack) <= size) {
+    Ack candidate;
+    memcpy(&candidate, &rx[i], sizeof(Ack));
+    if (candidate.magic != kAckMagic ||
+        candidate.check != ~(candidate.next_frame ^ candidate.frame)) {
+      ++i;
+      continue;
+    }
+    acks->push_back(candidate);
+    i += sizeof(Ack);
+  }
+  return size - i;
+}
+
+/** Prints the number and offset of frame `f` before sending it. */
+void PrintFrame(const Frame &f) {
+  std::cout << "frame: 0x" << std::setfill('0') << std::setw(8) << std::hex
+            << f.hdr.frame_num << " to offset: 0x" << std::setfill('0')
+            << std::setw(8) << std::hex << f.hdr.offset << std::endl;
+}
+
 }  // namespace
 
+constexpr uint32_t Updater::kFlashPageSize;
+
 bool Updater::Run() {
   std::cout << "Running SPI flash update." << std::endl;
-  std::vector<Frame> frames;
-  if (!GenerateFrames(options_.code, &frames)) {
+  if (options_.code.empty()) {
     std::cerr << "Unable to process flash image." << std::endl;
     return false;
   }
-  std::cout << "Image divided into " << frames.size() << " frames."
+  // Delta updates need the windowed protocol to learn whether the device
+  // takes them.
+  const bool windowed = options_.windowed || options_.delta;
+  frame_flags_ = windowed ? kFrameWindowedMarker : 0;
+  if (!options_.delta || !PlanDelta()) {
+    spans_ = SplitImage(options_.code.size());
+  }
+  std::cout << "Image divided into " << NumFrames() << " frames."
             << std::endl;
+  if (options_.start_frame >= NumFrames()) {
+    std::cerr << "Cannot resume from frame " << std::dec
+              << options_.start_frame << ", the image only has "
+              << NumFrames() << " frames." << std::endl;
+    return false;
+  }
+
+  bool ok = windowed ? RunWindowed() : RunStopAndWait();
+  if (!ok && delta_refused_) {
+    // The device has not written anything, and expects frame 0 again.
+    std::cout << "The device refused the delta update, sending the whole "
+                 "image."
+              << std::endl;
+    delta_refused_ = false;
+    verify_frames_.clear();
+    spans_ = SplitImage(options_.code.size());
+    frame_flags_ = kFrameWindowedMarker;
+    options_.start_frame = 0;
+    ok = RunWindowed();
+  }
+  if (ok && !options_.manifest.empty() &&
+      !WriteManifest(options_.manifest, options_.code)) {
+    std::cerr << "Unable to write manifest: " << options_.manifest
+              << std::endl;
+    return false;
+  }
+  return ok;
+}
+
+bool Updater::PlanDelta() {
+  std::vector<std::string> old_hashes;
+  if (!ReadManifest(options_.manifest, &old_hashes)) {
+    std::cout << "No usable manifest at " << options_.manifest
+              << ", sending the whole image." << std::endl;
+    return false;
+  }
+
+  // Pages past the end of the new image must end up blank.
+  std::vector<std::string> new_hashes = PageHashes(options_.code);
+  const std::string blank_hash = PageHash(std::string(), 0);
+  size_t num_pages = std::max(new_hashes.size(), old_hashes.size());
+  std::vector<size_t> changed;
+  std::vector<size_t> unchanged;
+  std::vector<std::string> unchanged_hashes;
+  for (size_t page = 0; page < num_pages; ++page) {
+    const std::string &hash =
+        page < new_hashes.size() ? new_hashes[page] : blank_hash;
+    if (page >= old_hashes.size() || old_hashes[page] != hash) {
+      changed.push_back(page);
+    } else {
+      unchanged.push_back(page);
+      unchanged_hashes.push_back(hash);
+    }
+  }
+  std::cout << "Delta update: " << std::dec << changed.size() << " of "
+            << num_pages << " flash pages changed." << std::endl;
+  // The device waits for at least one frame before it boots.
+  if (changed.empty()) {
+    changed.push_back(0);
+    unchanged.erase(unchanged.begin());
+    unchanged_hashes.erase(unchanged_hashes.begin());
+  }
 
-  std::string ack_expected;
-  ack_expected.resize(sizeof(Frame), '\0');
-  std::string ack;
-  ack.resize(sizeof(Frame));
-  for (uint32_t current_frame = 0; current_frame < frames.size();) {
-    const Frame &f = frames[current_frame];
+  // The device checks that the pages left alone hold what the manifest says
+  // before it writes anything, and refuses the update otherwise.
+  frame_flags_ |= kFrameDeltaMarker;
+  verify_frames_ = BuildVerifyFrames(unchanged, unchanged_hashes,
+                                     frame_flags_ | kFrameVerifyMarker);
 
-    std::cout << "frame: 0x" << std::setfill('0') << std::setw(8) << std::hex
-              << f.hdr.frame_num << " to offset: 0x" << std::setfill('0')
-              << std::setw(8) << std::hex << f.hdr.offset << std::endl;
+  // Delta frames don't cross page boundaries, see spiflash_frame.h.
+  spans_.clear();
+  for (size_t page : changed) {
+    for (uint32_t offset = 0; offset < kFlashPageSize;
+         offset += kPayloadSize) {
+      spans_.push_back(
+          {static_cast<uint32_t>(page * kFlashPageSize + offset),
+           std::min(kPayloadSize, kFlashPageSize - offset)});
+    }
+  }
+  return true;
+}
+
+uint32_t Updater::NumFrames() const {
+  return verify_frames_.size() + spans_.size();
+}
+
+void Updater::MakeFrame(uint32_t frame_number, Frame *f) const {
+  if (frame_number < verify_frames_.size()) {
+    *f = verify_frames_[frame_number];
+    return;
+  }
+  uint32_t frame_num = frame_number | frame_flags_;
+  if (frame_number == NumFrames() - 1) {
+    frame_num |= kFrameEofMarker;
+  }
+  BuildFrame(options_.code, spans_[frame_number - verify_frames_.size()],
+             frame_num, f);
+}
+
+bool Updater::RunStopAndWait() {
+  const uint32_t num_frames = NumFrames();
+  Frame f;
+  int resume_attempts = 0;
+  for (uint32_t current_frame = options_.start_frame;
+       current_frame < num_frames;) {
+    MakeFrame(current_frame, &f);
+    PrintFrame(f);
 
     if (!spi_->TransmitFrame(reinterpret_cast<const uint8_t *>(&f),
                              sizeof(Frame))) {
@@ -87,35 +440,133 @@ bool Updater::Run() {
     }
 
     // When we send each frame we wait for the correct hash before continuing.
-    if (current_frame == frames.size() - 1 ||
+    if (current_frame == num_frames - 1 ||
         spi_->CheckHash(reinterpret_cast<const uint8_t *>(&f), sizeof(Frame))) {
       current_frame++;
+      continue;
+    }
+
+    // A device which was reset since the interrupted update only takes frame
+    // 0, so it never acks the frame we resume from.
+    if (current_frame == options_.start_frame && current_frame > 0 &&
+        ++resume_attempts == kResumeAttempts) {
+      std::cerr << "The device did not accept frame " << std::dec
+                << current_frame
+                << ", it probably expects frame 0 after a reset. Run the "
+                   "update again without resuming."
+                << std::endl;
+      return false;
     }
   }
   return true;
 }
 
-bool Updater::GenerateFrames(const std::string &code,
-                             std::vector<Frame> *frames) {
-  if (frames == nullptr) {
-    return false;
-  }
-  uint32_t frame_number = 0;
-  uint32_t code_offset = 0;
-  while (code_offset < code.size()) {
-    Frame frame;
-    uint32_t bytes_copied = Populate(frame_number, code_offset, code, &frame);
-    code_offset += bytes_copied;
-    frame_number++;
-    frames->emplace_back(frame);
+bool Updater::RunWindowed() {
+  const uint32_t last_frame = NumFrames() - 1;
+
+  // Only one frame is sent before the device answers it, so that the frame
+  // and the polls for its ack fit in the device's RX FIFO. The device acks a
+  // frame before programming it, so the next one is still sent while the
+  // flash is busy.
+  uint32_t current_frame = options_.start_frame;
+  bool erase_delay_done = false;
+  Frame f;
+  std::vector<uint8_t> tx(kWindowedTransferSize);
+  std::vector<uint8_t> rx(kWindowedTransferSize);
+  const std::vector<uint8_t> poll(kPollSize, 0);
+  // Received bytes which may be the start of an ack.
+  std::vector<uint8_t> pending;
+  std::vector<Ack> acks;
+  while (true) {
+    const uint32_t sent_frame = current_frame;
+    MakeFrame(sent_frame, &f);
+    PrintFrame(f);
+    memcpy(&tx[0], &kFrameSync, sizeof(kFrameSync));
+    memcpy(&tx[sizeof(kFrameSync)], &f, sizeof(Frame));
+
+    // Send the frame, then poll until the device answers it. The frame is
+    // sent again if the device rejects it, or if it doesn't answer, e.g.
+    // because the sync word was lost.
+    bool resend = true;
+    bool answered = false;
+    for (int polls = 0; !answered && polls <= kPollsBeforeResend; ++polls) {
+      const std::vector<uint8_t> &out = resend ? tx : poll;
+      if (!resend) {
+        usleep(kPollDelayUs);
+      }
+      resend = false;
+      if (!spi_->TransferFrame(&out[0], &rx[0], out.size())) {
+        std::cerr << "Failed to transmit frame no: 0x" << std::setfill('0')
+                  << std::setw(8) << std::hex << f.hdr.frame_num << std::endl;
+        return false;
+      }
+
+      // Acks may be split across transfers.
+      pending.insert(pending.end(), rx.begin(), rx.begin() + out.size());
+      acks.clear();
+      size_t carry = FindAcks(&pending[0], pending.size(), &acks);
+      pending.erase(pending.begin(), pending.end() - carry);
+
+      for (const Ack &ack : acks) {
+        if (ack.frame == kAckRefused) {
+          if (verify_frames_.empty()) {
+            std::cerr << "The device refused frame " << std::dec << sent_frame
+                      << "." << std::endl;
+          }
+          delta_refused_ = !verify_frames_.empty();
+          return false;
+        }
+        if (ack.next_frame == 0 && options_.start_frame > 0) {
+          std::cerr << "The device expects frame 0, it was probably reset "
+                       "since the interrupted update. Run the update again "
+                       "without resuming."
+                    << std::endl;
+          return false;
+        }
+        // The last frame counts as sent only once the device has acked it.
+        if (ack.next_frame > last_frame) {
+          return true;
+        }
+        if (ack.frame == kAckNak) {
+          std::cerr << "Frame " << std::dec << sent_frame
+                    << " was rejected, resending." << std::endl;
+          resend = true;
+        } else if (ack.frame == f.hdr.frame_num) {
+          // The device may be ahead of us or behind us (e.g. when resuming
+          // from a frame it hasn't got yet): continue from where it is.
+          answered = true;
+          current_frame = ack.next_frame;
+        }
+      }
+    }
+
+    // After receiving and validating the first frame, the device is erasing
+    // the Flash.
+    if (answered && sent_frame == 0 && !erase_delay_done) {
+      usleep(options_.flash_erase_delay_us);
+      erase_delay_done = true;
+    }
   }
-  // Update last frame to sentinel EOF value.
-  Frame &last_frame = frames->back();
-  last_frame.hdr.frame_num = 0x80000000 | last_frame.hdr.frame_num;
+}
 
-  for (Frame &f : *frames) {
-    HashFrame(&f);
+bool Updater::GenerateFrames(const std::string &code,
+                             std::vector<Frame> *frames, bool windowed) {
+  if (frames == nullptr || code.empty()) {
+    return false;
   }
+  // Frames are independent, so they are populated and hashed in place on all
+  // cores.
+  std::vector<FrameSpan> spans = SplitImage(code.size());
+  const uint32_t flags = windowed ? kFrameWindowedMarker : 0;
+  frames->clear();
+  frames->resize(spans.size());
+  ParallelFor(spans.size(), [&](size_t i) {
+    uint32_t frame_num = i | flags;
+    if (i == spans.size() - 1) {
+      frame_num |= kFrameEofMarker;
+    }
+    BuildFrame(code, spans[i], frame_num, &(*frames)[i]);
+  });
   return true;
 }
 
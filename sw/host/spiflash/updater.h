@@ -42,11 +42,29 @@ struct Frame {
   size_t PayloadSize() const { return 2048 - sizeof(hdr); }
 };
 
+/** Part of the image carried by one `Frame`. */
+struct FrameSpan {
+  /** Flash target offset. */
+  uint32_t offset;
+
+  /** Number of bytes, at most `Frame::PayloadSize()`. */
+  uint32_t size;
+};
+
 /**
  * Implements SPI flash update protocol.
  *
  * The firmare image is split into frames, and then sent to the SPI device.
- * More details will be added on the ack protocol once implemented.
+ * By default each frame is sent once the device has acked the previous one
+ * with its hash. With `Options::windowed` set, the windowed protocol from
+ * sw/device/boot_rom/spiflash_frame.h is used instead: the device acks each
+ * frame by number as soon as it has checked it, so the next frame can be sent
+ * while the device programs the previous one, and frames it rejects are sent
+ * again.
+ *
+ * Frames are built as they are sent, so only the ones in flight are held in
+ * memory. With `Options::delta` set, only the flash pages which differ from
+ * the manifest of the previous update are sent.
  * This class is not thread safe due to the spi driver dependency.
  */
 class Updater {
@@ -57,8 +75,35 @@ class Updater {
     std::string code;
     /** Flash erase delay in microseconds. */
     int32_t flash_erase_delay_us = 100000;
+    /**
+     * Use the windowed protocol instead of waiting for the hash of each frame
+     * before sending the next one.
+     */
+    bool windowed = false;
+    /**
+     * First frame to send, to resume an update that was interrupted. With
+     * the windowed protocol the device's acks take precedence, unless they
+     * show that it expects frame 0 (after a reset), which is an error.
+     */
+    uint32_t start_frame = 0;
+    /**
+     * Manifest file holding the hash of each flash page of the image, which
+     * is written after a successful update. Empty for none.
+     */
+    std::string manifest;
+    /**
+     * Only send the flash pages whose hash differs from `manifest`, and tell
+     * the device to leave the others alone. The device checks the others
+     * against `manifest` first, and if they don't match, or if it doesn't
+     * take delta updates, the whole image is sent instead. Implies
+     * `windowed`.
+     */
+    bool delta = false;
   };
 
+  /** Flash page size in bytes, the unit of delta updates. */
+  static constexpr uint32_t kFlashPageSize = 2048;
+
   /**
    * Constructs updater instance with given configuration `options` and `spi`
    * interface.
@@ -82,19 +127,50 @@ class Updater {
   bool Run();
 
   /**
-   * Generates `frames` from `code` image.
+   * Generates `frames` from `code` image, hashing them on all cores.
    *
    * @param code   software image in binary format.
    * @param[out] frames output SPI frames.
+   * @param windowed mark the frames for the windowed protocol.
    *
    * @return true on success, false otherwise.
    */
   static bool GenerateFrames(const std::string &code,
-                             std::vector<Frame> *frames);
+                             std::vector<Frame> *frames,
+                             bool windowed = false);
 
  private:
+  /**
+   * Fills `spans_` with the pages of `options_.code` which differ from
+   * `options_.manifest`.
+   */
+  bool PlanDelta();
+
+  /** Sends the frames one at a time, waiting for each to be acked. */
+  bool RunStopAndWait();
+
+  /**
+   * Sends the frames with the windowed protocol. Sets `delta_refused_` if
+   * the device refuses a delta update.
+   */
+  bool RunWindowed();
+
+  /** Returns the number of frames to send. */
+  uint32_t NumFrames() const;
+
+  /** Builds the frame with `frame_number` into `f`. */
+  void MakeFrame(uint32_t frame_number, Frame *f) const;
+
   Options options_;
   std::unique_ptr<SpiInterface> spi_;
+  /** Verify frames of a delta update, which come first. */
+  std::vector<Frame> verify_frames_;
+  /** Parts of the image to send, one per frame after `verify_frames_`. */
+  std::vector<FrameSpan> spans_;
+  /** Flags for the `frame_num` of every frame. */
+  uint32_t frame_flags_ = 0;
+  /** Whether the device has refused a delta update. */
+  bool delta_refused_ = false;
 };
 
 }  // namespace spiflash
@@ -0,0 +1,501 @@
+// Copyright lowRISC contributors.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sw/host/spiflash/updater.h"
+
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <set>
+
+#include "gtest/gtest.h"
+
+namespace {
+using ::opentitan::spiflash::Frame;
+using ::opentitan::spiflash::SpiInterface;
+using ::opentitan::spiflash::Updater;
+
+// Windowed protocol definitions, see sw/device/boot_rom/spiflash_frame.h.
+constexpr uint32_t kFrameEofMarker = 0x80000000;
+constexpr uint32_t kFrameWindowedMarker = 0x40000000;
+constexpr uint32_t kFrameDeltaMarker = 0x20000000;
+constexpr uint32_t kFrameVerifyMarker = 0x10000000;
+constexpr uint32_t kFrameSync = 0x434e5953;
+constexpr uint32_t kAckMagic = 0x4b414653;
+constexpr uint32_t kAckNak = 0xffffffff;
+constexpr uint32_t kAckRefused = 0xfffffffe;
+constexpr size_t kRxFifoSize = 3072;
+
+/**
+ * Models the boot ROM's side of the windowed protocol, down to its RX FIFO,
+ * which drops whatever doesn't fit.
+ */
+class FakeDevice : public SpiInterface {
+ public:
+  /**
+   * @param busy_transfers transfers during which the device programs a frame
+   * and doesn't read its RX FIFO.
+   */
+  explicit FakeDevice(int busy_transfers = 0)
+      : busy_transfers_(busy_transfers), flash_(1 << 16, '\xff') {}
+
+  bool Init() override { return true; }
+  bool TransmitFrame(const uint8_t *, size_t) override { return false; }
+  bool CheckHash(const uint8_t *, size_t) override { return false; }
+
+  bool TransferFrame(const uint8_t *tx, uint8_t *rx, size_t size) override {
+    ++transfers_;
+    for (size_t i = 0; i < size; ++i) {
+      rx[i] = 0;
+      if (!tx_fifo_.empty()) {
+        rx[i] = tx_fifo_.front();
+        tx_fifo_.pop_front();
+      }
+      if (lose_transfer_ == transfers_ && i >= 8 && i < 8 + kLostBytes) {
+        continue;
+      }
+      if (rx_fifo_.size() == kRxFifoSize) {
+        ++overflowed_bytes_;
+        continue;
+      }
+      rx_fifo_.push_back(tx[i]);
+    }
+    Run();
+    return true;
+  }
+
+  /** Flips a bit of frame `frame_num` the first time it is received. */
+  void CorruptFrame(uint32_t frame_num) { corrupt_frame_ = frame_num; }
+
+  /** Drops a few bytes at the start of transfer `transfer`. */
+  void LoseTransfer(int transfer) { lose_transfer_ = transfer; }
+
+  /**
+   * Sends `junk` bytes before each ack, so that acks straddle the host's
+   * transfers.
+   */
+  void OffsetAcks(size_t junk) { ack_junk_ = junk; }
+
+  /** Makes the device take delta updates, like a ROM built to allow them. */
+  void AcceptDelta() { accept_delta_ = true; }
+
+  void set_flash(const std::string &flash) { flash_ = flash; }
+  const std::string &flash() const { return flash_; }
+  int frames_received() const { return frames_received_; }
+  int frames_written() const { return frames_written_; }
+  int refusals() const { return refusals_; }
+  bool done() const { return done_; }
+  size_t overflowed_bytes() const { return overflowed_bytes_; }
+  int naks() const { return naks_; }
+
+ private:
+  static constexpr size_t kLostBytes = 100;
+
+  /** Reads and processes frames until the RX FIFO runs dry. */
+  void Run() {
+    if (busy_ > 0) {
+      --busy_;
+      return;
+    }
+    while (!done_ && FindSync() && rx_fifo_.size() >= sizeof(Frame)) {
+      Frame f;
+      std::copy(rx_fifo_.begin(), rx_fifo_.begin() + sizeof(Frame),
+                reinterpret_cast<uint8_t *>(&f));
+      rx_fifo_.erase(rx_fifo_.begin(), rx_fifo_.begin() + sizeof(Frame));
+      sync_matched_ = 0;
+      FindSync();
+      if (Process(f)) {
+        busy_ = busy_transfers_;
+        return;
+      }
+    }
+  }
+
+  /** Discards bytes up to the end of the next sync word. */
+  bool FindSync() {
+    while (sync_matched_ < sizeof(uint32_t) && !rx_fifo_.empty()) {
+      uint8_t byte = rx_fifo_.front();
+      rx_fifo_.pop_front();
+      if (byte == ((kFrameSync >> (8 * sync_matched_)) & 0xff)) {
+        ++sync_matched_;
+      } else {
+        sync_matched_ = byte == (kFrameSync & 0xff) ? 1 : 0;
+      }
+    }
+    return sync_matched_ == sizeof(uint32_t);
+  }
+
+  /**
+   * Returns true if frame `f`, the next one expected, may be processed: it
+   * must be a delta frame if and only if frame 0 was.
+   */
+  bool CheckMode(const Frame &f) {
+    bool delta = (f.hdr.frame_num & kFrameDeltaMarker) != 0;
+    if (next_frame_ != 0 && delta != delta_) {
+      return false;
+    }
+    if (!delta) {
+      return true;
+    }
+    if (!accept_delta_) {
+      return false;
+    }
+    if ((f.hdr.frame_num & kFrameVerifyMarker) == 0) {
+      return next_frame_ != 0;
+    }
+    uint32_t num_pages;
+    memcpy(&num_pages, f.data, sizeof(num_pages));
+    const uint8_t *entry = f.data + sizeof(num_pages);
+    for (uint32_t i = 0; i < num_pages; ++i) {
+      uint32_t page;
+      memcpy(&page, entry, sizeof(page));
+      uint8_t hash[SHA256_DIGEST_LENGTH];
+      SHA256(reinterpret_cast<const uint8_t *>(
+                 &flash_[page * Updater::kFlashPageSize]),
+             Updater::kFlashPageSize, hash);
+      if (memcmp(hash, entry + sizeof(page), sizeof(hash)) != 0) {
+        return false;
+      }
+      entry += sizeof(page) + sizeof(hash);
+    }
+    return true;
+  }
+
+  /** Writes `f` to flash. */
+  void Write(const Frame &f) {
+    ++frames_written_;
+    if ((f.hdr.frame_num & kFrameDeltaMarker) == 0) {
+      std::copy(f.data, f.data + f.PayloadSize(), &flash_[f.hdr.offset]);
+      return;
+    }
+    uint32_t page = f.hdr.offset / Updater::kFlashPageSize;
+    if (erased_pages_.insert(page).second) {
+      flash_.replace(page * Updater::kFlashPageSize, Updater::kFlashPageSize,
+                     Updater::kFlashPageSize, '\xff');
+    }
+    size_t size = std::min<size_t>(
+        f.PayloadSize(),
+        (page + 1) * Updater::kFlashPageSize - f.hdr.offset);
+    std::copy(f.data, f.data + size, &flash_[f.hdr.offset]);
+  }
+
+  /** Returns true if `f` was programmed. */
+  bool Process(Frame f) {
+    ++frames_received_;
+    uint32_t frame_num = f.hdr.frame_num & 0xffffff;
+    if (frame_num == corrupt_frame_) {
+      f.data[0] ^= 1;
+      corrupt_frame_ = UINT32_MAX;
+    }
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t *>(&f.hdr.frame_num),
+           sizeof(Frame) - sizeof(f.hdr.hash), hash);
+    if (memcmp(hash, f.hdr.hash, sizeof(hash)) != 0) {
+      ++naks_;
+      SendAck(kAckNak);
+      return false;
+    }
+    bool delta = (f.hdr.frame_num & kFrameDeltaMarker) != 0;
+    if (frame_num == next_frame_ && !CheckMode(f)) {
+      ++refusals_;
+      next_frame_ = 0;
+      erased_pages_.clear();
+      SendAck(kAckRefused);
+      return false;
+    }
+    if (frame_num != next_frame_) {
+      SendAck(f.hdr.frame_num);
+      return false;
+    }
+    bool first_frame = next_frame_ == 0;
+    if (first_frame) {
+      delta_ = delta;
+    }
+    ++next_frame_;
+    SendAck(f.hdr.frame_num);
+    if (first_frame && !delta) {
+      flash_.assign(flash_.size(), '\xff');
+    }
+    if ((f.hdr.frame_num & kFrameVerifyMarker) == 0) {
+      Write(f);
+    }
+    done_ = (f.hdr.frame_num & kFrameEofMarker) != 0;
+    return true;
+  }
+
+  void SendAck(uint32_t frame) {
+    uint32_t ack[4] = {kAckMagic, next_frame_, frame, ~(next_frame_ ^ frame)};
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(ack);
+    tx_fifo_.insert(tx_fifo_.end(), ack_junk_, 0x5a);
+    tx_fifo_.insert(tx_fifo_.end(), bytes, bytes + sizeof(ack));
+  }
+
+  int busy_transfers_;
+  int busy_ = 0;
+  std::string flash_;
+  std::deque<uint8_t> rx_fifo_;
+  std::deque<uint8_t> tx_fifo_;
+  uint32_t sync_matched_ = 0;
+  uint32_t next_frame_ = 0;
+  bool delta_ = false;
+  bool done_ = false;
+  int transfers_ = 0;
+  uint32_t corrupt_frame_ = UINT32_MAX;
+  int lose_transfer_ = -1;
+  size_t overflowed_bytes_ = 0;
+  int naks_ = 0;
+  size_t ack_junk_ = 0;
+  bool accept_delta_ = false;
+  std::set<uint32_t> erased_pages_;
+  int frames_received_ = 0;
+  int frames_written_ = 0;
+  int refusals_ = 0;
+};
+
+class WindowedUpdateTest : public ::testing::Test {
+ protected:
+  WindowedUpdateTest()
+      : manifest_(::testing::TempDir() + "spiflash_updater_unittest.manifest") {
+    std::mt19937 rng(1);
+    for (int i = 0; i < 10000; ++i) {
+      code_ += static_cast<char>(rng());
+    }
+    std::remove(manifest_.c_str());
+  }
+  ~WindowedUpdateTest() override { std::remove(manifest_.c_str()); }
+
+  /**
+   * Runs a windowed update of `code_` to `device`, which is owned by the
+   * updater and lives until the next update or the end of the test.
+   */
+  bool Run(FakeDevice *device, uint32_t start_frame = 0, bool delta = false) {
+    Updater::Options options;
+    options.code = code_;
+    options.flash_erase_delay_us = 0;
+    options.windowed = true;
+    options.start_frame = start_frame;
+    options.manifest = manifest_;
+    options.delta = delta;
+    updater_ = std::make_unique<Updater>(
+        options, std::unique_ptr<SpiInterface>(device));
+    return updater_->Run();
+  }
+
+  /** Checks that `device` holds `code_`. */
+  void ExpectProgrammed(const FakeDevice &device) {
+    EXPECT_TRUE(device.done());
+    EXPECT_EQ(device.flash().substr(0, code_.size()), code_);
+  }
+
+  /**
+   * Updates a device to `code_`, then changes a byte of `code_`, and returns
+   * the device's flash.
+   */
+  std::string UpdateAndChange() {
+    FakeDevice *device = new FakeDevice();
+    EXPECT_TRUE(Run(device));
+    code_[3 * Updater::kFlashPageSize + 10] ^= 1;
+    return device->flash();
+  }
+
+  std::string code_;
+  std::string manifest_;
+  std::unique_ptr<Updater> updater_;
+};
+
+TEST_F(WindowedUpdateTest, Programs) {
+  FakeDevice *device = new FakeDevice();
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->naks(), 0);
+}
+
+TEST_F(WindowedUpdateTest, FindsAcksSplitAcrossTransfers) {
+  FakeDevice *device = new FakeDevice(/*busy_transfers=*/3);
+  device->OffsetAcks(7);
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  // No frame had to be sent again for lack of an ack.
+  EXPECT_EQ(device->frames_received(), 5);
+}
+
+TEST_F(WindowedUpdateTest, SlowDeviceDoesNotOverflow) {
+  FakeDevice *device = new FakeDevice(/*busy_transfers=*/20);
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->overflowed_bytes(), 0u);
+}
+
+TEST_F(WindowedUpdateTest, ResendsCorruptFrame) {
+  FakeDevice *device = new FakeDevice();
+  device->CorruptFrame(1);
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->naks(), 1);
+}
+
+TEST_F(WindowedUpdateTest, RecoversFromOverflow) {
+  // The device is busy for longer than it takes the host to give up on an
+  // answer and send the frame again, which overflows the RX FIFO.
+  FakeDevice *device = new FakeDevice(/*busy_transfers=*/100);
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  EXPECT_GT(device->overflowed_bytes(), 0u);
+}
+
+TEST_F(WindowedUpdateTest, ResyncsAfterLostBytes) {
+  for (int transfer : {1, 2, 4}) {
+    FakeDevice *device = new FakeDevice();
+    device->LoseTransfer(transfer);
+    ASSERT_TRUE(Run(device)) << "transfer " << transfer;
+    ExpectProgrammed(*device);
+  }
+}
+
+TEST_F(WindowedUpdateTest, WaitsForLastFrame) {
+  FakeDevice *device = new FakeDevice();
+  // The code fits in 5 frames.
+  device->CorruptFrame(4);
+  ASSERT_TRUE(Run(device));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->naks(), 1);
+}
+
+TEST_F(WindowedUpdateTest, DeltaSendsChangedPage) {
+  std::string flash = UpdateAndChange();
+  FakeDevice *device = new FakeDevice();
+  device->AcceptDelta();
+  device->set_flash(flash);
+  ASSERT_TRUE(Run(device, /*start_frame=*/0, /*delta=*/true));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->refusals(), 0);
+  // A page takes two frames.
+  EXPECT_EQ(device->frames_written(), 2);
+}
+
+TEST_F(WindowedUpdateTest, DeltaRefusedForOtherFlash) {
+  UpdateAndChange();
+  // A blank flash, like after a bootstrap triggered by a blank flash.
+  FakeDevice *device = new FakeDevice();
+  device->AcceptDelta();
+  ASSERT_TRUE(Run(device, /*start_frame=*/0, /*delta=*/true));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->refusals(), 1);
+}
+
+TEST_F(WindowedUpdateTest, DeltaRefusedWithoutOptIn) {
+  std::string flash = UpdateAndChange();
+  FakeDevice *device = new FakeDevice();
+  device->set_flash(flash);
+  ASSERT_TRUE(Run(device, /*start_frame=*/0, /*delta=*/true));
+  ExpectProgrammed(*device);
+  EXPECT_EQ(device->refusals(), 1);
+}
+
+TEST_F(WindowedUpdateTest, FullFramesRefusedInDeltaUpdate) {
+  // A delta update which was interrupted after its verify frame (which lists
+  // no pages).
+  FakeDevice *device = new FakeDevice();
+  device->AcceptDelta();
+  Frame verify;
+  memset(&verify, 0, sizeof(verify));
+  verify.hdr.frame_num =
+      kFrameWindowedMarker | kFrameDeltaMarker | kFrameVerifyMarker;
+  SHA256(reinterpret_cast<const uint8_t *>(&verify.hdr.frame_num),
+         sizeof(Frame) - sizeof(verify.hdr.hash), verify.hdr.hash);
+  std::vector<uint8_t> tx(sizeof(kFrameSync) + sizeof(Frame));
+  std::vector<uint8_t> rx(tx.size());
+  memcpy(&tx[0], &kFrameSync, sizeof(kFrameSync));
+  memcpy(&tx[sizeof(kFrameSync)], &verify, sizeof(Frame));
+  ASSERT_TRUE(device->TransferFrame(&tx[0], &rx[0], tx.size()));
+
+  // Resuming it as a full update would write to pages that haven't been
+  // erased.
+  EXPECT_FALSE(Run(device, /*start_frame=*/1));
+  EXPECT_EQ(device->refusals(), 1);
+  EXPECT_EQ(device->frames_written(), 0);
+}
+
+TEST_F(WindowedUpdateTest, ResumeAfterResetFails) {
+  FakeDevice *device = new FakeDevice();
+  EXPECT_FALSE(Run(device, /*start_frame=*/2));
+  EXPECT_FALSE(device->done());
+}
+
+/**
+ * Generates the frames for `code` one after another, like the original
+ * serial implementation of Updater::GenerateFrames.
+ */
+std::vector<Frame> SerialFrames(const std::string &code, bool windowed) {
+  std::vector<Frame> frames;
+  for (uint32_t offset = 0; offset < code.size();) {
+    Frame f;
+    size_t size = std::min<size_t>(f.PayloadSize(), code.size() - offset);
+    memset(f.data, 0xff, f.PayloadSize());
+    memcpy(f.data, code.data() + offset, size);
+    f.hdr.frame_num = frames.size();
+    f.hdr.offset = offset;
+    offset += size;
+    frames.push_back(f);
+  }
+  frames.back().hdr.frame_num |= kFrameEofMarker;
+  for (Frame &f : frames) {
+    if (windowed) {
+      f.hdr.frame_num |= kFrameWindowedMarker;
+    }
+    SHA256(reinterpret_cast<const uint8_t *>(&f.hdr.frame_num),
+           sizeof(Frame) - sizeof(f.hdr.hash), f.hdr.hash);
+  }
+  return frames;
+}
+
+TEST(GenerateFramesTest, MatchesSerialVersion) {
+  std::mt19937 rng(2);
+  const size_t payload_size = Frame().PayloadSize();
+  for (size_t size : {size_t{1}, payload_size - 1, payload_size,
+                      payload_size + 1, size_t{100000}}) {
+    std::string code;
+    for (size_t i = 0; i < size; ++i) {
+      code += static_cast<char>(rng());
+    }
+    for (bool windowed : {false, true}) {
+      std::vector<Frame> frames;
+      ASSERT_TRUE(Updater::GenerateFrames(code, &frames, windowed));
+      std::vector<Frame> expected = SerialFrames(code, windowed);
+      ASSERT_EQ(frames.size(), expected.size()) << "size " << size;
+      EXPECT_EQ(memcmp(frames.data(), expected.data(),
+                       frames.size() * sizeof(Frame)),
+                0)
+          << "size " << size << ", windowed " << windowed;
+    }
+  }
+}
+
+/** A device which never acks a frame, like one reset since an update. */
+class ResetDevice : public SpiInterface {
+ public:
+  bool Init() override { return true; }
+  bool TransmitFrame(const uint8_t *, size_t) override {
+    ++frames;
+    return true;
+  }
+  bool TransferFrame(const uint8_t *, uint8_t *, size_t) override {
+    return false;
+  }
+  bool CheckHash(const uint8_t *, size_t) override { return false; }
+
+  int frames = 0;
+};
+
+TEST(StopAndWaitUpdateTest, ResumeAfterResetFails) {
+  Updater::Options options;
+  options.code = std::string(10000, 'a');
+  options.start_frame = 2;
+  ResetDevice *device = new ResetDevice();
+  Updater updater(options, std::unique_ptr<SpiInterface>(device));
+  EXPECT_FALSE(updater.Run());
+  EXPECT_GT(device->frames, 1);
+}
+
+}  // namespace
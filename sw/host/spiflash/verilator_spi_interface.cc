@@ -6,9 +6,12 @@
 
 #include <fcntl.h>
 #include <openssl/sha.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <string>
@@ -19,9 +22,18 @@ namespace spiflash {
 namespace {
 
 // TODO: If transmission is not successful, adapt this by an argument.
-/** Required delay to synchronize transactions with simulation environment. */
+/**
+ * Required delay to synchronize transactions with simulation environment
+ * (when not in framed mode).
+ */
 constexpr int kWriteReadDelay = 20000000;
 
+/** Framing bytes, see hw/dv/dpi/spidpi/spidpi.h. */
+constexpr uint8_t kFrameDone = 'F';
+constexpr size_t kFrameHeaderSize = 2;
+constexpr size_t kFrameDoneHeaderSize = 3;
+constexpr size_t kMaxFrameSize = 2048;
+
 /** Configure `fd` as a serial port with baud rate 9600. */
 bool SetTermOpts(int fd) {
   struct termios options;
@@ -61,26 +73,66 @@ int OpenDevice(const std::string &filename) {
 }
 
 /**
- * Reads `size` bytes into `rx` buffer from `fd`. Returns the number of bytes
- * read.
+ * Waits until `fd` is ready for `events`. Returns false if the simulation
+ * went away.
+ */
+bool WaitFor(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return (pfd.revents & events) != 0;
+}
+
+/**
+ * Reads `size` bytes into `rx` buffer from `fd`, waiting for them with
+ * poll(). Returns the number of bytes read, which is less than `size` if the
+ * connection to the simulation is lost.
  */
 size_t ReadBytes(int fd, uint8_t *rx, size_t size) {
   size_t bytes_read = 0;
   while (bytes_read != size) {
     ssize_t read_size = read(fd, &rx[bytes_read], size - bytes_read);
-    switch (read_size) {
-      case -1:
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          continue;
-        }
-        break;
-      default:
-        bytes_read += read_size;
+    if (read_size > 0) {
+      bytes_read += read_size;
+      continue;
+    }
+    if (read_size < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR) {
+      break;
+    }
+    if (read_size == 0 || !WaitFor(fd, POLLIN)) {
+      break;
     }
   }
   return bytes_read;
 }
 
+/**
+ * Writes `size` bytes from `tx` to `fd`, waiting with poll() while the
+ * device can't take more. Returns true on success.
+ */
+bool WriteBytes(int fd, const uint8_t *tx, size_t size) {
+  size_t bytes_written = 0;
+  while (bytes_written != size) {
+    ssize_t write_size = write(fd, &tx[bytes_written], size - bytes_written);
+    if (write_size > 0) {
+      bytes_written += write_size;
+      continue;
+    }
+    if (write_size < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR) {
+      return false;
+    }
+    if (!WaitFor(fd, POLLOUT)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace
 
 VerilatorSpiInterface::~VerilatorSpiInterface() {
@@ -98,6 +150,9 @@ bool VerilatorSpiInterface::Init() {
 }
 
 bool VerilatorSpiInterface::TransmitFrame(const uint8_t *tx, size_t size) {
+  if (framed_) {
+    return TransmitFramed(tx, size);
+  }
   size_t bytes_written = write(fd_, tx, size);
   if (bytes_written != size) {
     std::cerr << "Failed to write bytes to spi interface. Bytes written: "
@@ -108,6 +163,65 @@ bool VerilatorSpiInterface::TransmitFrame(const uint8_t *tx, size_t size) {
   return true;
 }
 
+bool VerilatorSpiInterface::TransferFrame(const uint8_t *tx, uint8_t *rx,
+                                          size_t size) {
+  if (framed_) {
+    if (!TransmitFramed(tx, size)) {
+      return false;
+    }
+    memset(rx, 0, size);
+    memcpy(rx, response_.data(), std::min(size, response_.size()));
+    return true;
+  }
+
+  // Without framing, the simulation sends back one byte for every byte it
+  // has shifted out, so reading them also waits for the frame to be sent.
+  if (!WriteBytes(fd_, tx, size)) {
+    std::cerr << "Failed to write frame to spi interface." << std::endl;
+    return false;
+  }
+  size_t bytes_read = ReadBytes(fd_, rx, size);
+  if (bytes_read < size) {
+    std::cerr << "Failed to read bytes from spi interface. Bytes read: "
+              << bytes_read << " expected: " << size << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VerilatorSpiInterface::TransmitFramed(const uint8_t *tx, size_t size) {
+  if (size == 0 || size > kMaxFrameSize) {
+    std::cerr << "Invalid frame size: " << size << std::endl;
+    return false;
+  }
+  uint8_t header[kFrameHeaderSize] = {static_cast<uint8_t>(size & 0xff),
+                                      static_cast<uint8_t>(size >> 8)};
+  if (!WriteBytes(fd_, header, sizeof(header)) ||
+      !WriteBytes(fd_, tx, size)) {
+    std::cerr << "Failed to write frame to spi interface." << std::endl;
+    return false;
+  }
+
+  // Wait for the simulation to report that the frame has been shifted out
+  uint8_t done[kFrameDoneHeaderSize];
+  if (ReadBytes(fd_, done, sizeof(done)) != sizeof(done) ||
+      done[0] != kFrameDone) {
+    std::cerr << "Did not get a frame completion from spi interface. Was the "
+                 "simulation started with +SPIDPI_FRAMED_spi0?"
+              << std::endl;
+    return false;
+  }
+  size_t response_size = done[1] | (done[2] << 8);
+  response_.resize(response_size);
+  if (response_size &&
+      ReadBytes(fd_, &response_[0], response_size) != response_size) {
+    std::cerr << "Failed to read frame response from spi interface."
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
 bool VerilatorSpiInterface::CheckHash(const uint8_t *tx, size_t size) {
   uint8_t hash[SHA256_DIGEST_LENGTH];
   SHA256_CTX sha256;
@@ -115,6 +229,12 @@ bool VerilatorSpiInterface::CheckHash(const uint8_t *tx, size_t size) {
   SHA256_Update(&sha256, tx, size);
   SHA256_Final(hash, &sha256);
 
+  if (framed_) {
+    // The response was read with the frame
+    return response_.size() >= SHA256_DIGEST_LENGTH &&
+           !std::memcmp(&response_[0], hash, SHA256_DIGEST_LENGTH);
+  }
+
   std::vector<uint8_t> rx(size);
   size_t bytes_read = ReadBytes(fd_, &rx[0], size);
   if (bytes_read < size) {
@@ -6,6 +6,7 @@
 #define OPENTITAN_SW_HOST_SPIFLASH_VERILATOR_SPI_INTERFACE_H_
 
 #include <string>
+#include <vector>
 
 #include "sw/host/spiflash/spi_interface.h"
 
@@ -17,13 +18,17 @@ namespace spiflash {
  * The OpenTitan Verilator model provides a file handle for the SPI device
  * interface. This class sends ands recevies data to the device handle, and
  * adds synchronication delays between writes and reads.
+ *
+ * In framed mode (simulation started with `+SPIDPI_FRAMED_spi0`), each frame
+ * is sent as one SPI transaction and the simulation reports when it is done,
+ * together with the bytes received during it. No delays are needed then.
  * This class is not thread safe.
  */
 class VerilatorSpiInterface : public SpiInterface {
  public:
   /** Constructs instance pointing to the `spi_filename` file path. */
-  explicit VerilatorSpiInterface(std::string spi_filename)
-      : spi_filename_(spi_filename), fd_(-1) {}
+  explicit VerilatorSpiInterface(std::string spi_filename, bool framed = false)
+      : spi_filename_(spi_filename), framed_(framed), fd_(-1) {}
 
   /**
    * Closes the internal file handle used to communicate with the SPI device.
@@ -32,11 +37,21 @@ class VerilatorSpiInterface : public SpiInterface {
 
   bool Init() final;
   bool TransmitFrame(const uint8_t *tx, size_t size) final;
+  bool TransferFrame(const uint8_t *tx, uint8_t *rx, size_t size) final;
   bool CheckHash(const uint8_t *tx, size_t size) final;
 
  private:
+  /**
+   * Sends a frame in framed mode and waits until the simulation has shifted
+   * it out, storing the bytes received in `response_`.
+   */
+  bool TransmitFramed(const uint8_t *tx, size_t size);
+
   std::string spi_filename_;
+  bool framed_;
   int fd_;
+  /** Bytes received during the last frame (framed mode only). */
+  std::vector<uint8_t> response_;
 };
 
 }  // namespace spiflash